@@ -35,6 +35,8 @@ CONFIG_SCHEMA = cv.All(
             cv.Optional(CONF_ENABLE_UPLOAD, default=False): cv.boolean,
         }
     ).extend(cv.COMPONENT_SCHEMA),
+    # web_server_base (AsyncWebServer) n'existe pas en host
+    cv.only_on_esp32,
 )
 
 @coroutine_with_priority(45.0)
@@ -3,10 +3,13 @@
 #include "esphome/components/network/util.h"
 #include "esphome/core/helpers.h"
 
+#include <memory>
+
 namespace esphome {
 namespace box3web {
 
 static const char *TAG = "box3web";
+static constexpr size_t DOWNLOAD_CHUNK_SIZE = 8192;
 
 // Fonctions utilitaires pour remplacer endsWith et startsWith
 bool endsWith(const std::string &str, const std::string &suffix) {
@@ -70,18 +73,58 @@ void Box3Web::handleUpload(AsyncWebServerRequest *request, const String &filenam
     }
     std::string file_name(filename.c_str());
     if (index == 0) {
-        this->sd_mmc_card_->write_file(Path::join(path, file_name).c_str(), data, len);
+        // Request freed and reallocated at the same address: its session was never closed
+        this->abort_upload(request);
+        std::string file_path = Path::join(path, file_name);
+        sd_mmc_card::FileWriter writer = this->sd_mmc_card_->open_writer(file_path);
+        if (!writer.is_open()) {
+            auto response = request->beginResponse(500, "application/json", "{ \"error\": \"failed to open file\" }");
+            response->addHeader("Connection", "close");
+            request->send(response);
+            return;
+        }
+        this->uploads_[request] = Upload{std::move(writer), file_path};
+        // A client gone before the last chunk would otherwise keep the file, its lock and its handle slot
+        request->onDisconnect([this, request]() { this->abort_upload(request); });
+    }
+    auto upload = this->uploads_.find(request);
+    if (upload == this->uploads_.end())
+        return;
+    bool written = false;
+    this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK,
+                               [&]() { written = upload->second.writer.write(data, len); });
+    if (!written) {
+        this->uploads_.erase(upload);
+        auto response = request->beginResponse(500, "application/json", "{ \"error\": \"failed to write file\" }");
+        response->addHeader("Connection", "close");
+        request->send(response);
         return;
     }
-    this->sd_mmc_card_->append_file(Path::join(path, file_name).c_str(), data, len);
     if (final) {
-        auto response = request->beginResponse(201, "text/html", "upload success");
+        bool ok = false;
+        this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK, [&]() { ok = upload->second.writer.close(); });
+        this->uploads_.erase(upload);
+        auto response = ok ? request->beginResponse(201, "text/html", "upload success")
+                           : request->beginResponse(500, "application/json", "{ \"error\": \"failed to write file\" }");
         response->addHeader("Connection", "close");
         request->send(response);
         return;
     }
 }
 
+void Box3Web::abort_upload(AsyncWebServerRequest *request) {
+    auto upload = this->uploads_.find(request);
+    if (upload == this->uploads_.end())
+        return;
+    ESP_LOGW(TAG, "Upload of %s aborted", upload->second.path.c_str());
+    std::string path = upload->second.path;
+    this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK, [&]() {
+        upload->second.writer.close();
+        this->sd_mmc_card_->delete_file(path);
+    });
+    this->uploads_.erase(upload);
+}
+
 void Box3Web::set_url_prefix(std::string const &prefix) { this->url_prefix_ = prefix; }
 
 void Box3Web::set_root_path(std::string const &path) { this->root_path_ = path; }
@@ -282,9 +325,12 @@ void Box3Web::handle_index(AsyncWebServerRequest *request, std::string const &pa
                       "<th>Size</th>"
                       "<th>Actions</th>"
                       "</tr></thead><tbody>"));
-    auto entries = this->sd_mmc_card_->list_directory_file_info(path, 0);
-    for (auto const &entry : entries)
-        write_row(response, entry);
+    this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_INTERACTIVE, [&]() {
+        this->sd_mmc_card_->for_each_entry(path, 0, [this, response](sd_mmc_card::FileInfo const &entry) {
+            this->write_row(response, entry);
+            return true;
+        });
+    });
     response->print(F("</tbody></table></div>"));
     
     // Onglet d'upload si activé
@@ -395,55 +441,67 @@ void Box3Web::handle_download(AsyncWebServerRequest *request, std::string const
         return;
     }
     
-    // Vérifier si le fichier existe
-    if (!this->sd_mmc_card_->exists(path)) {
+    // Ouvrir le fichier sans charger son contenu
+    sd_mmc_card::FileReader reader = this->sd_mmc_card_->open_file(path);
+    if (!reader.is_open()) {
         request->send(404, "application/json", "{ \"error\": \"file not found\" }");
         return;
     }
-    
-    // Récupérer la taille du fichier sans charger son contenu
-    size_t fileSize = this->sd_mmc_card_->get_file_size(path);
-    if (fileSize == 0) {
+    if (reader.size() == 0) {
         request->send(404, "application/json", "{ \"error\": \"file is empty\" }");
         return;
     }
     
     String content_type = get_content_type(path);
     std::string filename = Path::file_name(path);
-    
-    // Pour ESP-IDF, nous devons éviter beginChunkedResponse et read_file_chunk
-    // Charger le fichier entier en mémoire
-    std::vector<uint8_t> fileData = this->sd_mmc_card_->read_file(path);
-    if (fileData.size() == 0) {
-        request->send(404, "application/json", "{ \"error\": \"failed to read file\" }");
+    std::string disposition = "inline; filename=\"" + filename + "\"";
+    bool ranges = content_type == "audio/mpeg" || content_type == "audio/wav" ||
+                  content_type == "video/mp4" || startsWith(content_type.c_str(), "image/");
+
+#ifdef USE_ESP_IDF
+    // Envoi par chunks directement sur la requête httpd, la mémoire reste bornée par DOWNLOAD_CHUNK_SIZE
+    httpd_req_t *req = *request;
+    std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[DOWNLOAD_CHUNK_SIZE]);
+    if (!buffer) {
+        request->send(500, "application/json", "{ \"error\": \"out of memory\" }");
         return;
     }
-    
-    // Convertir le vecteur d'octets en std::string pour la compatibilité avec beginResponse
-    std::string fileContent(fileData.begin(), fileData.end());
-    
-    // Utiliser la version de beginResponse qui accepte une std::string
+    httpd_resp_set_status(req, "200 OK");
+    httpd_resp_set_type(req, content_type.c_str());
+    if (ranges)
+        httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition.c_str());
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    // Chaque lecture passe par le worker I/O en classe bulk, les requêtes interactives restent prioritaires
+    size_t len;
+    auto read_chunk = [&]() { len = reader.read(buffer.get(), DOWNLOAD_CHUNK_SIZE); };
+    while (this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK, read_chunk) && len > 0) {
+        if (httpd_resp_send_chunk(req, reinterpret_cast<const char *>(buffer.get()), len) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to send chunk at offset %zu of %s", reader.position() - len, path.c_str());
+            return;
+        }
+    }
+    httpd_resp_send_chunk(req, nullptr, 0);
+#else
+    // Le serveur asynchrone appelle le filler à chaque fois qu'il peut envoyer des données
+    auto shared_reader = std::make_shared<sd_mmc_card::FileReader>(std::move(reader));
     AsyncWebServerResponse *response = request->beginResponse(
-        200,                   // HTTP status code
-        content_type.c_str(),  // Content type
-        fileContent            // Contenu du fichier en tant que std::string
-    );
-    
-    // Ajouter les headers nécessaires
-    if (content_type == "audio/mpeg" || content_type == "audio/wav" ||
-        content_type == "video/mp4" || startsWith(content_type.c_str(), "image/")) {
+        content_type, shared_reader->size(),
+        [this, shared_reader](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+            size_t len = 0;
+            this->sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK,
+                                       [&]() { len = shared_reader->read(index, buffer, max_len); });
+            return len;
+        });
+    if (ranges)
         response->addHeader("Accept-Ranges", "bytes");
-    }
-    
-    response->addHeader("Content-Disposition", 
-                       ("inline; filename=\"" + String(filename.c_str()) + "\"").c_str());
-    
-    // Ajouter d'autres headers pour améliorer la stabilité
+    response->addHeader("Content-Disposition", disposition.c_str());
     response->addHeader("Connection", "close");
     response->addHeader("Cache-Control", "no-cache");
-    
-    // Envoyer la réponse
     request->send(response);
+#endif
 }
 void Box3Web::handle_delete(AsyncWebServerRequest *request) {
     if (!this->deletion_enabled_) {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <string>
 #include "esphome/components/web_server_base/web_server_base.h"
 #include "../sd_mmc_card/sd_mmc_card.h"
@@ -49,10 +50,19 @@ class Box3Web : public Component, public AsyncWebHandler {  // Héritage de Comp
   bool download_enabled_{true};
   bool upload_enabled_{true};
 
+  // Une session d'écriture par requête d'upload en cours
+  struct Upload {
+    sd_mmc_card::FileWriter writer;
+    std::string path;
+  };
+  std::map<AsyncWebServerRequest *, Upload> uploads_;
+
   void handle_get(AsyncWebServerRequest *request) const;
   void handle_index(AsyncWebServerRequest *request, std::string const &path) const;
   void handle_download(AsyncWebServerRequest *request, std::string const &path) const;
   void handle_delete(AsyncWebServerRequest *request);
+  // Ferme la session d'un upload interrompu et supprime le fichier incomplet
+  void abort_upload(AsyncWebServerRequest *request);
 
   void write_row(AsyncResponseStream *response, sd_mmc_card::FileInfo const &info) const;
 
@@ -1,6 +1,7 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.const import CONF_ID, CONF_PASSWORD, CONF_USERNAME, CONF_PORT
+from ..sd_mmc_card import CONF_SD_MMC_CARD_ID, SdMmc
 
 DEPENDENCIES = ['network']
 CODEOWNERS = ['@votre_nom']
@@ -19,6 +20,7 @@ CONFIG_SCHEMA = cv.Schema({
     cv.Required(CONF_PASSWORD): cv.string,
     cv.Optional(CONF_ROOT_PATH, default='/'): cv.string,
     cv.Optional(CONF_PORT, default=21): cv.port,
+    cv.Optional(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
 }).extend(cv.COMPONENT_SCHEMA)
 
 async def to_code(config):
@@ -31,6 +33,11 @@ async def to_code(config):
     cg.add(var.set_root_path(config[CONF_ROOT_PATH]))
     cg.add(var.set_port(config[CONF_PORT]))
 
+    # Carte SD partagée: les commandes prennent les verrous de la carte
+    if CONF_SD_MMC_CARD_ID in config:
+        sd_mmc_card = await cg.get_variable(config[CONF_SD_MMC_CARD_ID])
+        cg.add(var.set_sd_mmc_card(sd_mmc_card))
+
 
 
 
@@ -1,14 +1,13 @@
 #include "ftp_server.h"
-#include "../sd_mmc_card/sd_mmc_card.h"
-#include "esp_log.h"
+#include "esphome/core/log.h"
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <chrono>
 #include <ctime>
-#include "esp_netif.h"
-#include "esp_err.h"
+#include <cstdlib>
+#include <cstring>
 #include <errno.h>
 
 namespace esphome {
@@ -152,6 +151,7 @@ void FTPServer::handle_new_clients() {
     client_states_.push_back(FTP_WAIT_LOGIN);
     client_usernames_.push_back("");
     client_current_paths_.push_back(root_path_);
+    client_allocations_.push_back(0);
     send_response(client_socket, 220, "Welcome to ESPHome FTP Server");
   }
 }
@@ -163,6 +163,7 @@ void FTPServer::handle_ftp_client(int client_socket) {
     buffer[len] = '\0';
     std::string command(buffer);
     process_command(client_socket, command);
+    unlock_paths();
   } else if (len == 0) {
     ESP_LOGI(TAG, "FTP client disconnected");
     close(client_socket);
@@ -173,12 +174,109 @@ void FTPServer::handle_ftp_client(int client_socket) {
       client_states_.erase(client_states_.begin() + index);
       client_usernames_.erase(client_usernames_.begin() + index);
       client_current_paths_.erase(client_current_paths_.begin() + index);
+      client_allocations_.erase(client_allocations_.begin() + index);
     }
   } else if (errno != EWOULDBLOCK && errno != EAGAIN) {
     ESP_LOGW(TAG, "Socket error: %d", errno);
   }
 }
 
+bool FTPServer::lock_path(const std::string& path, bool exclusive) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ == nullptr) {
+    return true;
+  }
+  // Runs on the main loop, a busy path is answered with 450 instead of waiting
+  sd_mmc_card::PathLock lock = sd_mmc_card_->lock_path(path, exclusive, 0);
+  if (!lock.is_locked()) {
+    return false;
+  }
+  locks_.push_back(std::move(lock));
+#endif
+  return true;
+}
+
+void FTPServer::unlock_paths() {
+#ifdef USE_SD_MMC_CARD
+  locks_.clear();
+#endif
+}
+
+bool FTPServer::stat_path(const std::string& path, struct stat& st) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ != nullptr) {
+    sd_mmc_card::FileInfo info;
+    if (!sd_mmc_card_->stat(path, info)) {
+      errno = ENOENT;
+      return false;
+    }
+    sd_mmc_card::file_info_to_stat(info, st);
+    return true;
+  }
+#endif
+  return stat(path.c_str(), &st) == 0;
+}
+
+FILE *FTPServer::open_stream(const std::string& path, const char *mode) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ != nullptr) {
+    return sd_mmc_card_->open_stream(path, mode);
+  }
+#endif
+  return fopen(path.c_str(), mode);
+}
+
+bool FTPServer::close_stream(FILE *file) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ != nullptr) {
+    return sd_mmc_card_->close_stream(file);
+  }
+#endif
+  return fclose(file) == 0;
+}
+
+bool FTPServer::remove_file(const std::string& path) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ != nullptr) {
+    return sd_mmc_card_->remove_file(path);
+  }
+#endif
+  return unlink(path.c_str()) == 0;
+}
+
+bool FTPServer::for_each_entry(const std::string& path,
+                               const std::function<void(const std::string& name, const struct stat& st)>& callback) {
+#ifdef USE_SD_MMC_CARD
+  if (sd_mmc_card_ != nullptr) {
+    // Une seule lecture du répertoire, sans stat par entrée
+    struct stat st;
+    return sd_mmc_card_->for_each_entry(sd_mmc_card_->card_path(path), 0, [&](const sd_mmc_card::FileInfo& info) {
+      sd_mmc_card::file_info_to_stat(info, st);
+      callback(info.path.substr(info.path.rfind('/') + 1), st);
+      return true;
+    });
+  }
+#endif
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string entry_name = entry->d_name;
+    if (entry_name == "." || entry_name == "..") {
+      continue;
+    }
+    std::string full_path = path + "/" + entry_name;
+    struct stat entry_stat;
+    if (stat(full_path.c_str(), &entry_stat) == 0) {
+      callback(entry_name, entry_stat);
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
 void FTPServer::process_command(int client_socket, const std::string& command) {
   ESP_LOGI(TAG, "FTP command: %s", command.c_str());
   std::string cmd_str = command;
@@ -246,9 +344,8 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
       
       ESP_LOGI(TAG, "Attempting to change directory to: %s", full_path.c_str());
       
-      DIR *dir = opendir(full_path.c_str());
-      if (dir != nullptr) {
-        closedir(dir);
+      struct stat dir_stat;
+      if (stat_path(full_path, dir_stat) && S_ISDIR(dir_stat.st_mode)) {
         client_current_paths_[client_index] = full_path;
         send_response(client_socket, 250, "Directory successfully changed");
       } else {
@@ -329,8 +426,14 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     
     std::string full_path = normalize_path(client_current_paths_[client_index], filename);
     ESP_LOGI(TAG, "Starting file upload to: %s", full_path.c_str());
+    if (!lock_path(full_path, true)) {
+      send_response(client_socket, 450, "File busy");
+      return;
+    }
     send_response(client_socket, 150, "Opening connection for file upload");
-    start_file_upload(client_socket, full_path);
+    size_t allocation = client_allocations_[client_index];
+    client_allocations_[client_index] = 0;
+    start_file_upload(client_socket, full_path, allocation);
   } else if (cmd_str.find("RETR") == 0) {
     std::string filename = cmd_str.substr(5);
     size_t first_non_space = filename.find_first_not_of(" \t");
@@ -340,9 +443,13 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     
     std::string full_path = normalize_path(client_current_paths_[client_index], filename);
     ESP_LOGI(TAG, "Starting file download from: %s", full_path.c_str());
+    if (!lock_path(full_path, false)) {
+      send_response(client_socket, 450, "File busy");
+      return;
+    }
     
     struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0) {
+    if (stat_path(full_path, file_stat)) {
       if (S_ISREG(file_stat.st_mode)) {
         std::string size_msg = "Opening connection for file download (" +
                               std::to_string(file_stat.st_size) + " bytes)";
@@ -365,7 +472,9 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     std::string full_path = normalize_path(client_current_paths_[client_index], filename);
     ESP_LOGI(TAG, "Deleting file: %s", full_path.c_str());
     
-    if (unlink(full_path.c_str()) == 0) {
+    if (!lock_path(full_path, true)) {
+      send_response(client_socket, 450, "File busy");
+    } else if (remove_file(full_path)) {
       send_response(client_socket, 250, "File deleted successfully");
     } else {
       ESP_LOGE(TAG, "Failed to delete file: %s (errno: %d)", full_path.c_str(), errno);
@@ -381,7 +490,9 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     std::string full_path = normalize_path(client_current_paths_[client_index], dirname);
     ESP_LOGI(TAG, "Creating directory: %s", full_path.c_str());
     
-    if (mkdir(full_path.c_str(), 0755) == 0) {
+    if (!lock_path(full_path, true)) {
+      send_response(client_socket, 450, "Directory busy");
+    } else if (mkdir(full_path.c_str(), 0755) == 0) {
       send_response(client_socket, 257, "Directory created");
     } else {
       ESP_LOGE(TAG, "Failed to create directory: %s (errno: %d)", full_path.c_str(), errno);
@@ -397,7 +508,9 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     std::string full_path = normalize_path(client_current_paths_[client_index], dirname);
     ESP_LOGI(TAG, "Removing directory: %s", full_path.c_str());
     
-    if (rmdir(full_path.c_str()) == 0) {
+    if (!lock_path(full_path, true)) {
+      send_response(client_socket, 450, "Directory busy");
+    } else if (rmdir(full_path.c_str()) == 0) {
       send_response(client_socket, 250, "Directory removed");
     } else {
       ESP_LOGE(TAG, "Failed to remove directory: %s (errno: %d)", full_path.c_str(), errno);
@@ -412,7 +525,7 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     
     rename_from_ = normalize_path(client_current_paths_[client_index], filename);
     struct stat file_stat;
-    if (stat(rename_from_.c_str(), &file_stat) == 0) {
+    if (stat_path(rename_from_, file_stat)) {
       send_response(client_socket, 350, "Ready for RNTO");
     } else {
       ESP_LOGE(TAG, "File not found for rename: %s (errno: %d)", rename_from_.c_str(), errno);
@@ -432,7 +545,9 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
       std::string rename_to = normalize_path(client_current_paths_[client_index], filename);
       ESP_LOGI(TAG, "Renaming from %s to %s", rename_from_.c_str(), rename_to.c_str());
       
-      if (rename(rename_from_.c_str(), rename_to.c_str()) == 0) {
+      if (!lock_path(rename_from_, true) || !lock_path(rename_to, true)) {
+        send_response(client_socket, 450, "File busy");
+      } else if (rename(rename_from_.c_str(), rename_to.c_str()) == 0) {
         send_response(client_socket, 250, "Rename successful");
       } else {
         ESP_LOGE(TAG, "Failed to rename: %s -> %s (errno: %d)", 
@@ -450,7 +565,7 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     
     std::string full_path = normalize_path(client_current_paths_[client_index], filename);
     struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+    if (stat_path(full_path, file_stat) && S_ISREG(file_stat.st_mode)) {
       send_response(client_socket, 213, std::to_string(file_stat.st_size));
     } else {
       send_response(client_socket, 550, "File not found or not a regular file");
@@ -464,7 +579,7 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     
     std::string full_path = normalize_path(client_current_paths_[client_index], filename);
     struct stat file_stat;
-    if (stat(full_path.c_str(), &file_stat) == 0) {
+    if (stat_path(full_path, file_stat)) {
       char mdtm_str[15];
       struct tm *tm_info = gmtime(&file_stat.st_mtime);
       strftime(mdtm_str, sizeof(mdtm_str), "%Y%m%d%H%M%S", tm_info);
@@ -472,6 +587,15 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
     } else {
       send_response(client_socket, 550, "File not found");
     }
+  } else if (cmd_str.find("ALLO") == 0) {
+    // Taille annoncée avant un STOR, utilisée pour réserver le fichier d'un seul bloc
+    unsigned long long size = cmd_str.length() > 5 ? strtoull(cmd_str.c_str() + 5, nullptr, 10) : 0;
+    client_allocations_[client_index] = size;
+    if (size > 0) {
+      send_response(client_socket, 200, "ALLO command successful");
+    } else {
+      send_response(client_socket, 202, "No storage allocation necessary");
+    }
   } else if (cmd_str.find("NOOP") == 0) {
     send_response(client_socket, 200, "NOOP command successful");
   } else if (cmd_str.find("QUIT") == 0) {
@@ -484,6 +608,7 @@ void FTPServer::process_command(int client_socket, const std::string& command) {
       client_states_.erase(client_states_.begin() + index);
       client_usernames_.erase(client_usernames_.begin() + index);
       client_current_paths_.erase(client_current_paths_.begin() + index);
+      client_allocations_.erase(client_allocations_.begin() + index);
     }
   } else {
     send_response(client_socket, 502, "Command not implemented");
@@ -551,22 +676,17 @@ bool FTPServer::start_passive_mode(int client_socket) {
 
   passive_data_port_ = ntohs(sin.sin_port);
 
-  esp_netif_t *netif = esp_netif_get_default_netif();
-  if (netif == nullptr) {
-    ESP_LOGE(TAG, "Failed to get default netif");
-    close(passive_data_socket_);
-    passive_data_socket_ = -1;
-    return false;
-  }
-  esp_netif_ip_info_t ip_info;
-  if (esp_netif_get_ip_info(netif, &ip_info) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to get IP info");
+  // Address the client reached us on, also right on the host and with several interfaces
+  struct sockaddr_in local;
+  len = sizeof(local);
+  if (getsockname(client_socket, (struct sockaddr *)&local, &len) < 0) {
+    ESP_LOGE(TAG, "Failed to get local address (errno: %d)", errno);
     close(passive_data_socket_);
     passive_data_socket_ = -1;
     return false;
   }
 
-  uint32_t ip = ip_info.ip.addr;
+  uint32_t ip = local.sin_addr.s_addr;
   std::string response = "Entering Passive Mode (" +
                         std::to_string((ip & 0xFF)) + "," +
                         std::to_string((ip >> 8) & 0xFF) + "," +
@@ -627,51 +747,36 @@ void FTPServer::list_directory(int client_socket, const std::string& path) {
     return;
   }
 
-  DIR *dir = opendir(path.c_str());
-  if (dir == nullptr) {
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open directory");
-    return;
-  }
+  bool listed = for_each_entry(path, [&](const std::string& entry_name, const struct stat& entry_stat) {
+    char time_str[80];
+    strftime(time_str, sizeof(time_str), "%b %d %H:%M", localtime(&entry_stat.st_mtime));
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    std::string entry_name = entry->d_name;
-    if (entry_name == "." || entry_name == "..") {
-      continue;
-    }
+    char perm_str[11] = "----------";
+    if (S_ISDIR(entry_stat.st_mode)) perm_str[0] = 'd';
+    if (entry_stat.st_mode & S_IRUSR) perm_str[1] = 'r';
+    if (entry_stat.st_mode & S_IWUSR) perm_str[2] = 'w';
+    if (entry_stat.st_mode & S_IXUSR) perm_str[3] = 'x';
+    if (entry_stat.st_mode & S_IRGRP) perm_str[4] = 'r';
+    if (entry_stat.st_mode & S_IWGRP) perm_str[5] = 'w';
+    if (entry_stat.st_mode & S_IXGRP) perm_str[6] = 'x';
+    if (entry_stat.st_mode & S_IROTH) perm_str[7] = 'r';
+    if (entry_stat.st_mode & S_IWOTH) perm_str[8] = 'w';
+    if (entry_stat.st_mode & S_IXOTH) perm_str[9] = 'x';
 
-    std::string full_path = path + "/" + entry_name;
-    struct stat entry_stat;
-    if (stat(full_path.c_str(), &entry_stat) == 0) {
-      char time_str[80];
-      strftime(time_str, sizeof(time_str), "%b %d %H:%M", localtime(&entry_stat.st_mtime));
-      
-      char perm_str[11] = "----------";
-      if (S_ISDIR(entry_stat.st_mode)) perm_str[0] = 'd';
-      if (entry_stat.st_mode & S_IRUSR) perm_str[1] = 'r';
-      if (entry_stat.st_mode & S_IWUSR) perm_str[2] = 'w';
-      if (entry_stat.st_mode & S_IXUSR) perm_str[3] = 'x';
-      if (entry_stat.st_mode & S_IRGRP) perm_str[4] = 'r';
-      if (entry_stat.st_mode & S_IWGRP) perm_str[5] = 'w';
-      if (entry_stat.st_mode & S_IXGRP) perm_str[6] = 'x';
-      if (entry_stat.st_mode & S_IROTH) perm_str[7] = 'r';
-      if (entry_stat.st_mode & S_IWOTH) perm_str[8] = 'w';
-      if (entry_stat.st_mode & S_IXOTH) perm_str[9] = 'x';
-
-      char list_item[512];
-      snprintf(list_item, sizeof(list_item),
-               "%s 1 root root %8ld %s %s\r\n",
-               perm_str, (long)entry_stat.st_size, time_str, entry_name.c_str());
-      
-      send(data_socket, list_item, strlen(list_item), 0);
-    }
-  }
+    char list_item[512];
+    snprintf(list_item, sizeof(list_item),
+             "%s 1 root root %8ld %s %s\r\n",
+             perm_str, (long)entry_stat.st_size, time_str, entry_name.c_str());
+
+    send(data_socket, list_item, strlen(list_item), 0);
+  });
 
-  closedir(dir);
   close(data_socket);
   close_data_connection(client_socket);
+  if (!listed) {
+    send_response(client_socket, 550, "Failed to open directory");
+    return;
+  }
   send_response(client_socket, 226, "Directory send OK");
 }
 
@@ -682,60 +787,89 @@ void FTPServer::list_names(int client_socket, const std::string& path) {
     return;
   }
 
-  DIR *dir = opendir(path.c_str());
-  if (dir == nullptr) {
-    close(data_socket);
-    close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open directory");
-    return;
-  }
+  bool listed = for_each_entry(path, [&](const std::string& entry_name, const struct stat&) {
+    std::string list_item = entry_name + "\r\n";
+    send(data_socket, list_item.c_str(), list_item.length(), 0);
+  });
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    std::string entry_name = entry->d_name;
-    if (entry_name == "." || entry_name == "..") {
-      continue;
-    }
-
-    std::string full_path = path + "/" + entry_name;
-    struct stat entry_stat;
-    if (stat(full_path.c_str(), &entry_stat) == 0) {
-      std::string list_item = entry_name + "\r\n";
-      send(data_socket, list_item.c_str(), list_item.length(), 0);
-    }
-  }
-
-  closedir(dir);
   close(data_socket);
   close_data_connection(client_socket);
+  if (!listed) {
+    send_response(client_socket, 550, "Failed to open directory");
+    return;
+  }
   send_response(client_socket, 226, "Directory send OK");
 }
 
-void FTPServer::start_file_upload(int client_socket, const std::string& path) {
+void FTPServer::start_file_upload(int client_socket, const std::string& path, size_t allocation) {
   int data_socket = open_data_connection(client_socket);
   if (data_socket < 0) {
     send_response(client_socket, 425, "Can't open data connection");
     return;
   }
 
-  int file_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-  if (file_fd < 0) {
+  // Avec ALLO, les clusters sont réservés d'un seul bloc contigu et le fichier est ramené à la taille reçue
+  bool preallocated = false;
+#ifdef USE_SD_MMC_CARD
+  preallocated = allocation > 0 && sd_mmc_card_ != nullptr && sd_mmc_card_->preallocate(path, allocation);
+#endif
+
+  // Un fichier existant est supprimé plutôt que tronqué par "wb", ses clusters partent ainsi au trim
+  struct stat st;
+  if (!preallocated && stat_path(path, st) && S_ISREG(st.st_mode)) {
+    remove_file(path);
+  }
+
+  FILE *file = open_stream(path, preallocated ? "r+b" : "wb");
+  if (file == nullptr) {
     close(data_socket);
     close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open file for writing");
+    if (errno == EMFILE) {
+      send_response(client_socket, 450, "No file handle available");
+    } else {
+      send_response(client_socket, 550, "Failed to open file for writing");
+    }
     return;
   }
 
   char buffer[2048];
   int len;
+  off_t received = 0;
+  int write_error = 0;
+  errno = 0;
   while ((len = recv(data_socket, buffer, sizeof(buffer), 0)) > 0) {
-    write(file_fd, buffer, len);
+    if (fwrite(buffer, 1, len, file) != static_cast<size_t>(len)) {
+      write_error = errno != 0 ? errno : EIO;
+      break;
+    }
+    received += len;
   }
+  bool aborted = len < 0;
 
-  close(file_fd);
+  // Le tampon doit être vidé avant de tronquer sous le descripteur
+  if (write_error == 0 && preallocated && (fflush(file) != 0 || ftruncate(fileno(file), received) != 0)) {
+    write_error = errno;
+    ESP_LOGE(TAG, "Failed to trim preallocated file %s: %d", path.c_str(), errno);
+  }
+  // Les dernières données tamponnées ne partent sur la carte qu'à la fermeture
+  errno = 0;
+  if (!close_stream(file) && write_error == 0) {
+    write_error = errno != 0 ? errno : EIO;
+  }
   close(data_socket);
   close_data_connection(client_socket);
-  send_response(client_socket, 226, "Transfer complete");
+  if (write_error != 0) {
+    ESP_LOGE(TAG, "Failed to write %s: %d", path.c_str(), write_error);
+    if (write_error == ENOSPC) {
+      send_response(client_socket, 552, "Insufficient storage space");
+    } else {
+      send_response(client_socket, 451, "Local error while writing the file");
+    }
+  } else if (aborted) {
+    send_response(client_socket, 426, "Connection closed; transfer aborted");
+  } else {
+    send_response(client_socket, 226, "Transfer complete");
+  }
 }
 
 void FTPServer::start_file_download(int client_socket, const std::string& path) {
@@ -745,21 +879,25 @@ void FTPServer::start_file_download(int client_socket, const std::string& path)
     return;
   }
 
-  int file_fd = open(path.c_str(), O_RDONLY);
-  if (file_fd < 0) {
+  FILE *file = open_stream(path, "rb");
+  if (file == nullptr) {
     close(data_socket);
     close_data_connection(client_socket);
-    send_response(client_socket, 550, "Failed to open file for reading");
+    if (errno == EMFILE) {
+      send_response(client_socket, 450, "No file handle available");
+    } else {
+      send_response(client_socket, 550, "Failed to open file for reading");
+    }
     return;
   }
 
   char buffer[2048];
-  int len;
-  while ((len = read(file_fd, buffer, sizeof(buffer))) > 0) {
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
     send(data_socket, buffer, len, 0);
   }
 
-  close(file_fd);
+  close_stream(file);
   close(data_socket);
   close_data_connection(client_socket);
   send_response(client_socket, 226, "Transfer complete");
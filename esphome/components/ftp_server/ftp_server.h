@@ -1,8 +1,15 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/defines.h"
+#ifdef USE_SD_MMC_CARD
+#include "../sd_mmc_card/sd_mmc_card.h"
+#endif
+#include <cstdio>
+#include <functional>
 #include <string>
 #include <vector>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -29,6 +36,9 @@ class FTPServer : public Component {
   void set_username(const std::string &username) { username_ = username; }
   void set_password(const std::string &password) { password_ = password; }
   void set_root_path(const std::string &root_path) { root_path_ = root_path; }
+#ifdef USE_SD_MMC_CARD
+  void set_sd_mmc_card(sd_mmc_card::SdMmc *card) { sd_mmc_card_ = card; }
+#endif
 
   // Méthode pour vérifier si le serveur est en cours d'exécution
   bool is_running() const;
@@ -41,8 +51,20 @@ class FTPServer : public Component {
   bool authenticate(const std::string& username, const std::string& password);
   void list_directory(int client_socket, const std::string& path);
   void list_names(int client_socket, const std::string& path);  // Add this line
-  void start_file_upload(int client_socket, const std::string& path);
+  void start_file_upload(int client_socket, const std::string& path, size_t allocation = 0);
   void start_file_download(int client_socket, const std::string& path);
+  // Verrous partagés avec les autres clients de la carte, relâchés après chaque commande
+  bool lock_path(const std::string& path, bool exclusive);
+  void unlock_paths();
+  // Métadonnées et listings servis par le cache du composant SD quand il est configuré
+  bool stat_path(const std::string& path, struct stat& st);
+  bool for_each_entry(const std::string& path,
+                      const std::function<void(const std::string& name, const struct stat& st)>& callback);
+  // Flux tamponnés par le pool du composant SD quand il est configuré
+  FILE *open_stream(const std::string& path, const char *mode);
+  bool close_stream(FILE *file);
+  // Suppression par le composant SD pour que les clusters libérés partent au trim
+  bool remove_file(const std::string& path);
 
   uint16_t port_{21};
   std::string username_{"admin"};
@@ -54,6 +76,8 @@ class FTPServer : public Component {
   std::vector<FTPClientState> client_states_;
   std::vector<std::string> client_usernames_;
   std::vector<std::string> client_current_paths_;
+  // Taille annoncée par ALLO pour le prochain STOR
+  std::vector<size_t> client_allocations_;
 
   // Variables pour le mode passif
   bool passive_mode_enabled_ = false;
@@ -64,6 +88,11 @@ class FTPServer : public Component {
   // Variable pour la commande RNFR
   std::string rename_from_;  // Add this line
 
+#ifdef USE_SD_MMC_CARD
+  sd_mmc_card::SdMmc *sd_mmc_card_{nullptr};
+  std::vector<sd_mmc_card::PathLock> locks_;
+#endif
+
   // Méthodes pour le mode passif
   bool start_passive_mode(int client_socket);
   int open_data_connection(int client_socket);
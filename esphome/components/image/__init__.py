@@ -27,6 +27,8 @@ from esphome.const import (
 )
 from esphome.core import CORE, HexInt
 
+from ..sd_mmc_card import CONF_SD_MMC_CARD_ID, SdMmc
+
 _LOGGER = logging.getLogger(__name__)
 
 DOMAIN = "image"
@@ -538,6 +540,7 @@ IMAGE_ID_SCHEMA = {
     cv.Required(CONF_ID): cv.declare_id(Image_),
     cv.Required(CONF_FILE): cv.Any(validate_file_shorthand, TYPED_FILE_SCHEMA),
     cv.GenerateID(CONF_RAW_DATA_ID): cv.declare_id(cg.uint8),
+    cv.Optional(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
 }
 
 
@@ -598,7 +601,11 @@ def validate_defaults(value):
             available_options.remove(CONF_BYTE_ORDER)
         config = {
             **{key: image.get(key, defaults.get(key)) for key in available_options},
-            **{key.schema: image[key.schema] for key in IMAGE_ID_SCHEMA},
+            **{
+                key.schema: image[key.schema]
+                for key in IMAGE_ID_SCHEMA
+                if key.schema in image
+            },
         }
         validate_settings(config)
         result.append(config)
@@ -907,6 +914,10 @@ async def to_code(config):
         if sd_runtime:
             cg.add(var.set_sd_path(sd_path))
             cg.add(var.set_sd_runtime(True))
+            # Lecture en flux depuis la carte au lieu de charger le fichier entier
+            if CONF_SD_MMC_CARD_ID in config:
+                sd_card = await cg.get_variable(config[CONF_SD_MMC_CARD_ID])
+                cg.add(var.set_sd_mmc_card(sd_card))
             _LOGGER.info(f"Image {config[CONF_ID]} configured for SD card runtime loading: {sd_path}")
 
 
@@ -4,11 +4,13 @@
 #include "esphome/core/log.h"
 #include <sys/stat.h>
 #include <stdio.h>
+#include <string.h>
 
 namespace esphome {
 namespace image {
 
 static const char *const TAG = "image";
+static const char *const SD_MOUNT_POINT = "/sdcard";
 
 // Lecteur de fichier SD global
 SDFileReader Image::global_sd_reader_ = nullptr;
@@ -174,41 +176,80 @@ bool Image::read_sd_file(const std::string &path, std::vector<uint8_t> &data) {
   return result;
 }
 
-bool Image::decode_image_from_sd() {
+bool Image::read_sd_header(const std::string &path, uint8_t *header, size_t &header_len, size_t &file_size) {
+#ifdef USE_SD_MMC_CARD
+  // Lecture en flux: seuls les octets nécessaires sont chargés
+  if (sd_mmc_card_ != nullptr) {
+    std::string card_path = path;
+    if (str_startswith(card_path, SD_MOUNT_POINT)) {
+      card_path = card_path.substr(strlen(SD_MOUNT_POINT));
+    }
+    // Chargement interactif: passe devant les transferts en masse sur le worker I/O
+    bool opened = false;
+    sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_INTERACTIVE, [&]() {
+      sd_mmc_card::FileReader reader = sd_mmc_card_->open_file(card_path);
+      if (!reader.is_open())
+        return;
+      opened = true;
+      file_size = reader.size();
+      header_len = reader.read(0, header, header_len);
+    });
+    if (!opened) {
+      ESP_LOGE(TAG, "Failed to open SD file: %s", path.c_str());
+      return false;
+    }
+    ESP_LOGI(TAG, "SD file opened, size: %zu bytes", file_size);
+    return true;
+  }
+#endif
   std::vector<uint8_t> file_data;
-  if (!read_sd_file(sd_path_, file_data)) {
+  if (!read_sd_file(path, file_data)) {
+    return false;
+  }
+  file_size = file_data.size();
+  header_len = std::min(header_len, file_data.size());
+  memcpy(header, file_data.data(), header_len);
+  return true;
+}
+
+bool Image::decode_image_from_sd() {
+  uint8_t header[8] = {0};
+  size_t header_len = sizeof(header);
+  size_t file_size = 0;
+  if (!read_sd_header(sd_path_, header, header_len, file_size)) {
     return false;
   }
 
   // Détecte le format d'image
-  if (file_data.size() >= 4) {
+  if (header_len >= 4) {
     // JPEG: FF D8 FF
-    if (file_data[0] == 0xFF && file_data[1] == 0xD8 && file_data[2] == 0xFF) {
+    if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
       ESP_LOGI(TAG, "Detected JPEG format");
-      return decode_jpeg_data(file_data);
+      return decode_jpeg_data(file_size);
     }
     // PNG: 89 50 4E 47
-    else if (file_data[0] == 0x89 && file_data[1] == 0x50 && 
-             file_data[2] == 0x4E && file_data[3] == 0x47) {
+    else if (header[0] == 0x89 && header[1] == 0x50 && 
+             header[2] == 0x4E && header[3] == 0x47) {
       ESP_LOGI(TAG, "Detected PNG format");
-      return decode_png_data(file_data);
+      return decode_png_data(file_size);
     }
   }
 
   ESP_LOGE(TAG, "Unsupported image format or corrupted file");
   // Affiche les premiers bytes pour debug
-  if (file_data.size() >= 8) {
+  if (header_len >= 8) {
     ESP_LOGE(TAG, "File header: %02X %02X %02X %02X %02X %02X %02X %02X", 
-             file_data[0], file_data[1], file_data[2], file_data[3],
-             file_data[4], file_data[5], file_data[6], file_data[7]);
+             header[0], header[1], header[2], header[3],
+             header[4], header[5], header[6], header[7]);
   }
   return false;
 }
 
-bool Image::decode_jpeg_data(const std::vector<uint8_t> &jpeg_data) {
-  ESP_LOGI(TAG, "Decoding JPEG data (%zu bytes)", jpeg_data.size());
+bool Image::decode_jpeg_data(size_t file_size) {
+  ESP_LOGI(TAG, "Decoding JPEG data (%zu bytes)", file_size);
   
-  // TODO: Intégrez ici une bibliothèque de décodage JPEG comme TJpgDec
+  // TODO: Intégrez ici une bibliothèque de décodage JPEG comme TJpgDec,
+  // en lui fournissant les données par blocs via SdMmc::read_file_chunked
   // Pour l'instant, on crée une image de test VISIBLE (pas noire)
   
   size_t expected_size = get_expected_buffer_size();
@@ -292,8 +333,8 @@ bool Image::decode_jpeg_data(const std::vector<uint8_t> &jpeg_data) {
   return true;
 }
 
-bool Image::decode_png_data(const std::vector<uint8_t> &png_data) {
-  ESP_LOGI(TAG, "Decoding PNG data (%zu bytes)", png_data.size());
+bool Image::decode_png_data(size_t file_size) {
+  ESP_LOGI(TAG, "Decoding PNG data (%zu bytes)", file_size);
   
   // TODO: Intégrez ici une bibliothèque de décodage PNG
   // Pour l'instant, on crée une image de test VISIBLE (pas noire)
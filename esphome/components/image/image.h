@@ -69,6 +69,9 @@ class Image : public display::BaseImage {
   void set_sd_path(const std::string &path) { this->sd_path_ = path; }
   void set_sd_runtime(bool enabled) { this->sd_runtime_ = enabled; }
   void set_sd_file_reader(SDFileReader reader) { this->sd_file_reader_ = reader; }
+#ifdef USE_SD_MMC_CARD
+  void set_sd_mmc_card(sd_mmc_card::SdMmc *card) { this->sd_mmc_card_ = card; }
+#endif
   bool load_from_sd();
 
   bool mount_sd_card(); 
@@ -90,9 +93,10 @@ class Image : public display::BaseImage {
   
   // Méthodes privées pour le décodage d'images
   bool decode_image_from_sd();
-  bool decode_jpeg_data(const std::vector<uint8_t> &jpeg_data);
-  bool decode_png_data(const std::vector<uint8_t> &png_data);
+  bool decode_jpeg_data(size_t file_size);
+  bool decode_png_data(size_t file_size);
   bool read_sd_file(const std::string &path, std::vector<uint8_t> &data);
+  bool read_sd_header(const std::string &path, uint8_t *header, size_t &header_len, size_t &file_size);
   size_t get_expected_buffer_size() const;
 
   bool sdcard_mounted_ = false; 
@@ -110,6 +114,9 @@ class Image : public display::BaseImage {
   bool sd_runtime_{false};
   std::vector<uint8_t> sd_buffer_;
   SDFileReader sd_file_reader_;
+#ifdef USE_SD_MMC_CARD
+  sd_mmc_card::SdMmc *sd_mmc_card_{nullptr};
+#endif
   
   // Lecteur de fichier global (partagé par toutes les images)
   static SDFileReader global_sd_reader_;
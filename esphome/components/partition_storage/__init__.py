@@ -0,0 +1,3 @@
+import esphome.codegen as cg
+
+partition_storage_ns = cg.esphome_ns.namespace("partition_storage")
@@ -0,0 +1,323 @@
+#include "partition_storage.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace partition_storage {
+
+static const char *const TAG = "partition_storage";
+
+static constexpr uint32_t RECORD_MAGIC = 0x46545350;  // "PSTF"
+static constexpr uint32_t ERASED = 0xFFFFFFFF;
+// Cleared once the record is deleted or superseded, flash bits only go from 1 to 0 without an erase
+static constexpr uint8_t FLAG_LIVE = 0x01;
+static constexpr uint32_t SECTOR_SIZE = 4096;
+
+struct RecordHeader {
+  uint32_t magic;
+  // ERASED until the record is sealed
+  uint32_t size;
+  uint16_t path_length;
+  uint8_t flags;
+  uint8_t reserved;
+};
+static_assert(sizeof(RecordHeader) == 12, "RecordHeader is stored on flash");
+
+static uint32_t align4(uint32_t value) { return (value + 3) & ~3u; }
+
+// Records hold paths without the leading slash, "/a/b" and "a/b" are the same file
+static std::string normalize(std::string const &path) {
+  size_t start = path.find_first_not_of('/');
+  return start == std::string::npos ? std::string() : path.substr(start);
+}
+
+// Prefix of the paths below a directory, empty for the root
+static std::string directory_prefix(std::string const &path) {
+  std::string dir = normalize(path);
+  if (!dir.empty() && dir.back() != '/')
+    dir += '/';
+  return dir;
+}
+
+void PartitionStorage::setup() {
+  if (!this->open_partition_() || !this->scan_()) {
+    this->mark_failed();
+    return;
+  }
+}
+
+void PartitionStorage::dump_config() {
+  ESP_LOGCONFIG(TAG, "Partition Storage:");
+  ESP_LOGCONFIG(TAG, "  Partition: %s", this->partition_label_.c_str());
+  ESP_LOGCONFIG(TAG, "  Prefix: %s", this->get_prefix().c_str());
+  ESP_LOGCONFIG(TAG, "  Size: %zu bytes, %zu free", this->size_, this->get_free_space());
+  ESP_LOGCONFIG(TAG, "  Files: %zu", this->entries_.size());
+  ESP_LOGCONFIG(TAG, "  Mapped: %s", TRUEFALSE(this->mapped_ != nullptr));
+}
+
+void PartitionStorage::on_shutdown() {
+  storage::Storage::on_shutdown();
+  if (this->current_ >= 0 && this->entries_[this->current_].open)
+    this->seal_();
+}
+
+bool PartitionStorage::scan_() {
+  this->entries_.clear();
+  uint32_t offset = 0;
+  while (offset + sizeof(RecordHeader) <= this->size_) {
+    RecordHeader header;
+    if (!this->read_(offset, &header, sizeof(header)))
+      return false;
+    if (header.magic == ERASED)
+      break;
+    uint32_t data_offset = align4(offset + sizeof(header) + header.path_length);
+    if (header.magic != RECORD_MAGIC || data_offset > this->size_ ||
+        (header.size != ERASED && data_offset + header.size > this->size_)) {
+      // Nothing after it can be located, appending is refused until the partition is erased
+      ESP_LOGE(TAG, "Corrupted record at 0x%" PRIX32 ", the partition is read only until erased", offset);
+      this->log_end_ = this->size_;
+      return true;
+    }
+    std::string path(header.path_length, '\0');
+    if (!this->read_(offset + sizeof(header), &path[0], header.path_length))
+      return false;
+
+    Entry entry{path, offset, data_offset, header.size, false};
+    if (header.size == ERASED) {
+      // Written up to a power loss: the data runs at most up to the first erased sector
+      uint32_t end = (data_offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+      uint8_t chunk[64];
+      for (; end < this->size_; end += SECTOR_SIZE) {
+        bool erased = true;
+        for (uint32_t pos = end; erased && pos < end + SECTOR_SIZE; pos += sizeof(chunk)) {
+          if (!this->read_(pos, chunk, sizeof(chunk)))
+            return false;
+          erased = std::all_of(chunk, chunk + sizeof(chunk), [](uint8_t b) { return b == 0xFF; });
+        }
+        if (erased)
+          break;
+      }
+      entry.size = std::min(end, (uint32_t) this->size_) - data_offset;
+      ESP_LOGW(TAG, "Dropping %s, its write was cut", path.c_str());
+      if (!this->write_(offset + offsetof(RecordHeader, size), &entry.size, sizeof(entry.size)) ||
+          !this->mark_deleted_(entry))
+        return false;
+    } else if (header.flags & FLAG_LIVE) {
+      // Both versions stay live when power is lost between sealing the new one and dropping the old one
+      int previous = this->find_(path);
+      if (previous >= 0) {
+        this->mark_deleted_(this->entries_[previous]);
+        this->entries_.erase(this->entries_.begin() + previous);
+      }
+      this->entries_.push_back(entry);
+    }
+    offset = align4(data_offset + entry.size);
+  }
+  this->log_end_ = std::min<uint32_t>(offset, this->size_);
+  ESP_LOGD(TAG, "%zu files, %" PRIu32 " bytes used", this->entries_.size(), this->log_end_);
+  return true;
+}
+
+int PartitionStorage::find_(std::string const &path) const {
+  for (int i = (int) this->entries_.size() - 1; i >= 0; i--) {
+    if (this->entries_[i].path == path)
+      return i;
+  }
+  return -1;
+}
+
+bool PartitionStorage::mark_deleted_(Entry const &entry) {
+  uint8_t flags = 0xFF & ~FLAG_LIVE;
+  return this->write_(entry.header_offset + offsetof(RecordHeader, flags), &flags, 1);
+}
+
+bool PartitionStorage::create_() {
+  uint32_t offset = this->log_end_;
+  uint32_t data_offset = align4(offset + sizeof(RecordHeader) + this->current_path_.size());
+  if (this->current_path_.empty() || this->current_path_.size() > UINT16_MAX || data_offset > this->size_) {
+    ESP_LOGE(TAG, "No room left for %s", this->current_path_.c_str());
+    return false;
+  }
+  RecordHeader header{RECORD_MAGIC, ERASED, (uint16_t) this->current_path_.size(), 0xFF, 0xFF};
+  // The header goes first: a record cut before its path is written is dropped by the next scan
+  if (!this->write_(offset, &header, sizeof(header)) ||
+      !this->write_(offset + sizeof(header), this->current_path_.data(), this->current_path_.size()))
+    return false;
+  this->entries_.push_back(Entry{this->current_path_, offset, data_offset, 0, true});
+  this->current_ = this->entries_.size() - 1;
+  this->log_end_ = data_offset;
+  return true;
+}
+
+bool PartitionStorage::seal_() {
+  Entry &entry = this->entries_[this->current_];
+  if (!this->write_(entry.header_offset + offsetof(RecordHeader, size), &entry.size, sizeof(entry.size)))
+    return false;
+  entry.open = false;
+  this->log_end_ = std::min<uint32_t>(align4(entry.data_offset + entry.size), this->size_);
+  // The previous versions are dropped only once the new one is complete
+  std::string path = entry.path;
+  for (int i = this->current_ - 1; i >= 0; i--) {
+    if (this->entries_[i].path == path) {
+      this->mark_deleted_(this->entries_[i]);
+      this->entries_.erase(this->entries_.begin() + i);
+    }
+  }
+  this->current_ = this->find_(this->current_path_);
+  return true;
+}
+
+void PartitionStorage::direct_set_file(const std::string &path) {
+  if (this->current_ >= 0 && this->entries_[this->current_].open)
+    this->seal_();
+  this->current_path_ = normalize(path);
+  this->current_ = this->find_(this->current_path_);
+}
+
+void PartitionStorage::direct_delete_file(const std::string &path) {
+  std::string name = normalize(path);
+  int index = this->find_(name);
+  if (index >= 0 && this->entries_[index].open) {
+    // The size must be on flash for the next scan to get past the record
+    this->seal_();
+    index = this->find_(name);
+  }
+  if (index >= 0) {
+    this->mark_deleted_(this->entries_[index]);
+    this->entries_.erase(this->entries_.begin() + index);
+  }
+  this->current_ = this->find_(this->current_path_);
+}
+
+storage::FileInfo PartitionStorage::direct_get_file_info(const std::string &path) const {
+  int index = this->find_(normalize(path));
+  if (index >= 0)
+    return storage::FileInfo(path, this->entries_[index].size, false);
+  // Directories only exist through the files below them
+  std::string dir = directory_prefix(path);
+  for (auto const &entry : this->entries_) {
+    if (entry.path.compare(0, dir.size(), dir) == 0)
+      return storage::FileInfo(path, 0, true);
+  }
+  return storage::FileInfo(path, 0, false);
+}
+
+std::vector<storage::FileInfo> PartitionStorage::direct_list_directory(const std::string &path) const {
+  std::string dir = directory_prefix(path);
+  std::vector<storage::FileInfo> result;
+  for (int i = 0; i < (int) this->entries_.size(); i++) {
+    Entry const &entry = this->entries_[i];
+    if (entry.path.compare(0, dir.size(), dir) != 0 || this->find_(entry.path) != i)
+      continue;
+    size_t slash = entry.path.find('/', dir.size());
+    if (slash == std::string::npos) {
+      result.emplace_back("/" + entry.path, entry.size, false);
+      continue;
+    }
+    std::string sub = "/" + entry.path.substr(0, slash);
+    bool listed = std::any_of(result.begin(), result.end(),
+                              [&sub](storage::FileInfo const &info) { return info.is_directory && info.path == sub; });
+    if (!listed)
+      result.emplace_back(sub, 0, true);
+  }
+  return result;
+}
+
+uint8_t PartitionStorage::direct_read_byte(size_t offset) {
+  uint8_t data = 0;
+  this->direct_read_byte_array(offset, &data, 1);
+  return data;
+}
+
+size_t PartitionStorage::direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) {
+  if (this->current_ < 0)
+    return 0;
+  Entry const &entry = this->entries_[this->current_];
+  if (offset >= entry.size)
+    return 0;
+  size_t n = std::min<size_t>(data_length, entry.size - offset);
+  if (!this->read_(entry.data_offset + offset, data, n))
+    return 0;
+  return n;
+}
+
+const uint8_t *PartitionStorage::direct_get_mapped_view(size_t offset, size_t length) {
+  if (this->mapped_ == nullptr || this->current_ < 0)
+    return nullptr;
+  Entry const &entry = this->entries_[this->current_];
+  if (offset > entry.size || length > entry.size - offset)
+    return nullptr;
+  return this->mapped_ + entry.data_offset + offset;
+}
+
+bool PartitionStorage::write_data_(size_t offset, const uint8_t *data, size_t data_length) {
+  // Writing from the start of a sealed file begins its next version
+  if (this->current_ < 0 || (!this->entries_[this->current_].open && offset == 0)) {
+    if (!this->create_())
+      return false;
+  }
+  Entry &entry = this->entries_[this->current_];
+  if (!entry.open || offset > entry.size) {
+    ESP_LOGE(TAG, "%s can only be written sequentially from its start", entry.path.c_str());
+    return false;
+  }
+  // A buffer flush may write bytes again, they must not change
+  size_t overlap = std::min<size_t>(entry.size - offset, data_length);
+  for (size_t done = 0; done < overlap;) {
+    uint8_t chunk[64];
+    size_t n = std::min(overlap - done, sizeof(chunk));
+    if (!this->read_(entry.data_offset + offset + done, chunk, n))
+      return false;
+    if (memcmp(chunk, data + done, n) != 0) {
+      ESP_LOGE(TAG, "Bytes already written to %s cannot change", entry.path.c_str());
+      return false;
+    }
+    done += n;
+  }
+  data += overlap;
+  data_length -= overlap;
+  if (data_length == 0)
+    return true;
+  if (entry.data_offset + entry.size + data_length > this->size_) {
+    ESP_LOGE(TAG, "Partition full, %zu bytes of %s not written", data_length, entry.path.c_str());
+    return false;
+  }
+  if (!this->write_(entry.data_offset + entry.size, data, data_length))
+    return false;
+  entry.size += data_length;
+  this->log_end_ = entry.data_offset + entry.size;
+  return true;
+}
+
+bool PartitionStorage::direct_write_byte(size_t offset, uint8_t data) {
+  return this->write_data_(offset, &data, 1);
+}
+
+bool PartitionStorage::direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) {
+  return this->write_data_(offset, data, data_length);
+}
+
+bool PartitionStorage::direct_append_byte(uint8_t data) { return this->direct_append_byte_array(&data, 1); }
+
+bool PartitionStorage::direct_append_byte_array(uint8_t *data, size_t data_length) {
+  size_t size = this->current_ >= 0 ? this->entries_[this->current_].size : 0;
+  return this->write_data_(size, data, data_length);
+}
+
+bool PartitionStorage::erase() {
+  this->drop_buffer();
+  if (!this->erase_partition_())
+    return false;
+  this->entries_.clear();
+  this->log_end_ = 0;
+  this->current_ = -1;
+  ESP_LOGI(TAG, "Erased %s", this->partition_label_.c_str());
+  return true;
+}
+
+}  // namespace partition_storage
+}  // namespace esphome
@@ -0,0 +1,97 @@
+#pragma once
+#include "esphome/core/defines.h"
+
+#include <string>
+#include <vector>
+#include "esphome/components/storage/storage.h"
+
+#ifdef USE_ESP32
+#include "esp_partition.h"
+#endif
+
+namespace esphome {
+namespace partition_storage {
+
+/* storage::Storage backend on a flash data partition, for read-mostly assets such as fonts, icons and tables.
+ *
+ * The partition is mapped once in the address space: reads are a memcpy from the mapping and get_mapped_view()
+ * hands out pointers into it. Files are records of a log written from the start of the partition, a record being
+ * a header, the path and the data. A file is written sequentially into a new record which supersedes the previous
+ * version once sealed, when another file is selected or on shutdown. Deleted and superseded records only get their
+ * space back when the partition is erased.
+ *
+ * On host a file of the same size stands in for the partition. */
+class PartitionStorage : public storage::Storage {
+ public:
+  void setup() override;
+  void dump_config() override;
+  void on_shutdown() override;
+
+  void set_partition_label(std::string const &label) { this->partition_label_ = label; }
+#ifdef USE_HOST
+  void set_host_size(size_t size) { this->size_ = size; }
+#endif
+
+  uint8_t direct_read_byte(size_t offset) override;
+  bool direct_write_byte(size_t offset, uint8_t data) override;
+  bool direct_append_byte(uint8_t data) override;
+  size_t direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) override;
+  bool direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) override;
+  bool direct_append_byte_array(uint8_t *data, size_t data_length) override;
+
+  /* Erases the whole partition, every file is lost. */
+  bool erase();
+  size_t get_free_space() const { return this->size_ - this->log_end_; }
+
+ protected:
+  struct Entry {
+    std::string path;
+    uint32_t header_offset;
+    uint32_t data_offset;
+    uint32_t size;
+    // Record still being written, its size is not on flash yet
+    bool open;
+  };
+
+  void direct_set_file(const std::string &path) override;
+  void direct_delete_file(const std::string &path) override;
+  storage::FileInfo direct_get_file_info(const std::string &path) const override;
+  std::vector<storage::FileInfo> direct_list_directory(const std::string &path) const override;
+  const uint8_t *direct_get_mapped_view(size_t offset, size_t length) override;
+
+  // Backend specific access to the partition
+  bool open_partition_();
+  bool read_(uint32_t offset, void *data, size_t length) const;
+  bool write_(uint32_t offset, const void *data, size_t length);
+  bool erase_partition_();
+
+  bool scan_();
+  // Latest version of a path
+  int find_(std::string const &path) const;
+  bool mark_deleted_(Entry const &entry);
+  // Starts a new record for the current path
+  bool create_();
+  // Writes the size of the open record and drops the version it replaces
+  bool seal_();
+  bool write_data_(size_t offset, const uint8_t *data, size_t data_length);
+
+  std::string partition_label_;
+#ifdef USE_ESP32
+  const esp_partition_t *partition_{nullptr};
+  esp_partition_mmap_handle_t mmap_handle_{0};
+#endif
+#ifdef USE_HOST
+  int fd_{-1};
+#endif
+  // Mapping of the whole partition, nullptr when it could not be mapped
+  const uint8_t *mapped_{nullptr};
+  size_t size_{1024 * 1024};
+  uint32_t log_end_{0};
+  std::vector<Entry> entries_;
+  // Path selected by direct_set_file and its entry, -1 until it is written
+  std::string current_path_;
+  int current_{-1};
+};
+
+}  // namespace partition_storage
+}  // namespace esphome
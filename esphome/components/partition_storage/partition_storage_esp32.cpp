@@ -0,0 +1,68 @@
+#include "partition_storage.h"
+
+#ifdef USE_ESP32
+#include <cstring>
+
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace partition_storage {
+
+static const char *const TAG = "partition_storage.esp32";
+
+bool PartitionStorage::open_partition_() {
+  this->partition_ =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, this->partition_label_.c_str());
+  if (this->partition_ == nullptr) {
+    ESP_LOGE(TAG, "Data partition %s not found", this->partition_label_.c_str());
+    return false;
+  }
+  this->size_ = this->partition_->size;
+  const void *mapped;
+  esp_err_t err =
+      esp_partition_mmap(this->partition_, 0, this->size_, ESP_PARTITION_MMAP_DATA, &mapped, &this->mmap_handle_);
+  if (err != ESP_OK) {
+    // Out of MMU pages: still usable, reads copy from flash
+    ESP_LOGW(TAG, "Failed to map %s: %s", this->partition_label_.c_str(), esp_err_to_name(err));
+  } else {
+    this->mapped_ = static_cast<const uint8_t *>(mapped);
+  }
+  return true;
+}
+
+bool PartitionStorage::read_(uint32_t offset, void *data, size_t length) const {
+  if (this->mapped_ != nullptr) {
+    memcpy(data, this->mapped_ + offset, length);
+    return true;
+  }
+  esp_err_t err = esp_partition_read(this->partition_, offset, data, length);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read %zu bytes at 0x%" PRIX32 ": %s", length, offset, esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+bool PartitionStorage::write_(uint32_t offset, const void *data, size_t length) {
+  // The mapping goes through the flash cache, which esp_partition_write invalidates
+  esp_err_t err = esp_partition_write(this->partition_, offset, data, length);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write %zu bytes at 0x%" PRIX32 ": %s", length, offset, esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+bool PartitionStorage::erase_partition_() {
+  esp_err_t err = esp_partition_erase_range(this->partition_, 0, this->partition_->size);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to erase %s: %s", this->partition_label_.c_str(), esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+}  // namespace partition_storage
+}  // namespace esphome
+
+#endif  // USE_ESP32
@@ -0,0 +1,93 @@
+#include "partition_storage.h"
+
+#ifdef USE_HOST
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace partition_storage {
+
+static const char *const TAG = "partition_storage.host";
+
+bool PartitionStorage::open_partition_() {
+  std::string path = this->partition_label_ + ".bin";
+  this->fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (this->fd_ < 0 || fstat(this->fd_, &st) != 0) {
+    ESP_LOGE(TAG, "Failed to open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  // A new or grown file starts erased like flash
+  if ((size_t) st.st_size != this->size_) {
+    if (ftruncate(this->fd_, this->size_) != 0) {
+      ESP_LOGE(TAG, "Failed to resize %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    if ((size_t) st.st_size < this->size_) {
+      uint8_t erased[256];
+      memset(erased, 0xFF, sizeof(erased));
+      for (size_t offset = st.st_size; offset < this->size_; offset += sizeof(erased)) {
+        if (pwrite(this->fd_, erased, std::min(sizeof(erased), this->size_ - offset), offset) < 0)
+          return false;
+      }
+    }
+  }
+  void *mapped = mmap(nullptr, this->size_, PROT_READ, MAP_SHARED, this->fd_, 0);
+  if (mapped == MAP_FAILED) {
+    ESP_LOGW(TAG, "Failed to map %s: %s", path.c_str(), strerror(errno));
+  } else {
+    this->mapped_ = static_cast<const uint8_t *>(mapped);
+  }
+  return true;
+}
+
+bool PartitionStorage::read_(uint32_t offset, void *data, size_t length) const {
+  if (this->mapped_ != nullptr) {
+    memcpy(data, this->mapped_ + offset, length);
+    return true;
+  }
+  return pread(this->fd_, data, length, offset) == (ssize_t) length;
+}
+
+bool PartitionStorage::write_(uint32_t offset, const void *data, size_t length) {
+  // Programming flash only clears bits, the file behaves the same so that misuse shows up on host
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  uint8_t chunk[256];
+  for (size_t done = 0; done < length;) {
+    size_t n = std::min(length - done, sizeof(chunk));
+    if (pread(this->fd_, chunk, n, offset + done) != (ssize_t) n)
+      return false;
+    for (size_t i = 0; i < n; i++)
+      chunk[i] &= bytes[done + i];
+    if (pwrite(this->fd_, chunk, n, offset + done) != (ssize_t) n) {
+      ESP_LOGE(TAG, "Failed to write %zu bytes at 0x%" PRIX32 ": %s", n, offset, strerror(errno));
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool PartitionStorage::erase_partition_() {
+  uint8_t erased[256];
+  memset(erased, 0xFF, sizeof(erased));
+  for (size_t offset = 0; offset < this->size_; offset += sizeof(erased)) {
+    if (pwrite(this->fd_, erased, std::min(sizeof(erased), this->size_ - offset), offset) < 0) {
+      ESP_LOGE(TAG, "Failed to erase %s: %s", this->partition_label_.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace partition_storage
+}  // namespace esphome
+
+#endif  // USE_HOST
@@ -0,0 +1,32 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import storage
+from esphome.const import CONF_ID
+from esphome.core import CORE
+from . import partition_storage_ns
+
+CONF_PARTITION = "partition"
+CONF_HOST_SIZE = "host_size"
+
+PartitionStorage = partition_storage_ns.class_("PartitionStorage", storage.Storage)
+
+CONFIG_SCHEMA = cv.All(
+    storage.storage_schema(PartitionStorage).extend(
+        {
+            # Reads come straight from the mapping, a window would only add a copy
+            cv.Optional(storage.CONF_BUFFER_SIZE, default=0): cv.int_range(min=0),
+            cv.Required(CONF_PARTITION): cv.string,
+            # Size of the file standing in for the partition on host
+            cv.Optional(CONF_HOST_SIZE, default=1024 * 1024): cv.int_range(min=4096),
+        }
+    ),
+    cv.only_on(["esp32", "host"]),
+)
+
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+    cg.add(var.set_partition_label(config[CONF_PARTITION]))
+    if CORE.is_host:
+        cg.add(var.set_host_size(config[CONF_HOST_SIZE]))
+    await storage.storage_to_code(config)
@@ -10,8 +10,10 @@ from esphome.const import (
     CONF_OUTPUT,
     CONF_PULLUP,
     CONF_PULLDOWN,
+    CONF_TRIGGER_ID,
 )
 from esphome.core import CORE
+from esphome.components.esp32 import add_idf_sdkconfig_option
 
 CONF_SD_MMC_CARD_ID = "sd_mmc_card_id"
 CONF_CMD_PIN = "cmd_pin"
@@ -21,16 +23,69 @@ CONF_DATA2_PIN = "data2_pin"
 CONF_DATA3_PIN = "data3_pin"
 CONF_MODE_1BIT = "mode_1bit"
 CONF_POWER_CTRL_PIN = "power_ctrl_pin"
+CONF_FREE_SPACE_RECONCILE_INTERVAL = "free_space_reconcile_interval"
+CONF_IO_WORKER = "io_worker"
+CONF_BUS_SPEED = "bus_speed"
+CONF_ON_BENCHMARK = "on_benchmark"
+CONF_ON_FORMAT = "on_format"
+CONF_CLUSTER_SIZE = "cluster_size"
+CONF_FILE_SIZE = "file_size"
+CONF_BUFFER_SIZES = "buffer_sizes"
+CONF_RANDOM_OPS = "random_ops"
+CONF_QUEUE_SIZE = "queue_size"
+CONF_TASK_PRIORITY = "task_priority"
+CONF_FAST_SEEK = "fast_seek"
+CONF_MIN_FILE_SIZE = "min_file_size"
+CONF_CACHE_SIZE = "cache_size"
+CONF_DIRECTORY_CACHE = "directory_cache"
+CONF_MAX_DIRECTORIES = "max_directories"
+CONF_MAX_ENTRIES = "max_entries"
+CONF_MAX_FILES = "max_files"
+CONF_STREAM_BUFFER_SIZE = "stream_buffer_size"
+CONF_STAT_CACHE = "stat_cache"
+CONF_BLOCK_CACHE = "block_cache"
+CONF_SIZE = "size"
+CONF_READ_AHEAD = "read_ahead"
+CONF_TRIM = "trim"
+CONF_BATCH_SIZE = "batch_size"
+CONF_RING_LOG = "ring_log"
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_HOST_ROOT = "host_root"
+CONF_HOST_MODEL = "host_model"
+CONF_OP_LATENCY = "op_latency"
+CONF_READ_BANDWIDTH = "read_bandwidth"
+CONF_WRITE_BANDWIDTH = "write_bandwidth"
 
 sd_mmc_card_component_ns = cg.esphome_ns.namespace("sd_mmc_card")
-SdMmc = sd_mmc_card_component_ns.class_("SdMmc", cg.Component)
+SdMmc = sd_mmc_card_component_ns.class_("SdMmc", cg.PollingComponent)
+
+BusSpeed = sd_mmc_card_component_ns.enum("BusSpeed")
+BUS_SPEEDS = {
+    "default": BusSpeed.BUS_SPEED_DEFAULT,
+    "high_speed": BusSpeed.BUS_SPEED_HIGH_SPEED,
+    "ddr50": BusSpeed.BUS_SPEED_DDR50,
+    "auto": BusSpeed.BUS_SPEED_AUTO,
+}
 
 # Action
 SdMmcWriteFileAction = sd_mmc_card_component_ns.class_("SdMmcWriteFileAction", automation.Action)
+SdMmcReplaceFileAction = sd_mmc_card_component_ns.class_("SdMmcReplaceFileAction", automation.Action)
 SdMmcAppendFileAction = sd_mmc_card_component_ns.class_("SdMmcAppendFileAction", automation.Action)
 SdMmcCreateDirectoryAction = sd_mmc_card_component_ns.class_("SdMmcCreateDirectoryAction", automation.Action)
 SdMmcRemoveDirectoryAction = sd_mmc_card_component_ns.class_("SdMmcRemoveDirectoryAction", automation.Action)
 SdMmcDeleteFileAction = sd_mmc_card_component_ns.class_("SdMmcDeleteFileAction", automation.Action)
+SdMmcBenchmarkAction = sd_mmc_card_component_ns.class_("SdMmcBenchmarkAction", automation.Action)
+SdMmcFormatAction = sd_mmc_card_component_ns.class_("SdMmcFormatAction", automation.Action)
+SdMmcRingLogAppendAction = sd_mmc_card_component_ns.class_("SdMmcRingLogAppendAction", automation.Action)
+SdMmcRingLogExportAction = sd_mmc_card_component_ns.class_("SdMmcRingLogExportAction", automation.Action)
+
+# Trigger
+BenchmarkTrigger = sd_mmc_card_component_ns.class_(
+    "BenchmarkTrigger", automation.Trigger.template(cg.std_string)
+)
+FormatTrigger = sd_mmc_card_component_ns.class_(
+    "FormatTrigger", automation.Trigger.template(cg.std_string)
+)
 
 def validate_raw_data(value):
     if isinstance(value, str):
@@ -41,44 +96,176 @@ def validate_raw_data(value):
         "data must either be a string wrapped in quotes or a list of bytes"
     )
 
-CONFIG_SCHEMA = cv.Schema(
+def validate_bus_pins(config):
+    if CORE.is_host:
+        return config
+    for key in (CONF_CLK_PIN, CONF_CMD_PIN, CONF_DATA0_PIN):
+        if key not in config:
+            raise cv.Invalid(f"{key} is required")
+    return config
+
+CONFIG_SCHEMA = cv.All(cv.Schema(
     {
         cv.GenerateID(): cv.declare_id(SdMmc),
-        cv.Required(CONF_CLK_PIN): pins.internal_gpio_output_pin_number,
-        cv.Required(CONF_CMD_PIN): pins.internal_gpio_output_pin_number,
-        cv.Required(CONF_DATA0_PIN): pins.internal_gpio_pin_number({CONF_OUTPUT: True, CONF_INPUT: True}),
+        cv.Optional(CONF_CLK_PIN): pins.internal_gpio_output_pin_number,
+        cv.Optional(CONF_CMD_PIN): pins.internal_gpio_output_pin_number,
+        cv.Optional(CONF_DATA0_PIN): pins.internal_gpio_pin_number({CONF_OUTPUT: True, CONF_INPUT: True}),
         cv.Optional(CONF_DATA1_PIN): pins.internal_gpio_pin_number({CONF_OUTPUT: True, CONF_INPUT: True}),
         cv.Optional(CONF_DATA2_PIN): pins.internal_gpio_pin_number({CONF_OUTPUT: True, CONF_INPUT: True}),
         cv.Optional(CONF_DATA3_PIN): pins.internal_gpio_pin_number({CONF_OUTPUT: True, CONF_INPUT: True}),
         cv.Optional(CONF_MODE_1BIT, default=False): cv.boolean,
+        cv.Optional(CONF_BUS_SPEED, default="default"): cv.enum(BUS_SPEEDS, lower=True),
         cv.Optional(CONF_POWER_CTRL_PIN) : pins.gpio_pin_schema({
             CONF_OUTPUT: True,
             CONF_PULLUP: False,
             CONF_PULLDOWN: False,
         }),
+        cv.Optional(CONF_FREE_SPACE_RECONCILE_INTERVAL, default="15min"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_ON_BENCHMARK): automation.validate_automation(
+            {
+                cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(BenchmarkTrigger),
+            }
+        ),
+        cv.Optional(CONF_ON_FORMAT): automation.validate_automation(
+            {
+                cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(FormatTrigger),
+            }
+        ),
+        cv.Optional(CONF_MAX_FILES, default=16): cv.int_range(min=6, max=64),
+        cv.Optional(CONF_STREAM_BUFFER_SIZE, default=0): cv.int_range(min=0, max=256 * 1024),
+        cv.Optional(CONF_IO_WORKER): cv.Schema(
+            {
+                cv.Optional(CONF_QUEUE_SIZE, default=16): cv.int_range(min=1, max=255),
+                cv.Optional(CONF_TASK_PRIORITY, default=5): cv.int_range(min=1, max=24),
+            }
+        ),
+        cv.Optional(CONF_STAT_CACHE): cv.Schema(
+            {
+                cv.Optional(CONF_MAX_ENTRIES, default=256): cv.int_range(min=1, max=65535),
+            }
+        ),
+        cv.Optional(CONF_BLOCK_CACHE): cv.All(
+            cv.Schema(
+                {
+                    cv.Optional(CONF_SIZE, default=256 * 1024): cv.int_range(min=8 * 1024),
+                    cv.Optional(CONF_READ_AHEAD, default=32 * 1024): cv.int_range(min=4 * 1024, max=128 * 1024),
+                }
+            ),
+            cv.only_with_esp_idf,
+        ),
+        cv.Optional(CONF_TRIM): cv.All(
+            cv.Schema(
+                {
+                    cv.Optional(CONF_BATCH_SIZE, default=4 * 1024 * 1024): cv.int_range(min=512),
+                }
+            ),
+            cv.only_with_esp_idf,
+        ),
+        cv.Optional(CONF_RING_LOG): cv.All(
+            cv.Schema(
+                {
+                    cv.Optional(CONF_PATH, default="/ring.log"): cv.string_strict,
+                    cv.Required(CONF_SIZE): cv.int_range(min=64 * 1024),
+                    cv.Optional(CONF_BUFFER_SIZE, default=16 * 1024): cv.int_range(min=512, max=256 * 1024),
+                }
+            ),
+            cv.only_with_esp_idf,
+        ),
+        cv.Optional(CONF_FAST_SEEK): cv.All(
+            cv.Schema(
+                {
+                    cv.Optional(CONF_MIN_FILE_SIZE, default=4 * 1024 * 1024): cv.int_range(min=1),
+                    cv.Optional(CONF_CACHE_SIZE, default=64 * 1024): cv.int_range(min=256),
+                }
+            ),
+            cv.only_with_esp_idf,
+        ),
+        cv.Optional(CONF_DIRECTORY_CACHE): cv.Schema(
+            {
+                cv.Optional(CONF_MAX_DIRECTORIES, default=16): cv.int_range(min=1, max=1024),
+                cv.Optional(CONF_MAX_ENTRIES, default=128): cv.int_range(min=1, max=65535),
+            }
+        ),
+        cv.Optional(CONF_HOST_ROOT, default="sdcard"): cv.string_strict,
+        cv.Optional(CONF_HOST_MODEL): cv.Schema(
+            {
+                cv.Optional(CONF_OP_LATENCY, default="0us"): cv.positive_time_period_microseconds,
+                cv.Optional(CONF_READ_BANDWIDTH, default=0): cv.positive_int,
+                cv.Optional(CONF_WRITE_BANDWIDTH, default=0): cv.positive_int,
+            }
+        ),
     }
-).extend(cv.COMPONENT_SCHEMA)
+).extend(cv.polling_component_schema("60s")), validate_bus_pins)
 
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
+    cg.add_define("USE_SD_MMC_CARD")
 
     cg.add(var.set_mode_1bit(config[CONF_MODE_1BIT]))
+    cg.add(var.set_bus_speed(config[CONF_BUS_SPEED]))
+    cg.add(var.set_free_space_reconcile_interval(config[CONF_FREE_SPACE_RECONCILE_INTERVAL]))
+    cg.add(var.set_max_files(config[CONF_MAX_FILES]))
+    cg.add(var.set_stream_buffer_size(config[CONF_STREAM_BUFFER_SIZE]))
+    if CONF_IO_WORKER in config:
+        io_worker = config[CONF_IO_WORKER]
+        cg.add(var.set_io_worker(io_worker[CONF_QUEUE_SIZE], io_worker[CONF_TASK_PRIORITY]))
+
+    if CONF_DIRECTORY_CACHE in config:
+        directory_cache = config[CONF_DIRECTORY_CACHE]
+        cg.add(var.set_directory_cache(directory_cache[CONF_MAX_DIRECTORIES], directory_cache[CONF_MAX_ENTRIES]))
+
+    if CONF_STAT_CACHE in config:
+        cg.add(var.set_stat_cache(config[CONF_STAT_CACHE][CONF_MAX_ENTRIES]))
+
+    if CONF_BLOCK_CACHE in config:
+        block_cache = config[CONF_BLOCK_CACHE]
+        cg.add(var.set_block_cache(block_cache[CONF_SIZE], block_cache[CONF_READ_AHEAD]))
+
+    if CONF_TRIM in config:
+        cg.add(var.set_trim(config[CONF_TRIM][CONF_BATCH_SIZE]))
 
-    cg.add(var.set_clk_pin(config[CONF_CLK_PIN]))
-    cg.add(var.set_cmd_pin(config[CONF_CMD_PIN]))
-    cg.add(var.set_data0_pin(config[CONF_DATA0_PIN]))
+    if CONF_RING_LOG in config:
+        ring_log = config[CONF_RING_LOG]
+        cg.add(var.set_ring_log(ring_log[CONF_PATH], ring_log[CONF_SIZE], ring_log[CONF_BUFFER_SIZE]))
 
-    if (config[CONF_MODE_1BIT] == False):
-        cg.add(var.set_data1_pin(config[CONF_DATA1_PIN]))
-        cg.add(var.set_data2_pin(config[CONF_DATA2_PIN]))
-        cg.add(var.set_data3_pin(config[CONF_DATA3_PIN]))
+    if CONF_FAST_SEEK in config:
+        fast_seek = config[CONF_FAST_SEEK]
+        cg.add(var.set_fast_seek(fast_seek[CONF_MIN_FILE_SIZE], fast_seek[CONF_CACHE_SIZE]))
+        add_idf_sdkconfig_option("CONFIG_FATFS_USE_FASTSEEK", True)
+
+    if CORE.is_host:
+        cg.add(var.set_host_root(config[CONF_HOST_ROOT]))
+        if CONF_HOST_MODEL in config:
+            model = config[CONF_HOST_MODEL]
+            cg.add(var.set_host_timing(
+                model[CONF_OP_LATENCY].total_microseconds,
+                model[CONF_READ_BANDWIDTH],
+                model[CONF_WRITE_BANDWIDTH],
+            ))
+    else:
+        cg.add(var.set_clk_pin(config[CONF_CLK_PIN]))
+        cg.add(var.set_cmd_pin(config[CONF_CMD_PIN]))
+        cg.add(var.set_data0_pin(config[CONF_DATA0_PIN]))
+
+        if (config[CONF_MODE_1BIT] == False):
+            cg.add(var.set_data1_pin(config[CONF_DATA1_PIN]))
+            cg.add(var.set_data2_pin(config[CONF_DATA2_PIN]))
+            cg.add(var.set_data3_pin(config[CONF_DATA3_PIN]))
 
     if (CONF_POWER_CTRL_PIN in config):
         power_ctrl = await cg.gpio_pin_expression(config[CONF_POWER_CTRL_PIN])
         cg.add(var.set_power_ctrl_pin(power_ctrl));
 
+    for conf in config.get(CONF_ON_BENCHMARK, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        await automation.build_automation(trigger, [(cg.std_string, "json")], conf)
+
+    for conf in config.get(CONF_ON_FORMAT, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        await automation.build_automation(trigger, [(cg.std_string, "json")], conf)
+
     if CORE.using_arduino:
         if CORE.is_esp32:
             cg.add_library("FS", None)
@@ -113,6 +300,19 @@ async def sd_mmc_write_file_to_code(config, action_id, template_arg, args):
     return var
 
 
+@automation.register_action(
+    "sd_mmc_card.replace_file", SdMmcReplaceFileAction, SD_MMC_WRITE_FILE_ACTION_SCHEMA
+)
+async def sd_mmc_replace_file_to_code(config, action_id, template_arg, args):
+    parent = await cg.get_variable(config[CONF_ID])
+    var = cg.new_Pvariable(action_id, template_arg, parent)
+    path_ = await cg.templatable(config[CONF_PATH], args, cg.std_string)
+    data_ = await cg.templatable(config[CONF_DATA], args, cg.std_vector.template(cg.uint8))
+    cg.add(var.set_path(path_))
+    cg.add(var.set_data(data_))
+    return var
+
+
 @automation.register_action(
     "sd_mmc_card.append_file", SdMmcAppendFileAction, SD_MMC_WRITE_FILE_ACTION_SCHEMA
 )
@@ -157,3 +357,81 @@ async def sd_mmc_delete_file_to_code(config, action_id, template_arg, args):
     path_ = await cg.templatable(config[CONF_PATH], args, cg.std_string)
     cg.add(var.set_path(path_))
     return var
+
+
+SD_MMC_BENCHMARK_ACTION_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(): cv.use_id(SdMmc),
+        cv.Optional(CONF_PATH): cv.templatable(cv.string_strict),
+        cv.Optional(CONF_FILE_SIZE): cv.templatable(cv.positive_int),
+        cv.Optional(CONF_RANDOM_OPS): cv.templatable(cv.positive_int),
+        cv.Optional(CONF_BUFFER_SIZES): cv.ensure_list(cv.int_range(min=1)),
+    }
+)
+
+@automation.register_action(
+    "sd_mmc_card.benchmark", SdMmcBenchmarkAction, SD_MMC_BENCHMARK_ACTION_SCHEMA
+)
+async def sd_mmc_benchmark_to_code(config, action_id, template_arg, args):
+    parent = await cg.get_variable(config[CONF_ID])
+    var = cg.new_Pvariable(action_id, template_arg, parent)
+    if CONF_PATH in config:
+        path_ = await cg.templatable(config[CONF_PATH], args, cg.std_string)
+        cg.add(var.set_path(path_))
+    if CONF_FILE_SIZE in config:
+        file_size_ = await cg.templatable(config[CONF_FILE_SIZE], args, cg.uint32)
+        cg.add(var.set_file_size(file_size_))
+    if CONF_RANDOM_OPS in config:
+        random_ops_ = await cg.templatable(config[CONF_RANDOM_OPS], args, cg.uint32)
+        cg.add(var.set_random_ops(random_ops_))
+    if CONF_BUFFER_SIZES in config:
+        cg.add(var.set_buffer_sizes(config[CONF_BUFFER_SIZES]))
+    return var
+
+
+SD_MMC_RING_LOG_APPEND_ACTION_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(): cv.use_id(SdMmc),
+        cv.Required(CONF_DATA): cv.templatable(validate_raw_data),
+    }
+)
+
+@automation.register_action(
+    "sd_mmc_card.ring_log_append", SdMmcRingLogAppendAction, SD_MMC_RING_LOG_APPEND_ACTION_SCHEMA
+)
+async def sd_mmc_ring_log_append_to_code(config, action_id, template_arg, args):
+    parent = await cg.get_variable(config[CONF_ID])
+    var = cg.new_Pvariable(action_id, template_arg, parent)
+    data_ = await cg.templatable(config[CONF_DATA], args, cg.std_vector.template(cg.uint8))
+    cg.add(var.set_data(data_))
+    return var
+
+
+@automation.register_action(
+    "sd_mmc_card.ring_log_export", SdMmcRingLogExportAction, SD_MMC_PATH_ACTION_SCHEMA
+)
+async def sd_mmc_ring_log_export_to_code(config, action_id, template_arg, args):
+    parent = await cg.get_variable(config[CONF_ID])
+    var = cg.new_Pvariable(action_id, template_arg, parent)
+    path_ = await cg.templatable(config[CONF_PATH], args, cg.std_string)
+    cg.add(var.set_path(path_))
+    return var
+
+
+SD_MMC_FORMAT_ACTION_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(): cv.use_id(SdMmc),
+        cv.Optional(CONF_CLUSTER_SIZE): cv.templatable(cv.int_range(min=512, max=64 * 1024)),
+    }
+)
+
+@automation.register_action(
+    "sd_mmc_card.format", SdMmcFormatAction, SD_MMC_FORMAT_ACTION_SCHEMA
+)
+async def sd_mmc_format_to_code(config, action_id, template_arg, args):
+    parent = await cg.get_variable(config[CONF_ID])
+    var = cg.new_Pvariable(action_id, template_arg, parent)
+    if CONF_CLUSTER_SIZE in config:
+        cluster_size_ = await cg.templatable(config[CONF_CLUSTER_SIZE], args, cg.uint32)
+        cg.add(var.set_cluster_size(cluster_size_))
+    return var
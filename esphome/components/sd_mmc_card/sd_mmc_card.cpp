@@ -1,16 +1,56 @@
 #include "sd_mmc_card.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "math.h"
 #include "esphome/core/log.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+#ifdef USE_ESP32
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#else
+#include <thread>
+#endif
 
 namespace esphome {
 namespace sd_mmc_card {
 
 static const char *TAG = "sd_mmc_card";
 
+static const char *const REPLACE_JOURNAL = "/.replace.journal";
+static const char *const REPLACE_SUFFIX = ".replace~";
+static constexpr uint32_t REPLACE_MAGIC = 0x4A524453;   // "SDRJ"
+static constexpr uint32_t REPLACE_COMMIT = 0x43524453;  // "SDRC"
+static constexpr size_t REPLACE_JOURNAL_MAX_SIZE = 12 + 512 + 4;
+// Without PSRAM, larger stream buffers are not worth the internal RAM
+static constexpr size_t MAX_INTERNAL_STREAM_BUFFER = 8 * 1024;
+
+SdMmc::SdMmc() {
+  this->locks_.set_release_callback([this](std::string const &path) { this->invalidate_caches_(path); });
+  this->set_max_files(DEFAULT_MAX_FILES);
+}
+
+void SdMmc::set_max_files(uint8_t max_files) {
+  this->max_files_ = max_files;
+  this->handles_.set_slots(max_files > UNPOOLED_FILES ? max_files - UNPOOLED_FILES : 1);
+}
+
 bool SdMmc::exists(const std::string &path) {
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached != DirectoryCache::LOOKUP_UNKNOWN)
+    return cached == DirectoryCache::LOOKUP_FILE;
   FILE *file = fopen(path.c_str(), "rb");
   if (file != nullptr) {
     fclose(file);
@@ -34,7 +74,484 @@ size_t SdMmc::get_file_size(const std::string &path) {
 FileSizeSensor::FileSizeSensor(sensor::Sensor *sensor, std::string const &path) : sensor(sensor), path(path) {}
 #endif
 
-void SdMmc::loop() {}
+void SdMmc::loop() {
+  this->publish_free_space_scan_();
+  this->publish_benchmark_();
+  this->publish_format_();
+}
+
+void SdMmc::on_shutdown() {
+#ifdef USE_ESP_IDF
+  if (this->ring_log_ != nullptr)
+    this->ring_log_->flush();
+#endif
+  this->flush_cache();
+}
+
+bool SdMmc::flush_cache() {
+#ifdef USE_ESP_IDF
+  if (this->block_cache_ != nullptr)
+    return this->block_cache_->flush();
+#endif
+  return true;
+}
+
+std::string FormatResult::to_json() const {
+  static const char *const FAT_TYPES[] = {"", "FAT12", "FAT16", "FAT32", "exFAT"};
+  char buffer[192];
+  snprintf(buffer, sizeof(buffer),
+           "{\"ok\":%s,\"fat_type\":\"%s\",\"allocation_unit\":%" PRIu32 ",\"cluster_size\":%" PRIu32
+           ",\"data_offset\":%" PRIu32 ",\"clusters\":%" PRIu32 "}",
+           this->ok ? "true" : "false", this->fat_type <= 4 ? FAT_TYPES[this->fat_type] : "", this->allocation_unit,
+           this->cluster_size, this->data_offset, this->clusters);
+  return buffer;
+}
+
+FormatResult SdMmc::format(uint32_t cluster_size) {
+  if (this->ring_log_exports_ > 0) {
+    ESP_LOGW(TAG, "Ring log export running, format refused");
+    return FormatResult();
+  }
+#ifdef USE_ESP_IDF
+  // The region of the ring log goes away with the file system
+  this->close_ring_log_();
+#endif
+  FormatResult result = this->format_(cluster_size);
+#ifdef USE_ESP_IDF
+  // On the new file system, or on the old one when the format did not start
+  this->setup_ring_log_();
+#endif
+  return result;
+}
+
+bool SdMmc::start_format(uint32_t cluster_size) {
+  if (this->format_running_.exchange(true)) {
+    ESP_LOGW(TAG, "Format already running");
+    return false;
+  }
+  // A queued export reads the ring log on the I/O worker, the log is only closed once no export is left
+  if (this->ring_log_exports_ > 0) {
+    ESP_LOGW(TAG, "Ring log export running, format refused");
+    this->format_running_ = false;
+    return false;
+  }
+  this->format_cluster_size_ = cluster_size;
+#ifdef USE_ESP_IDF
+  // The main loop appends to and flushes the ring log, it is closed here and opened again by publish_format_()
+  this->close_ring_log_();
+#endif
+  if (!SdMmc::start_task_(SdMmc::format_task_, "sd_format", 6144, this, 1)) {
+    ESP_LOGE(TAG, "Failed to start format task");
+#ifdef USE_ESP_IDF
+    this->setup_ring_log_();
+#endif
+    this->format_running_ = false;
+    return false;
+  }
+  return true;
+}
+
+void SdMmc::format_task_(void *arg) {
+  SdMmc *sd = static_cast<SdMmc *>(arg);
+  FormatResult result = sd->format_(sd->format_cluster_size_);
+  sd->format_result_ = result;
+  sd->format_done_ = true;
+  SdMmc::end_task_();
+}
+
+void SdMmc::publish_format_() {
+  if (!this->format_done_.exchange(false))
+    return;
+#ifdef USE_ESP_IDF
+  this->setup_ring_log_();
+#endif
+  this->update_sensors();
+  this->format_callback_.call(this->format_result_.to_json());
+  this->format_running_ = false;
+}
+
+void SdMmc::update() {
+  // The incremental counter misses cluster chains from renames or failed writes, rescan now and then
+  if (this->free_space_reconcile_interval_ > 0 &&
+      millis() - this->last_free_space_scan_ >= this->free_space_reconcile_interval_)
+    this->start_free_space_scan_();
+#ifdef USE_ESP_IDF
+  // Whatever is left below the batch size goes out once per interval
+  this->start_trim_();
+  if (this->ring_log_ != nullptr)
+    this->ring_log_->flush();
+#endif
+  this->update_sensors();
+}
+
+bool SdMmc::append_ring_log(const uint8_t *data, size_t len) {
+#ifdef USE_ESP_IDF
+  if (this->ring_log_ != nullptr)
+    return this->ring_log_->append(data, len);
+#endif
+  ESP_LOGE(TAG, "No ring log");
+  return false;
+}
+
+bool SdMmc::export_ring_log(std::string const &path) {
+#ifdef USE_ESP_IDF
+  if (this->ring_log_ != nullptr) {
+    FileWriter writer = this->open_writer(path, "w");
+    if (!writer.is_open())
+      return false;
+    bool ok = this->ring_log_->read([&](const uint8_t *data, size_t len) { return writer.write(data, len); });
+    ok &= writer.close();
+    ESP_LOGI(TAG, "Exported the ring log to %s: %zu bytes", path.c_str(), writer.size());
+    return ok;
+  }
+#endif
+  ESP_LOGE(TAG, "No ring log");
+  return false;
+}
+
+bool SdMmc::start_ring_log_export(std::string const &path) {
+  // Counted before format_running_ is read, start_format() reads them the other way round
+  this->ring_log_exports_++;
+  if (this->format_running_) {
+    this->ring_log_exports_--;
+    ESP_LOGW(TAG, "Format running, ring log not exported");
+    return false;
+  }
+  bool queued = this->submit_io(IO_PRIORITY_BULK, [this, path]() {
+    this->export_ring_log(path);
+    this->ring_log_exports_--;
+  });
+  if (!queued)
+    this->ring_log_exports_--;
+  return queued;
+}
+
+uint64_t SdMmc::get_erased_bytes() const {
+#ifdef USE_ESP_IDF
+  if (this->trim_queue_ != nullptr)
+    return this->trim_queue_->get_erased_bytes();
+#endif
+  return 0;
+}
+
+void SdMmc::update_sensors() {
+#ifdef USE_SENSOR
+  // Nothing to publish until the first scan seeded the counter
+  if (this->free_space_valid_) {
+    uint64_t total_bytes = (uint64_t) this->total_clusters_ * this->cluster_size_;
+    // The counter is an estimate between scans, it may drift past either end
+    uint64_t free_bytes = (uint64_t) std::max<int32_t>(this->free_clusters_, 0) * this->cluster_size_;
+    free_bytes = std::min(free_bytes, total_bytes);
+    if (this->used_space_sensor_ != nullptr)
+      this->used_space_sensor_->publish_state(total_bytes - free_bytes);
+    if (this->total_space_sensor_ != nullptr)
+      this->total_space_sensor_->publish_state(total_bytes);
+    if (this->free_space_sensor_ != nullptr)
+      this->free_space_sensor_->publish_state(free_bytes);
+  }
+
+  for (auto &sensor : this->file_size_sensors_) {
+    if (sensor.sensor != nullptr)
+      sensor.sensor->publish_state(this->file_size(sensor.path));
+  }
+
+  if (this->io_queue_depth_sensor_ != nullptr)
+    this->io_queue_depth_sensor_->publish_state(this->get_io_queue_depth());
+  sensor::Sensor *latency_sensors[IO_PRIORITY_COUNT] = {
+      this->io_interactive_latency_sensor_, this->io_normal_latency_sensor_, this->io_bulk_latency_sensor_};
+  for (uint8_t priority = 0; priority < IO_PRIORITY_COUNT; priority++) {
+    if (latency_sensors[priority] == nullptr)
+      continue;
+    IoStats stats = this->take_io_stats((IoPriority) priority);
+    // Average wait in the queue over the last interval
+    latency_sensors[priority]->publish_state(stats.completed ? (float) stats.total_wait_ms / stats.completed : 0);
+  }
+
+  if (this->erased_space_sensor_ != nullptr)
+    this->erased_space_sensor_->publish_state(this->get_erased_bytes());
+#endif
+}
+
+void SdMmc::start_free_space_scan_() {
+  if (this->free_space_scanning_.exchange(true))
+    return;
+  this->last_free_space_scan_ = millis();
+  this->free_space_delta_ = 0;
+  if (!SdMmc::start_task_(SdMmc::free_space_scan_task_, "sd_free_space", 4096, this, 1)) {
+    ESP_LOGE(TAG, "Failed to start free space scan");
+    this->free_space_scanning_ = false;
+  }
+}
+
+void SdMmc::free_space_scan_task_(void *arg) {
+  SdMmc *sd = static_cast<SdMmc *>(arg);
+  if (sd->scan_free_space_(sd->scanned_cluster_size_, sd->scanned_total_clusters_, sd->scanned_free_clusters_)) {
+    sd->free_space_scan_done_ = true;
+  } else {
+    sd->free_space_scanning_ = false;
+  }
+  SdMmc::end_task_();
+}
+
+void SdMmc::publish_free_space_scan_() {
+  if (!this->free_space_scan_done_.exchange(false))
+    return;
+  // Writers kept counting in free_space_delta_ while the FAT was walked
+  int32_t free_clusters = (int32_t) this->scanned_free_clusters_ + this->free_space_delta_.exchange(0);
+  if (this->free_space_valid_) {
+    int32_t drift = free_clusters - this->free_clusters_;
+    if (drift != 0)
+      ESP_LOGD(TAG, "Free space counter drifted by %d clusters", drift);
+  }
+  this->cluster_size_ = this->scanned_cluster_size_;
+  this->total_clusters_ = this->scanned_total_clusters_;
+  this->free_clusters_ = free_clusters;
+  this->free_space_valid_ = true;
+  this->free_space_scanning_ = false;
+}
+
+bool SdMmc::start_task_(void (*task)(void *), const char *name, uint32_t stack_size, void *arg, uint8_t priority) {
+#ifdef USE_ESP32
+  return xTaskCreate(task, name, stack_size, arg, priority, nullptr) == pdPASS;
+#else
+  std::thread(task, arg).detach();
+  return true;
+#endif
+}
+
+void SdMmc::end_task_() {
+#ifdef USE_ESP32
+  vTaskDelete(nullptr);
+#endif
+}
+
+static const char *const BUS_PROBE_FILE = "/.bus_probe";
+static constexpr size_t BUS_PROBE_BLOCK_SIZE = 32 * 1024;
+static constexpr size_t BUS_PROBE_BLOCKS = 8;
+
+static inline uint8_t bus_probe_pattern(size_t block, size_t i) { return (i * 31 + block * 7 + (i >> 8)) & 0xFF; }
+
+bool SdMmc::write_bus_probe_() {
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[BUS_PROBE_BLOCK_SIZE]);
+  if (!buffer)
+    return false;
+  FILE *file = this->open_stream_(BUS_PROBE_FILE, "wb");
+  if (file == nullptr) {
+    ESP_LOGW(TAG, "Bus probe: failed to create test file: %s", strerror(errno));
+    return false;
+  }
+  bool ok = true;
+  for (size_t block = 0; ok && block < BUS_PROBE_BLOCKS; block++) {
+    for (size_t i = 0; i < BUS_PROBE_BLOCK_SIZE; i++)
+      buffer[i] = bus_probe_pattern(block, i);
+    ok = fwrite(buffer.get(), 1, BUS_PROBE_BLOCK_SIZE, file) == BUS_PROBE_BLOCK_SIZE;
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    ESP_LOGW(TAG, "Bus probe: write failed: %s", strerror(errno));
+    remove((this->mount_point_ + BUS_PROBE_FILE).c_str());
+  }
+  return ok;
+}
+
+bool SdMmc::verify_bus_(float &read_speed) {
+  read_speed = 0;
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[BUS_PROBE_BLOCK_SIZE]);
+  if (!buffer) {
+    ESP_LOGW(TAG, "Not enough memory for the bus probe");
+    return true;
+  }
+
+  // The test file is kept on the card so that later boots only read it
+  std::string probe_path = this->mount_point_ + BUS_PROBE_FILE;
+  FILE *file = this->open_stream_(BUS_PROBE_FILE, "rb");
+  if (file == nullptr) {
+    if (!this->write_bus_probe_())
+      return false;
+    file = this->open_stream_(BUS_PROBE_FILE, "rb");
+    if (file == nullptr)
+      return false;
+  }
+  bool ok = true;
+  uint32_t start = micros();
+  for (size_t block = 0; ok && block < BUS_PROBE_BLOCKS; block++) {
+    ok = fread(buffer.get(), 1, BUS_PROBE_BLOCK_SIZE, file) == BUS_PROBE_BLOCK_SIZE;
+    for (size_t i = 0; ok && i < BUS_PROBE_BLOCK_SIZE; i++)
+      ok = buffer[i] == bus_probe_pattern(block, i);
+  }
+  uint32_t elapsed = micros() - start;
+  fclose(file);
+  if (!ok) {
+    // Rewritten by the next, slower mode in case the file itself is damaged
+    ESP_LOGW(TAG, "Bus probe: read back mismatch or CRC error");
+    remove(probe_path.c_str());
+    return false;
+  }
+  // Bytes per microsecond is MB/s
+  read_speed = elapsed > 0 ? (float) (BUS_PROBE_BLOCK_SIZE * BUS_PROBE_BLOCKS) / elapsed : 0;
+  return true;
+}
+
+void SdMmc::set_bus_mode_(uint8_t width, uint32_t freq_khz, bool ddr, float read_speed) {
+  char mode[48];
+  snprintf(mode, sizeof(mode), "%u-bit %" PRIu32 " MHz%s", width, freq_khz / 1000, ddr ? " DDR" : "");
+  this->bus_mode_ = mode;
+  if (read_speed > 0)
+    ESP_LOGI(TAG, "Bus mode %s, read %.1f MB/s", mode, read_speed);
+#ifdef USE_TEXT_SENSOR
+  if (this->bus_mode_text_sensor_ != nullptr)
+    this->bus_mode_text_sensor_->publish_state(this->bus_mode_);
+#endif
+}
+
+void SdMmc::set_io_worker(uint8_t queue_size, uint8_t task_priority) {
+  this->io_queue_size_ = queue_size;
+  this->io_task_priority_ = task_priority;
+}
+
+#ifdef USE_ESP32
+void SdMmc::setup_io_worker_() {
+  if (this->io_queue_size_ == 0)
+    return;
+  for (auto &queue : this->io_queues_) {
+    queue = xQueueCreate(this->io_queue_size_, sizeof(IoRequest *));
+    if (queue == nullptr) {
+      ESP_LOGE(TAG, "Failed to allocate I/O queue, running without worker");
+      return;
+    }
+  }
+  this->io_pending_ = xSemaphoreCreateCounting(IO_PRIORITY_COUNT * this->io_queue_size_, 0);
+  this->io_stats_lock_ = xSemaphoreCreateMutex();
+  if (this->io_pending_ == nullptr || this->io_stats_lock_ == nullptr ||
+      xTaskCreate(SdMmc::io_task_loop_, "sd_io", 6144, this, this->io_task_priority_, &this->io_task_) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to start I/O worker, running without worker");
+    this->io_task_ = nullptr;
+  }
+}
+
+void SdMmc::io_task_loop_(void *arg) {
+  SdMmc *sd = static_cast<SdMmc *>(arg);
+  while (true) {
+    xSemaphoreTake(sd->io_pending_, portMAX_DELAY);
+    // One request per wakeup, always from the most urgent non empty class
+    for (uint8_t priority = 0; priority < IO_PRIORITY_COUNT; priority++) {
+      IoRequest *request;
+      if (xQueueReceive(sd->io_queues_[priority], &request, 0) != pdTRUE)
+        continue;
+      uint32_t wait = millis() - request->queued_at;
+      request->job();
+      xSemaphoreTake(sd->io_stats_lock_, portMAX_DELAY);
+      IoStats &stats = sd->io_stats_[priority];
+      stats.completed++;
+      stats.total_wait_ms += wait;
+      stats.max_wait_ms = std::max(stats.max_wait_ms, wait);
+      xSemaphoreGive(sd->io_stats_lock_);
+      if (request->done != nullptr) {
+        xSemaphoreGive(request->done);
+      } else {
+        delete request;
+      }
+      break;
+    }
+  }
+}
+
+bool SdMmc::has_io_worker() const { return this->io_task_ != nullptr; }
+
+bool SdMmc::submit_io(IoPriority priority, IoJob job) {
+  if (this->io_task_ == nullptr || xTaskGetCurrentTaskHandle() == this->io_task_) {
+    job();
+    return true;
+  }
+  IoRequest *request = new IoRequest{std::move(job), millis(), nullptr};
+  if (xQueueSend(this->io_queues_[priority], &request, 0) != pdTRUE) {
+    ESP_LOGW(TAG, "I/O queue full, request dropped");
+    delete request;
+    return false;
+  }
+  xSemaphoreGive(this->io_pending_);
+  return true;
+}
+
+bool SdMmc::run_io(IoPriority priority, IoJob const &job) {
+  // Jobs queued from the worker itself would wait on their own completion
+  if (this->io_task_ == nullptr || xTaskGetCurrentTaskHandle() == this->io_task_) {
+    job();
+    return true;
+  }
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  if (done == nullptr)
+    return false;
+  IoRequest request{job, millis(), done};
+  IoRequest *request_ptr = &request;
+  bool ok = xQueueSend(this->io_queues_[priority], &request_ptr, portMAX_DELAY) == pdTRUE;
+  if (ok) {
+    xSemaphoreGive(this->io_pending_);
+    xSemaphoreTake(done, portMAX_DELAY);
+  }
+  vSemaphoreDelete(done);
+  return ok;
+}
+
+size_t SdMmc::get_io_queue_depth() const {
+  if (this->io_task_ == nullptr)
+    return 0;
+  size_t depth = 0;
+  for (auto queue : this->io_queues_)
+    depth += uxQueueMessagesWaiting(queue);
+  return depth;
+}
+
+IoStats SdMmc::take_io_stats(IoPriority priority) {
+  if (this->io_stats_lock_ == nullptr)
+    return IoStats();
+  xSemaphoreTake(this->io_stats_lock_, portMAX_DELAY);
+  IoStats stats = this->io_stats_[priority];
+  this->io_stats_[priority] = IoStats();
+  xSemaphoreGive(this->io_stats_lock_);
+  return stats;
+}
+#else
+// No worker off device, jobs run on the calling thread
+void SdMmc::setup_io_worker_() {
+  if (this->io_queue_size_ > 0)
+    ESP_LOGW(TAG, "The I/O worker is only available on ESP32, running jobs inline");
+}
+
+bool SdMmc::has_io_worker() const { return false; }
+
+bool SdMmc::submit_io(IoPriority priority, IoJob job) {
+  job();
+  return true;
+}
+
+bool SdMmc::run_io(IoPriority priority, IoJob const &job) {
+  job();
+  return true;
+}
+
+size_t SdMmc::get_io_queue_depth() const { return 0; }
+
+IoStats SdMmc::take_io_stats(IoPriority priority) { return IoStats(); }
+#endif
+
+size_t SdMmc::size_to_clusters_(size_t size) const {
+  size_t cluster_size = this->cluster_size_;
+  return (size + cluster_size - 1) / cluster_size;
+}
+
+void SdMmc::adjust_free_space_(size_t old_size, size_t new_size) {
+  int32_t delta = (int32_t) this->size_to_clusters_(old_size) - (int32_t) this->size_to_clusters_(new_size);
+  if (delta != 0)
+    this->adjust_free_clusters_(delta);
+}
+
+void SdMmc::adjust_free_clusters_(int32_t delta) {
+  if (this->free_space_scanning_)
+    this->free_space_delta_ += delta;
+  if (this->free_space_valid_)
+    this->free_clusters_ += delta;
+}
 
 void SdMmc::dump_config() {
   ESP_LOGCONFIG(TAG, "SD MMC Component");
@@ -51,11 +568,65 @@ void SdMmc::dump_config() {
   if (this->power_ctrl_pin_ != nullptr) {
     LOG_PIN("  Power Ctrl Pin: ", this->power_ctrl_pin_);
   }
+  ESP_LOGCONFIG(TAG, "  Cluster size: %zu", this->cluster_size_.load());
+  if (!this->bus_mode_.empty())
+    ESP_LOGCONFIG(TAG, "  Bus mode: %s", this->bus_mode_.c_str());
+  if (this->free_space_reconcile_interval_ > 0)
+    ESP_LOGCONFIG(TAG, "  Free space reconcile interval: %" PRIu32 " ms", this->free_space_reconcile_interval_);
+  if (this->io_queue_size_ > 0) {
+    ESP_LOGCONFIG(TAG, "  I/O worker: %s", this->has_io_worker() ? "running" : "disabled");
+    ESP_LOGCONFIG(TAG, "    Queue size: %u", this->io_queue_size_);
+    ESP_LOGCONFIG(TAG, "    Task priority: %u", this->io_task_priority_);
+  }
+  if (this->directories_.is_enabled()) {
+    ESP_LOGCONFIG(TAG, "  Directory cache: %zu directories of up to %zu entries", this->directories_.get_max_directories(),
+                  this->directories_.get_max_entries());
+  }
+  if (this->stats_.is_enabled())
+    ESP_LOGCONFIG(TAG, "  Stat cache: %zu entries", this->stats_.get_max_entries());
+  HandlePool::Stats handle_stats = this->handles_.get_stats();
+  ESP_LOGCONFIG(TAG, "  Max files: %u, %u pooled", this->max_files_, this->handles_.get_slots());
+  ESP_LOGCONFIG(TAG, "    Stream buffer: %zu bytes", this->get_stream_buffer_size());
+  ESP_LOGCONFIG(TAG, "    Opened: %" PRIu32 ", reused: %" PRIu32 ", waits: %" PRIu32 ", timeouts: %" PRIu32,
+                handle_stats.opened, handle_stats.reused, handle_stats.waits, handle_stats.timeouts);
+#ifdef USE_ESP_IDF
+  if (this->block_cache_ != nullptr) {
+    BlockCache::Stats stats = this->block_cache_->get_stats();
+    ESP_LOGCONFIG(TAG, "  Block cache: %zu bytes, read-ahead up to %zu bytes", this->block_cache_->get_arena_size(),
+                  this->block_cache_read_ahead_);
+    ESP_LOGCONFIG(TAG, "    Hits: %" PRIu32 ", misses: %" PRIu32, stats.hits, stats.misses);
+  }
+  if (this->trim_queue_ != nullptr) {
+    ESP_LOGCONFIG(TAG, "  Trim: %s in batches of %zu bytes", this->trim_queue_->uses_discard() ? "discard" : "erase",
+                  this->trim_batch_size_);
+    ESP_LOGCONFIG(TAG, "    Erased: %" PRIu64 " bytes", this->get_erased_bytes());
+  }
+  if (this->ring_log_ != nullptr) {
+    ESP_LOGCONFIG(TAG, "  Ring log: %s, id %08" PRIx32, this->ring_log_path_.c_str(), this->ring_log_->get_log_id());
+    ESP_LOGCONFIG(TAG, "    Used: %" PRIu64 " of %" PRIu64 " bytes", this->ring_log_->get_used_bytes(),
+                  this->ring_log_->get_capacity());
+  }
+#endif
+  if (this->fast_seek_min_size_ > 0) {
+    ESP_LOGCONFIG(TAG, "  Fast seek: files from %zu bytes", this->fast_seek_min_size_);
+    ESP_LOGCONFIG(TAG, "    Link map cache: %zu bytes", this->link_maps_.get_budget());
+  }
 
 #ifdef USE_SENSOR
   LOG_SENSOR("  ", "Used space", this->used_space_sensor_);
   LOG_SENSOR("  ", "Total space", this->total_space_sensor_);
   LOG_SENSOR("  ", "Free space", this->free_space_sensor_);
+  LOG_SENSOR("  ", "I/O queue depth", this->io_queue_depth_sensor_);
+  LOG_SENSOR("  ", "I/O interactive latency", this->io_interactive_latency_sensor_);
+  LOG_SENSOR("  ", "I/O normal latency", this->io_normal_latency_sensor_);
+  LOG_SENSOR("  ", "I/O bulk latency", this->io_bulk_latency_sensor_);
+  LOG_SENSOR("  ", "Benchmark read speed", this->benchmark_read_speed_sensor_);
+  LOG_SENSOR("  ", "Benchmark write speed", this->benchmark_write_speed_sensor_);
+  LOG_SENSOR("  ", "Benchmark random read IOPS", this->benchmark_random_read_iops_sensor_);
+  LOG_SENSOR("  ", "Benchmark random write IOPS", this->benchmark_random_write_iops_sensor_);
+  LOG_SENSOR("  ", "Benchmark read latency p99", this->benchmark_read_latency_p99_sensor_);
+  LOG_SENSOR("  ", "Benchmark metadata latency", this->benchmark_metadata_latency_sensor_);
+  LOG_SENSOR("  ", "Erased space", this->erased_space_sensor_);
   for (auto &sensor : this->file_size_sensors_) {
     if (sensor.sensor != nullptr)
       LOG_SENSOR("  ", "File size", sensor.sensor);
@@ -63,6 +634,7 @@ void SdMmc::dump_config() {
 #endif
 #ifdef USE_TEXT_SENSOR
   LOG_TEXT_SENSOR("  ", "SD Card Type", this->sd_card_type_text_sensor_);
+  LOG_TEXT_SENSOR("  ", "Bus mode", this->bus_mode_text_sensor_);
 #endif
 
   if (this->is_failed()) {
@@ -73,7 +645,16 @@ void SdMmc::dump_config() {
 
 void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len) {
   ESP_LOGV(TAG, "Writing to file: %s", path);
-  this->write_file(path, buffer, len, "w");
+  // Beyond one cluster the size is worth reserving up front, the file then lands in a single extent
+  if (this->cluster_size_ == 0 || len <= this->cluster_size_) {
+    this->write_file(path, buffer, len, "w");
+    return;
+  }
+  FileWriter writer = this->open_preallocated_writer(path, len);
+  if (!writer.is_open())
+    return;
+  writer.write(buffer, len);
+  writer.close();
 }
 
 void SdMmc::append_file(const char *path, const uint8_t *buffer, size_t len) {
@@ -81,10 +662,167 @@ void SdMmc::append_file(const char *path, const uint8_t *buffer, size_t len) {
   this->write_file(path, buffer, len, "a");
 }
 
+static void put_le(std::vector<uint8_t> &out, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++)
+    out.push_back((value >> (8 * i)) & 0xFF);
+}
+
+static uint32_t get_le(const uint8_t *data, size_t bytes) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < bytes; i++)
+    value |= (uint32_t) data[i] << (8 * i);
+  return value;
+}
+
+// Journal record: magic, new size, path length, path, CRC16 of the preceding bytes. The commit mark is appended
+// once the temporary file is on the card.
+static bool parse_replace_journal(const uint8_t *record, size_t len, std::string &path, uint32_t &size,
+                                  bool &committed) {
+  if (len < 12 || get_le(record, 4) != REPLACE_MAGIC)
+    return false;
+  size_t path_len = get_le(record + 8, 2);
+  size_t record_len = 12 + path_len;
+  if (len < record_len || get_le(record + 10 + path_len, 2) != crc16(record, 10 + path_len))
+    return false;
+  size = get_le(record + 4, 4);
+  path.assign(reinterpret_cast<const char *>(record + 10), path_len);
+  committed = len == record_len + 4 && get_le(record + record_len, 4) == REPLACE_COMMIT;
+  return true;
+}
+
+bool SdMmc::replace_file(const char *path, const uint8_t *buffer, size_t len) {
+  ESP_LOGV(TAG, "Replacing file: %s", path);
+  std::string target = this->card_path(path);
+  if (target.size() > REPLACE_JOURNAL_MAX_SIZE - 16) {
+    ESP_LOGE(TAG, "Path too long to be replaced: %s", path);
+    return false;
+  }
+  std::string temp = target + REPLACE_SUFFIX;
+  std::lock_guard<std::mutex> guard(this->replace_mutex_);
+  // A journal left by a failed commit is finished before being overwritten
+  if (this->exists(this->mount_point_ + REPLACE_JOURNAL))
+    this->recover_replace_();
+
+  // The journal goes first, a temporary file never exists without a journal naming it
+  std::vector<uint8_t> record;
+  put_le(record, REPLACE_MAGIC, 4);
+  put_le(record, len, 4);
+  put_le(record, target.size(), 2);
+  record.insert(record.end(), target.begin(), target.end());
+  put_le(record, crc16(record.data(), record.size()), 2);
+  FileWriter journal = this->open_writer(REPLACE_JOURNAL, "w");
+  if (!journal.is_open() || !journal.write(record.data(), record.size()) || !journal.sync() || !journal.close()) {
+    ESP_LOGE(TAG, "Failed to write the replace journal");
+    journal.close();
+    this->delete_file(REPLACE_JOURNAL);
+    return false;
+  }
+
+  FileWriter writer = this->open_writer(temp, "w");
+  if (!writer.is_open() || !writer.write(buffer, len) || !writer.sync() || !writer.close()) {
+    ESP_LOGE(TAG, "Failed to write %s", temp.c_str());
+    writer.close();
+    this->delete_file(temp);
+    this->delete_file(REPLACE_JOURNAL);
+    return false;
+  }
+
+  // Appended only once the new content is on the card: until then the target is untouched
+  std::vector<uint8_t> mark;
+  put_le(mark, REPLACE_COMMIT, 4);
+  FileWriter commit = this->open_writer(REPLACE_JOURNAL, "a");
+  if (!commit.is_open() || !commit.write(mark.data(), mark.size()) || !commit.sync() || !commit.close()) {
+    ESP_LOGE(TAG, "Failed to commit the replace journal");
+    commit.close();
+    this->delete_file(temp);
+    this->delete_file(REPLACE_JOURNAL);
+    return false;
+  }
+
+  if (!this->commit_replace_(target, temp)) {
+    ESP_LOGE(TAG, "Failed to replace %s, the journal is kept for recovery", target.c_str());
+    return false;
+  }
+  this->delete_file(REPLACE_JOURNAL);
+  return true;
+}
+
+bool SdMmc::replace_file(std::string const &path, std::vector<uint8_t> const &data) {
+  return this->replace_file(path.c_str(), data.data(), data.size());
+}
+
+bool SdMmc::commit_replace_(std::string const &path, std::string const &temp) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  PathLock temp_lock = this->lock_path(temp, true);
+  if (!temp_lock.is_locked())
+    return false;
+  std::string target = this->mount_point_ + path;
+  FileInfo info;
+  // FAT does not rename over an existing file, the journal covers the window where the target is missing
+  if (this->stat_(path, info)) {
+    if (info.is_directory) {
+      ESP_LOGE(TAG, "%s is a directory", path.c_str());
+      return false;
+    }
+#ifdef USE_ESP_IDF
+    std::vector<TrimQueue::Range> freed = this->queue_trim_(path);
+#endif
+    if (remove(target.c_str()) != 0) {
+      ESP_LOGE(TAG, "Failed to remove %s: %s", path.c_str(), strerror(errno));
+#ifdef USE_ESP_IDF
+      if (this->trim_queue_ != nullptr)
+        this->trim_queue_->cancel(freed);
+#endif
+      return false;
+    }
+    this->adjust_free_space_(info.size, 0);
+  }
+  if (rename((this->mount_point_ + temp).c_str(), target.c_str()) != 0) {
+    ESP_LOGE(TAG, "Failed to rename %s: %s", temp.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void SdMmc::recover_replace_() {
+  FILE *file = this->open_stream_(REPLACE_JOURNAL, "rb");
+  if (file == nullptr)
+    return;
+  uint8_t record[REPLACE_JOURNAL_MAX_SIZE];
+  size_t len = fread(record, 1, sizeof(record), file);
+  fclose(file);
+  std::string path;
+  uint32_t size;
+  bool committed;
+  if (!parse_replace_journal(record, len, path, size, committed)) {
+    // Cut while the journal was written, no temporary file was created yet
+    ESP_LOGW(TAG, "Dropping a torn replace journal");
+  } else {
+    std::string temp = path + REPLACE_SUFFIX;
+    FileInfo info;
+    if (!this->stat_(temp, info)) {
+      // Cut after the rename, only the journal is left, or before the temporary file was created
+      ESP_LOGD(TAG, "Replacement of %s was %s", path.c_str(), committed ? "complete" : "not started");
+    } else if (committed && info.size == size) {
+      ESP_LOGW(TAG, "Completing the interrupted replacement of %s", path.c_str());
+      if (!this->commit_replace_(path, temp))
+        return;
+    } else {
+      ESP_LOGW(TAG, "Dropping an incomplete replacement of %s", path.c_str());
+      this->delete_file(temp);
+    }
+  }
+  this->delete_file(REPLACE_JOURNAL);
+}
+
 std::vector<std::string> SdMmc::list_directory(const char *path, uint8_t depth) {
   std::vector<std::string> list;
-  std::vector<FileInfo> infos = list_directory_file_info(path, depth);
-  std::transform(infos.cbegin(), infos.cend(), list.begin(), [](FileInfo const &info) { return info.path; });
+  this->for_each_entry(path, depth, [&list](FileInfo const &info) {
+    list.push_back(info.path);
+    return true;
+  });
   return list;
 }
 
@@ -94,7 +832,10 @@ std::vector<std::string> SdMmc::list_directory(std::string path, uint8_t depth)
 
 std::vector<FileInfo> SdMmc::list_directory_file_info(const char *path, uint8_t depth) {
   std::vector<FileInfo> list;
-  list_directory_file_info_rec(path, depth, list);
+  this->for_each_entry(path, depth, [&list](FileInfo const &info) {
+    list.push_back(info);
+    return true;
+  });
   return list;
 }
 
@@ -102,14 +843,311 @@ std::vector<FileInfo> SdMmc::list_directory_file_info(std::string path, uint8_t
   return this->list_directory_file_info(path.c_str(), depth);
 }
 
+bool SdMmc::for_each_entry(const char *path, uint8_t depth, DirectoryCallback const &callback) {
+  ESP_LOGV(TAG, "Listing directory: %s", path);
+  PathLock lock = this->lock_path(path, false);
+  if (!lock.is_locked())
+    return false;
+  std::string dir_path(path);
+  // Entries are built as dir_path + "/" + name
+  while (!dir_path.empty() && dir_path.back() == '/')
+    dir_path.pop_back();
+  return this->enumerate_(dir_path, depth, callback);
+}
+
+bool SdMmc::enumerate_(std::string &dir_path, uint8_t depth, DirectoryCallback const &callback) {
+  if (!this->directories_.is_enabled())
+    return this->for_each_entry_rec_(dir_path, depth, callback);
+
+  std::vector<DirectoryCache::Dentry> entries;
+  if (depth == 0 && this->directories_.get_entries(this->card_path(dir_path), entries)) {
+    for (auto const &entry : entries) {
+      if (!callback(FileInfo(dir_path + "/" + entry.name, entry.size, entry.is_directory, entry.mtime,
+                             entry.attributes)))
+        return false;
+    }
+    return true;
+  }
+
+  // A complete enumeration also fills the directory cache with the direct children
+  uint32_t generation = this->directories_.get_generation();
+  entries.clear();
+  bool overflow = false;
+  const size_t prefix_len = dir_path.size() + 1;
+  bool res = this->for_each_entry_rec_(dir_path, depth, [&](FileInfo const &info) {
+    if (!overflow && info.path.find('/', prefix_len) == std::string::npos) {
+      if (entries.size() < this->directories_.get_max_entries()) {
+        entries.push_back(
+            {info.path.substr(prefix_len), info.is_directory, info.size, info.mtime, info.attributes});
+      } else {
+        overflow = true;
+      }
+    }
+    return callback(info);
+  });
+  if (res && !overflow)
+    this->directories_.store(this->card_path(dir_path), std::move(entries), generation);
+  return res;
+}
+
+bool SdMmc::for_each_entry(std::string const &path, uint8_t depth, DirectoryCallback const &callback) {
+  return this->for_each_entry(path.c_str(), depth, callback);
+}
+
 size_t SdMmc::file_size(std::string const &path) { return this->file_size(path.c_str()); }
 
 bool SdMmc::is_directory(std::string const &path) { return this->is_directory(path.c_str()); }
 
 bool SdMmc::delete_file(std::string const &path) { return this->delete_file(path.c_str()); }
 
+bool SdMmc::create_directories(std::string const &path) {
+  std::string key = this->card_path(path);
+  if (key == "/")
+    return true;
+  std::string top;
+  int created = 0;
+  bool ok = true;
+  size_t end = 0;
+  while (end != std::string::npos) {
+    end = key.find('/', end + 1);
+    std::string dir = key.substr(0, end);
+    FileInfo info;
+    if (this->stat_(dir, info)) {
+      if (!info.is_directory) {
+        ESP_LOGE(TAG, "%s exists and is not a directory", dir.c_str());
+        ok = false;
+        break;
+      }
+      continue;
+    }
+    if (mkdir((this->mount_point_ + dir).c_str(), 0777) != 0 && errno != EEXIST) {
+      ESP_LOGE(TAG, "Failed to create directory %s: %s", dir.c_str(), strerror(errno));
+      ok = false;
+      break;
+    }
+    if (top.empty())
+      top = dir;
+    created++;
+  }
+  // Listings and stats of the parent of the first new directory no longer hold
+  if (!top.empty()) {
+    this->invalidate_caches_(top);
+    this->adjust_free_clusters_(-created);
+  }
+  return ok;
+}
+
+std::vector<uint8_t> SdMmc::read_file(char const *path) {
+  ESP_LOGV(TAG, "Read File: %s", path);
+  FileReader reader = this->open_file(path);
+  if (!reader.is_open()) {
+    ESP_LOGE(TAG, "Failed to open file for reading");
+    return std::vector<uint8_t>();
+  }
+
+  std::vector<uint8_t> res(reader.size());
+  size_t len = reader.read(0, res.data(), res.size());
+  res.resize(len);
+  return res;
+}
+
 std::vector<uint8_t> SdMmc::read_file(std::string const &path) { return this->read_file(path.c_str()); }
 
+FileReader SdMmc::open_file(const char *path, uint32_t timeout_ms) {
+  std::string key = this->card_path(path);
+  {
+    PathLock lock = this->lock_path(key, false, timeout_ms);
+    if (!lock.is_locked())
+      return FileReader();
+    HandlePool::Handle handle;
+    if (this->handles_.take(key, handle)) {
+      FileReader reader(std::move(handle), std::move(lock));
+      reader.set_pool(&this->handles_, key);
+      return reader;
+    }
+  }
+  // The slot is taken before the path lock, a writer waiting for this path may hold the last one
+  if (!(timeout_ms == 0 ? this->handles_.try_acquire() : this->handles_.acquire(timeout_ms))) {
+    ESP_LOGE(TAG, "No file handle left to open %s", path);
+    return FileReader();
+  }
+  FileReader reader = this->open_reader_(path, timeout_ms);
+  if (!reader.is_open()) {
+    this->handles_.release();
+    return reader;
+  }
+  reader.set_pool(&this->handles_, key);
+  if (reader.file_ != nullptr)
+    this->buffer_stream_(reader.file_, reader.stream_buffer_, reader.stream_buffer_size_);
+  return reader;
+}
+
+size_t SdMmc::get_stream_buffer_size() const {
+  size_t cluster = this->cluster_size_;
+  // Unknown until the card is scanned, the stream keeps its default buffer meanwhile
+  if (cluster == 0)
+    return 0;
+  size_t size = std::max(this->stream_buffer_size_, cluster);
+  return (size + cluster - 1) / cluster * cluster;
+}
+
+void SdMmc::buffer_stream_(FILE *file, uint8_t *&buffer, size_t &size) {
+  size = this->get_stream_buffer_size();
+  buffer = size > 0 ? this->handles_.take_buffer(size) : nullptr;
+  // Only valid before the first I/O on the stream
+  if (buffer != nullptr && setvbuf(file, reinterpret_cast<char *>(buffer), _IOFBF, size) != 0) {
+    this->handles_.give_buffer(buffer, size);
+    buffer = nullptr;
+  }
+  if (buffer == nullptr)
+    size = 0;
+}
+
+FILE *SdMmc::open_stream(std::string const &path, const char *mode, uint32_t timeout_ms) {
+  if (!(timeout_ms == 0 ? this->handles_.try_acquire() : this->handles_.acquire(timeout_ms))) {
+    ESP_LOGE(TAG, "No file handle left to open %s", path.c_str());
+    errno = EMFILE;
+    return nullptr;
+  }
+  HandlePool::Stream stream;
+  std::string key = this->card_path(path);
+  // The clusters a writer takes or frees are only known once it closes, from the size it started with
+  FileInfo info;
+  if (strpbrk(mode, "wa+") != nullptr) {
+    stream.path = key;
+    stream.start_size = this->stat_(key, info) && !info.is_directory ? info.size : 0;
+  }
+  FILE *file = this->open_stream_(key, mode);
+  if (file == nullptr) {
+    int err = errno;
+    this->handles_.release();
+    errno = err;
+    return nullptr;
+  }
+  stream.file = file;
+  this->buffer_stream_(file, stream.buffer, stream.size);
+  this->handles_.track_stream(std::move(stream));
+  return file;
+}
+
+bool SdMmc::close_stream(FILE *file) {
+  HandlePool::Stream stream;
+  if (!this->handles_.untrack_stream(file, stream)) {
+    ESP_LOGE(TAG, "Closing a stream not opened by open_stream");
+    return fclose(file) == 0;
+  }
+  bool ok = fclose(file) == 0;
+  this->handles_.give_buffer(stream.buffer, stream.size);
+  this->handles_.release();
+  if (!stream.path.empty()) {
+    int err = errno;
+    FileInfo info;
+    this->adjust_free_space_(stream.start_size, this->stat_(stream.path, info) ? info.size : 0);
+    errno = err;
+  }
+  return ok;
+}
+
+FileReader SdMmc::open_file(std::string const &path, uint32_t timeout_ms) {
+  return this->open_file(path.c_str(), timeout_ms);
+}
+
+FileWriter SdMmc::open_writer(const char *path, const char *mode) {
+  if (!this->handles_.acquire(DEFAULT_LOCK_TIMEOUT_MS)) {
+    ESP_LOGE(TAG, "No file handle left to write %s", path);
+    return FileWriter();
+  }
+  FileWriter writer = this->open_writer_(path, mode);
+  if (!writer.is_open()) {
+    this->handles_.release();
+    return writer;
+  }
+  writer.set_pool(&this->handles_);
+  return writer;
+}
+
+FileWriter SdMmc::open_writer(std::string const &path, const char *mode) {
+  return this->open_writer(path.c_str(), mode);
+}
+
+FileWriter SdMmc::open_preallocated_writer(const char *path, size_t size) {
+  if (!this->handles_.acquire(DEFAULT_LOCK_TIMEOUT_MS)) {
+    ESP_LOGE(TAG, "No file handle left to write %s", path);
+    return FileWriter();
+  }
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked()) {
+    this->handles_.release();
+    return FileWriter();
+  }
+  bool preallocated = size > 0 && this->preallocate(path, size);
+  // preallocate() already charged the reserved extent, the writer settles the rest from there
+  FileInfo info;
+  size_t old_size = this->stat_(this->card_path(path), info) && !info.is_directory ? info.size : 0;
+  // "r+" keeps the reserved clusters, "w" would release them again
+  FILE *file = this->open_stream_(path, preallocated ? "r+b" : "wb");
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open file for writing");
+    this->handles_.release();
+    return FileWriter();
+  }
+  FileWriter writer(this, file, old_size, 0, this->cluster_size_, std::move(lock));
+  writer.set_trim_on_close(preallocated);
+  writer.set_pool(&this->handles_);
+  return writer;
+}
+
+FileWriter SdMmc::open_preallocated_writer(std::string const &path, size_t size) {
+  return this->open_preallocated_writer(path.c_str(), size);
+}
+
+bool SdMmc::preallocate(std::string const &path, size_t size) {
+  std::string key = this->card_path(path);
+  FileInfo info;
+  size_t old_size = this->stat_(key, info) && !info.is_directory ? info.size : 0;
+  if (!this->preallocate_(key, size)) {
+    ESP_LOGD(TAG, "No contiguous extent of %zu bytes for %s", size, key.c_str());
+    // The file may have been truncated before the extent was refused
+    this->adjust_free_space_(old_size, this->stat_(key, info) ? info.size : old_size);
+    return false;
+  }
+  this->adjust_free_space_(old_size, size);
+  ESP_LOGV(TAG, "Preallocated %zu bytes for %s", size, key.c_str());
+  return true;
+}
+
+bool SdMmc::read_file_chunked(const char *path, ChunkCallback const &callback, size_t chunk_size) {
+  ESP_LOGV(TAG, "Read File chunked: %s", path);
+  FileReader reader = this->open_file(path);
+  if (!reader.is_open()) {
+    ESP_LOGE(TAG, "Failed to open file for reading");
+    return false;
+  }
+
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[chunk_size]);
+  if (!buffer) {
+    ESP_LOGE(TAG, "Failed to allocate %zu bytes read buffer", chunk_size);
+    return false;
+  }
+
+  size_t offset = 0;
+  while (offset < reader.size()) {
+    size_t len = reader.read(buffer.get(), chunk_size);
+    if (len == 0) {
+      ESP_LOGE(TAG, "Failed to read file: %s", strerror(errno));
+      return false;
+    }
+    if (!callback(buffer.get(), len, offset))
+      break;
+    offset += len;
+  }
+  return true;
+}
+
+bool SdMmc::read_file_chunked(std::string const &path, ChunkCallback const &callback, size_t chunk_size) {
+  return this->read_file_chunked(path.c_str(), callback, chunk_size);
+}
+
 #ifdef USE_SENSOR
 void SdMmc::add_file_size_sensor(sensor::Sensor *sensor, std::string const &path) {
   this->file_size_sensors_.emplace_back(sensor, path);
@@ -140,6 +1178,8 @@ std::string SdMmc::error_code_to_string(SdMmc::ErrorCode code) {
       return "Failed to mount card";
     case ErrorCode::ERR_NO_CARD:
       return "No card found";
+    case ErrorCode::ERR_BUS:
+      return "Bus errors in every mode";
     default:
       return "Unknown error";
   }
@@ -184,8 +1224,896 @@ std::string format_size(size_t size) {
   return std::string(buffer);
 }
 
+void file_info_to_stat(FileInfo const &info, struct stat &st) {
+  memset(&st, 0, sizeof(st));
+  // Same permissions as the FAT VFS reports
+  st.st_mode = (info.is_directory ? S_IFDIR : S_IFREG) | S_IRWXU | S_IRWXG | S_IRWXO;
+  if (info.attributes & 0x01)  // AM_RDO
+    st.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+  st.st_size = info.size;
+  st.st_mtime = info.mtime;
+}
+
 FileInfo::FileInfo(std::string const &path, size_t size, bool is_directory)
     : path(path), size(size), is_directory(is_directory) {}
 
+FileInfo::FileInfo(std::string const &path, size_t size, bool is_directory, time_t mtime, uint8_t attributes)
+    : path(path), size(size), is_directory(is_directory), mtime(mtime), attributes(attributes) {}
+
+// FAT names are case-insensitive, so are the paths of the caches and of the lock table
+static bool same_path(std::string const &a, std::string const &b) { return strcasecmp(a.c_str(), b.c_str()) == 0; }
+
+static bool is_child_of(std::string const &path, std::string const &parent) {
+  if (parent == "/")
+    return true;
+  return path.size() >= parent.size() && strncasecmp(path.c_str(), parent.c_str(), parent.size()) == 0 &&
+         (path.size() == parent.size() || path[parent.size()] == '/');
+}
+
+// True when one path is the other or one of its ancestors, the empty path overlaps everything
+static bool paths_overlap(std::string const &a, std::string const &b) {
+  if (a.empty() || b.empty())
+    return true;
+  return is_child_of(a, b) || is_child_of(b, a);
+}
+
+bool PathLockTable::conflicts_(std::string const &path, bool exclusive) const {
+  for (auto const &entry : this->entries_) {
+    if (!paths_overlap(path, entry.path))
+      continue;
+    if (exclusive || entry.writer)
+      return true;
+  }
+  return false;
+}
+
+bool PathLockTable::lock(std::string const &path, bool exclusive, uint32_t timeout_ms) {
+  std::unique_lock<std::mutex> guard(this->mutex_);
+  if (!this->released_.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                                [&]() { return !this->conflicts_(path, exclusive); }))
+    return false;
+  for (auto &entry : this->entries_) {
+    if (same_path(entry.path, path)) {
+      entry.readers++;
+      return true;
+    }
+  }
+  this->entries_.push_back(Entry{path, (uint16_t) (exclusive ? 0 : 1), exclusive});
+  return true;
+}
+
+void PathLockTable::unlock(std::string const &path, bool exclusive) {
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+      if (!same_path(it->path, path))
+        continue;
+      if (exclusive) {
+        it->writer = false;
+      } else if (it->readers > 0) {
+        it->readers--;
+      }
+      if (!it->writer && it->readers == 0)
+        this->entries_.erase(it);
+      break;
+    }
+  }
+  if (exclusive && this->release_callback_)
+    this->release_callback_(path);
+  this->released_.notify_all();
+}
+
+PathLock::PathLock(PathLockTable *table, std::string path, bool exclusive)
+    : table_(table), path_(std::move(path)), exclusive_(exclusive) {}
+
+PathLock::PathLock(PathLock &&other)
+    : table_(other.table_), path_(std::move(other.path_)), exclusive_(other.exclusive_) {
+  other.table_ = nullptr;
+}
+
+PathLock &PathLock::operator=(PathLock &&other) {
+  if (this != &other) {
+    this->unlock();
+    this->table_ = other.table_;
+    this->path_ = std::move(other.path_);
+    this->exclusive_ = other.exclusive_;
+    other.table_ = nullptr;
+  }
+  return *this;
+}
+
+PathLock::~PathLock() { this->unlock(); }
+
+void PathLock::unlock() {
+  if (this->table_ != nullptr) {
+    this->table_->unlock(this->path_, this->exclusive_);
+    this->table_ = nullptr;
+  }
+}
+
+std::string SdMmc::card_path(std::string const &path) const {
+  // Same key for "/sdcard/a", "/a" and "a/"
+  size_t start = 0;
+  if (str_startswith(path, this->mount_point_) &&
+      (path.size() == this->mount_point_.size() || path[this->mount_point_.size()] == '/' ||
+       this->mount_point_.back() == '/'))
+    start = this->mount_point_.size();
+  size_t end = path.size();
+  while (end > start && path[end - 1] == '/')
+    end--;
+  if (end == start)
+    return "/";
+  return path[start] == '/' ? path.substr(start, end - start) : "/" + path.substr(start, end - start);
+}
+
+PathLock SdMmc::lock_path(std::string const &path, bool exclusive, uint32_t timeout_ms) {
+  std::string key = this->card_path(path);
+#ifdef USE_ESP_IDF
+  // The ring log writes below FatFs, its file must never be moved, truncated or freed
+  if (exclusive && this->ring_log_ != nullptr && strcasecmp(key.c_str(), this->ring_log_path_.c_str()) == 0) {
+    ESP_LOGE(TAG, "%s holds the ring log", key.c_str());
+    return PathLock();
+  }
+#endif
+  if (!this->locks_.lock(key, exclusive, timeout_ms)) {
+    ESP_LOGE(TAG, "Timeout waiting for %s lock on %s", exclusive ? "exclusive" : "shared", key.c_str());
+    return PathLock();
+  }
+  // Every mutation holds an exclusive lock, the caches are dropped when it is taken and again when it is
+  // released so that nothing read in between stays
+  if (exclusive)
+    this->invalidate_caches_(key);
+  return PathLock(&this->locks_, key, exclusive);
+}
+
+void SdMmc::invalidate_caches_(std::string const &path) {
+  this->handles_.drop(path);
+  this->link_maps_.invalidate(path);
+  this->directories_.invalidate(path);
+  this->stats_.invalidate(path);
+}
+
+bool SdMmc::stat(std::string const &path, FileInfo &info) {
+  std::string key = this->card_path(path);
+  if (key == "/") {
+    info = FileInfo("/", 0, true);
+    return true;
+  }
+  DirectoryCache::Lookup cached = this->lookup_entry_(key);
+  if (cached == DirectoryCache::LOOKUP_MISSING)
+    return false;
+  if (cached != DirectoryCache::LOOKUP_UNKNOWN &&
+      this->directories_.lookup(key, &info) != DirectoryCache::LOOKUP_UNKNOWN)
+    return true;
+  if (this->stats_.get(key, info))
+    return true;
+  uint32_t generation = this->stats_.get_generation();
+  if (!this->stat_(key, info))
+    return false;
+  this->stats_.put(info, generation);
+  return true;
+}
+
+DirectoryCache::Lookup SdMmc::lookup_entry_(std::string const &path) {
+  if (!this->directories_.is_enabled())
+    return DirectoryCache::LOOKUP_UNKNOWN;
+  std::string key = this->card_path(path);
+  DirectoryCache::Lookup res = this->directories_.lookup(key);
+  if (res != DirectoryCache::LOOKUP_UNKNOWN)
+    return res;
+  std::string parent = key.substr(0, std::max<size_t>(key.rfind('/'), 1));
+  // Resolved from the root down, each level is a single directory read
+  DirectoryCache::Lookup parent_res = this->lookup_entry_(parent);
+  if (parent_res == DirectoryCache::LOOKUP_MISSING || parent_res == DirectoryCache::LOOKUP_FILE)
+    return DirectoryCache::LOOKUP_MISSING;
+  if (parent_res == DirectoryCache::LOOKUP_UNKNOWN)
+    return DirectoryCache::LOOKUP_UNKNOWN;
+  // Never waits, the caller may already hold a conflicting lock
+  if (!this->locks_.lock(parent, false, 0))
+    return DirectoryCache::LOOKUP_UNKNOWN;
+  PathLock lock(&this->locks_, parent, false);
+  std::string dir_path = parent == "/" ? "" : parent;
+  this->enumerate_(dir_path, 0, [](FileInfo const &) { return true; });
+  return this->directories_.lookup(key);
+}
+
+uint32_t DirectoryCache::get_generation() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->generation_;
+}
+
+DirectoryCache::Lookup DirectoryCache::lookup(std::string const &path, FileInfo *info) {
+  if (path == "/")
+    return LOOKUP_DIRECTORY;
+  size_t slash = path.rfind('/');
+  std::string parent = path.substr(0, std::max<size_t>(slash, 1));
+  const char *name = path.c_str() + slash + 1;
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  // The parent listing comes first, it also knows the metadata
+  for (auto &dir : this->directories_) {
+    if (!same_path(dir.path, parent))
+      continue;
+    dir.last_used = ++this->tick_;
+    for (auto const &entry : dir.entries) {
+      if (strcasecmp(entry.name.c_str(), name) != 0)
+        continue;
+      if (info != nullptr)
+        *info = FileInfo(path, entry.size, entry.is_directory, entry.mtime, entry.attributes);
+      return entry.is_directory ? LOOKUP_DIRECTORY : LOOKUP_FILE;
+    }
+    return LOOKUP_MISSING;
+  }
+  if (info != nullptr)
+    return LOOKUP_UNKNOWN;
+  for (auto &dir : this->directories_) {
+    if (same_path(dir.path, path)) {
+      dir.last_used = ++this->tick_;
+      return LOOKUP_DIRECTORY;
+    }
+  }
+  return LOOKUP_UNKNOWN;
+}
+
+bool DirectoryCache::get_entries(std::string const &path, std::vector<Dentry> &entries) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  for (auto &dir : this->directories_) {
+    if (same_path(dir.path, path)) {
+      dir.last_used = ++this->tick_;
+      entries = dir.entries;
+      return true;
+    }
+  }
+  return false;
+}
+
+void DirectoryCache::store(std::string const &path, std::vector<Dentry> &&entries, uint32_t generation) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (generation != this->generation_ || this->max_directories_ == 0 || entries.size() > this->max_entries_)
+    return;
+  for (auto &dir : this->directories_) {
+    if (same_path(dir.path, path)) {
+      dir.entries = std::move(entries);
+      dir.last_used = ++this->tick_;
+      return;
+    }
+  }
+  if (this->directories_.size() >= this->max_directories_) {
+    auto lru = std::min_element(this->directories_.begin(), this->directories_.end(),
+                                [](Directory const &a, Directory const &b) { return a.last_used < b.last_used; });
+    this->directories_.erase(lru);
+  }
+  this->directories_.push_back({path, std::move(entries), ++this->tick_});
+}
+
+uint32_t StatCache::get_generation() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->generation_;
+}
+
+bool StatCache::get(std::string const &path, FileInfo &info) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  for (auto &entry : this->entries_) {
+    if (same_path(entry.info.path, path)) {
+      entry.last_used = ++this->tick_;
+      info = entry.info;
+      return true;
+    }
+  }
+  return false;
+}
+
+void StatCache::put(FileInfo const &info, uint32_t generation) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (generation != this->generation_ || this->max_entries_ == 0)
+    return;
+  for (auto &entry : this->entries_) {
+    if (same_path(entry.info.path, info.path)) {
+      entry.info = info;
+      entry.last_used = ++this->tick_;
+      return;
+    }
+  }
+  if (this->entries_.size() >= this->max_entries_) {
+    auto lru = std::min_element(this->entries_.begin(), this->entries_.end(),
+                                [](Entry const &a, Entry const &b) { return a.last_used < b.last_used; });
+    this->entries_.erase(lru);
+  }
+  this->entries_.push_back({info, ++this->tick_});
+}
+
+void StatCache::invalidate(std::string const &path) {
+  // The parent changes too when an entry is added or removed (its mtime on the host)
+  std::string parent = path.substr(0, std::max<size_t>(path.rfind('/'), 1));
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->generation_++;
+  this->entries_.erase(std::remove_if(this->entries_.begin(), this->entries_.end(),
+                                      [&](Entry const &entry) {
+                                        return same_path(entry.info.path, parent) ||
+                                               is_child_of(entry.info.path, path);
+                                      }),
+                       this->entries_.end());
+}
+
+void DirectoryCache::invalidate(std::string const &path) {
+  std::string parent = path.substr(0, std::max<size_t>(path.rfind('/'), 1));
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->generation_++;
+  this->directories_.erase(std::remove_if(this->directories_.begin(), this->directories_.end(),
+                                          [&](Directory const &dir) {
+                                            return same_path(dir.path, parent) || is_child_of(dir.path, path);
+                                          }),
+                           this->directories_.end());
+}
+
+PathLock SdMmc::lock_volume(uint32_t timeout_ms) {
+  if (!this->locks_.lock("", true, timeout_ms)) {
+    ESP_LOGE(TAG, "Timeout waiting for volume lock");
+    return PathLock();
+  }
+  return PathLock(&this->locks_, "", true);
+}
+
+LinkMapCache::Table LinkMapCache::get(std::string const &path, uint32_t start_cluster, size_t size) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+    if (!same_path(it->path, path))
+      continue;
+    if (it->start_cluster != start_cluster || it->size != size) {
+      this->used_ -= it->bytes;
+      this->entries_.erase(it);
+      return nullptr;
+    }
+    it->last_used = ++this->tick_;
+    return it->table;
+  }
+  return nullptr;
+}
+
+bool LinkMapCache::put(std::string const &path, uint32_t start_cluster, size_t size, Table table, size_t words) {
+  size_t bytes = words * sizeof(uint32_t);
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (bytes > this->budget_)
+    return false;
+  this->entries_.erase(std::remove_if(this->entries_.begin(), this->entries_.end(),
+                                      [&](Entry const &entry) {
+                                        if (!same_path(entry.path, path))
+                                          return false;
+                                        this->used_ -= entry.bytes;
+                                        return true;
+                                      }),
+                       this->entries_.end());
+  while (this->used_ + bytes > this->budget_) {
+    auto lru = std::min_element(this->entries_.begin(), this->entries_.end(),
+                                [](Entry const &a, Entry const &b) { return a.last_used < b.last_used; });
+    this->used_ -= lru->bytes;
+    this->entries_.erase(lru);
+  }
+  this->entries_.push_back({path, start_cluster, size, std::move(table), bytes, ++this->tick_});
+  this->used_ += bytes;
+  return true;
+}
+
+void LinkMapCache::invalidate(std::string const &path) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (this->entries_.empty())
+    return;
+  this->entries_.erase(std::remove_if(this->entries_.begin(), this->entries_.end(),
+                                      [&](Entry const &entry) {
+                                        bool below = is_child_of(entry.path, path);
+                                        if (below)
+                                          this->used_ -= entry.bytes;
+                                        return below;
+                                      }),
+                       this->entries_.end());
+}
+
+static uint8_t *allocate_stream_buffer(size_t size) {
+#ifdef USE_ESP32
+  // stdio only copies through it, PSRAM keeps internal RAM for DMA buffers and stacks
+  void *buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (buffer == nullptr && size <= MAX_INTERNAL_STREAM_BUFFER)
+    buffer = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  return static_cast<uint8_t *>(buffer);
+#else
+  return static_cast<uint8_t *>(malloc(size));
+#endif
+}
+
+static void free_stream_buffer(uint8_t *buffer) {
+#ifdef USE_ESP32
+  heap_caps_free(buffer);
+#else
+  free(buffer);
+#endif
+}
+
+void HandlePool::close_(Handle &handle) {
+  if (handle.file != nullptr)
+    fclose(handle.file);
+#ifdef USE_ESP_IDF
+  if (handle.fil != nullptr) {
+    f_close(handle.fil);
+    delete handle.fil;
+  }
+#endif
+}
+
+bool HandlePool::evict_() {
+  if (this->idle_.empty())
+    return false;
+  // Parked in closing order, the front is the least recently used
+  Handle &handle = this->idle_.front().handle;
+  close_(handle);
+  this->recycle_(handle.buffer, handle.buffer_size);
+  this->idle_.erase(this->idle_.begin());
+  this->used_--;
+  return true;
+}
+
+bool HandlePool::acquire(uint32_t timeout_ms) {
+  std::unique_lock<std::mutex> guard(this->mutex_);
+  uint32_t id = this->next_waiter_++;
+  this->waiters_.push_back(id);
+  auto ready = [&]() {
+    return this->waiters_.front() == id && (this->used_ < this->slots_ || !this->idle_.empty());
+  };
+  if (!ready())
+    this->stats_.waits++;
+  bool ok = this->released_.wait_for(guard, std::chrono::milliseconds(timeout_ms), ready);
+  this->waiters_.erase(std::find(this->waiters_.begin(), this->waiters_.end(), id));
+  if (ok) {
+    if (this->used_ == this->slots_)
+      this->evict_();
+    this->used_++;
+    this->stats_.opened++;
+  } else {
+    this->stats_.timeouts++;
+  }
+  // The next one in line may be served as well
+  this->released_.notify_all();
+  return ok;
+}
+
+bool HandlePool::try_acquire() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (!this->waiters_.empty() || (this->used_ == this->slots_ && !this->evict_()))
+    return false;
+  this->used_++;
+  this->stats_.opened++;
+  return true;
+}
+
+void HandlePool::release() {
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    if (this->used_ > 0)
+      this->used_--;
+  }
+  this->released_.notify_all();
+}
+
+bool HandlePool::take(std::string const &path, Handle &handle) {
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    auto it = std::find_if(this->idle_.begin(), this->idle_.end(),
+                           [&](Idle const &idle) { return same_path(idle.path, path); });
+    if (it == this->idle_.end())
+      return false;
+    handle = std::move(it->handle);
+    this->idle_.erase(it);
+    this->stats_.reused++;
+  }
+  // Readers start at the beginning of the file
+  bool ok = true;
+#ifdef USE_ESP_IDF
+  if (handle.fil != nullptr)
+    ok = f_lseek(handle.fil, 0) == FR_OK;
+#endif
+  if (handle.file != nullptr)
+    ok = fseek(handle.file, 0, SEEK_SET) == 0;
+  if (!ok) {
+    close_(handle);
+    this->give_buffer(handle.buffer, handle.buffer_size);
+    this->release();
+  }
+  return ok;
+}
+
+void HandlePool::park(std::string const &path, Handle &&handle) {
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    // At most half of the slots stay idle, the others are kept for new files
+    if (this->idle_.size() >= std::max<size_t>(this->slots_ / 2, 1))
+      this->evict_();
+    this->idle_.push_back(Idle{path, std::move(handle)});
+  }
+  // A waiter can now evict it
+  this->released_.notify_all();
+}
+
+void HandlePool::drop(std::string const &path) {
+  std::vector<Idle> dropped;
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    if (this->idle_.empty())
+      return;
+    auto it = std::stable_partition(this->idle_.begin(), this->idle_.end(),
+                                    [&](Idle const &idle) { return !is_child_of(idle.path, path); });
+    std::move(it, this->idle_.end(), std::back_inserter(dropped));
+    this->idle_.erase(it, this->idle_.end());
+    this->used_ -= dropped.size();
+  }
+  for (auto &idle : dropped) {
+    close_(idle.handle);
+    this->give_buffer(idle.handle.buffer, idle.handle.buffer_size);
+  }
+  if (!dropped.empty())
+    this->released_.notify_all();
+}
+
+uint8_t *HandlePool::take_buffer(size_t size) {
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    if (size == this->free_buffer_size_ && !this->free_buffers_.empty()) {
+      uint8_t *buffer = this->free_buffers_.back();
+      this->free_buffers_.pop_back();
+      return buffer;
+    }
+  }
+  return allocate_stream_buffer(size);
+}
+
+void HandlePool::give_buffer(uint8_t *buffer, size_t size) {
+  if (buffer == nullptr)
+    return;
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->recycle_(buffer, size);
+}
+
+void HandlePool::recycle_(uint8_t *buffer, size_t size) {
+  if (buffer == nullptr)
+    return;
+  // The size follows the cluster size, which only changes with a format
+  if (size != this->free_buffer_size_) {
+    for (uint8_t *free : this->free_buffers_)
+      free_stream_buffer(free);
+    this->free_buffers_.clear();
+    this->free_buffer_size_ = size;
+  }
+  if (this->free_buffers_.size() < this->slots_) {
+    this->free_buffers_.push_back(buffer);
+  } else {
+    free_stream_buffer(buffer);
+  }
+}
+
+void HandlePool::track_stream(Stream &&stream) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->streams_.push_back(std::move(stream));
+}
+
+bool HandlePool::untrack_stream(FILE *file, Stream &stream) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  auto it = std::find_if(this->streams_.begin(), this->streams_.end(),
+                         [&](Stream const &tracked) { return tracked.file == file; });
+  if (it == this->streams_.end())
+    return false;
+  stream = std::move(*it);
+  this->streams_.erase(it);
+  return true;
+}
+
+size_t HandlePool::get_idle_count() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->idle_.size();
+}
+
+HandlePool::Stats HandlePool::get_stats() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->stats_;
+}
+
+FileReader::FileReader(FILE *file, size_t size, PathLock lock) : file_(file), size_(size), lock_(std::move(lock)) {}
+
+#ifdef USE_ESP_IDF
+FileReader::FileReader(FIL *fil, size_t size, LinkMapCache::Table link_map, PathLock lock)
+    : fil_(fil), link_map_(std::move(link_map)), size_(size), lock_(std::move(lock)) {}
+#endif
+
+FileReader::FileReader(HandlePool::Handle &&handle, PathLock lock)
+    : stream_buffer_(handle.buffer),
+      stream_buffer_size_(handle.buffer_size),
+      file_(handle.file),
+#ifdef USE_ESP_IDF
+      fil_(handle.fil),
+      link_map_(std::move(handle.link_map)),
+#endif
+      size_(handle.size),
+      lock_(std::move(lock)) {}
+
+FileReader::FileReader(FileReader &&other)
+    : pool_(other.pool_),
+      pool_path_(std::move(other.pool_path_)),
+      stream_buffer_(other.stream_buffer_),
+      stream_buffer_size_(other.stream_buffer_size_),
+      file_(other.file_),
+#ifdef USE_ESP_IDF
+      fil_(other.fil_),
+      link_map_(std::move(other.link_map_)),
+#endif
+      size_(other.size_),
+      position_(other.position_),
+      lock_(std::move(other.lock_)) {
+  other.pool_ = nullptr;
+  other.stream_buffer_ = nullptr;
+  other.file_ = nullptr;
+#ifdef USE_ESP_IDF
+  other.fil_ = nullptr;
+#endif
+  other.size_ = 0;
+  other.position_ = 0;
+}
+
+FileReader &FileReader::operator=(FileReader &&other) {
+  if (this != &other) {
+    this->close();
+    this->pool_ = other.pool_;
+    this->pool_path_ = std::move(other.pool_path_);
+    this->stream_buffer_ = other.stream_buffer_;
+    this->stream_buffer_size_ = other.stream_buffer_size_;
+    other.pool_ = nullptr;
+    other.stream_buffer_ = nullptr;
+    this->file_ = other.file_;
+#ifdef USE_ESP_IDF
+    this->fil_ = other.fil_;
+    this->link_map_ = std::move(other.link_map_);
+    other.fil_ = nullptr;
+#endif
+    this->size_ = other.size_;
+    this->position_ = other.position_;
+    this->lock_ = std::move(other.lock_);
+    other.file_ = nullptr;
+    other.size_ = 0;
+    other.position_ = 0;
+  }
+  return *this;
+}
+
+FileReader::~FileReader() { this->close(); }
+
+size_t FileReader::read(size_t offset, uint8_t *buffer, size_t len) {
+  if (!this->is_open())
+    return 0;
+  if (offset != this->position_) {
+#ifdef USE_ESP_IDF
+    if (this->fil_ != nullptr) {
+      // O(1) with a link map, otherwise FatFs follows the cluster chain from the start
+      FRESULT res = f_lseek(this->fil_, offset);
+      if (res != FR_OK) {
+        ESP_LOGE(TAG, "Failed to seek to %zu: %d", offset, res);
+        return 0;
+      }
+      this->position_ = offset;
+      return this->read(buffer, len);
+    }
+#endif
+    if (fseek(this->file_, offset, SEEK_SET) != 0) {
+      ESP_LOGE(TAG, "Failed to seek to %zu: %s", offset, strerror(errno));
+      return 0;
+    }
+    this->position_ = offset;
+  }
+  return this->read(buffer, len);
+}
+
+size_t FileReader::read(uint8_t *buffer, size_t len) {
+#ifdef USE_ESP_IDF
+  if (this->fil_ != nullptr) {
+    UINT res = 0;
+    if (f_read(this->fil_, buffer, len, &res) != FR_OK)
+      return 0;
+    this->position_ += res;
+    return res;
+  }
+#endif
+  if (this->file_ == nullptr)
+    return 0;
+  size_t res = fread(buffer, 1, len, this->file_);
+  this->position_ += res;
+  return res;
+}
+
+void FileReader::set_pool(HandlePool *pool, std::string const &path) {
+  this->pool_ = pool;
+  this->pool_path_ = path;
+}
+
+void FileReader::close() {
+  if (this->pool_ != nullptr && this->is_open()) {
+    // Parked while the shared lock is still held, a writer of the file drops it when taking its lock
+    bool failed = this->file_ != nullptr && ferror(this->file_);
+    if (!failed) {
+      HandlePool::Handle handle;
+      handle.file = this->file_;
+#ifdef USE_ESP_IDF
+      handle.fil = this->fil_;
+      handle.link_map = std::move(this->link_map_);
+      this->fil_ = nullptr;
+#endif
+      handle.size = this->size_;
+      handle.buffer = this->stream_buffer_;
+      handle.buffer_size = this->stream_buffer_size_;
+      this->file_ = nullptr;
+      this->stream_buffer_ = nullptr;
+      this->pool_->park(this->pool_path_, std::move(handle));
+    }
+  }
+  bool was_open = this->is_open();
+  if (this->file_ != nullptr) {
+    fclose(this->file_);
+    this->file_ = nullptr;
+  }
+#ifdef USE_ESP_IDF
+  if (this->fil_ != nullptr) {
+    f_close(this->fil_);
+    delete this->fil_;
+    this->fil_ = nullptr;
+  }
+  this->link_map_.reset();
+#endif
+  if (this->pool_ != nullptr) {
+    // stdio used the buffer up to fclose
+    this->pool_->give_buffer(this->stream_buffer_, this->stream_buffer_size_);
+    if (was_open)
+      this->pool_->release();
+  }
+  this->stream_buffer_ = nullptr;
+  this->pool_ = nullptr;
+  this->lock_.unlock();
+}
+
+FileWriter::FileWriter(SdMmc *parent, FILE *file, size_t initial_size, size_t offset, size_t block_size,
+                       PathLock lock)
+    : parent_(parent),
+      file_(file),
+      block_size_(block_size),
+      initial_size_(initial_size),
+      offset_(offset),
+      lock_(std::move(lock)) {
+  this->buffer_.reset(new (std::nothrow) uint8_t[block_size]);
+  if (!this->buffer_) {
+    ESP_LOGW(TAG, "Failed to allocate %zu bytes write buffer, writing unbuffered", block_size);
+    this->block_size_ = 0;
+    return;
+  }
+  // The session does its own buffering, stdio would only add a copy
+  setvbuf(file, nullptr, _IONBF, 0);
+}
+
+FileWriter::FileWriter(FileWriter &&other)
+    : parent_(other.parent_),
+      file_(other.file_),
+      buffer_(std::move(other.buffer_)),
+      block_size_(other.block_size_),
+      buffer_len_(other.buffer_len_),
+      initial_size_(other.initial_size_),
+      offset_(other.offset_),
+      error_(other.error_),
+      trim_on_close_(other.trim_on_close_),
+      pool_(other.pool_),
+      lock_(std::move(other.lock_)) {
+  other.file_ = nullptr;
+  other.buffer_len_ = 0;
+}
+
+FileWriter &FileWriter::operator=(FileWriter &&other) {
+  if (this != &other) {
+    this->close();
+    this->parent_ = other.parent_;
+    this->file_ = other.file_;
+    this->buffer_ = std::move(other.buffer_);
+    this->block_size_ = other.block_size_;
+    this->buffer_len_ = other.buffer_len_;
+    this->initial_size_ = other.initial_size_;
+    this->offset_ = other.offset_;
+    this->error_ = other.error_;
+    this->trim_on_close_ = other.trim_on_close_;
+    this->pool_ = other.pool_;
+    this->lock_ = std::move(other.lock_);
+    other.file_ = nullptr;
+    other.buffer_len_ = 0;
+  }
+  return *this;
+}
+
+FileWriter::~FileWriter() { this->close(); }
+
+size_t FileWriter::next_block_len_() const {
+  // The first block of an append only fills the partial cluster, later ones are full clusters
+  return this->block_size_ - (this->offset_ % this->block_size_);
+}
+
+bool FileWriter::write_block_(const uint8_t *data, size_t len) {
+  size_t res = fwrite(data, 1, len, this->file_);
+  this->offset_ += res;
+  if (res != len) {
+    ESP_LOGE(TAG, "Failed to write to file: %s", strerror(errno));
+    this->error_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool FileWriter::write(const uint8_t *data, size_t len) {
+  if (this->file_ == nullptr || this->error_)
+    return false;
+  if (this->block_size_ == 0)
+    return this->write_block_(data, len);
+
+  while (len > 0) {
+    size_t block_len = this->next_block_len_();
+    // Whole blocks skip the buffer when nothing is pending
+    if (this->buffer_len_ == 0 && len >= block_len) {
+      size_t direct = block_len + ((len - block_len) / this->block_size_) * this->block_size_;
+      if (!this->write_block_(data, direct))
+        return false;
+      data += direct;
+      len -= direct;
+      continue;
+    }
+    size_t copy = std::min(len, block_len - this->buffer_len_);
+    memcpy(this->buffer_.get() + this->buffer_len_, data, copy);
+    this->buffer_len_ += copy;
+    data += copy;
+    len -= copy;
+    if (this->buffer_len_ == block_len && !this->flush())
+      return false;
+  }
+  return true;
+}
+
+bool FileWriter::flush() {
+  if (this->file_ == nullptr || this->error_)
+    return false;
+  if (this->buffer_len_ == 0)
+    return true;
+  size_t len = this->buffer_len_;
+  this->buffer_len_ = 0;
+  return this->write_block_(this->buffer_.get(), len);
+}
+
+bool FileWriter::sync() {
+  if (!this->flush())
+    return false;
+  if (fflush(this->file_) != 0 || !this->parent_->sync_stream_(this->file_)) {
+    ESP_LOGE(TAG, "Failed to sync file: %s", strerror(errno));
+    this->error_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool FileWriter::close() {
+  if (this->file_ == nullptr)
+    return false;
+  bool ok = this->flush();
+  if (this->trim_on_close_ && (fflush(this->file_) != 0 || ftruncate(fileno(this->file_), this->offset_) != 0)) {
+    ESP_LOGE(TAG, "Failed to trim preallocated file: %s", strerror(errno));
+    ok = false;
+  }
+  if (fclose(this->file_) != 0) {
+    ESP_LOGE(TAG, "Failed to close file: %s", strerror(errno));
+    ok = false;
+  }
+  this->file_ = nullptr;
+  this->buffer_.reset();
+  if (this->pool_ != nullptr)
+    this->pool_->release();
+  if (this->parent_ != nullptr)
+    this->parent_->adjust_free_space_(this->initial_size_, this->offset_);
+  this->lock_.unlock();
+  return ok && !this->error_;
+}
+
 }  // namespace sd_mmc_card
 }  // namespace esphome
@@ -1,8 +1,19 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
 #include "esphome/core/gpio.h"
 #include "esphome/core/defines.h"
 #include "esphome/core/component.h"
 #include "esphome/core/automation.h"
+#include "esphome/core/helpers.h"
 #ifdef USE_SENSOR
 #include "esphome/components/sensor/sensor.h"
 #endif
@@ -10,15 +21,49 @@
 #include "esphome/components/text_sensor/text_sensor.h"
 #endif
 
+#ifdef USE_ESP32
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#endif
+
 #ifdef USE_ESP_IDF
 #include "sdmmc_cmd.h"
+#include "ff.h"
 #endif
 
 namespace esphome {
 namespace sd_mmc_card {
 
+enum BusSpeed : uint8_t {
+  BUS_SPEED_DEFAULT = 0,
+  BUS_SPEED_HIGH_SPEED = 1,
+  BUS_SPEED_DDR50 = 2,
+  /* Probe the fastest working mode at mount time */
+  BUS_SPEED_AUTO = 3,
+};
+
+#ifdef USE_HOST
+/* Faults the host backend can simulate, see SdMmc::inject_host_fault. */
+enum HostFault : uint8_t {
+  HOST_FAULT_NONE = 0,
+  HOST_FAULT_EIO = 1,
+  HOST_FAULT_ENOSPC = 2,
+  HOST_FAULT_REMOVED = 3,
+};
+#endif
+
 enum MemoryUnits : short { Byte = 0, KiloByte = 1, MegaByte = 2, GigaByte = 3, TeraByte = 4, PetaByte = 5 };
 
+static constexpr size_t DEFAULT_CHUNK_SIZE = 4096;
+static constexpr size_t DEFAULT_CLUSTER_SIZE = 16 * 1024;
+static constexpr uint32_t DEFAULT_LOCK_TIMEOUT_MS = 10000;
+static constexpr uint8_t DEFAULT_MAX_FILES = 16;
+// VFS file table entries kept out of the handle pool for direct stdio users (servers, internal short opens)
+static constexpr uint8_t UNPOOLED_FILES = 4;
+
+class SdMmc;
+
 #ifdef USE_SENSOR
 struct FileSizeSensor {
   sensor::Sensor *sensor{nullptr};
@@ -31,53 +76,805 @@ struct FileSizeSensor {
 
 struct FileInfo {
   std::string path;
-  size_t size;
-  bool is_directory;
+  size_t size{0};
+  bool is_directory{false};
+  time_t mtime{0};
+  /* FatFs attributes (AM_RDO, AM_HID, AM_SYS, AM_DIR, AM_ARC), 0 when unknown. */
+  uint8_t attributes{0};
 
+  FileInfo() = default;
   FileInfo(std::string const &, size_t, bool);
+  FileInfo(std::string const &, size_t, bool, time_t, uint8_t);
+};
+
+/* Called for every directory entry, return false to stop the enumeration. The entry is only valid
+ * during the call. */
+using DirectoryCallback = std::function<bool(FileInfo const &info)>;
+
+/* Shared and exclusive locks keyed by card path. An exclusive lock also conflicts with locks held on the
+ * ancestors and descendants of its path. The empty path stands for the whole volume and conflicts with every
+ * other lock. */
+class PathLockTable {
+ public:
+  bool lock(std::string const &path, bool exclusive, uint32_t timeout_ms);
+  void unlock(std::string const &path, bool exclusive);
+  /* Called with the path whenever an exclusive lock is released. */
+  void set_release_callback(std::function<void(std::string const &)> &&callback) {
+    this->release_callback_ = std::move(callback);
+  }
+
+ protected:
+  struct Entry {
+    std::string path;
+    uint16_t readers;
+    bool writer;
+  };
+  bool conflicts_(std::string const &path, bool exclusive) const;
+
+  std::mutex mutex_;
+  std::condition_variable released_;
+  std::vector<Entry> entries_;
+  std::function<void(std::string const &)> release_callback_;
+};
+
+/* Lock held on a path, released when destroyed. */
+class PathLock {
+ public:
+  PathLock() = default;
+  PathLock(PathLockTable *table, std::string path, bool exclusive);
+  PathLock(PathLock const &) = delete;
+  PathLock &operator=(PathLock const &) = delete;
+  PathLock(PathLock &&other);
+  PathLock &operator=(PathLock &&other);
+  ~PathLock();
+
+  bool is_locked() const { return this->table_ != nullptr; }
+  void unlock();
+
+ protected:
+  PathLockTable *table_{nullptr};
+  std::string path_;
+  bool exclusive_{false};
+};
+
+/* Entries of recently resolved directories with their type. Existence and type lookups are answered from the
+ * listing of the parent directory instead of letting FatFs scan every directory of the path again. Names are
+ * matched case-insensitively, like FAT does. */
+class DirectoryCache {
+ public:
+  enum Lookup : uint8_t {
+    LOOKUP_UNKNOWN = 0,
+    LOOKUP_MISSING = 1,
+    LOOKUP_FILE = 2,
+    LOOKUP_DIRECTORY = 3,
+  };
+  struct Dentry {
+    std::string name;
+    bool is_directory;
+    size_t size;
+    time_t mtime;
+    uint8_t attributes;
+  };
+
+  void set_limits(size_t max_directories, size_t max_entries) {
+    this->max_directories_ = max_directories;
+    this->max_entries_ = max_entries;
+  }
+  bool is_enabled() const { return this->max_directories_ > 0; }
+  size_t get_max_directories() const { return this->max_directories_; }
+  size_t get_max_entries() const { return this->max_entries_; }
+  /* Changes on every invalidation, a listing read across one is not stored. */
+  uint32_t get_generation();
+  /* Fills info when the path was found in the listing of its parent. */
+  Lookup lookup(std::string const &path, FileInfo *info = nullptr);
+  /* Copies the cached listing of a directory, false when it is not cached. */
+  bool get_entries(std::string const &path, std::vector<Dentry> &entries);
+  void store(std::string const &path, std::vector<Dentry> &&entries, uint32_t generation);
+  /* Drops the listing of the parent of path and every listing at or below path. */
+  void invalidate(std::string const &path);
+
+ protected:
+  struct Directory {
+    std::string path;
+    std::vector<Dentry> entries;
+    uint32_t last_used;
+  };
+
+  std::mutex mutex_;
+  std::vector<Directory> directories_;
+  size_t max_directories_{0};
+  size_t max_entries_{0};
+  uint32_t generation_{0};
+  uint32_t tick_{0};
+};
+
+/* Metadata of recently stat'ed paths whose parent listing is not cached, bounded in count and evicted LRU. */
+class StatCache {
+ public:
+  void set_max_entries(size_t max_entries) { this->max_entries_ = max_entries; }
+  size_t get_max_entries() const { return this->max_entries_; }
+  bool is_enabled() const { return this->max_entries_ > 0; }
+  uint32_t get_generation();
+  bool get(std::string const &path, FileInfo &info);
+  void put(FileInfo const &info, uint32_t generation);
+  /* Drops the path, everything below it and its parent. */
+  void invalidate(std::string const &path);
+
+ protected:
+  struct Entry {
+    FileInfo info;
+    uint32_t last_used;
+  };
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  size_t max_entries_{0};
+  uint32_t generation_{0};
+  uint32_t tick_{0};
+};
+
+/* Cluster link map tables of recently opened large files, shared with the readers using them. An evicted
+ * table stays alive until its last reader is closed. Entries are keyed by path and validated against the
+ * start cluster and size of the file. */
+class LinkMapCache {
+ public:
+  using Table = std::shared_ptr<uint32_t>;
+
+  void set_budget(size_t bytes) { this->budget_ = bytes; }
+  size_t get_budget() const { return this->budget_; }
+  size_t get_used() const { return this->used_; }
+  Table get(std::string const &path, uint32_t start_cluster, size_t size);
+  /* Stores a table of words entries, evicting the least recently used ones to stay within the budget. */
+  bool put(std::string const &path, uint32_t start_cluster, size_t size, Table table, size_t words);
+  /* Drops the entry of a path and of everything below it. */
+  void invalidate(std::string const &path);
+
+ protected:
+  struct Entry {
+    std::string path;
+    uint32_t start_cluster;
+    size_t size;
+    Table table;
+    size_t bytes;
+    uint32_t last_used;
+  };
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  size_t budget_{0};
+  size_t used_{0};
+  uint32_t tick_{0};
+};
+
+/* Bounds the files held open by readers and writers to the slots left in the VFS file table. Slots are handed
+ * out in request order. A closed reader parks its handle, by path, for the next reader of the same file; idle
+ * handles are closed when their slot is needed or when the file changes. The pool also recycles the stdio
+ * buffers of its streams, allocated in PSRAM when available. */
+class HandlePool {
+ public:
+  /* Open file of a parked reader. */
+  struct Handle {
+    FILE *file{nullptr};
+#ifdef USE_ESP_IDF
+    FIL *fil{nullptr};
+    LinkMapCache::Table link_map;
+#endif
+    size_t size{0};
+    uint8_t *buffer{nullptr};
+    size_t buffer_size{0};
+  };
+  struct Stats {
+    uint32_t reused{0};
+    uint32_t opened{0};
+    uint32_t waits{0};
+    uint32_t timeouts{0};
+  };
+  /* Stream handed out to a direct user. path is only set when it writes, start_size is then the size of the
+   * file when it was opened. */
+  struct Stream {
+    FILE *file{nullptr};
+    uint8_t *buffer{nullptr};
+    size_t size{0};
+    std::string path;
+    size_t start_size{0};
+  };
+
+  void set_slots(uint8_t slots) { this->slots_ = slots; }
+  uint8_t get_slots() const { return this->slots_; }
+  /* Takes a slot, closing the least recently used idle handle when none is free, and waits in line otherwise. */
+  bool acquire(uint32_t timeout_ms);
+  /* Same without waiting. */
+  bool try_acquire();
+  void release();
+  /* Takes the idle handle of a path along with its slot, rewound to the start of the file. */
+  bool take(std::string const &path, Handle &handle);
+  /* Keeps the handle of a closed reader, the slot stays taken. */
+  void park(std::string const &path, Handle &&handle);
+  /* Closes the idle handles of a path and of everything below it. */
+  void drop(std::string const &path);
+  size_t get_idle_count();
+  Stats get_stats();
+  /* stdio buffer of size bytes, nullptr when out of memory. */
+  uint8_t *take_buffer(size_t size);
+  void give_buffer(uint8_t *buffer, size_t size);
+  /* Remembers the buffer of a stream handed out to a direct user, until it is closed. */
+  void track_stream(Stream &&stream);
+  bool untrack_stream(FILE *file, Stream &stream);
+
+ protected:
+  struct Idle {
+    std::string path;
+    Handle handle;
+  };
+  static void close_(Handle &handle);
+  bool evict_();
+  /* Keeps a buffer for reuse, the caller holds the mutex. */
+  void recycle_(uint8_t *buffer, size_t size);
+
+  std::mutex mutex_;
+  std::condition_variable released_;
+  std::vector<Idle> idle_;
+  std::vector<Stream> streams_;
+  std::vector<uint8_t *> free_buffers_;
+  size_t free_buffer_size_{0};
+  std::vector<uint32_t> waiters_;
+  uint32_t next_waiter_{0};
+  uint8_t slots_{1};
+  uint8_t used_{0};
+  Stats stats_;
+};
+
+/* Run of consecutive sectors on the card. */
+struct SectorRange {
+  uint32_t sector;
+  uint32_t count;
+};
+
+/* Sector ranges kept sorted, ranges that overlap or touch are merged. Not thread safe. */
+class SectorRangeSet {
+ public:
+  void add(uint32_t sector, uint32_t count);
+  /* Drops the given sectors, a range straddling them is split. */
+  void remove(uint32_t sector, uint32_t count);
+  /* Takes up to max_count sectors from the start of the lowest range, false when the set is empty. */
+  bool pop(uint32_t max_count, SectorRange &range);
+  uint64_t get_sector_count() const;
+  std::vector<SectorRange> const &get_ranges() const { return this->ranges_; }
+  bool empty() const { return this->ranges_.empty(); }
+
+ protected:
+  /* Sorted by sector, never overlapping or adjacent */
+  std::vector<SectorRange> ranges_;
+};
+
+#ifdef USE_ESP_IDF
+/* Sector cache installed between FatFs and the SDMMC driver. Lines of a few sectors live in an arena in PSRAM,
+ * card transfers go through an internal DMA buffer so they stay multi-sector. Sequential reads fetch a
+ * growing read-ahead window. Writes stay dirty in the cache and are written back in runs of adjacent sectors
+ * on eviction, on CTRL_SYNC (f_sync, f_close) and on flush(). */
+class BlockCache {
+ public:
+  struct Stats {
+    uint32_t hits{0};
+    uint32_t misses{0};
+    uint32_t read_ahead_sectors{0};
+    uint32_t written_back_sectors{0};
+  };
+
+  ~BlockCache();
+  bool init(sdmmc_card_t *card, size_t arena_size, size_t max_read_ahead);
+  bool read(uint8_t *buffer, uint32_t sector, uint32_t count);
+  bool write(const uint8_t *buffer, uint32_t sector, uint32_t count);
+  /* Writes every dirty sector back to the card. */
+  bool flush();
+  /* Forgets the cached copy of a sector range, dirty data included. */
+  void discard(uint32_t sector, uint32_t count);
+  size_t get_arena_size() const { return this->lines_.size() * this->line_bytes_; }
+  Stats get_stats();
+
+ protected:
+  struct Line {
+    uint32_t base{UINT32_MAX};
+    uint32_t valid{0};
+    uint32_t dirty{0};
+    uint32_t last_used{0};
+    uint8_t *data{nullptr};
+  };
+
+  Line *find_(uint32_t base);
+  Line *allocate_(uint32_t base);
+  bool transfer_(bool write, uint8_t *buffer, uint32_t sector, uint32_t count);
+  bool fetch_(uint32_t sector, uint32_t count);
+  bool flush_();
+
+  sdmmc_card_t *card_{nullptr};
+  std::mutex mutex_;
+  std::vector<Line> lines_;
+  uint8_t *arena_{nullptr};
+  uint8_t *dma_buffer_{nullptr};
+  size_t sector_size_{512};
+  size_t line_bytes_{0};
+  uint32_t dma_sectors_{0};
+  uint32_t read_ahead_{0};
+  uint32_t max_read_ahead_{0};
+  uint32_t next_sector_{UINT32_MAX};
+  uint32_t tick_{0};
+  Stats stats_;
+};
+
+/* Sector runs holding the clusters of an open file, in file order. */
+bool get_file_sectors(FIL *fil, std::vector<SectorRange> &ranges);
+
+/* Sector ranges freed by deletes and truncations. They are erased in batches so the card controller
+ * knows the blocks are free, a range written again before its turn leaves the queue. */
+class TrimQueue {
+ public:
+  using Range = SectorRange;
+
+  void init(sdmmc_card_t *card) { this->card_ = card; }
+  void add(uint32_t sector, uint32_t count);
+  /* Queues the clusters of a FatFs path and returns them, to be cancelled if the file survives. */
+  std::vector<Range> add_file(std::string const &fatfs_path);
+  void cancel(uint32_t sector, uint32_t count);
+  void cancel(std::vector<Range> const &ranges);
+  uint64_t get_pending_bytes();
+  /* Erases every queued range, cached copies are dropped first. Stops at the first error, the failed range
+   * is dropped since erasing is only a hint to the card. */
+  bool erase(BlockCache *cache);
+  uint64_t get_erased_bytes() const { return this->erased_bytes_; }
+  /* Discard when the card supports it, the controller then chooses when to clear the blocks. */
+  bool uses_discard() const;
+
+ protected:
+  sdmmc_card_t *card_{nullptr};
+  std::mutex mutex_;
+  SectorRangeSet ranges_;
+  std::atomic<uint64_t> erased_bytes_{0};
+};
+
+/* Replaces the FatFs disk I/O of a drive by one going to the card through the block cache and the trim queue,
+ * either may be null. */
+bool install_disk_io(uint8_t pdrv, sdmmc_card_t *card, BlockCache *cache, TrimQueue *trim);
+
+/* Append-only log of records in a contiguous region of the card, written with raw sector writes. FatFs only
+ * allocates the region, nothing of the file system changes while logging. Every sector carries the log id and a
+ * sequence number, the write position is recovered from them after a power loss. Once the region is full the
+ * oldest sectors are overwritten. */
+class RingLog {
+ public:
+  /* Called for every record from the oldest, return false to stop reading. */
+  using RecordCallback = std::function<bool(const uint8_t *data, size_t len)>;
+  static constexpr size_t MAX_RECORD_SIZE = 0xFFFF;
+
+  ~RingLog();
+  /* Opens the log stored in the sectors [first_sector, first_sector + sector_count), the first one holds the
+   * log id. A region without a valid log id is started empty. */
+  bool begin(SdMmc *parent, sdmmc_card_t *card, uint32_t first_sector, uint32_t sector_count, size_t buffer_size);
+  /* Buffers a record, it reaches the card when the buffer is full or on flush. */
+  bool append(const uint8_t *data, size_t len);
+  bool flush();
+  bool read(RecordCallback const &callback);
+  /* Bytes of record data the region holds once full. */
+  uint64_t get_capacity() const;
+  uint64_t get_used_bytes() const;
+  uint32_t get_log_id() const { return this->log_id_; }
+
+ protected:
+  struct SectorHeader {
+    uint32_t magic;
+    uint32_t log_id;
+    uint32_t sequence;
+    uint16_t used;
+    /* Offset of the first record starting in the sector, NO_RECORD when it only continues one */
+    uint16_t first_record;
+    uint32_t crc;
+  };
+  static constexpr uint16_t NO_RECORD = 0xFFFF;
+
+  bool recover_();
+  /* Reads a data sector, false when it holds no valid sector of this log. */
+  bool load_(uint32_t index, uint8_t *buffer, uint32_t &sequence);
+  /* Checks a data sector read at index and returns its header. */
+  bool parse_(const uint8_t *sector, uint32_t index, SectorHeader &header) const;
+  uint32_t crc_(const uint8_t *sector, uint16_t used) const;
+  /* Closes the sector being filled, it gets the next sequence number. The buffer is written once full. */
+  bool seal_();
+  bool write_buffer_();
+  size_t payload_size_() const { return this->sector_size_ - sizeof(SectorHeader); }
+  uint8_t *sector_(uint32_t index) const { return this->buffer_ + index * this->sector_size_; }
+
+  SdMmc *parent_{nullptr};
+  sdmmc_card_t *card_{nullptr};
+  std::mutex mutex_;
+  uint32_t first_sector_{0};
+  /* Data sectors, after the log id sector */
+  uint32_t sector_count_{0};
+  size_t sector_size_{512};
+  uint32_t log_id_{0};
+  /* Next sequence number, the sector of a sequence is sequence % sector_count_ */
+  uint32_t next_sequence_{0};
+  uint8_t *buffer_{nullptr};
+  uint32_t buffer_sectors_{0};
+  uint32_t sealed_{0};
+  /* Payload bytes in the open sector */
+  size_t open_used_{0};
+  uint16_t open_first_record_{NO_RECORD};
+};
+#endif
+
+/* Read handle on an open file. Reads are positional, the caller owns the buffers. */
+class FileReader {
+ public:
+  FileReader() = default;
+  FileReader(FILE *file, size_t size, PathLock lock = PathLock());
+#ifdef USE_ESP_IDF
+  /* Reader going through FatFs directly, seeks use the cluster link map when one is given. */
+  FileReader(FIL *fil, size_t size, LinkMapCache::Table link_map, PathLock lock = PathLock());
+#endif
+  /* Reader on a handle parked in the pool. */
+  FileReader(HandlePool::Handle &&handle, PathLock lock);
+  FileReader(FileReader const &) = delete;
+  FileReader &operator=(FileReader const &) = delete;
+  FileReader(FileReader &&other);
+  FileReader &operator=(FileReader &&other);
+  ~FileReader();
+
+#ifdef USE_ESP_IDF
+  bool is_open() const { return this->file_ != nullptr || this->fil_ != nullptr; }
+  bool has_link_map() const { return this->link_map_ != nullptr; }
+#else
+  bool is_open() const { return this->file_ != nullptr; }
+#endif
+  size_t size() const { return this->size_; }
+  size_t position() const { return this->position_; }
+  /* Read up to len bytes starting at offset, returns the number of bytes read. */
+  size_t read(size_t offset, uint8_t *buffer, size_t len);
+  /* Read up to len bytes from the current position. */
+  size_t read(uint8_t *buffer, size_t len);
+  void close();
+  /* The handle holds a slot of the pool, it is parked there under path when the reader is closed. */
+  void set_pool(HandlePool *pool, std::string const &path);
+
+ protected:
+  friend class SdMmc;
+
+  HandlePool *pool_{nullptr};
+  std::string pool_path_;
+  // Pooled stdio buffer of file_, given back once the stream is closed
+  uint8_t *stream_buffer_{nullptr};
+  size_t stream_buffer_size_{0};
+  FILE *file_{nullptr};
+#ifdef USE_ESP_IDF
+  FIL *fil_{nullptr};
+  LinkMapCache::Table link_map_;
+#endif
+  size_t size_{0};
+  size_t position_{0};
+  PathLock lock_;
 };
 
-class SdMmc : public Component {
+/* Write session keeping a file open. Writes are coalesced into cluster aligned blocks and the
+ * free space counter is adjusted once, when the session is closed. */
+class FileWriter {
+ public:
+  FileWriter() = default;
+  FileWriter(SdMmc *parent, FILE *file, size_t initial_size, size_t offset, size_t block_size,
+             PathLock lock = PathLock());
+  FileWriter(FileWriter const &) = delete;
+  FileWriter &operator=(FileWriter const &) = delete;
+  FileWriter(FileWriter &&other);
+  FileWriter &operator=(FileWriter &&other);
+  ~FileWriter();
+
+  bool is_open() const { return this->file_ != nullptr; }
+  /* Current size of the file, including the bytes still buffered. */
+  size_t size() const { return this->offset_ + this->buffer_len_; }
+  bool write(const uint8_t *data, size_t len);
+  bool flush();
+  /* Writes the buffered bytes and pushes the file data and metadata to the card. */
+  bool sync();
+  bool close();
+  /* The file was preallocated past its final size, close cuts it at the written length. */
+  void set_trim_on_close(bool trim) { this->trim_on_close_ = trim; }
+  /* The handle holds a slot of the pool, given back on close. */
+  void set_pool(HandlePool *pool) { this->pool_ = pool; }
+
+ protected:
+  bool write_block_(const uint8_t *data, size_t len);
+  size_t next_block_len_() const;
+
+  SdMmc *parent_{nullptr};
+  FILE *file_{nullptr};
+  std::unique_ptr<uint8_t[]> buffer_;
+  size_t block_size_{0};
+  size_t buffer_len_{0};
+  size_t initial_size_{0};
+  size_t offset_{0};
+  bool error_{false};
+  bool trim_on_close_{false};
+  HandlePool *pool_{nullptr};
+  PathLock lock_;
+};
+
+/* Request classes of the I/O worker, a lower value is served first. */
+enum IoPriority : uint8_t {
+  IO_PRIORITY_INTERACTIVE = 0,
+  IO_PRIORITY_NORMAL = 1,
+  IO_PRIORITY_BULK = 2,
+  IO_PRIORITY_COUNT = 3,
+};
+
+using IoJob = std::function<void()>;
+
+struct IoStats {
+  uint32_t completed{0};
+  uint32_t total_wait_ms{0};
+  uint32_t max_wait_ms{0};
+};
+
+struct BenchmarkConfig {
+  std::string path{"/.benchmark"};
+  size_t file_size{4 * 1024 * 1024};
+  std::vector<size_t> buffer_sizes{512, 4096, 32768};
+  uint32_t random_ops{256};
+  uint32_t metadata_ops{64};
+};
+
+/* Latency samples of one operation type, in microseconds. */
+struct LatencyStats {
+  std::vector<uint32_t> samples;
+
+  void add(uint32_t us) { this->samples.push_back(us); }
+  /* Sorts the samples, call before percentile(). */
+  void finalize();
+  uint32_t percentile(float p) const;
+  float mean() const;
+  /* Sample count per power of two, bucket i holds [2^i, 2^(i+1)) us and bucket 0 also holds 0 us. Trailing
+   * empty buckets are dropped. */
+  std::vector<uint32_t> histogram() const;
+};
+
+struct SequentialResult {
+  size_t buffer_size;
+  float read_mbps;
+  float write_mbps;
+};
+
+struct BenchmarkResult {
+  bool ok{false};
+  std::vector<SequentialResult> sequential;
+  float random_read_iops{0};
+  float random_write_iops{0};
+  LatencyStats random_read_latency;
+  LatencyStats random_write_latency;
+  LatencyStats fopen_latency;
+  LatencyStats stat_latency;
+  LatencyStats readdir_latency;
+
+  float best_read_mbps() const;
+  float best_write_mbps() const;
+  std::string to_json() const;
+};
+
+/* Layout of a freshly formatted card. */
+struct FormatResult {
+  bool ok{false};
+  /* Allocation unit from the SD status, in bytes. The data area starts on an allocation unit boundary. */
+  uint32_t allocation_unit{0};
+  uint32_t cluster_size{0};
+  /* First sector of the data area, counted from the start of the card. */
+  uint32_t data_offset{0};
+  uint32_t clusters{0};
+  /* FatFs file system type: 1 FAT12, 2 FAT16, 3 FAT32, 4 exFAT */
+  uint8_t fat_type{0};
+
+  std::string to_json() const;
+};
+
+/* Called for every chunk of a streamed file, return false to stop reading. */
+using ChunkCallback = std::function<bool(const uint8_t *data, size_t len, size_t offset)>;
+
+class SdMmc : public PollingComponent {
+  friend class FileWriter;
+#ifdef USE_ESP_IDF
+  friend class RingLog;
+#endif
+
 #ifdef USE_SENSOR
   SUB_SENSOR(used_space)
   SUB_SENSOR(total_space)
   SUB_SENSOR(free_space)
+  SUB_SENSOR(io_queue_depth)
+  SUB_SENSOR(io_interactive_latency)
+  SUB_SENSOR(io_normal_latency)
+  SUB_SENSOR(io_bulk_latency)
+  SUB_SENSOR(benchmark_read_speed)
+  SUB_SENSOR(benchmark_write_speed)
+  SUB_SENSOR(benchmark_random_read_iops)
+  SUB_SENSOR(benchmark_random_write_iops)
+  SUB_SENSOR(benchmark_read_latency_p99)
+  SUB_SENSOR(benchmark_metadata_latency)
+  SUB_SENSOR(erased_space)
 #endif
 #ifdef USE_TEXT_SENSOR
   SUB_TEXT_SENSOR(sd_card_type)
+  SUB_TEXT_SENSOR(bus_mode)
 #endif
  public:
   enum ErrorCode {
     ERR_PIN_SETUP,
     ERR_MOUNT,
     ERR_NO_CARD,
+    ERR_BUS,
   };
   void setup() override;
   void loop() override;
+  void update() override;
   void dump_config() override;
+  void on_shutdown() override;
+  SdMmc();
   void write_file(const char *path, const uint8_t *buffer, size_t len, const char *mode);
   void write_file(const char *path, const uint8_t *buffer, size_t len);
   void append_file(const char *path, const uint8_t *buffer, size_t len);
+  /* Replaces the content of a file so that a power loss leaves either the old or the new content. The data
+   * is written to a temporary file, synced, then renamed over the target; a journal lets setup() finish a
+   * rename that was cut. */
+  bool replace_file(const char *path, const uint8_t *buffer, size_t len);
+  bool replace_file(std::string const &path, std::vector<uint8_t> const &data);
+  FileWriter open_writer(const char *path, const char *mode = "w");
+  FileWriter open_writer(std::string const &path, const char *mode = "w");
+  /* Write session on a file whose final size is known: the clusters are reserved as one contiguous extent
+   * up front and the file is trimmed to the written length on close. Falls back to a plain writer when
+   * the card has no free extent that large. */
+  FileWriter open_preallocated_writer(const char *path, size_t size);
+  FileWriter open_preallocated_writer(std::string const &path, size_t size);
+  /* Truncates the file and reserves size bytes of contiguous clusters, the file is left at that size.
+   * The caller holds the exclusive lock of the path and cuts the file to its real length when done.
+   * Paths may be given with or without the mount point. */
+  bool preallocate(std::string const &path, size_t size);
+  size_t get_cluster_size() const { return this->cluster_size_; }
   bool delete_file(const char *path);
   bool delete_file(std::string const &path);
+  /* Deletes a file whose exclusive lock the caller already holds, its clusters are queued for trim.
+   * Paths may be given with or without the mount point. */
+  bool remove_file(std::string const &path);
   bool create_directory(const char *path);
+  /* Creates path and its missing parents. Takes no lock, the caller holds the lock of path or of a path below
+   * it; the caches are dropped from the top-most created directory. Paths may be given with or without the
+   * mount point. */
+  bool create_directories(std::string const &path);
   bool remove_directory(const char *path);
   bool exists(const std::string &path);
   size_t get_file_size(const std::string &path);
   std::vector<uint8_t> read_file(char const *path);
   std::vector<uint8_t> read_file(std::string const &path);
+  /* Waits at most timeout_ms for the shared lock of the path and for a slot of the handle pool. */
+  FileReader open_file(const char *path, uint32_t timeout_ms = DEFAULT_LOCK_TIMEOUT_MS);
+  FileReader open_file(std::string const &path, uint32_t timeout_ms = DEFAULT_LOCK_TIMEOUT_MS);
+  bool read_file_chunked(const char *path, ChunkCallback const &callback, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  bool read_file_chunked(std::string const &path, ChunkCallback const &callback,
+                         size_t chunk_size = DEFAULT_CHUNK_SIZE);
   bool is_directory(const char *path);
   bool is_directory(std::string const &path);
   std::vector<std::string> list_directory(const char *path, uint8_t depth);
   std::vector<std::string> list_directory(std::string path, uint8_t depth);
   std::vector<FileInfo> list_directory_file_info(const char *path, uint8_t depth);
   std::vector<FileInfo> list_directory_file_info(std::string path, uint8_t depth);
+  bool for_each_entry(const char *path, uint8_t depth, DirectoryCallback const &callback);
+  bool for_each_entry(std::string const &path, uint8_t depth, DirectoryCallback const &callback);
   size_t file_size(const char *path);
   size_t file_size(std::string const &path);
+  /* Size, date, type and attributes of a path, served from the directory and stat caches when possible.
+   * info.path is the card path. */
+  bool stat(std::string const &path, FileInfo &info);
 #ifdef USE_SENSOR
   void add_file_size_sensor(sensor::Sensor *, std::string const &path);
 #endif
 
+  /* The worker serializes the jobs given to submit_io and run_io, other callers still access the card from their
+   * own task. */
+  void set_io_worker(uint8_t queue_size, uint8_t task_priority);
+  bool has_io_worker() const;
+  /* Queue a job on the I/O worker and return immediately, the job reports its own completion. Without
+   * worker the job runs inline. Returns false when the queue of that class is full. */
+  bool submit_io(IoPriority priority, IoJob job);
+  /* Run a job on the I/O worker and wait for it to complete. */
+  bool run_io(IoPriority priority, IoJob const &job);
+  size_t get_io_queue_depth() const;
+  /* Wait time statistics of a class since the last call, the counters are reset. */
+  IoStats take_io_stats(IoPriority priority);
+  /* Shared locks let readers run in parallel, an exclusive lock waits for every other holder of the path.
+   * Returns an unlocked PathLock on timeout. Paths may be given with or without the mount point. */
+  PathLock lock_path(std::string const &path, bool exclusive, uint32_t timeout_ms = DEFAULT_LOCK_TIMEOUT_MS);
+  PathLock lock_volume(uint32_t timeout_ms = DEFAULT_LOCK_TIMEOUT_MS);
+
+  /* Runs the whole benchmark on the calling task, this takes seconds. */
+  BenchmarkResult run_benchmark(BenchmarkConfig const &config);
+  /* Runs the benchmark on a background task, results are published from the main loop. */
+  bool start_benchmark(BenchmarkConfig const &config);
+  bool is_benchmark_running() const { return this->benchmark_running_; }
+  /* Last published result, only for the main loop. */
+  BenchmarkResult const &get_benchmark_result() const { return this->benchmark_result_; }
+  /* Sequential read of an existing file, in MB/s. */
+  float benchmark_sequential_read(std::string const &path, size_t buffer_size);
+  void add_on_benchmark_callback(std::function<void(std::string const &)> &&callback) {
+    this->benchmark_callback_.add(std::move(callback));
+  }
+  /* Formats the card on the calling task, everything on it is lost. The data area is aligned on the allocation
+   * unit of the card, a cluster_size of 0 uses the allocation unit capped to 32 KB. The ring log is closed and
+   * opened again around it, call it from the main loop. */
+  FormatResult format(uint32_t cluster_size = 0);
+  /* Formats on a background task, the geometry is reported from the main loop. */
+  bool start_format(uint32_t cluster_size = 0);
+  bool is_format_running() const { return this->format_running_; }
+  FormatResult const &get_format_result() const { return this->format_result_; }
+  void add_on_format_callback(std::function<void(std::string const &)> &&callback) {
+    this->format_callback_.add(std::move(callback));
+  }
+  std::string const &get_mount_point() const { return this->mount_point_; }
+  /* Card relative form of a path, with or without the mount point: "/dir/file", "/" for the root. */
+  std::string card_path(std::string const &path) const;
+  /* Files of at least min_file_size bytes are read with a cluster link map, the tables are cached in PSRAM
+   * within budget bytes. */
+  void set_fast_seek(size_t min_file_size, size_t budget) {
+    this->fast_seek_min_size_ = min_file_size;
+    this->link_maps_.set_budget(budget);
+  }
+  /* Keep the listings of up to max_directories directories of at most max_entries entries each. */
+  void set_directory_cache(size_t max_directories, size_t max_entries) {
+    this->directories_.set_limits(max_directories, max_entries);
+  }
+  void set_stat_cache(size_t max_entries) { this->stats_.set_max_entries(max_entries); }
+  /* Size of the VFS file table. Readers and writers share the pool, the rest is left to direct stdio users. */
+  void set_max_files(uint8_t max_files);
+  uint8_t get_max_files() const { return this->max_files_; }
+  HandlePool::Stats get_handle_stats() { return this->handles_.get_stats(); }
+  /* stdio buffer of pooled streams in bytes, rounded up to whole clusters. 0 is one cluster. */
+  void set_stream_buffer_size(size_t size) { this->stream_buffer_size_ = size; }
+  size_t get_stream_buffer_size() const;
+  /* stdio stream for direct users such as the file servers, with a pooled cluster aligned buffer. It takes a
+   * slot of the handle pool, waiting at most timeout_ms for one: the default fails at once with EMFILE so the
+   * main loop never blocks. Close it with close_stream(). The caller holds the lock of the path. */
+  FILE *open_stream(std::string const &path, const char *mode, uint32_t timeout_ms = 0);
+  bool close_stream(FILE *file);
+  /* Sector cache of arena_size bytes under FatFs, reading ahead up to max_read_ahead bytes. */
+  void set_block_cache(size_t arena_size, size_t max_read_ahead) {
+    this->block_cache_size_ = arena_size;
+    this->block_cache_read_ahead_ = max_read_ahead;
+  }
+  /* Flush barrier: everything written so far is on the card when this returns. */
+  bool flush_cache();
+  /* Clusters freed by deletes and overwrites are erased on the card, in the background once batch_size
+   * bytes are pending and at every update. */
+  void set_trim(size_t batch_size) { this->trim_batch_size_ = batch_size; }
+  /* Bytes erased since boot. */
+  uint64_t get_erased_bytes() const;
+  /* Reserves size bytes at path as a contiguous region holding a ring log, see RingLog. */
+  void set_ring_log(std::string const &path, size_t size, size_t buffer_size) {
+    this->ring_log_path_ = path;
+    this->ring_log_size_ = size;
+    this->ring_log_buffer_size_ = buffer_size;
+  }
+#ifdef USE_ESP_IDF
+  /* nullptr when no ring log is configured or it could not be opened. */
+  RingLog *get_ring_log() { return this->ring_log_.get(); }
+#endif
+  bool append_ring_log(const uint8_t *data, size_t len);
+  /* Copies the records of the ring log, oldest first, into a regular file served like any other. */
+  bool export_ring_log(std::string const &path);
+  /* Same on the I/O worker. Refused while a format runs, and a format is refused until the export is done. */
+  bool start_ring_log_export(std::string const &path);
+#ifdef USE_HOST
+  /* Local directory standing in for the card. */
+  void set_host_root(std::string const &root) { this->mount_point_ = root; }
+  /* Simulated card timing, a bandwidth of 0 is unlimited. */
+  void set_host_timing(uint32_t op_latency_us, uint32_t read_bytes_per_s, uint32_t write_bytes_per_s);
+  /* Every operation fails with the fault once after_ops more operations went through. */
+  void inject_host_fault(HostFault fault, uint32_t after_ops = 0);
+  /* Applies the timing model and the injected fault to one operation, returns 0 or an errno value. */
+  int simulate_host_io(size_t bytes, bool write);
+#endif
+
   void set_clk_pin(uint8_t);
   void set_cmd_pin(uint8_t);
   void set_data0_pin(uint8_t);
@@ -86,6 +883,10 @@ class SdMmc : public Component {
   void set_data3_pin(uint8_t);
   void set_mode_1bit(bool);
   void set_power_ctrl_pin(GPIOPin *);
+  void set_bus_speed(BusSpeed speed) { this->bus_speed_ = speed; }
+  /* Mode the card was mounted with, e.g. "4-bit 40 MHz". */
+  std::string const &get_bus_mode() const { return this->bus_mode_; }
+  void set_free_space_reconcile_interval(uint32_t interval) { this->free_space_reconcile_interval_ = interval; }
 
  protected:
   ErrorCode init_error_;
@@ -97,21 +898,165 @@ class SdMmc : public Component {
   uint8_t data3_pin_;
   bool mode_1bit_;
   GPIOPin *power_ctrl_pin_{nullptr};
+  BusSpeed bus_speed_{BUS_SPEED_DEFAULT};
+  std::string bus_mode_;
+  // Read by writers on any task, changed from the main loop and by format
+  std::atomic<size_t> cluster_size_{DEFAULT_CLUSTER_SIZE};
+  uint32_t free_space_reconcile_interval_{0};
+  uint32_t last_free_space_scan_{0};
+  std::atomic<uint32_t> total_clusters_{0};
+  std::atomic<int32_t> free_clusters_{0};
+  std::atomic<bool> free_space_valid_{false};
+  std::atomic<bool> free_space_scanning_{false};
+  // Clusters freed (positive) or taken since the running scan started, applied on top of its result
+  std::atomic<int32_t> free_space_delta_{0};
+  // Result of the scan task, handed to the main loop once free_space_scan_done_ is set
+  uint32_t scanned_cluster_size_{0};
+  uint32_t scanned_total_clusters_{0};
+  uint32_t scanned_free_clusters_{0};
+  std::atomic<bool> free_space_scan_done_{false};
+
+  std::string mount_point_{"/sdcard"};
+
+  uint8_t io_queue_size_{0};
+  uint8_t io_task_priority_{5};
+#ifdef USE_ESP32
+  struct IoRequest {
+    IoJob job;
+    uint32_t queued_at;
+    SemaphoreHandle_t done;
+  };
+  TaskHandle_t io_task_{nullptr};
+  QueueHandle_t io_queues_[IO_PRIORITY_COUNT]{};
+  SemaphoreHandle_t io_pending_{nullptr};
+  SemaphoreHandle_t io_stats_lock_{nullptr};
+  IoStats io_stats_[IO_PRIORITY_COUNT]{};
+#endif
+#ifdef USE_HOST
+  uint32_t host_op_latency_us_{0};
+  uint32_t host_read_bytes_per_s_{0};
+  uint32_t host_write_bytes_per_s_{0};
+  std::atomic<uint8_t> host_fault_{HOST_FAULT_NONE};
+  std::atomic<int32_t> host_fault_countdown_{-1};
+#endif
+  PathLockTable locks_;
+  HandlePool handles_;
+  uint8_t max_files_{DEFAULT_MAX_FILES};
+  size_t stream_buffer_size_{0};
+  // There is a single replace journal, replacements run one at a time
+  std::mutex replace_mutex_;
+  LinkMapCache link_maps_;
+  DirectoryCache directories_;
+  StatCache stats_;
+  size_t fast_seek_min_size_{0};
+  size_t block_cache_size_{0};
+  size_t block_cache_read_ahead_{0};
+  size_t trim_batch_size_{0};
+  std::string ring_log_path_;
+  size_t ring_log_size_{0};
+  size_t ring_log_buffer_size_{0};
+#ifdef USE_ESP_IDF
+  std::unique_ptr<BlockCache> block_cache_;
+  std::unique_ptr<TrimQueue> trim_queue_;
+  std::unique_ptr<RingLog> ring_log_;
+  std::atomic<bool> trim_running_{false};
+#endif
+
+  BenchmarkConfig benchmark_config_;
+  BenchmarkResult benchmark_result_;
+  // Written by the benchmark task, moved to benchmark_result_ by the main loop
+  BenchmarkResult benchmark_pending_;
+  std::atomic<bool> benchmark_running_{false};
+  std::atomic<bool> benchmark_done_{false};
+  CallbackManager<void(std::string const &)> benchmark_callback_;
+
+  uint32_t format_cluster_size_{0};
+  FormatResult format_result_;
+  std::atomic<bool> format_running_{false};
+  // Exports queued or running on the I/O worker, they keep the ring log open
+  std::atomic<uint8_t> ring_log_exports_{0};
+  std::atomic<bool> format_done_{false};
+  CallbackManager<void(std::string const &)> format_callback_;
 
 #ifdef USE_ESP_IDF
-  sdmmc_card_t *card_;
+  sdmmc_card_t *card_{nullptr};
+  /* FatFs logical drive of the card, "0:" */
+  std::string fatfs_drive_;
 #endif
 #ifdef USE_SENSOR
   std::vector<FileSizeSensor> file_size_sensors_{};
 #endif
   void update_sensors();
+  /* Existence and type of a path from the directory cache, reading the missing parent listings. */
+  DirectoryCache::Lookup lookup_entry_(std::string const &path);
+  /* Drops what the caches know about a path, called around every mutation. */
+  void invalidate_caches_(std::string const &path);
+  /* Installs a pooled buffer on a freshly opened stream, buffer is nullptr when the default one is kept. */
+  void buffer_stream_(FILE *file, uint8_t *&buffer, size_t &size);
+  /* Backend opens, the caller holds a slot of the handle pool. */
+  FileReader open_reader_(const char *path, uint32_t timeout_ms);
+  FileWriter open_writer_(const char *path, const char *mode);
+  /* Opens a stdio stream on a card path, the backend maps it to the mount point. */
+  FILE *open_stream_(std::string const &path, const char *mode);
+  /* Pushes a flushed stream down to the card. */
+  bool sync_stream_(FILE *file);
+  /* Removes the target and renames the synced temporary file over it. */
+  bool commit_replace_(std::string const &path, std::string const &temp);
+  /* Finishes or drops the replacement recorded in the journal, if any. */
+  void recover_replace_();
+  static bool start_task_(void (*task)(void *), const char *name, uint32_t stack_size, void *arg, uint8_t priority);
+  static void end_task_();
+  /* Full free space scan, walks the FAT and may take seconds on large cards. Only reads the state of the
+   * component, the result is applied by publish_free_space_scan_(). */
+  bool scan_free_space_(uint32_t &cluster_size, uint32_t &total_clusters, uint32_t &free_clusters);
+  void start_free_space_scan_();
+  static void free_space_scan_task_(void *arg);
+  void publish_free_space_scan_();
+  /* Write and read back a test pattern on the freshly mounted card, false on mismatch or I/O error. */
+  bool verify_bus_(float &read_speed);
+  bool write_bus_probe_();
+  void set_bus_mode_(uint8_t width, uint32_t freq_khz, bool ddr, float read_speed);
+  void setup_io_worker_();
+  static void benchmark_task_(void *arg);
+  void publish_benchmark_();
+  /* Backend format, leaves the ring log alone. */
+  FormatResult format_(uint32_t cluster_size);
+  static void format_task_(void *arg);
+  void publish_format_();
+  static void io_task_loop_(void *arg);
+  void adjust_free_space_(size_t old_size, size_t new_size);
+  void adjust_free_clusters_(int32_t delta);
+  size_t size_to_clusters_(size_t size) const;
 #ifdef USE_ESP32_FRAMEWORK_ARDUINO
   std::string sd_card_type_to_string(int) const;
 #endif
 #ifdef USE_ESP_IDF
   std::string sd_card_type() const;
 #endif
-  std::vector<FileInfo> &list_directory_file_info_rec(const char *path, uint8_t depth, std::vector<FileInfo> &list);
+  /* Enumeration under the lock of the caller, fills the directory cache. */
+  bool enumerate_(std::string &dir_path, uint8_t depth, DirectoryCallback const &callback);
+  bool for_each_entry_rec_(std::string &path, uint8_t depth, DirectoryCallback const &callback);
+  /* Backend stat of a card path, without cache. */
+  bool stat_(std::string const &path, FileInfo &info);
+  /* Backend contiguous allocation of a card path, false when unsupported or no extent is large enough. */
+  bool preallocate_(std::string const &path, size_t size);
+#ifdef USE_ESP_IDF
+  FileReader open_fast_seek_reader_(const char *path, PathLock lock);
+  /* Queues the clusters of a file about to be deleted or truncated, the caller holds its exclusive lock. */
+  std::vector<TrimQueue::Range> queue_trim_(std::string const &path);
+  /* Erases the queued ranges on the I/O worker, or on a task of its own without one, unless a pass is
+   * already running. */
+  void start_trim_();
+  static void trim_task_(void *arg);
+  void run_trim_();
+  /* Allocates the ring log region on first boot and recovers the log. */
+  void setup_ring_log_();
+  /* Flushes and closes the ring log, from the main loop which appends to it. */
+  void close_ring_log_();
+  /* Sector access bypassing FatFs, the block cache and the trim queue are kept coherent. */
+  bool write_raw_sectors_(const uint8_t *buffer, uint32_t sector, uint32_t count);
+  bool read_raw_sectors_(uint8_t *buffer, uint32_t sector, uint32_t count);
+#endif
   static std::string error_code_to_string(ErrorCode);
 };
 
@@ -131,6 +1076,22 @@ template<typename... Ts> class SdMmcWriteFileAction : public Action<Ts...> {
   SdMmc *parent_;
 };
 
+template<typename... Ts> class SdMmcReplaceFileAction : public Action<Ts...> {
+ public:
+  SdMmcReplaceFileAction(SdMmc *parent) : parent_(parent) {}
+  TEMPLATABLE_VALUE(std::string, path)
+  TEMPLATABLE_VALUE(std::vector<uint8_t>, data)
+
+  void play(Ts... x) {
+    auto path = this->path_.value(x...);
+    auto buffer = this->data_.value(x...);
+    this->parent_->replace_file(path.c_str(), buffer.data(), buffer.size());
+  }
+
+ protected:
+  SdMmc *parent_;
+};
+
 template<typename... Ts> class SdMmcAppendFileAction : public Action<Ts...> {
  public:
   SdMmcAppendFileAction(SdMmc *parent) : parent_(parent) {}
@@ -189,10 +1150,94 @@ template<typename... Ts> class SdMmcDeleteFileAction : public Action<Ts...> {
   SdMmc *parent_;
 };
 
+template<typename... Ts> class SdMmcBenchmarkAction : public Action<Ts...> {
+ public:
+  SdMmcBenchmarkAction(SdMmc *parent) : parent_(parent) {}
+  TEMPLATABLE_VALUE(std::string, path)
+  TEMPLATABLE_VALUE(uint32_t, file_size)
+  TEMPLATABLE_VALUE(uint32_t, random_ops)
+  void set_buffer_sizes(std::vector<size_t> const &sizes) { this->buffer_sizes_ = sizes; }
+
+  void play(Ts... x) {
+    BenchmarkConfig config;
+    if (this->path_.has_value())
+      config.path = this->path_.value(x...);
+    if (this->file_size_.has_value())
+      config.file_size = this->file_size_.value(x...);
+    if (this->random_ops_.has_value())
+      config.random_ops = this->random_ops_.value(x...);
+    if (!this->buffer_sizes_.empty())
+      config.buffer_sizes = this->buffer_sizes_;
+    this->parent_->start_benchmark(config);
+  }
+
+ protected:
+  SdMmc *parent_;
+  std::vector<size_t> buffer_sizes_;
+};
+
+class BenchmarkTrigger : public Trigger<std::string> {
+ public:
+  explicit BenchmarkTrigger(SdMmc *parent) {
+    parent->add_on_benchmark_callback([this](std::string const &json) { this->trigger(json); });
+  }
+};
+
+template<typename... Ts> class SdMmcRingLogAppendAction : public Action<Ts...> {
+ public:
+  SdMmcRingLogAppendAction(SdMmc *parent) : parent_(parent) {}
+  TEMPLATABLE_VALUE(std::vector<uint8_t>, data)
+
+  void play(Ts... x) {
+    auto buffer = this->data_.value(x...);
+    this->parent_->append_ring_log(buffer.data(), buffer.size());
+  }
+
+ protected:
+  SdMmc *parent_;
+};
+
+template<typename... Ts> class SdMmcRingLogExportAction : public Action<Ts...> {
+ public:
+  SdMmcRingLogExportAction(SdMmc *parent) : parent_(parent) {}
+  TEMPLATABLE_VALUE(std::string, path)
+
+  void play(Ts... x) {
+    // Reads the whole log, kept off the main loop when the I/O worker runs
+    this->parent_->start_ring_log_export(this->path_.value(x...));
+  }
+
+ protected:
+  SdMmc *parent_;
+};
+
+template<typename... Ts> class SdMmcFormatAction : public Action<Ts...> {
+ public:
+  SdMmcFormatAction(SdMmc *parent) : parent_(parent) {}
+  TEMPLATABLE_VALUE(uint32_t, cluster_size)
+
+  void play(Ts... x) {
+    uint32_t cluster_size = this->cluster_size_.has_value() ? this->cluster_size_.value(x...) : 0;
+    this->parent_->start_format(cluster_size);
+  }
+
+ protected:
+  SdMmc *parent_;
+};
+
+class FormatTrigger : public Trigger<std::string> {
+ public:
+  explicit FormatTrigger(SdMmc *parent) {
+    parent->add_on_format_callback([this](std::string const &json) { this->trigger(json); });
+  }
+};
+
 long double convertBytes(uint64_t, MemoryUnits);
 std::string memory_unit_to_string(MemoryUnits);
 MemoryUnits memory_unit_from_size(size_t);
 std::string format_size(size_t);
+/* Fills st like the FAT VFS would for this entry, for servers working with struct stat. */
+void file_info_to_stat(FileInfo const &info, struct stat &st);
 
 }  // namespace sd_mmc_card
 }  // namespace esphome
@@ -0,0 +1,310 @@
+#include "sd_mmc_card.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+static const char *TAG = "sd_mmc_card.benchmark";
+static constexpr size_t RANDOM_IO_SIZE = 4096;
+
+void LatencyStats::finalize() { std::sort(this->samples.begin(), this->samples.end()); }
+
+uint32_t LatencyStats::percentile(float p) const {
+  if (this->samples.empty())
+    return 0;
+  size_t index = (size_t) (p / 100.0f * (this->samples.size() - 1) + 0.5f);
+  return this->samples[std::min(index, this->samples.size() - 1)];
+}
+
+float LatencyStats::mean() const {
+  if (this->samples.empty())
+    return 0;
+  uint64_t total = 0;
+  for (uint32_t sample : this->samples)
+    total += sample;
+  return (float) total / this->samples.size();
+}
+
+std::vector<uint32_t> LatencyStats::histogram() const {
+  std::vector<uint32_t> buckets;
+  for (uint32_t sample : this->samples) {
+    size_t bucket = 0;
+    while (sample > 1) {
+      sample >>= 1;
+      bucket++;
+    }
+    if (bucket >= buckets.size())
+      buckets.resize(bucket + 1, 0);
+    buckets[bucket]++;
+  }
+  return buckets;
+}
+
+float BenchmarkResult::best_read_mbps() const {
+  float best = 0;
+  for (auto const &result : this->sequential)
+    best = std::max(best, result.read_mbps);
+  return best;
+}
+
+float BenchmarkResult::best_write_mbps() const {
+  float best = 0;
+  for (auto const &result : this->sequential)
+    best = std::max(best, result.write_mbps);
+  return best;
+}
+
+static void append_latency_json(std::string &json, const char *name, LatencyStats const &stats) {
+  char buffer[160];
+  snprintf(buffer, sizeof(buffer),
+           "\"%s\":{\"count\":%zu,\"mean_us\":%.1f,\"p50_us\":%" PRIu32 ",\"p90_us\":%" PRIu32 ",\"p99_us\":%" PRIu32
+           ",\"max_us\":%" PRIu32 ",\"histogram\":[",
+           name, stats.samples.size(), stats.mean(), stats.percentile(50), stats.percentile(90),
+           stats.percentile(99), stats.percentile(100));
+  json += buffer;
+  std::vector<uint32_t> buckets = stats.histogram();
+  for (size_t i = 0; i < buckets.size(); i++) {
+    snprintf(buffer, sizeof(buffer), "%s%" PRIu32, i > 0 ? "," : "", buckets[i]);
+    json += buffer;
+  }
+  json += "]}";
+}
+
+std::string BenchmarkResult::to_json() const {
+  char buffer[96];
+  std::string json = "{\"ok\":";
+  json += this->ok ? "true" : "false";
+  json += ",\"sequential\":[";
+  for (size_t i = 0; i < this->sequential.size(); i++) {
+    auto const &result = this->sequential[i];
+    snprintf(buffer, sizeof(buffer), "%s{\"buffer_size\":%zu,\"read_mbps\":%.2f,\"write_mbps\":%.2f}",
+             i > 0 ? "," : "", result.buffer_size, result.read_mbps, result.write_mbps);
+    json += buffer;
+  }
+  snprintf(buffer, sizeof(buffer), "],\"random_read_iops\":%.1f,\"random_write_iops\":%.1f,", this->random_read_iops,
+           this->random_write_iops);
+  json += buffer;
+  append_latency_json(json, "random_read", this->random_read_latency);
+  json += ",";
+  append_latency_json(json, "random_write", this->random_write_latency);
+  json += ",";
+  append_latency_json(json, "fopen", this->fopen_latency);
+  json += ",";
+  append_latency_json(json, "stat", this->stat_latency);
+  json += ",";
+  append_latency_json(json, "readdir", this->readdir_latency);
+  json += "}";
+  return json;
+}
+
+float SdMmc::benchmark_sequential_read(std::string const &path, size_t buffer_size) {
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[buffer_size]);
+  if (!buffer) {
+    ESP_LOGE(TAG, "Failed to allocate %zu bytes benchmark buffer", buffer_size);
+    return 0;
+  }
+  PathLock lock = this->lock_path(path, false);
+  if (!lock.is_locked())
+    return 0;
+  FILE *file = this->open_stream_(path, "rb");
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open %s: %s", path.c_str(), strerror(errno));
+    return 0;
+  }
+  // The measured buffer size is the one reaching the VFS, not the stdio one
+  setvbuf(file, nullptr, _IONBF, 0);
+  size_t total = 0;
+  size_t len;
+  uint32_t start = micros();
+  while ((len = fread(buffer.get(), 1, buffer_size, file)) > 0)
+    total += len;
+  uint32_t elapsed = micros() - start;
+  fclose(file);
+  return elapsed > 0 ? (float) total / elapsed : 0;
+}
+
+static float benchmark_sequential_write(FILE *file, uint8_t *buffer, size_t buffer_size, size_t file_size) {
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to create benchmark file: %s", strerror(errno));
+    return 0;
+  }
+  setvbuf(file, nullptr, _IONBF, 0);
+  size_t total = 0;
+  uint32_t start = micros();
+  while (total < file_size) {
+    size_t len = std::min(buffer_size, file_size - total);
+    if (fwrite(buffer, 1, len, file) != len) {
+      ESP_LOGE(TAG, "Write failed: %s", strerror(errno));
+      fclose(file);
+      return 0;
+    }
+    total += len;
+  }
+  fsync(fileno(file));
+  uint32_t elapsed = micros() - start;
+  fclose(file);
+  return elapsed > 0 ? (float) total / elapsed : 0;
+}
+
+static float benchmark_random(FILE *file, uint8_t *buffer, size_t file_size, uint32_t ops, bool write,
+                              LatencyStats &latency) {
+  if (file == nullptr)
+    return 0;
+  setvbuf(file, nullptr, _IONBF, 0);
+  uint32_t blocks = file_size / RANDOM_IO_SIZE;
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < ops; i++) {
+    long offset = (long) (random_uint32() % blocks) * RANDOM_IO_SIZE;
+    uint32_t op_start = micros();
+    fseek(file, offset, SEEK_SET);
+    size_t len = write ? fwrite(buffer, 1, RANDOM_IO_SIZE, file) : fread(buffer, 1, RANDOM_IO_SIZE, file);
+    latency.add(micros() - op_start);
+    if (len != RANDOM_IO_SIZE) {
+      ESP_LOGE(TAG, "Random %s failed: %s", write ? "write" : "read", strerror(errno));
+      fclose(file);
+      return 0;
+    }
+  }
+  if (write)
+    fsync(fileno(file));
+  uint32_t elapsed = micros() - start;
+  fclose(file);
+  latency.finalize();
+  return elapsed > 0 ? ops * 1e6f / elapsed : 0;
+}
+
+BenchmarkResult SdMmc::run_benchmark(BenchmarkConfig const &config) {
+  BenchmarkResult result;
+  size_t max_buffer = RANDOM_IO_SIZE;
+  for (size_t size : config.buffer_sizes)
+    max_buffer = std::max(max_buffer, size);
+  if (config.file_size < RANDOM_IO_SIZE) {
+    ESP_LOGE(TAG, "Benchmark file size must be at least %zu bytes", RANDOM_IO_SIZE);
+    return result;
+  }
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[max_buffer]);
+  if (!buffer) {
+    ESP_LOGE(TAG, "Failed to allocate %zu bytes benchmark buffer", max_buffer);
+    return result;
+  }
+  for (size_t i = 0; i < max_buffer; i++)
+    buffer[i] = i & 0xFF;
+
+  std::string absolut_path = this->mount_point_ + config.path;
+  ESP_LOGI(TAG, "Benchmark on %s, %zu bytes", config.path.c_str(), config.file_size);
+  result.ok = true;
+  {
+    PathLock lock = this->lock_path(config.path, true);
+    if (!lock.is_locked()) {
+      result.ok = false;
+      return result;
+    }
+    for (size_t buffer_size : config.buffer_sizes) {
+      SequentialResult sequential{buffer_size, 0, 0};
+      sequential.write_mbps = benchmark_sequential_write(this->open_stream_(config.path, "wb"), buffer.get(), buffer_size, config.file_size);
+      lock.unlock();
+      sequential.read_mbps = this->benchmark_sequential_read(config.path, buffer_size);
+      lock = this->lock_path(config.path, true);
+      ESP_LOGI(TAG, "  Sequential %zu bytes: read %.2f MB/s, write %.2f MB/s", buffer_size, sequential.read_mbps,
+               sequential.write_mbps);
+      result.ok &= sequential.read_mbps > 0 && sequential.write_mbps > 0;
+      result.sequential.push_back(sequential);
+      if (!lock.is_locked())
+        return result;
+    }
+
+    result.random_read_iops = benchmark_random(this->open_stream_(config.path, "r+b"), buffer.get(), config.file_size,
+                                               config.random_ops, false, result.random_read_latency);
+    result.random_write_iops = benchmark_random(this->open_stream_(config.path, "r+b"), buffer.get(),
+                                                config.file_size, config.random_ops, true, result.random_write_latency);
+    ESP_LOGI(TAG, "  Random 4K: read %.1f IOPS (p99 %" PRIu32 " us), write %.1f IOPS (p99 %" PRIu32 " us)",
+             result.random_read_iops, result.random_read_latency.percentile(99), result.random_write_iops,
+             result.random_write_latency.percentile(99));
+
+    for (uint32_t i = 0; i < config.metadata_ops; i++) {
+      uint32_t start = micros();
+      FILE *file = this->open_stream_(config.path, "rb");
+      result.fopen_latency.add(micros() - start);
+      if (file != nullptr)
+        fclose(file);
+      struct stat info;
+      start = micros();
+      ::stat(absolut_path.c_str(), &info);
+      result.stat_latency.add(micros() - start);
+    }
+    remove(absolut_path.c_str());
+  }
+  // Listing the root takes a shared lock on it, the test file lock is released by now
+  for (uint32_t i = 0; i < std::max<uint32_t>(config.metadata_ops / 8, 1); i++) {
+    uint32_t start = micros();
+    this->for_each_entry("/", 0, [](FileInfo const &) { return true; });
+    result.readdir_latency.add(micros() - start);
+  }
+  result.fopen_latency.finalize();
+  result.stat_latency.finalize();
+  result.readdir_latency.finalize();
+  ESP_LOGI(TAG, "  Metadata: fopen %.0f us, stat %.0f us, readdir / %.0f us", result.fopen_latency.mean(),
+           result.stat_latency.mean(), result.readdir_latency.mean());
+  return result;
+}
+
+bool SdMmc::start_benchmark(BenchmarkConfig const &config) {
+  if (this->benchmark_running_.exchange(true)) {
+    ESP_LOGW(TAG, "Benchmark already running");
+    return false;
+  }
+  this->benchmark_config_ = config;
+  if (!SdMmc::start_task_(SdMmc::benchmark_task_, "sd_benchmark", 6144, this, 1)) {
+    ESP_LOGE(TAG, "Failed to start benchmark task");
+    this->benchmark_running_ = false;
+    return false;
+  }
+  return true;
+}
+
+void SdMmc::benchmark_task_(void *arg) {
+  SdMmc *sd = static_cast<SdMmc *>(arg);
+  BenchmarkResult result = sd->run_benchmark(sd->benchmark_config_);
+  // Handed over to the main loop, sensors and triggers are not thread safe
+  sd->benchmark_pending_ = std::move(result);
+  sd->benchmark_done_ = true;
+  SdMmc::end_task_();
+}
+
+void SdMmc::publish_benchmark_() {
+  if (!this->benchmark_done_.exchange(false))
+    return;
+  this->benchmark_result_ = std::move(this->benchmark_pending_);
+  this->benchmark_pending_ = BenchmarkResult();
+  BenchmarkResult const &result = this->benchmark_result_;
+#ifdef USE_SENSOR
+  if (this->benchmark_read_speed_sensor_ != nullptr)
+    this->benchmark_read_speed_sensor_->publish_state(result.best_read_mbps());
+  if (this->benchmark_write_speed_sensor_ != nullptr)
+    this->benchmark_write_speed_sensor_->publish_state(result.best_write_mbps());
+  if (this->benchmark_random_read_iops_sensor_ != nullptr)
+    this->benchmark_random_read_iops_sensor_->publish_state(result.random_read_iops);
+  if (this->benchmark_random_write_iops_sensor_ != nullptr)
+    this->benchmark_random_write_iops_sensor_->publish_state(result.random_write_iops);
+  if (this->benchmark_read_latency_p99_sensor_ != nullptr)
+    this->benchmark_read_latency_p99_sensor_->publish_state(result.random_read_latency.percentile(99) / 1000.0f);
+  if (this->benchmark_metadata_latency_sensor_ != nullptr)
+    this->benchmark_metadata_latency_sensor_->publish_state(result.stat_latency.mean() / 1000.0f);
+#endif
+  this->benchmark_callback_.call(result.to_json());
+  this->benchmark_running_ = false;
+}
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
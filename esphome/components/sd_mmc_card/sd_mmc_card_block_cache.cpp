@@ -0,0 +1,390 @@
+#include "sd_mmc_card.h"
+
+#ifdef USE_ESP_IDF
+#include <algorithm>
+#include <cstring>
+
+#include "esphome/core/log.h"
+#include "esp_heap_caps.h"
+#include "diskio_impl.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+static const char *TAG = "sd_mmc_card.cache";
+
+static constexpr uint32_t LINE_SECTORS = 8;
+// Requests of this many sectors or more bypass the cache, they are already efficient transfers
+static constexpr uint32_t BYPASS_SECTORS = 2 * LINE_SECTORS;
+
+// Largest transfer through the DMA buffer, which lives in internal memory
+static constexpr size_t MAX_DMA_BYTES = 128 * 1024;
+
+// The layer talks to the card through the public sdmmc API, not the diskio_sdmmc internals
+static sdmmc_card_t *cards[FF_VOLUMES];
+static BlockCache *caches[FF_VOLUMES];
+static TrimQueue *trim_queues[FF_VOLUMES];
+
+static DSTATUS card_status(BYTE pdrv) { return sdmmc_get_status(cards[pdrv]) == ESP_OK ? 0 : STA_NOINIT; }
+
+static DRESULT card_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+  return sdmmc_read_sectors(cards[pdrv], buff, sector, count) == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+static DRESULT card_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+  return sdmmc_write_sectors(cards[pdrv], buff, sector, count) == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+static DSTATUS cache_initialize(BYTE pdrv) { return card_status(pdrv); }
+
+static DSTATUS cache_status(BYTE pdrv) { return card_status(pdrv); }
+
+static DRESULT cache_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+  if (caches[pdrv] == nullptr)
+    return card_read(pdrv, buff, sector, count);
+  return caches[pdrv]->read(buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cache_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+  // A freed cluster given to a new file must not be erased after its data landed
+  if (trim_queues[pdrv] != nullptr)
+    trim_queues[pdrv]->cancel(sector, count);
+  if (caches[pdrv] == nullptr)
+    return card_write(pdrv, buff, sector, count);
+  return caches[pdrv]->write(buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT cache_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+  sdmmc_card_t *card = cards[pdrv];
+  switch (cmd) {
+    case CTRL_SYNC:
+      return caches[pdrv] != nullptr && !caches[pdrv]->flush() ? RES_ERROR : RES_OK;
+    case GET_SECTOR_COUNT:
+      *static_cast<LBA_t *>(buff) = card->csd.capacity;
+      return RES_OK;
+    case GET_SECTOR_SIZE:
+      *static_cast<WORD *>(buff) = card->csd.sector_size;
+      return RES_OK;
+#if FF_USE_TRIM
+    case CTRL_TRIM: {
+      LBA_t *range = static_cast<LBA_t *>(buff);
+      // Freed runs reported by FatFs join the queue instead of being erased inline
+      if (trim_queues[pdrv] != nullptr) {
+        trim_queues[pdrv]->add(range[0], range[1] - range[0] + 1);
+        return RES_OK;
+      }
+      if (sdmmc_can_trim(card) != ESP_OK)
+        return RES_PARERR;
+      return sdmmc_erase_sectors(card, range[0], range[1] - range[0] + 1, SDMMC_TRIM_ARG) == ESP_OK ? RES_OK
+                                                                                                   : RES_ERROR;
+    }
+#endif
+  }
+  return RES_PARERR;
+}
+
+bool install_disk_io(uint8_t pdrv, sdmmc_card_t *card, BlockCache *cache, TrimQueue *trim) {
+  if (pdrv >= FF_VOLUMES)
+    return false;
+  static const ff_diskio_impl_t impl = {
+      .init = &cache_initialize,
+      .status = &cache_status,
+      .read = &cache_read,
+      .write = &cache_write,
+      .ioctl = &cache_ioctl,
+  };
+  cards[pdrv] = card;
+  caches[pdrv] = cache;
+  trim_queues[pdrv] = trim;
+  if (ff_diskio_register(pdrv, &impl) != ESP_OK) {
+    cards[pdrv] = nullptr;
+    caches[pdrv] = nullptr;
+    trim_queues[pdrv] = nullptr;
+    return false;
+  }
+  return true;
+}
+
+BlockCache::~BlockCache() {
+  heap_caps_free(this->arena_);
+  heap_caps_free(this->dma_buffer_);
+}
+
+bool BlockCache::init(sdmmc_card_t *card, size_t arena_size, size_t max_read_ahead) {
+  this->card_ = card;
+  this->sector_size_ = card->csd.sector_size;
+  this->line_bytes_ = LINE_SECTORS * this->sector_size_;
+  size_t line_count = arena_size / this->line_bytes_;
+  // Whole lines only, the read-ahead window is also the largest transfer and sizes the DMA buffer
+  uint32_t max_dma_sectors = MAX_DMA_BYTES / this->sector_size_;
+  this->max_read_ahead_ =
+      std::min<uint32_t>(std::max<uint32_t>(max_read_ahead / this->sector_size_, LINE_SECTORS), max_dma_sectors);
+  this->max_read_ahead_ -= this->max_read_ahead_ % LINE_SECTORS;
+  this->dma_sectors_ = std::max(this->max_read_ahead_, BYPASS_SECTORS);
+  if (line_count < 2) {
+    ESP_LOGE(TAG, "Block cache needs at least %zu bytes", 2 * this->line_bytes_);
+    return false;
+  }
+
+  this->arena_ =
+      static_cast<uint8_t *>(heap_caps_malloc(line_count * this->line_bytes_, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+  if (this->arena_ == nullptr) {
+    ESP_LOGW(TAG, "No PSRAM for the block cache, using internal memory");
+    this->arena_ = static_cast<uint8_t *>(heap_caps_malloc(line_count * this->line_bytes_, MALLOC_CAP_8BIT));
+  }
+  this->dma_buffer_ =
+      static_cast<uint8_t *>(heap_caps_malloc(this->dma_sectors_ * this->sector_size_, MALLOC_CAP_DMA));
+  if (this->arena_ == nullptr || this->dma_buffer_ == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the block cache");
+    return false;
+  }
+  this->lines_.resize(line_count);
+  for (size_t i = 0; i < line_count; i++)
+    this->lines_[i].data = this->arena_ + i * this->line_bytes_;
+  this->read_ahead_ = LINE_SECTORS;
+  return true;
+}
+
+BlockCache::Line *BlockCache::find_(uint32_t base) {
+  for (auto &line : this->lines_) {
+    if (line.base == base) {
+      line.last_used = ++this->tick_;
+      return &line;
+    }
+  }
+  return nullptr;
+}
+
+BlockCache::Line *BlockCache::allocate_(uint32_t base) {
+  auto lru = std::min_element(this->lines_.begin(), this->lines_.end(),
+                              [](Line const &a, Line const &b) { return a.last_used < b.last_used; });
+  // Evicting dirty data writes back every dirty line, adjacent ones go out in the same transfer
+  if (lru->dirty != 0 && !this->flush_())
+    return nullptr;
+  lru->base = base;
+  lru->valid = 0;
+  lru->dirty = 0;
+  lru->last_used = ++this->tick_;
+  return &*lru;
+}
+
+bool BlockCache::transfer_(bool write, uint8_t *buffer, uint32_t sector, uint32_t count) {
+  // Through the DMA buffer, the driver would split a PSRAM buffer into single sector transfers
+  while (count > 0) {
+    uint32_t n = std::min(count, this->dma_sectors_);
+    esp_err_t err;
+    if (write) {
+      memcpy(this->dma_buffer_, buffer, n * this->sector_size_);
+      err = sdmmc_write_sectors(this->card_, this->dma_buffer_, sector, n);
+    } else {
+      err = sdmmc_read_sectors(this->card_, this->dma_buffer_, sector, n);
+      if (err == ESP_OK)
+        memcpy(buffer, this->dma_buffer_, n * this->sector_size_);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to %s %u sectors at %u: %s", write ? "write" : "read", (unsigned) n, (unsigned) sector,
+               esp_err_to_name(err));
+      return false;
+    }
+    buffer += n * this->sector_size_;
+    sector += n;
+    count -= n;
+  }
+  return true;
+}
+
+bool BlockCache::fetch_(uint32_t sector, uint32_t count) {
+  uint32_t capacity = this->card_->csd.capacity;
+  count = std::min(count, capacity - sector);
+  // Lines are taken before the transfer, an eviction may need the DMA buffer to write back
+  std::vector<Line *> lines;
+  for (uint32_t base = sector; base < sector + count; base += LINE_SECTORS) {
+    Line *line = this->find_(base);
+    if (line == nullptr)
+      line = this->allocate_(base);
+    if (line == nullptr)
+      return false;
+    lines.push_back(line);
+  }
+  esp_err_t err = sdmmc_read_sectors(this->card_, this->dma_buffer_, sector, count);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read %u sectors at %u: %s", (unsigned) count, (unsigned) sector, esp_err_to_name(err));
+    return false;
+  }
+  for (Line *line : lines) {
+    uint32_t n = std::min(LINE_SECTORS, sector + count - line->base);
+    // Sectors already cached are at least as recent as the card
+    for (uint32_t i = 0; i < n; i++) {
+      if (line->valid & (1u << i))
+        continue;
+      memcpy(line->data + i * this->sector_size_, this->dma_buffer_ + (line->base - sector + i) * this->sector_size_,
+             this->sector_size_);
+      line->valid |= 1u << i;
+    }
+  }
+  return true;
+}
+
+bool BlockCache::read(uint8_t *buffer, uint32_t sector, uint32_t count) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  // Adaptive read-ahead: doubles while the accesses are sequential
+  if (sector == this->next_sector_) {
+    this->read_ahead_ = std::min(this->read_ahead_ * 2, this->max_read_ahead_);
+  } else {
+    this->read_ahead_ = LINE_SECTORS;
+  }
+  this->next_sector_ = sector + count;
+
+  if (count >= BYPASS_SECTORS) {
+    if (!this->transfer_(false, buffer, sector, count))
+      return false;
+    // Dirty sectors are newer than the card
+    for (auto const &line : this->lines_) {
+      if (line.dirty == 0 || line.base + LINE_SECTORS <= sector || line.base >= sector + count)
+        continue;
+      for (uint32_t i = 0; i < LINE_SECTORS; i++) {
+        uint32_t s = line.base + i;
+        if ((line.dirty & (1u << i)) && s >= sector && s < sector + count)
+          memcpy(buffer + (s - sector) * this->sector_size_, line.data + i * this->sector_size_, this->sector_size_);
+      }
+    }
+    return true;
+  }
+
+  for (uint32_t s = sector; s < sector + count; s++) {
+    uint32_t base = s - s % LINE_SECTORS;
+    Line *line = this->find_(base);
+    if (line == nullptr || !(line->valid & (1u << (s - base)))) {
+      this->stats_.misses++;
+      uint32_t len = std::max(this->read_ahead_, sector + count - base);
+      len = std::min(len + LINE_SECTORS - 1 - (len + LINE_SECTORS - 1) % LINE_SECTORS, this->dma_sectors_);
+      // Never more than half the cache, a fetch must not evict its own lines
+      len = std::max<uint32_t>(std::min<uint32_t>(len, this->lines_.size() / 2 * LINE_SECTORS), LINE_SECTORS);
+      if (len > LINE_SECTORS)
+        this->stats_.read_ahead_sectors += len - LINE_SECTORS;
+      if (!this->fetch_(base, len))
+        return false;
+      line = this->find_(base);
+      if (line == nullptr)
+        return false;
+    } else {
+      this->stats_.hits++;
+    }
+    memcpy(buffer + (s - sector) * this->sector_size_, line->data + (s - base) * this->sector_size_,
+           this->sector_size_);
+  }
+  return true;
+}
+
+bool BlockCache::write(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  if (count >= BYPASS_SECTORS) {
+    // Written through, cached copies of these sectors are refreshed and become clean
+    for (auto &line : this->lines_) {
+      if (line.valid == 0 || line.base + LINE_SECTORS <= sector || line.base >= sector + count)
+        continue;
+      for (uint32_t i = 0; i < LINE_SECTORS; i++) {
+        uint32_t s = line.base + i;
+        if (s < sector || s >= sector + count)
+          continue;
+        memcpy(line.data + i * this->sector_size_, buffer + (s - sector) * this->sector_size_, this->sector_size_);
+        line.valid |= 1u << i;
+        line.dirty &= ~(1u << i);
+      }
+    }
+    return this->transfer_(true, const_cast<uint8_t *>(buffer), sector, count);
+  }
+
+  for (uint32_t s = sector; s < sector + count; s++) {
+    uint32_t base = s - s % LINE_SECTORS;
+    Line *line = this->find_(base);
+    if (line == nullptr)
+      line = this->allocate_(base);
+    if (line == nullptr)
+      return false;
+    memcpy(line->data + (s - base) * this->sector_size_, buffer + (s - sector) * this->sector_size_,
+           this->sector_size_);
+    line->valid |= 1u << (s - base);
+    line->dirty |= 1u << (s - base);
+  }
+  return true;
+}
+
+bool BlockCache::flush() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->flush_();
+}
+
+bool BlockCache::flush_() {
+  std::vector<Line *> dirty;
+  for (auto &line : this->lines_) {
+    if (line.dirty != 0)
+      dirty.push_back(&line);
+  }
+  if (dirty.empty())
+    return true;
+  std::sort(dirty.begin(), dirty.end(), [](Line *a, Line *b) { return a->base < b->base; });
+
+  // Runs of adjacent dirty sectors, across lines, are written in one transfer
+  uint32_t run_start = 0;
+  uint32_t run_len = 0;
+  auto write_run = [&]() {
+    if (run_len == 0)
+      return true;
+    esp_err_t err = sdmmc_write_sectors(this->card_, this->dma_buffer_, run_start, run_len);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to write back %u sectors at %u: %s", (unsigned) run_len, (unsigned) run_start,
+               esp_err_to_name(err));
+      return false;
+    }
+    this->stats_.written_back_sectors += run_len;
+    run_len = 0;
+    return true;
+  };
+  for (Line *line : dirty) {
+    for (uint32_t i = 0; i < LINE_SECTORS; i++) {
+      if (!(line->dirty & (1u << i)))
+        continue;
+      uint32_t s = line->base + i;
+      if (run_len > 0 && (s != run_start + run_len || run_len == this->dma_sectors_)) {
+        if (!write_run())
+          return false;
+      }
+      if (run_len == 0)
+        run_start = s;
+      memcpy(this->dma_buffer_ + run_len * this->sector_size_, line->data + i * this->sector_size_,
+             this->sector_size_);
+      run_len++;
+    }
+  }
+  if (!write_run())
+    return false;
+  for (Line *line : dirty)
+    line->dirty = 0;
+  return true;
+}
+
+void BlockCache::discard(uint32_t sector, uint32_t count) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  for (auto &line : this->lines_) {
+    if (line.base == UINT32_MAX || line.base + LINE_SECTORS <= sector || line.base >= sector + count)
+      continue;
+    for (uint32_t i = 0; i < LINE_SECTORS; i++) {
+      uint32_t s = line.base + i;
+      if (s >= sector && s < sector + count) {
+        line.valid &= ~(1u << i);
+        line.dirty &= ~(1u << i);
+      }
+    }
+  }
+}
+
+BlockCache::Stats BlockCache::get_stats() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->stats_;
+}
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
+
+#endif  // USE_ESP_IDF
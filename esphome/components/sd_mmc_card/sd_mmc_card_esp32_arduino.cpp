@@ -5,6 +5,9 @@
 #include "math.h"
 #include "esphome/core/log.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "SD_MMC.h"
 #include "FS.h"
 
@@ -12,6 +15,7 @@ namespace esphome {
 namespace sd_mmc_card {
 
 static const char *TAG = "sd_mmc_card_esp32_arduino";
+static const std::string MOUNT_POINT("/sdcard");
 
 void SdMmc::setup() {
   if (this->power_ctrl_pin_ != nullptr)
@@ -27,9 +31,42 @@ void SdMmc::setup() {
     return;
   }
 
-  bool beginResult = this->mode_1bit_ ? SD_MMC.begin("/sdcard", this->mode_1bit_) : SD_MMC.begin();
+  // Fastest first, every mode of a probe is verified before being kept. DDR50 is not available through SD_MMC.
+  std::vector<int> frequencies;
+  if (this->bus_speed_ != BUS_SPEED_DEFAULT)
+    frequencies.push_back(SDMMC_FREQ_HIGHSPEED);
+  if (this->bus_speed_ == BUS_SPEED_AUTO || this->bus_speed_ == BUS_SPEED_DEFAULT)
+    frequencies.push_back(SDMMC_FREQ_DEFAULT);
+  std::vector<bool> modes_1bit;
+  if (!this->mode_1bit_)
+    modes_1bit.push_back(false);
+  if (this->mode_1bit_ || this->bus_speed_ == BUS_SPEED_AUTO)
+    modes_1bit.push_back(true);
+  bool probe = frequencies.size() * modes_1bit.size() > 1;
+
+  bool beginResult = false;
+  bool probe_failed = false;
+  for (bool mode_1bit : modes_1bit) {
+    for (int frequency : frequencies) {
+      beginResult = SD_MMC.begin(MOUNT_POINT.c_str(), mode_1bit, false, frequency, this->max_files_);
+      if (!beginResult)
+        continue;
+      float read_speed = 0;
+      if (probe && !this->verify_bus_(read_speed)) {
+        ESP_LOGW(TAG, "%u-bit %d kHz mode is not reliable, falling back", mode_1bit ? 1 : 4, frequency);
+        SD_MMC.end();
+        beginResult = false;
+        probe_failed = true;
+        continue;
+      }
+      this->set_bus_mode_(mode_1bit ? 1 : 4, frequency, false, read_speed);
+      break;
+    }
+    if (beginResult)
+      break;
+  }
   if (!beginResult) {
-    this->init_error_ = ErrorCode::ERR_MOUNT;
+    this->init_error_ = probe_failed ? ErrorCode::ERR_BUS : ErrorCode::ERR_MOUNT;
     this->mark_failed();
     return;
   }
@@ -47,10 +84,16 @@ void SdMmc::setup() {
     return;
   }
 
-  update_sensors();
+  this->recover_replace_();
+  this->setup_io_worker_();
+  this->start_free_space_scan_();
 }
 
 void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return;
+  size_t old_size = SD_MMC.exists(path) ? this->file_size(path) : 0;
   File file = SD_MMC.open(path, mode);
   if (!file) {
     ESP_LOGE(TAG, "Failed to open file for writing");
@@ -59,83 +102,128 @@ void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len, cons
 
   file.write(buffer, len);
   file.close();
-  this->update_sensors();
+  this->adjust_free_space_(old_size, mode[0] == 'a' ? old_size + len : len);
 }
 
 bool SdMmc::create_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
   ESP_LOGV(TAG, "Create directory: %s", path);
   if (!SD_MMC.mkdir(path)) {
     ESP_LOGE(TAG, "Failed to create directory");
     return false;
   }
-  this->update_sensors();
+  this->adjust_free_clusters_(-1);
   return true;
 }
 
 bool SdMmc::remove_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
   ESP_LOGV(TAG, "Remove directory: %s", path);
   if (!SD_MMC.rmdir(path)) {
     ESP_LOGE(TAG, "Failed to remove directory");
     return false;
   }
-  this->update_sensors();
+  this->adjust_free_clusters_(1);
   return true;
 }
 
 bool SdMmc::delete_file(const char *path) {
-  ESP_LOGV(TAG, "Delete File: %s", path);
-  if (!SD_MMC.remove(path)) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  return this->remove_file(path);
+}
+
+bool SdMmc::remove_file(std::string const &path) {
+  std::string key = this->card_path(path);
+  ESP_LOGV(TAG, "Delete File: %s", key.c_str());
+  size_t old_size = this->file_size(key.c_str());
+  if (!SD_MMC.remove(key.c_str())) {
     ESP_LOGE(TAG, "failed to remove file");
     return false;
   }
-  this->update_sensors();
+  this->adjust_free_space_(old_size, 0);
   return true;
 }
 
-std::vector<uint8_t> SdMmc::read_file(char const *path) {
-  ESP_LOGV(TAG, "Read File: %s", path);
-  File file = SD_MMC.open(path);
-  if (!file) {
-    ESP_LOGE(TAG, "Failed to open file for reading");
-    return std::vector<uint8_t>();
+FileWriter SdMmc::open_writer_(const char *path, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return FileWriter();
+  ESP_LOGV(TAG, "Open write session: %s", path);
+  std::string absolut_path = MOUNT_POINT + path;
+  struct stat info;
+  size_t old_size = ::stat(absolut_path.c_str(), &info) == 0 ? info.st_size : 0;
+  FILE *file = this->open_stream_(path, mode);
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open file for writing");
+    return FileWriter();
   }
+  return FileWriter(this, file, old_size, mode[0] == 'a' ? old_size : 0, this->cluster_size_, std::move(lock));
+}
 
-  std::vector<uint8_t> res;
-  res.reserve(file.size());
-  while (file.available()) {
-    res.push_back(file.read());
-  }
-  return res;
+FILE *SdMmc::open_stream_(std::string const &path, const char *mode) {
+  // SD_MMC registers the card in the VFS, plain stdio gives positional reads without the File wrapper
+  return fopen((MOUNT_POINT + path).c_str(), mode);
 }
 
-std::vector<FileInfo> &SdMmc::list_directory_file_info_rec(const char *path, uint8_t depth,
-                                                           std::vector<FileInfo> &list) {
-  ESP_LOGV(TAG, "Listing directory file info: %s\n", path);
+bool SdMmc::sync_stream_(FILE *file) { return fsync(fileno(file)) == 0; }
 
-  File root = SD_MMC.open(path);
+FileReader SdMmc::open_reader_(const char *path, uint32_t timeout_ms) {
+  PathLock lock = this->lock_path(path, false, timeout_ms);
+  if (!lock.is_locked())
+    return FileReader();
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached == DirectoryCache::LOOKUP_MISSING || cached == DirectoryCache::LOOKUP_DIRECTORY)
+    return FileReader();
+  FILE *file = this->open_stream_(path, "rb");
+  if (file == nullptr)
+    return FileReader();
+  struct stat info;
+  if (fstat(fileno(file), &info) < 0) {
+    ESP_LOGE(TAG, "Failed to stat file: %s", strerror(errno));
+    fclose(file);
+    return FileReader();
+  }
+  return FileReader(file, info.st_size, std::move(lock));
+}
+
+bool SdMmc::for_each_entry_rec_(std::string &path, uint8_t depth, DirectoryCallback const &callback) {
+  File root = SD_MMC.open(path.empty() ? "/" : path.c_str());
   if (!root) {
     ESP_LOGE(TAG, "Failed to open directory");
-    return list;
+    return false;
   }
   if (!root.isDirectory()) {
     ESP_LOGE(TAG, "Not a directory");
-    return list;
+    return false;
   }
 
+  const size_t path_len = path.size();
+  bool ok = true;
   File file = root.openNextFile();
-  while (file) {
-    list.emplace_back(file.path(), file.size(), file.isDirectory());
-    if (file.isDirectory()) {
-      if (depth) {
-        list_directory_file_info_rec(file.path(), depth - 1, list);
-      }
-    }
-    file = root.openNextFile();
+  while (file && ok) {
+    bool is_dir = file.isDirectory();
+    path.append("/").append(file.name());
+    ok = callback(FileInfo(path, is_dir ? 0 : file.size(), is_dir, file.getLastWrite(), 0));
+    file.close();
+    if (ok && is_dir && depth)
+      ok = this->for_each_entry_rec_(path, depth - 1, callback);
+    path.resize(path_len);
+    if (ok)
+      file = root.openNextFile();
   }
-  return list;
+  return ok;
 }
 
 bool SdMmc::is_directory(const char *path) {
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached != DirectoryCache::LOOKUP_UNKNOWN)
+    return cached == DirectoryCache::LOOKUP_DIRECTORY;
   File root = SD_MMC.open(path);
   if (!root) {
     ESP_LOGE(TAG, "Failed to open directory");
@@ -144,6 +232,25 @@ bool SdMmc::is_directory(const char *path) {
   return root.isDirectory();
 }
 
+bool SdMmc::stat_(std::string const &path, FileInfo &info) {
+  File file = SD_MMC.open(path.c_str());
+  if (!file)
+    return false;
+  bool is_dir = file.isDirectory();
+  info = FileInfo(path, is_dir ? 0 : file.size(), is_dir, file.getLastWrite(), 0);
+  return true;
+}
+
+bool SdMmc::preallocate_(std::string const &path, size_t size) {
+  // SD_MMC does not expose the FatFs drive of the card
+  return false;
+}
+
+FormatResult SdMmc::format_(uint32_t cluster_size) {
+  ESP_LOGE(TAG, "Format is only supported with ESP-IDF");
+  return FormatResult();
+}
+
 size_t SdMmc::file_size(const char *path) {
   File file = SD_MMC.open(path);
   return file.size();
@@ -165,22 +272,16 @@ std::string SdMmc::sd_card_type_to_string(int type) const {
   }
 }
 
-void SdMmc::update_sensors() {
-#ifdef USE_SENSOR
-  uint64_t used_bytes = SD_MMC.usedBytes();
+bool SdMmc::scan_free_space_(uint32_t &cluster_size, uint32_t &total_clusters, uint32_t &free_clusters) {
   uint64_t total_bytes = SD_MMC.totalBytes();
-  if (this->used_space_sensor_ != nullptr)
-    this->used_space_sensor_->publish_state(used_bytes);
-  if (this->total_space_sensor_ != nullptr)
-    this->total_space_sensor_->publish_state(total_bytes);
-  if (this->free_space_sensor_ != nullptr)
-    this->free_space_sensor_->publish_state(total_bytes - used_bytes);
-
-  for (auto &sensor : this->file_size_sensors_) {
-    if (sensor.sensor != nullptr)
-      sensor.sensor->publish_state(this->file_size(sensor.path));
-  }
-#endif
+  if (total_bytes == 0)
+    return false;
+  uint64_t used_bytes = SD_MMC.usedBytes();
+  // The Arduino API does not expose the cluster size
+  cluster_size = this->cluster_size_;
+  total_clusters = total_bytes / cluster_size;
+  free_clusters = (total_bytes - used_bytes) / cluster_size;
+  return true;
 }
 
 }  // namespace sd_mmc_card
@@ -1,62 +1,118 @@
 #include "sd_mmc_card.h"
 
 #ifdef USE_ESP_IDF
+#include <algorithm>
+#include <unistd.h>
 #include "math.h"
 #include "esphome/core/log.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
+#include "diskio_sdmmc.h"
+#include "ff.h"
 #include "sdmmc_cmd.h"
 #include "driver/sdmmc_host.h"
 #include "driver/sdmmc_types.h"
+#include "esp_heap_caps.h"
 
 int constexpr SD_OCR_SDHC_CAP = (1 << 30);  // value defined in esp-idf/components/sdmmc/include/sd_protocol_defs.h
 
 namespace esphome {
 namespace sd_mmc_card {
 
-static constexpr size_t FILE_PATH_MAX = ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN;
 static const char *TAG = "sd_mmc_card";
 static const std::string MOUNT_POINT("/sdcard");
 
 std::string build_path(const char *path) { return MOUNT_POINT + path; }
 
+struct BusCandidate {
+  int freq_khz;
+  bool ddr;
+};
+
 void SdMmc::setup() {
   if (this->power_ctrl_pin_ != nullptr)
     this->power_ctrl_pin_->setup();
 
   esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-      .format_if_mount_failed = false, .max_files = 5, .allocation_unit_size = 16 * 1024};
-
-  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
-  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
-
-  if (this->mode_1bit_) {
-    slot_config.width = 1;
-  } else {
-    slot_config.width = 4;
+      .format_if_mount_failed = false, .max_files = this->max_files_, .allocation_unit_size = 16 * 1024};
+
+  // Fastest first, every mode of a probe is verified before being kept
+  std::vector<BusCandidate> speeds;
+  if (this->bus_speed_ == BUS_SPEED_AUTO || this->bus_speed_ == BUS_SPEED_DDR50) {
+#ifdef SDMMC_FREQ_DDR50
+    speeds.push_back({SDMMC_FREQ_DDR50, true});
+#else
+    if (this->bus_speed_ == BUS_SPEED_DDR50)
+      ESP_LOGW(TAG, "DDR50 is not supported by this ESP-IDF version, using high speed");
+#endif
   }
+  if (this->bus_speed_ != BUS_SPEED_DEFAULT)
+    speeds.push_back({SDMMC_FREQ_HIGHSPEED, false});
+  if (this->bus_speed_ == BUS_SPEED_AUTO || this->bus_speed_ == BUS_SPEED_DEFAULT)
+    speeds.push_back({SDMMC_FREQ_DEFAULT, false});
+  std::vector<uint8_t> widths;
+  if (!this->mode_1bit_)
+    widths.push_back(4);
+  if (this->mode_1bit_ || this->bus_speed_ == BUS_SPEED_AUTO)
+    widths.push_back(1);
+  bool probe = speeds.size() * widths.size() > 1;
+
+  esp_err_t ret = ESP_FAIL;
+  bool probe_failed = false;
+  for (uint8_t width : widths) {
+    for (auto const &speed : speeds) {
+      sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+      host.max_freq_khz = speed.freq_khz;
+      if (speed.ddr) {
+        host.flags |= SDMMC_HOST_FLAG_DDR;
+      } else {
+        host.flags &= ~SDMMC_HOST_FLAG_DDR;
+      }
+      sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+      slot_config.width = width;
 
 #ifdef SOC_SDMMC_USE_GPIO_MATRIX
-  slot_config.clk = static_cast<gpio_num_t>(this->clk_pin_);
-  slot_config.cmd = static_cast<gpio_num_t>(this->cmd_pin_);
-  slot_config.d0 = static_cast<gpio_num_t>(this->data0_pin_);
-
-  if (!this->mode_1bit_) {
-    slot_config.d1 = static_cast<gpio_num_t>(this->data1_pin_);
-    slot_config.d2 = static_cast<gpio_num_t>(this->data2_pin_);
-    slot_config.d3 = static_cast<gpio_num_t>(this->data3_pin_);
-  }
+      slot_config.clk = static_cast<gpio_num_t>(this->clk_pin_);
+      slot_config.cmd = static_cast<gpio_num_t>(this->cmd_pin_);
+      slot_config.d0 = static_cast<gpio_num_t>(this->data0_pin_);
+
+      if (width == 4) {
+        slot_config.d1 = static_cast<gpio_num_t>(this->data1_pin_);
+        slot_config.d2 = static_cast<gpio_num_t>(this->data2_pin_);
+        slot_config.d3 = static_cast<gpio_num_t>(this->data3_pin_);
+      }
 #endif
 
-  // Enable internal pullups on enabled pins. The internal pullups
-  // are insufficient however, please make sure 10k external pullups are
-  // connected on the bus. This is for debug / example purpose only.
-  slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+      // Enable internal pullups on enabled pins. The internal pullups
+      // are insufficient however, please make sure 10k external pullups are
+      // connected on the bus. This is for debug / example purpose only.
+      slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
 
-  auto ret = esp_vfs_fat_sdmmc_mount(MOUNT_POINT.c_str(), &host, &slot_config, &mount_config, &this->card_);
+      ret = esp_vfs_fat_sdmmc_mount(MOUNT_POINT.c_str(), &host, &slot_config, &mount_config, &this->card_);
+      if (ret != ESP_OK) {
+        ESP_LOGD(TAG, "Mount failed in %u-bit %d kHz mode: %s", width, speed.freq_khz, esp_err_to_name(ret));
+        continue;
+      }
+      float read_speed = 0;
+      if (probe && !this->verify_bus_(read_speed)) {
+        ESP_LOGW(TAG, "%u-bit %d kHz mode is not reliable, falling back", width, speed.freq_khz);
+        esp_vfs_fat_sdcard_unmount(MOUNT_POINT.c_str(), this->card_);
+        this->card_ = nullptr;
+        ret = ESP_ERR_INVALID_CRC;
+        probe_failed = true;
+        continue;
+      }
+      this->set_bus_mode_(width, this->card_->max_freq_khz, this->card_->is_ddr, read_speed);
+      break;
+    }
+    if (ret == ESP_OK)
+      break;
+  }
 
   if (ret != ESP_OK) {
-    if (ret == ESP_FAIL) {
+    if (probe_failed) {
+      this->init_error_ = ErrorCode::ERR_BUS;
+    } else if (ret == ESP_FAIL) {
       this->init_error_ = ErrorCode::ERR_MOUNT;
     } else {
       this->init_error_ = ErrorCode::ERR_NO_CARD;
@@ -65,20 +121,55 @@ void SdMmc::setup() {
     return;
   }
 
+  BYTE pdrv = ff_diskio_get_pdrv_card(this->card_);
+  this->fatfs_drive_ = {(char) ('0' + pdrv), ':'};
+
+  if (this->block_cache_size_ > 0) {
+    this->block_cache_.reset(new BlockCache());
+    if (!this->block_cache_->init(this->card_, this->block_cache_size_, this->block_cache_read_ahead_)) {
+      ESP_LOGE(TAG, "Failed to set up the block cache, running without it");
+      this->block_cache_.reset();
+    }
+  }
+  if (this->trim_batch_size_ > 0) {
+    this->trim_queue_.reset(new TrimQueue());
+    this->trim_queue_->init(this->card_);
+  }
+  if ((this->block_cache_ != nullptr || this->trim_queue_ != nullptr) &&
+      !install_disk_io(pdrv, this->card_, this->block_cache_.get(), this->trim_queue_.get())) {
+    ESP_LOGE(TAG, "Failed to install the disk I/O layer, running without block cache and trim");
+    this->block_cache_.reset();
+    this->trim_queue_.reset();
+  }
+
 #ifdef USE_TEXT_SENSOR
   if (this->sd_card_type_text_sensor_ != nullptr)
     this->sd_card_type_text_sensor_->publish_state(sd_card_type());
 #endif
 
-  update_sensors();
+  this->recover_replace_();
+  this->setup_ring_log_();
+  this->setup_io_worker_();
+  // f_getfree walks the whole FAT on a fresh mount, seed the free space counter off the main loop
+  this->start_free_space_scan_();
 }
 
 void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return;
   std::string absolut_path = build_path(path);
+  struct stat info;
+  size_t old_size = ::stat(absolut_path.c_str(), &info) == 0 ? info.st_size : 0;
+  std::vector<TrimQueue::Range> freed;
+  if (mode[0] == 'w' && old_size > 0)
+    freed = this->queue_trim_(path);
   FILE *file = NULL;
   file = fopen(absolut_path.c_str(), mode);
   if (file == NULL) {
     ESP_LOGE(TAG, "Failed to open file for writing");
+    if (this->trim_queue_ != nullptr)
+      this->trim_queue_->cancel(freed);
     return;
   }
   bool ok = fwrite(buffer, 1, len, file);
@@ -86,21 +177,27 @@ void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len, cons
     ESP_LOGE(TAG, "Failed to write to file");
   }
   fclose(file);
-  this->update_sensors();
+  this->adjust_free_space_(old_size, mode[0] == 'a' ? old_size + len : len);
 }
 
 bool SdMmc::create_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
   ESP_LOGV(TAG, "Create directory: %s", path);
   std::string absolut_path = build_path(path);
   if (mkdir(absolut_path.c_str(), 0777) < 0) {
     ESP_LOGE(TAG, "Failed to create a new directory: %s", strerror(errno));
     return false;
   }
-  this->update_sensors();
+  this->adjust_free_clusters_(-1);
   return true;
 }
 
 bool SdMmc::remove_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
   ESP_LOGV(TAG, "Remove directory: %s", path);
   if (!this->is_directory(path)) {
     ESP_LOGE(TAG, "Not a directory");
@@ -109,89 +206,203 @@ bool SdMmc::remove_directory(const char *path) {
   std::string absolut_path = build_path(path);
   if (remove(absolut_path.c_str()) != 0) {
     ESP_LOGE(TAG, "Failed to remove directory: %s", strerror(errno));
+    return false;
   }
-  this->update_sensors();
+  this->adjust_free_clusters_(1);
   return true;
 }
 
 bool SdMmc::delete_file(const char *path) {
-  ESP_LOGV(TAG, "Delete File: %s", path);
-  if (this->is_directory(path)) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  return this->remove_file(path);
+}
+
+bool SdMmc::remove_file(std::string const &path) {
+  std::string key = this->card_path(path);
+  ESP_LOGV(TAG, "Delete File: %s", key.c_str());
+  if (this->is_directory(key.c_str())) {
     ESP_LOGE(TAG, "Not a file");
     return false;
   }
-  std::string absolut_path = build_path(path);
+  std::string absolut_path = build_path(key.c_str());
+  struct stat info;
+  size_t old_size = ::stat(absolut_path.c_str(), &info) == 0 ? info.st_size : 0;
+  std::vector<TrimQueue::Range> freed = this->queue_trim_(key);
   if (remove(absolut_path.c_str()) != 0) {
     ESP_LOGE(TAG, "Failed to remove file: %s", strerror(errno));
+    if (this->trim_queue_ != nullptr)
+      this->trim_queue_->cancel(freed);
+    return false;
   }
-  this->update_sensors();
+  this->adjust_free_space_(old_size, 0);
+  // The erase pass runs on another task and waits for the caller to release the lock of the path
+  if (this->trim_queue_ != nullptr && this->trim_queue_->get_pending_bytes() >= this->trim_batch_size_)
+    this->start_trim_();
   return true;
 }
 
-std::vector<uint8_t> SdMmc::read_file(char const *path) {
-  ESP_LOGV(TAG, "Read File: %s", path);
-
+FileWriter SdMmc::open_writer_(const char *path, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return FileWriter();
+  ESP_LOGV(TAG, "Open write session: %s", path);
   std::string absolut_path = build_path(path);
-  FILE *file = nullptr;
-  file = fopen(absolut_path.c_str(), "rb");
+  struct stat info;
+  size_t old_size = ::stat(absolut_path.c_str(), &info) == 0 ? info.st_size : 0;
+  std::vector<TrimQueue::Range> freed;
+  if (mode[0] == 'w' && old_size > 0)
+    freed = this->queue_trim_(path);
+  FILE *file = this->open_stream_(path, mode);
   if (file == nullptr) {
-    ESP_LOGE(TAG, "Failed to open file for reading");
-    return std::vector<uint8_t>();
+    ESP_LOGE(TAG, "Failed to open file for writing");
+    if (this->trim_queue_ != nullptr)
+      this->trim_queue_->cancel(freed);
+    return FileWriter();
   }
+  return FileWriter(this, file, old_size, mode[0] == 'a' ? old_size : 0, this->cluster_size_, std::move(lock));
+}
 
-  std::vector<uint8_t> res;
-  size_t fileSize = this->file_size(path);
-  res.resize(fileSize);
-  size_t len = fread(res.data(), 1, fileSize, file);
-  fclose(file);
-  if (len < 0) {
-    ESP_LOGE(TAG, "Failed to read file: %s", strerror(errno));
-    return std::vector<uint8_t>();
+FILE *SdMmc::open_stream_(std::string const &path, const char *mode) {
+  return fopen((MOUNT_POINT + path).c_str(), mode);
+}
+
+bool SdMmc::sync_stream_(FILE *file) {
+  // f_sync writes the data, the FAT and the directory entry, dirty block cache lines included
+  return fsync(fileno(file)) == 0;
+}
+
+static constexpr size_t LINK_MAP_INITIAL_WORDS = 64;
+
+static LinkMapCache::Table allocate_link_map(size_t words) {
+  void *table = heap_caps_malloc(words * sizeof(DWORD), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (table == nullptr)
+    table = heap_caps_malloc(words * sizeof(DWORD), MALLOC_CAP_8BIT);
+  if (table == nullptr)
+    return nullptr;
+  return LinkMapCache::Table(static_cast<uint32_t *>(table), heap_caps_free);
+}
+
+FileReader SdMmc::open_fast_seek_reader_(const char *path, PathLock lock) {
+  std::unique_ptr<FIL> fil(new (std::nothrow) FIL);
+  if (!fil)
+    return FileReader();
+  std::string fatfs_path = this->fatfs_drive_ + path;
+  FRESULT res = f_open(fil.get(), fatfs_path.c_str(), FA_READ);
+  if (res != FR_OK) {
+    ESP_LOGE(TAG, "Failed to open %s: %d", path, res);
+    return FileReader();
   }
+  size_t size = f_size(fil.get());
+  if (size < this->fast_seek_min_size_)
+    return FileReader(fil.release(), size, nullptr, std::move(lock));
+
+  // The table only depends on the cluster chain, readers of the same file share it
+  std::string key = this->card_path(path);
+  LinkMapCache::Table table = this->link_maps_.get(key, fil->obj.sclust, size);
+  if (table == nullptr) {
+    size_t words = LINK_MAP_INITIAL_WORDS;
+    while (words * sizeof(DWORD) <= this->link_maps_.get_budget()) {
+      table = allocate_link_map(words);
+      if (table == nullptr)
+        break;
+      table.get()[0] = words;
+      fil->cltbl = table.get();
+      res = f_lseek(fil.get(), CREATE_LINKMAP);
+      if (res == FR_OK)
+        break;
+      fil->cltbl = nullptr;
+      // On FR_NOT_ENOUGH_CORE the first item holds the required size
+      size_t required = table.get()[0];
+      table.reset();
+      if (res != FR_NOT_ENOUGH_CORE || required <= words)
+        break;
+      words = required;
+    }
+    if (table == nullptr || !this->link_maps_.put(key, fil->obj.sclust, size, table, words)) {
+      ESP_LOGD(TAG, "No link map for %s, seeks follow the cluster chain", path);
+    } else {
+      ESP_LOGV(TAG, "Link map of %s: %u fragments", path, (unsigned) (table.get()[0] - 1) / 2);
+    }
+  }
+  fil->cltbl = table.get();
+  return FileReader(fil.release(), size, std::move(table), std::move(lock));
+}
 
-  return res;
+FileReader SdMmc::open_reader_(const char *path, uint32_t timeout_ms) {
+  PathLock lock = this->lock_path(path, false, timeout_ms);
+  if (!lock.is_locked())
+    return FileReader();
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached == DirectoryCache::LOOKUP_MISSING || cached == DirectoryCache::LOOKUP_DIRECTORY)
+    return FileReader();
+  if (this->fast_seek_min_size_ > 0)
+    return this->open_fast_seek_reader_(path, std::move(lock));
+  FILE *file = this->open_stream_(path, "rb");
+  if (file == nullptr)
+    return FileReader();
+  struct stat info;
+  if (fstat(fileno(file), &info) < 0) {
+    ESP_LOGE(TAG, "Failed to stat file: %s", strerror(errno));
+    fclose(file);
+    return FileReader();
+  }
+  return FileReader(file, info.st_size, std::move(lock));
 }
 
-std::vector<FileInfo> &SdMmc::list_directory_file_info_rec(const char *path, uint8_t depth,
-                                                           std::vector<FileInfo> &list) {
-  ESP_LOGV(TAG, "Listing directory file info: %s\n", path);
-  std::string absolut_path = build_path(path);
-  DIR *dir = opendir(absolut_path.c_str());
-  if (!dir) {
-    ESP_LOGE(TAG, "Failed to open directory: %s", strerror(errno));
-    return list;
-  }
-  char entry_absolut_path[FILE_PATH_MAX];
-  char entry_path[FILE_PATH_MAX];
-  const size_t dirpath_len = MOUNT_POINT.size();
-  size_t entry_path_len = strlen(path);
-  strlcpy(entry_path, path, sizeof(entry_path));
-  strlcpy(entry_path + entry_path_len, "/", sizeof(entry_path) - entry_path_len);
-  entry_path_len = strlen(entry_path);
-
-  strlcpy(entry_absolut_path, MOUNT_POINT.c_str(), sizeof(entry_absolut_path));
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    size_t file_size = 0;
-    strlcpy(entry_path + entry_path_len, entry->d_name, sizeof(entry_path) - entry_path_len);
-    strlcpy(entry_absolut_path + dirpath_len, entry_path, sizeof(entry_absolut_path) - dirpath_len);
-    if (entry->d_type != DT_DIR) {
-      struct stat info;
-      if (stat(entry_absolut_path, &info) < 0) {
-        ESP_LOGE(TAG, "Failed to stat file: %s '%s' %s", strerror(errno), entry->d_name, entry_absolut_path);
-      } else {
-        file_size = info.st_size;
-      }
+static time_t fatfs_time_to_time(WORD fdate, WORD ftime) {
+  if (fdate == 0)
+    return 0;
+  struct tm tm = {};
+  tm.tm_year = ((fdate >> 9) & 0x7F) + 80;
+  tm.tm_mon = ((fdate >> 5) & 0x0F) - 1;
+  tm.tm_mday = fdate & 0x1F;
+  tm.tm_hour = (ftime >> 11) & 0x1F;
+  tm.tm_min = (ftime >> 5) & 0x3F;
+  tm.tm_sec = (ftime & 0x1F) * 2;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+bool SdMmc::for_each_entry_rec_(std::string &path, uint8_t depth, DirectoryCallback const &callback) {
+  // Going through FatFs directly gives size, date and attributes with the directory entry,
+  // the VFS readdir would need a stat walking the full path for each of them
+  std::string fatfs_path = this->fatfs_drive_ + (path.empty() ? "/" : path);
+  FF_DIR dir;
+  FRESULT res = f_opendir(&dir, fatfs_path.c_str());
+  if (res != FR_OK) {
+    ESP_LOGE(TAG, "Failed to open directory %s: %d", path.c_str(), res);
+    return false;
+  }
+  const size_t path_len = path.size();
+  FILINFO info;
+  bool ok = true;
+  while (ok) {
+    res = f_readdir(&dir, &info);
+    if (res != FR_OK) {
+      ESP_LOGE(TAG, "Failed to read directory %s: %d", path.c_str(), res);
+      ok = false;
+      break;
     }
-    list.emplace_back(entry_path, file_size, entry->d_type == DT_DIR);
-    if (entry->d_type == DT_DIR && depth)
-      list_directory_file_info_rec(entry_absolut_path, depth - 1, list);
+    if (info.fname[0] == '\0')
+      break;
+    bool is_dir = info.fattrib & AM_DIR;
+    path.append("/").append(info.fname);
+    ok = callback(FileInfo(path, is_dir ? 0 : info.fsize, is_dir, fatfs_time_to_time(info.fdate, info.ftime),
+                           info.fattrib));
+    if (ok && is_dir && depth)
+      ok = this->for_each_entry_rec_(path, depth - 1, callback);
+    path.resize(path_len);
   }
-  closedir(dir);
-  return list;
+  f_closedir(&dir);
+  return ok;
 }
 
 bool SdMmc::is_directory(const char *path) {
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached != DirectoryCache::LOOKUP_UNKNOWN)
+    return cached == DirectoryCache::LOOKUP_DIRECTORY;
   std::string absolut_path = build_path(path);
   DIR *dir = opendir(absolut_path.c_str());
   if (dir) {
@@ -200,11 +411,138 @@ bool SdMmc::is_directory(const char *path) {
   return dir != nullptr;
 }
 
+bool SdMmc::stat_(std::string const &path, FileInfo &info) {
+  FILINFO fno;
+  FRESULT res = f_stat((this->fatfs_drive_ + path).c_str(), &fno);
+  if (res != FR_OK)
+    return false;
+  bool is_dir = fno.fattrib & AM_DIR;
+  info = FileInfo(path, is_dir ? 0 : fno.fsize, is_dir, fatfs_time_to_time(fno.fdate, fno.ftime), fno.fattrib);
+  return true;
+}
+
+std::vector<TrimQueue::Range> SdMmc::queue_trim_(std::string const &path) {
+  if (this->trim_queue_ == nullptr)
+    return {};
+  return this->trim_queue_->add_file(this->fatfs_drive_ + this->card_path(path));
+}
+
+void SdMmc::setup_ring_log_() {
+  if (this->ring_log_size_ == 0)
+    return;
+  this->ring_log_path_ = this->card_path(this->ring_log_path_);
+  std::string const &path = this->ring_log_path_;
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return;
+  FileInfo info;
+  if (!this->stat_(path, info) || info.size != this->ring_log_size_) {
+    ESP_LOGI(TAG, "Allocating ring log %s: %zu bytes", path.c_str(), this->ring_log_size_);
+    if (!this->preallocate(path, this->ring_log_size_)) {
+      ESP_LOGE(TAG, "No contiguous region of %zu bytes for the ring log", this->ring_log_size_);
+      return;
+    }
+  }
+  FIL fil;
+  if (f_open(&fil, (this->fatfs_drive_ + path).c_str(), FA_READ) != FR_OK) {
+    ESP_LOGE(TAG, "Failed to open ring log %s", path.c_str());
+    return;
+  }
+  std::vector<SectorRange> ranges;
+  bool mapped = get_file_sectors(&fil, ranges);
+  f_close(&fil);
+  if (!mapped || ranges.size() != 1) {
+    ESP_LOGE(TAG, "Ring log %s is not contiguous, delete it to allocate it again", path.c_str());
+    return;
+  }
+  // Raw writes do not wait for erase passes, nothing queued may cover the region
+  if (this->trim_queue_ != nullptr)
+    this->trim_queue_->cancel(ranges[0].sector, ranges[0].count);
+  this->ring_log_.reset(new RingLog());
+  if (!this->ring_log_->begin(this, this->card_, ranges[0].sector, ranges[0].count, this->ring_log_buffer_size_)) {
+    ESP_LOGE(TAG, "Failed to open ring log %s", path.c_str());
+    this->ring_log_.reset();
+  }
+}
+
+void SdMmc::close_ring_log_() {
+  if (this->ring_log_ == nullptr)
+    return;
+  this->ring_log_->flush();
+  this->ring_log_.reset();
+}
+
+bool SdMmc::write_raw_sectors_(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+  if (this->trim_queue_ != nullptr)
+    this->trim_queue_->cancel(sector, count);
+  if (this->block_cache_ != nullptr)
+    this->block_cache_->discard(sector, count);
+  esp_err_t err = sdmmc_write_sectors(this->card_, buffer, sector, count);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write %u sectors at %u: %s", (unsigned) count, (unsigned) sector, esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+bool SdMmc::read_raw_sectors_(uint8_t *buffer, uint32_t sector, uint32_t count) {
+  esp_err_t err = sdmmc_read_sectors(this->card_, buffer, sector, count);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read %u sectors at %u: %s", (unsigned) count, (unsigned) sector, esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+void SdMmc::start_trim_() {
+  if (this->trim_queue_ == nullptr || this->trim_queue_->get_pending_bytes() == 0 || this->trim_running_.exchange(true))
+    return;
+  // Without a worker submit_io() runs inline, the erase gets its own task instead of blocking the main loop
+  bool queued = this->has_io_worker() ? this->submit_io(IO_PRIORITY_BULK, [this]() { this->run_trim_(); })
+                                      : SdMmc::start_task_(SdMmc::trim_task_, "sd_trim", 4096, this, 1);
+  if (!queued) {
+    ESP_LOGE(TAG, "Failed to start trim");
+    this->trim_running_ = false;
+  }
+}
+
+void SdMmc::trim_task_(void *arg) {
+  static_cast<SdMmc *>(arg)->run_trim_();
+  SdMmc::end_task_();
+}
+
+void SdMmc::run_trim_() {
+  // Nothing may write or free clusters while the ranges are erased
+  PathLock lock = this->lock_volume();
+  if (lock.is_locked())
+    this->trim_queue_->erase(this->block_cache_.get());
+  this->trim_running_ = false;
+}
+
+bool SdMmc::preallocate_(std::string const &path, size_t size) {
+#if FF_USE_EXPAND
+  std::vector<TrimQueue::Range> freed = this->queue_trim_(path);
+  FIL fil;
+  FRESULT res = f_open(&fil, (this->fatfs_drive_ + path).c_str(), FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK) {
+    if (this->trim_queue_ != nullptr)
+      this->trim_queue_->cancel(freed);
+    return false;
+  }
+  // opt 1 allocates the extent now, f_expand fails with FR_DENIED when no free run is long enough
+  res = f_expand(&fil, size, 1);
+  f_close(&fil);
+  return res == FR_OK;
+#else
+  return false;
+#endif
+}
+
 size_t SdMmc::file_size(const char *path) {
   std::string absolut_path = build_path(path);
   struct stat info;
   size_t file_size = 0;
-  if (stat(absolut_path.c_str(), &info) < 0) {
+  if (::stat(absolut_path.c_str(), &info) < 0) {
     ESP_LOGE(TAG, "Failed to stat file: %s", strerror(errno));
     return -1;
   }
@@ -222,36 +560,114 @@ std::string SdMmc::sd_card_type() const {
   return "UNKNOWN";
 }
 
-void SdMmc::update_sensors() {
-#ifdef USE_SENSOR
+// Reported by most SDHC cards, used when the SD status has no allocation unit
+static constexpr uint32_t DEFAULT_ALLOCATION_UNIT = 4 * 1024 * 1024;
+static constexpr uint32_t MAX_AUTO_CLUSTER_SIZE = 32 * 1024;
+static constexpr size_t FORMAT_WORK_SIZE = 16 * 1024;
+
+FormatResult SdMmc::format_(uint32_t cluster_size) {
+  FormatResult result;
   if (this->card_ == nullptr)
-    return;
+    return result;
+  uint32_t sector_size = this->card_->csd.sector_size;
+  result.allocation_unit = this->card_->ssr.alloc_unit_kb * 1024;
+  if (result.allocation_unit == 0) {
+    ESP_LOGW(TAG, "No allocation unit in the SD status, assuming %" PRIu32 " bytes", DEFAULT_ALLOCATION_UNIT);
+    result.allocation_unit = DEFAULT_ALLOCATION_UNIT;
+  }
+  if (cluster_size == 0)
+    cluster_size = std::min(result.allocation_unit, MAX_AUTO_CLUSTER_SIZE);
+  if (cluster_size < sector_size || (cluster_size & (cluster_size - 1)) != 0) {
+    ESP_LOGE(TAG, "Invalid cluster size: %" PRIu32, cluster_size);
+    return result;
+  }
 
+  PathLock lock = this->lock_volume();
+  if (!lock.is_locked())
+    return result;
+  // Parked readers would point into the old file system
+  this->handles_.drop("/");
+  this->flush_cache();
+
+  size_t work_size = FORMAT_WORK_SIZE;
+  void *work = heap_caps_malloc(work_size, MALLOC_CAP_DMA);
+  if (work == nullptr) {
+    work_size = FF_MAX_SS;
+    work = heap_caps_malloc(work_size, MALLOC_CAP_DMA);
+  }
+  if (work == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the format buffer");
+    return result;
+  }
+
+  // The volume object registered by the VFS is mounted again on the new file system
   FATFS *fs;
-  DWORD fre_clust, fre_sect, tot_sect;
-  uint64_t total_bytes = -1, free_bytes = -1, used_bytes = -1;
-  auto res = f_getfree(MOUNT_POINT.c_str(), &fre_clust, &fs);
-  if (!res) {
-    tot_sect = (fs->n_fatent - 2) * fs->csize;
-    fre_sect = fre_clust * fs->csize;
+  DWORD free_clusters;
+  if (f_getfree(this->fatfs_drive_.c_str(), &free_clusters, &fs) != FR_OK) {
+    ESP_LOGE(TAG, "Failed to get the volume of %s", this->fatfs_drive_.c_str());
+    heap_caps_free(work);
+    return result;
+  }
+  ESP_LOGI(TAG, "Formatting the card: %" PRIu32 " bytes clusters, data area aligned on %" PRIu32 " bytes", cluster_size,
+           result.allocation_unit);
+  f_mount(nullptr, this->fatfs_drive_.c_str(), 0);
+  MKFS_PARM opt = {};
+  opt.fmt = FM_ANY;
+  opt.n_fat = 2;
+  opt.align = result.allocation_unit / sector_size;
+  opt.au_size = cluster_size;
+  FRESULT res = f_mkfs(this->fatfs_drive_.c_str(), &opt, work, work_size);
+  heap_caps_free(work);
+  if (res != FR_OK)
+    ESP_LOGE(TAG, "Failed to format the card: %d", res);
+  FRESULT mount_res = f_mount(fs, this->fatfs_drive_.c_str(), 1);
+  if (mount_res != FR_OK) {
+    ESP_LOGE(TAG, "Failed to mount the card after format: %d", mount_res);
+    return result;
+  }
 
-    total_bytes = static_cast<uint64_t>(tot_sect) * FF_SS_SDCARD;
-    free_bytes = static_cast<uint64_t>(fre_sect) * FF_SS_SDCARD;
-    used_bytes = total_bytes - free_bytes;
+  // Nothing cached about the old file system is valid any more
+  this->invalidate_caches_("/");
+  if (res != FR_OK)
+    return result;
+  result.ok = true;
+  result.cluster_size = fs->csize * sector_size;
+  result.data_offset = fs->database;
+  result.clusters = fs->n_fatent - 2;
+  result.fat_type = fs->fs_type;
+  // f_mkfs already took the FAT32 root directory, or the exFAT bitmap, up-case table and root directory
+  if (f_getfree(this->fatfs_drive_.c_str(), &free_clusters, &fs) != FR_OK)
+    free_clusters = 0;
+  this->cluster_size_ = result.cluster_size;
+  this->total_clusters_ = result.clusters;
+  this->free_clusters_ = free_clusters;
+  this->free_space_valid_ = free_clusters > 0;
+  // Those clusters are allocated from the start of the data area, everything past them holds no live data
+  if (this->trim_queue_ != nullptr && free_clusters > 0) {
+    uint32_t used_clusters = result.clusters - free_clusters;
+    this->trim_queue_->add(fs->database + used_clusters * fs->csize, free_clusters * fs->csize);
   }
+  ESP_LOGI(TAG, "Card formatted: FAT type %u, %" PRIu32 " clusters of %" PRIu32 " bytes, data at sector %" PRIu32 "%s",
+           result.fat_type, result.clusters, result.cluster_size, result.data_offset,
+           result.data_offset % opt.align == 0 ? "" : " (unaligned)");
+  return result;
+}
 
-  if (this->used_space_sensor_ != nullptr)
-    this->used_space_sensor_->publish_state(used_bytes);
-  if (this->total_space_sensor_ != nullptr)
-    this->total_space_sensor_->publish_state(total_bytes);
-  if (this->free_space_sensor_ != nullptr)
-    this->free_space_sensor_->publish_state(free_bytes);
+bool SdMmc::scan_free_space_(uint32_t &cluster_size, uint32_t &total_clusters, uint32_t &free_clusters) {
+  if (this->card_ == nullptr)
+    return false;
 
-  for (auto &sensor : this->file_size_sensors_) {
-    if (sensor.sensor != nullptr)
-      sensor.sensor->publish_state(this->file_size(sensor.path));
+  FATFS *fs;
+  DWORD fre_clust;
+  auto res = f_getfree(this->fatfs_drive_.c_str(), &fre_clust, &fs);
+  if (res != FR_OK) {
+    ESP_LOGE(TAG, "Failed to get free space: %d", res);
+    return false;
   }
-#endif
+  cluster_size = fs->csize * FF_SS_SDCARD;
+  total_clusters = fs->n_fatent - 2;
+  free_clusters = fre_clust;
+  return true;
 }
 
 }  // namespace sd_mmc_card
@@ -0,0 +1,356 @@
+#include "sd_mmc_card.h"
+
+#ifdef USE_HOST
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <unistd.h>
+
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+static const char *TAG = "sd_mmc_card_host";
+
+void SdMmc::setup() {
+  // The host root plays the role of the mounted card
+  struct stat info;
+  if (::stat(this->mount_point_.c_str(), &info) != 0 && mkdir(this->mount_point_.c_str(), 0755) != 0) {
+    ESP_LOGE(TAG, "Failed to create host root %s: %s", this->mount_point_.c_str(), strerror(errno));
+    this->init_error_ = ErrorCode::ERR_MOUNT;
+    this->mark_failed();
+    return;
+  }
+  this->bus_mode_ = "host";
+
+#ifdef USE_TEXT_SENSOR
+  if (this->sd_card_type_text_sensor_ != nullptr)
+    this->sd_card_type_text_sensor_->publish_state("HOST");
+  if (this->bus_mode_text_sensor_ != nullptr)
+    this->bus_mode_text_sensor_->publish_state(this->bus_mode_);
+#endif
+
+  this->recover_replace_();
+  this->setup_io_worker_();
+  this->start_free_space_scan_();
+}
+
+void SdMmc::set_host_timing(uint32_t op_latency_us, uint32_t read_bytes_per_s, uint32_t write_bytes_per_s) {
+  this->host_op_latency_us_ = op_latency_us;
+  this->host_read_bytes_per_s_ = read_bytes_per_s;
+  this->host_write_bytes_per_s_ = write_bytes_per_s;
+}
+
+void SdMmc::inject_host_fault(HostFault fault, uint32_t after_ops) {
+  this->host_fault_countdown_ = fault == HOST_FAULT_NONE ? -1 : (int32_t) after_ops;
+  this->host_fault_ = fault;
+}
+
+int SdMmc::simulate_host_io(size_t bytes, bool write) {
+  uint64_t delay_us = this->host_op_latency_us_;
+  uint32_t bandwidth = write ? this->host_write_bytes_per_s_ : this->host_read_bytes_per_s_;
+  if (bandwidth > 0)
+    delay_us += (uint64_t) bytes * 1000000 / bandwidth;
+  if (delay_us > 0)
+    std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+
+  if (this->host_fault_ == HOST_FAULT_NONE)
+    return 0;
+  if (this->host_fault_countdown_ > 0) {
+    this->host_fault_countdown_--;
+    return 0;
+  }
+  switch (this->host_fault_) {
+    case HOST_FAULT_ENOSPC:
+      return write ? ENOSPC : 0;
+    case HOST_FAULT_REMOVED:
+      return ENODEV;
+    case HOST_FAULT_EIO:
+    default:
+      return EIO;
+  }
+}
+
+#ifdef __GLIBC__
+// stdio streams going through the timing and fault model, so FileReader, FileWriter and the benchmark
+// see the simulated card
+struct HostStream {
+  SdMmc *parent;
+  FILE *file;
+};
+
+static ssize_t host_stream_read(void *cookie, char *buffer, size_t len) {
+  auto *stream = static_cast<HostStream *>(cookie);
+  int err = stream->parent->simulate_host_io(len, false);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  errno = 0;
+  size_t res = fread(buffer, 1, len, stream->file);
+  // 0 would read as end of file
+  if (res == 0 && ferror(stream->file)) {
+    clearerr(stream->file);
+    if (errno == 0)
+      errno = EIO;
+    return -1;
+  }
+  return res;
+}
+
+static ssize_t host_stream_write(void *cookie, const char *buffer, size_t len) {
+  auto *stream = static_cast<HostStream *>(cookie);
+  int err = stream->parent->simulate_host_io(len, true);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  size_t res = fwrite(buffer, 1, len, stream->file);
+  return res == 0 && len > 0 ? -1 : res;
+}
+
+static int host_stream_seek(void *cookie, off64_t *offset, int whence) {
+  auto *stream = static_cast<HostStream *>(cookie);
+  if (fseeko(stream->file, *offset, whence) != 0)
+    return -1;
+  *offset = ftello(stream->file);
+  return 0;
+}
+
+static int host_stream_close(void *cookie) {
+  auto *stream = static_cast<HostStream *>(cookie);
+  int res = fclose(stream->file);
+  delete stream;
+  return res;
+}
+#endif
+
+FILE *SdMmc::open_stream_(std::string const &path, const char *mode) {
+  int err = this->simulate_host_io(0, mode[0] != 'r');
+  if (err != 0) {
+    errno = err;
+    return nullptr;
+  }
+  FILE *file = fopen((this->mount_point_ + path).c_str(), mode);
+#ifdef __GLIBC__
+  if (file == nullptr)
+    return nullptr;
+  // The underlying stream keeps its own buffer, the simulated one sees the caller's I/O sizes
+  setvbuf(file, nullptr, _IONBF, 0);
+  cookie_io_functions_t functions = {host_stream_read, host_stream_write, host_stream_seek, host_stream_close};
+  FILE *stream = fopencookie(new HostStream{this, file}, mode, functions);
+  if (stream == nullptr)
+    fclose(file);
+  return stream;
+#else
+  return file;
+#endif
+}
+
+bool SdMmc::sync_stream_(FILE *file) {
+  // The wrapped stream is unbuffered, flushing the cookie stream already handed the data to the OS
+  return this->simulate_host_io(0, true) == 0;
+}
+
+static bool host_fail(int err, const char *what) {
+  errno = err;
+  ESP_LOGE(TAG, "%s: %s", what, strerror(err));
+  return false;
+}
+
+void SdMmc::write_file(const char *path, const uint8_t *buffer, size_t len, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return;
+  std::string absolut_path = this->mount_point_ + path;
+  struct stat info;
+  size_t old_size = ::stat(absolut_path.c_str(), &info) == 0 ? info.st_size : 0;
+  FILE *file = this->open_stream_(path, mode);
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open file for writing: %s", strerror(errno));
+    return;
+  }
+  if (fwrite(buffer, 1, len, file) != len)
+    ESP_LOGE(TAG, "Failed to write to file: %s", strerror(errno));
+  fclose(file);
+  this->adjust_free_space_(old_size, mode[0] == 'a' ? old_size + len : len);
+}
+
+bool SdMmc::create_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  ESP_LOGV(TAG, "Create directory: %s", path);
+  int err = this->simulate_host_io(0, true);
+  if (err != 0)
+    return host_fail(err, "Failed to create a new directory");
+  if (mkdir((this->mount_point_ + path).c_str(), 0755) < 0) {
+    ESP_LOGE(TAG, "Failed to create a new directory: %s", strerror(errno));
+    return false;
+  }
+  this->adjust_free_clusters_(-1);
+  return true;
+}
+
+bool SdMmc::remove_directory(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  ESP_LOGV(TAG, "Remove directory: %s", path);
+  int err = this->simulate_host_io(0, true);
+  if (err != 0)
+    return host_fail(err, "Failed to remove directory");
+  if (rmdir((this->mount_point_ + path).c_str()) != 0) {
+    ESP_LOGE(TAG, "Failed to remove directory: %s", strerror(errno));
+    return false;
+  }
+  this->adjust_free_clusters_(1);
+  return true;
+}
+
+bool SdMmc::delete_file(const char *path) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return false;
+  return this->remove_file(path);
+}
+
+bool SdMmc::remove_file(std::string const &path) {
+  std::string key = this->card_path(path);
+  ESP_LOGV(TAG, "Delete File: %s", key.c_str());
+  int err = this->simulate_host_io(0, true);
+  if (err != 0)
+    return host_fail(err, "Failed to remove file");
+  std::string absolut_path = this->mount_point_ + key;
+  struct stat info;
+  if (::stat(absolut_path.c_str(), &info) != 0 || S_ISDIR(info.st_mode)) {
+    ESP_LOGE(TAG, "Not a file");
+    return false;
+  }
+  if (unlink(absolut_path.c_str()) != 0) {
+    ESP_LOGE(TAG, "Failed to remove file: %s", strerror(errno));
+    return false;
+  }
+  this->adjust_free_space_(info.st_size, 0);
+  return true;
+}
+
+FileWriter SdMmc::open_writer_(const char *path, const char *mode) {
+  PathLock lock = this->lock_path(path, true);
+  if (!lock.is_locked())
+    return FileWriter();
+  ESP_LOGV(TAG, "Open write session: %s", path);
+  struct stat info;
+  size_t old_size = ::stat((this->mount_point_ + path).c_str(), &info) == 0 ? info.st_size : 0;
+  FILE *file = this->open_stream_(path, mode);
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open file for writing: %s", strerror(errno));
+    return FileWriter();
+  }
+  return FileWriter(this, file, old_size, mode[0] == 'a' ? old_size : 0, this->cluster_size_, std::move(lock));
+}
+
+FileReader SdMmc::open_reader_(const char *path, uint32_t timeout_ms) {
+  PathLock lock = this->lock_path(path, false, timeout_ms);
+  if (!lock.is_locked())
+    return FileReader();
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached == DirectoryCache::LOOKUP_MISSING || cached == DirectoryCache::LOOKUP_DIRECTORY)
+    return FileReader();
+  struct stat info;
+  if (::stat((this->mount_point_ + path).c_str(), &info) != 0 || S_ISDIR(info.st_mode))
+    return FileReader();
+  FILE *file = this->open_stream_(path, "rb");
+  if (file == nullptr)
+    return FileReader();
+  return FileReader(file, info.st_size, std::move(lock));
+}
+
+bool SdMmc::for_each_entry_rec_(std::string &path, uint8_t depth, DirectoryCallback const &callback) {
+  int err = this->simulate_host_io(0, false);
+  if (err != 0)
+    return host_fail(err, "Failed to open directory");
+  DIR *dir = opendir((this->mount_point_ + (path.empty() ? "/" : path)).c_str());
+  if (dir == nullptr) {
+    ESP_LOGE(TAG, "Failed to open directory %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  const size_t path_len = path.size();
+  bool ok = true;
+  struct dirent *entry;
+  while (ok && (entry = readdir(dir)) != nullptr) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    path.append("/").append(entry->d_name);
+    struct stat info;
+    if (::stat((this->mount_point_ + path).c_str(), &info) == 0) {
+      bool is_dir = S_ISDIR(info.st_mode);
+      ok = callback(FileInfo(path, is_dir ? 0 : info.st_size, is_dir, info.st_mtime, 0));
+      if (ok && is_dir && depth)
+        ok = this->for_each_entry_rec_(path, depth - 1, callback);
+    }
+    path.resize(path_len);
+  }
+  closedir(dir);
+  return ok;
+}
+
+bool SdMmc::is_directory(const char *path) {
+  DirectoryCache::Lookup cached = this->lookup_entry_(path);
+  if (cached != DirectoryCache::LOOKUP_UNKNOWN)
+    return cached == DirectoryCache::LOOKUP_DIRECTORY;
+  struct stat info;
+  return ::stat((this->mount_point_ + path).c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool SdMmc::stat_(std::string const &path, FileInfo &info) {
+  struct stat st;
+  if (this->simulate_host_io(0, false) != 0 || ::stat((this->mount_point_ + path).c_str(), &st) != 0)
+    return false;
+  bool is_dir = S_ISDIR(st.st_mode);
+  info = FileInfo(path, is_dir ? 0 : st.st_size, is_dir, st.st_mtime, 0);
+  return true;
+}
+
+bool SdMmc::preallocate_(std::string const &path, size_t size) {
+  // Extents are left to the host file system, writers take the plain path
+  return false;
+}
+
+FormatResult SdMmc::format_(uint32_t cluster_size) {
+  ESP_LOGE(TAG, "Format is not supported on the host, remove the files of the host root instead");
+  return FormatResult();
+}
+
+size_t SdMmc::file_size(const char *path) {
+  struct stat info;
+  if (this->simulate_host_io(0, false) != 0 || ::stat((this->mount_point_ + path).c_str(), &info) < 0) {
+    ESP_LOGE(TAG, "Failed to stat file: %s", strerror(errno));
+    return -1;
+  }
+  return info.st_size;
+}
+
+bool SdMmc::scan_free_space_(uint32_t &cluster_size, uint32_t &total_clusters, uint32_t &free_clusters) {
+  if (this->host_fault_ == HOST_FAULT_REMOVED && this->host_fault_countdown_ <= 0)
+    return false;
+  struct statvfs info;
+  if (statvfs(this->mount_point_.c_str(), &info) != 0) {
+    ESP_LOGE(TAG, "Failed to get free space: %s", strerror(errno));
+    return false;
+  }
+  cluster_size = info.f_frsize;
+  total_clusters = info.f_blocks;
+  free_clusters = info.f_bavail;
+  return true;
+}
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
+
+#endif  // USE_HOST
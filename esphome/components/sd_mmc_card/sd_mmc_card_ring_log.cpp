@@ -0,0 +1,275 @@
+#include "sd_mmc_card.h"
+
+#ifdef USE_ESP_IDF
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "esphome/core/log.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+static const char *TAG = "sd_mmc_card.ring_log";
+
+static constexpr uint32_t ID_MAGIC = 0x49524453;      // "SDRI"
+static constexpr uint32_t SECTOR_MAGIC = 0x4C524453;  // "SDRL"
+static constexpr uint32_t READ_SECTORS = 16;
+
+RingLog::~RingLog() { heap_caps_free(this->buffer_); }
+
+bool RingLog::begin(SdMmc *parent, sdmmc_card_t *card, uint32_t first_sector, uint32_t sector_count,
+                    size_t buffer_size) {
+  this->parent_ = parent;
+  this->card_ = card;
+  this->sector_size_ = card->csd.sector_size;
+  if (sector_count < 3) {
+    ESP_LOGE(TAG, "Region of %u sectors is too small", (unsigned) sector_count);
+    return false;
+  }
+  this->first_sector_ = first_sector;
+  this->sector_count_ = sector_count - 1;
+  this->buffer_sectors_ = std::max<uint32_t>(buffer_size / this->sector_size_, 1);
+  // Raw transfers from a non DMA buffer would be split into single sectors
+  this->buffer_ = static_cast<uint8_t *>(heap_caps_malloc(this->buffer_sectors_ * this->sector_size_, MALLOC_CAP_DMA));
+  if (this->buffer_ == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate %u sectors of buffer", (unsigned) this->buffer_sectors_);
+    return false;
+  }
+  return this->recover_();
+}
+
+uint32_t RingLog::crc_(const uint8_t *sector, uint16_t used) const {
+  uint32_t crc = esp_rom_crc32_le(0, sector, offsetof(SectorHeader, crc));
+  return esp_rom_crc32_le(crc, sector + sizeof(SectorHeader), used);
+}
+
+bool RingLog::parse_(const uint8_t *sector, uint32_t index, SectorHeader &header) const {
+  memcpy(&header, sector, sizeof(header));
+  if (header.magic != SECTOR_MAGIC || header.log_id != this->log_id_ || header.used > this->payload_size_())
+    return false;
+  if (header.sequence % this->sector_count_ != index)
+    return false;
+  return header.crc == this->crc_(sector, header.used);
+}
+
+bool RingLog::load_(uint32_t index, uint8_t *buffer, uint32_t &sequence) {
+  SectorHeader header;
+  if (!this->parent_->read_raw_sectors_(buffer, this->first_sector_ + 1 + index, 1) ||
+      !this->parse_(buffer, index, header))
+    return false;
+  sequence = header.sequence;
+  return true;
+}
+
+bool RingLog::recover_() {
+  uint8_t *scratch = this->buffer_;
+  if (!this->parent_->read_raw_sectors_(scratch, this->first_sector_, 1))
+    return false;
+  uint32_t id[4];
+  memcpy(id, scratch, sizeof(id));
+  if (id[0] != ID_MAGIC || id[2] != this->sector_count_ || id[3] != esp_rom_crc32_le(0, scratch, 12)) {
+    // A new id makes the sectors of any previous log in the region invalid
+    this->log_id_ = random_uint32();
+    this->next_sequence_ = 0;
+    memset(scratch, 0, this->sector_size_);
+    id[0] = ID_MAGIC;
+    id[1] = this->log_id_;
+    id[2] = this->sector_count_;
+    memcpy(scratch, id, 12);
+    id[3] = esp_rom_crc32_le(0, scratch, 12);
+    memcpy(scratch, id, sizeof(id));
+    if (!this->parent_->write_raw_sectors_(scratch, this->first_sector_, 1))
+      return false;
+    ESP_LOGI(TAG, "Started ring log %08" PRIx32 ", %u sectors", this->log_id_, (unsigned) this->sector_count_);
+    return true;
+  }
+  this->log_id_ = id[1];
+
+  // Sectors 0 to p hold the sequences first to first + p of the current pass, the following ones are older
+  // or were never written. The last written sector is found by bisection.
+  uint32_t first;
+  if (this->load_(0, scratch, first)) {
+    uint32_t lo = 0;
+    uint32_t hi = this->sector_count_ - 1;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo + 1) / 2;
+      uint32_t sequence;
+      if (this->load_(mid, scratch, sequence) && sequence == first + mid) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    this->next_sequence_ = first + lo + 1;
+  } else {
+    // Empty, or the write of sector 0 was cut right after a wrap
+    uint32_t last;
+    this->next_sequence_ = this->load_(this->sector_count_ - 1, scratch, last) ? last + 1 : 0;
+  }
+  ESP_LOGI(TAG, "Recovered ring log %08" PRIx32 ": %" PRIu64 " bytes, next sequence %" PRIu32, this->log_id_,
+           this->get_used_bytes(), this->next_sequence_);
+  return true;
+}
+
+uint64_t RingLog::get_capacity() const { return (uint64_t) this->sector_count_ * this->payload_size_(); }
+
+uint64_t RingLog::get_used_bytes() const {
+  uint32_t sectors = std::min(this->next_sequence_, this->sector_count_);
+  return (uint64_t) sectors * this->payload_size_();
+}
+
+bool RingLog::seal_() {
+  uint8_t *sector = this->sector_(this->sealed_);
+  SectorHeader header;
+  header.magic = SECTOR_MAGIC;
+  header.log_id = this->log_id_;
+  header.sequence = this->next_sequence_++;
+  header.used = this->open_used_;
+  header.first_record = this->open_first_record_;
+  memcpy(sector, &header, sizeof(header));
+  memset(sector + sizeof(header) + this->open_used_, 0, this->payload_size_() - this->open_used_);
+  header.crc = this->crc_(sector, header.used);
+  memcpy(sector, &header, sizeof(header));
+  this->sealed_++;
+  this->open_used_ = 0;
+  this->open_first_record_ = NO_RECORD;
+  if (this->sealed_ == this->buffer_sectors_)
+    return this->write_buffer_();
+  return true;
+}
+
+bool RingLog::write_buffer_() {
+  uint32_t sequence = this->next_sequence_ - this->sealed_;
+  uint32_t index = sequence % this->sector_count_;
+  uint32_t done = 0;
+  bool ok = true;
+  // Two transfers when the buffer crosses the end of the region
+  while (done < this->sealed_) {
+    uint32_t count = std::min(this->sealed_ - done, this->sector_count_ - index);
+    if (!this->parent_->write_raw_sectors_(this->sector_(done), this->first_sector_ + 1 + index, count)) {
+      // The sequences stay used, readers skip the gap
+      ok = false;
+      break;
+    }
+    done += count;
+    index = 0;
+  }
+  this->sealed_ = 0;
+  return ok;
+}
+
+bool RingLog::append(const uint8_t *data, size_t len) {
+  if (len > MAX_RECORD_SIZE || len + 2 > this->get_capacity() / 2) {
+    ESP_LOGE(TAG, "Record of %zu bytes is too large", len);
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  bool ok = true;
+  // The length prefix never spans two sectors
+  if (this->payload_size_() - this->open_used_ < 2)
+    ok = this->seal_();
+  if (this->open_first_record_ == NO_RECORD)
+    this->open_first_record_ = this->open_used_;
+  uint8_t *payload = this->sector_(this->sealed_) + sizeof(SectorHeader);
+  payload[this->open_used_++] = len & 0xFF;
+  payload[this->open_used_++] = len >> 8;
+  while (len > 0) {
+    if (this->open_used_ == this->payload_size_())
+      ok &= this->seal_();
+    payload = this->sector_(this->sealed_) + sizeof(SectorHeader);
+    size_t n = std::min(len, this->payload_size_() - this->open_used_);
+    memcpy(payload + this->open_used_, data, n);
+    this->open_used_ += n;
+    data += n;
+    len -= n;
+  }
+  return ok;
+}
+
+bool RingLog::flush() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  bool ok = true;
+  // The rest of a partial sector stays unused, sectors are never written twice
+  if (this->open_used_ > 0)
+    ok = this->seal_();
+  if (this->sealed_ > 0)
+    ok &= this->write_buffer_();
+  return ok;
+}
+
+bool RingLog::read(RecordCallback const &callback) {
+  if (!this->flush())
+    return false;
+  uint32_t end;
+  {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    end = this->next_sequence_;
+  }
+  uint8_t *scratch = static_cast<uint8_t *>(heap_caps_malloc(READ_SECTORS * this->sector_size_, MALLOC_CAP_DMA));
+  if (scratch == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the read buffer");
+    return false;
+  }
+
+  // Appends go on while reading, a sector overwritten meanwhile fails the sequence check and is skipped
+  std::vector<uint8_t> record;
+  size_t expected = 0;
+  bool in_record = false;
+  bool ok = true;
+  uint32_t sequence = end > this->sector_count_ ? end - this->sector_count_ : 0;
+  while (sequence != end) {
+    uint32_t index = sequence % this->sector_count_;
+    uint32_t count = std::min(std::min(end - sequence, READ_SECTORS), this->sector_count_ - index);
+    if (!this->parent_->read_raw_sectors_(scratch, this->first_sector_ + 1 + index, count)) {
+      ok = false;
+      break;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      const uint8_t *sector = scratch + i * this->sector_size_;
+      SectorHeader header;
+      if (!this->parse_(sector, index + i, header) || header.sequence != sequence + i) {
+        in_record = false;
+        continue;
+      }
+      const uint8_t *payload = sector + sizeof(SectorHeader);
+      size_t pos = 0;
+      if (!in_record) {
+        // A record started in a lost or overwritten sector
+        if (header.first_record == NO_RECORD)
+          continue;
+        pos = header.first_record;
+      }
+      while (pos < header.used) {
+        if (!in_record) {
+          if (header.used - pos < 2)
+            break;
+          expected = payload[pos] | (payload[pos + 1] << 8);
+          pos += 2;
+          record.clear();
+          in_record = true;
+        }
+        size_t n = std::min(expected - record.size(), header.used - pos);
+        record.insert(record.end(), payload + pos, payload + pos + n);
+        pos += n;
+        if (record.size() == expected) {
+          in_record = false;
+          if (!callback(record.data(), record.size())) {
+            heap_caps_free(scratch);
+            return true;
+          }
+        }
+      }
+    }
+    sequence += count;
+  }
+  heap_caps_free(scratch);
+  return ok;
+}
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
+
+#endif  // USE_ESP_IDF
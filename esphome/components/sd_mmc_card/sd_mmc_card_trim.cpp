@@ -0,0 +1,167 @@
+#include "sd_mmc_card.h"
+
+#include <algorithm>
+
+#ifdef USE_ESP_IDF
+#include "esphome/core/log.h"
+#endif
+
+namespace esphome {
+namespace sd_mmc_card {
+
+void SectorRangeSet::add(uint32_t sector, uint32_t count) {
+  if (count == 0)
+    return;
+  uint32_t end = sector + count;
+  // Merge with every range it overlaps or touches
+  auto first = std::lower_bound(this->ranges_.begin(), this->ranges_.end(), sector,
+                                [](SectorRange const &r, uint32_t s) { return r.sector + r.count < s; });
+  auto last = first;
+  while (last != this->ranges_.end() && last->sector <= end) {
+    sector = std::min(sector, last->sector);
+    end = std::max(end, last->sector + last->count);
+    ++last;
+  }
+  first = this->ranges_.erase(first, last);
+  this->ranges_.insert(first, SectorRange{sector, end - sector});
+}
+
+void SectorRangeSet::remove(uint32_t sector, uint32_t count) {
+  uint32_t end = sector + count;
+  auto it = std::lower_bound(this->ranges_.begin(), this->ranges_.end(), sector,
+                             [](SectorRange const &r, uint32_t s) { return r.sector + r.count <= s; });
+  while (it != this->ranges_.end() && it->sector < end) {
+    uint32_t r_end = it->sector + it->count;
+    if (it->sector < sector && r_end > end) {
+      // Split around the removed sectors
+      it->count = sector - it->sector;
+      this->ranges_.insert(it + 1, SectorRange{end, r_end - end});
+      return;
+    }
+    if (it->sector < sector) {
+      it->count = sector - it->sector;
+      ++it;
+    } else if (r_end > end) {
+      it->count = r_end - end;
+      it->sector = end;
+      return;
+    } else {
+      it = this->ranges_.erase(it);
+    }
+  }
+}
+
+bool SectorRangeSet::pop(uint32_t max_count, SectorRange &range) {
+  if (this->ranges_.empty() || max_count == 0)
+    return false;
+  range = this->ranges_.front();
+  range.count = std::min(range.count, max_count);
+  if (range.count == this->ranges_.front().count) {
+    this->ranges_.erase(this->ranges_.begin());
+  } else {
+    this->ranges_.front().sector += range.count;
+    this->ranges_.front().count -= range.count;
+  }
+  return true;
+}
+
+uint64_t SectorRangeSet::get_sector_count() const {
+  uint64_t sectors = 0;
+  for (auto const &range : this->ranges_)
+    sectors += range.count;
+  return sectors;
+}
+
+#ifdef USE_ESP_IDF
+
+static const char *TAG = "sd_mmc_card.trim";
+
+// Bounds the time the card is busy with a single erase command
+static constexpr uint32_t MAX_ERASE_SECTORS = 8192;
+
+void TrimQueue::add(uint32_t sector, uint32_t count) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->ranges_.add(sector, count);
+}
+
+void TrimQueue::cancel(uint32_t sector, uint32_t count) {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  this->ranges_.remove(sector, count);
+}
+
+void TrimQueue::cancel(std::vector<Range> const &ranges) {
+  for (auto const &range : ranges)
+    this->cancel(range.sector, range.count);
+}
+
+bool get_file_sectors(FIL *fil, std::vector<SectorRange> &ranges) {
+  FATFS *fs = fil->obj.fs;
+  FSIZE_t size = f_size(fil);
+#if FF_MAX_SS != FF_MIN_SS
+  FSIZE_t cluster_bytes = (FSIZE_t) fs->csize * fs->ssize;
+#else
+  FSIZE_t cluster_bytes = (FSIZE_t) fs->csize * FF_MAX_SS;
+#endif
+  DWORD cluster = fil->obj.sclust;
+  // Seeking one byte into each cluster makes FatFs follow the chain from the previous one
+  for (FSIZE_t offset = 0; offset < size && cluster >= 2; offset += cluster_bytes) {
+    if (offset > 0) {
+      if (f_lseek(fil, offset + 1) != FR_OK)
+        return false;
+      cluster = fil->clust;
+    }
+    uint32_t sector = fs->database + (cluster - 2) * fs->csize;
+    if (!ranges.empty() && ranges.back().sector + ranges.back().count == sector) {
+      ranges.back().count += fs->csize;
+    } else {
+      ranges.push_back(SectorRange{sector, fs->csize});
+    }
+  }
+  return true;
+}
+
+std::vector<TrimQueue::Range> TrimQueue::add_file(std::string const &fatfs_path) {
+  std::vector<Range> ranges;
+  FIL fil;
+  if (f_open(&fil, fatfs_path.c_str(), FA_READ) != FR_OK)
+    return ranges;
+  get_file_sectors(&fil, ranges);
+  f_close(&fil);
+  for (auto const &range : ranges)
+    this->add(range.sector, range.count);
+  return ranges;
+}
+
+uint64_t TrimQueue::get_pending_bytes() {
+  std::lock_guard<std::mutex> guard(this->mutex_);
+  return this->ranges_.get_sector_count() * this->card_->csd.sector_size;
+}
+
+bool TrimQueue::uses_discard() const { return sdmmc_can_discard(this->card_) == ESP_OK; }
+
+bool TrimQueue::erase(BlockCache *cache) {
+  sdmmc_erase_arg_t arg = this->uses_discard() ? SDMMC_DISCARD_ARG : SDMMC_ERASE_ARG;
+  while (true) {
+    Range range;
+    {
+      std::lock_guard<std::mutex> guard(this->mutex_);
+      if (!this->ranges_.pop(MAX_ERASE_SECTORS, range))
+        return true;
+    }
+    // Cached copies would hide the erased content, dirty ones would write freed data back
+    if (cache != nullptr)
+      cache->discard(range.sector, range.count);
+    esp_err_t err = sdmmc_erase_sectors(this->card_, range.sector, range.count, arg);
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "Failed to erase %u sectors at %u: %s", (unsigned) range.count, (unsigned) range.sector,
+               esp_err_to_name(err));
+      return false;
+    }
+    this->erased_bytes_ += (uint64_t) range.count * this->card_->csd.sector_size;
+  }
+}
+
+#endif  // USE_ESP_IDF
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
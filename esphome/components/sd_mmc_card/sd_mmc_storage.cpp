@@ -0,0 +1,245 @@
+#include "sd_mmc_storage.h"
+
+#ifdef USE_STORAGE
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+static const char *const TAG = "sd_mmc_card.storage";
+
+static constexpr size_t MAX_HANDLES = 4;
+// Other clients wait on the path lock of an open handle at most this long
+static constexpr uint32_t HANDLE_IDLE_MS = 1000;
+// Accesses run on the main loop, a file busy elsewhere fails them instead of blocking it
+static constexpr uint32_t LOCK_TIMEOUT_MS = 20;
+
+void SdMmcStorage::loop() {
+  // Write back first, the handles it used can then be closed below
+  storage::Storage::loop();
+  uint32_t now = millis();
+  for (auto it = this->handles_.begin(); it != this->handles_.end();) {
+    Handle &handle = **it;
+    bool open = handle.reader.is_open() || handle.stream != nullptr;
+    if (&handle != this->current_ && now - handle.last_used > HANDLE_IDLE_MS) {
+      this->close_(handle);
+      it = this->handles_.erase(it);
+      continue;
+    }
+    if (open && now - handle.last_used > HANDLE_IDLE_MS) {
+      // The current file stays selected, it is reopened by its next access
+      this->close_(handle);
+    }
+    ++it;
+  }
+}
+
+void SdMmcStorage::on_shutdown() {
+  storage::Storage::on_shutdown();
+  for (auto &handle : this->handles_)
+    this->close_(*handle);
+}
+
+void SdMmcStorage::dump_config() {
+  ESP_LOGCONFIG(TAG, "SD MMC Storage:");
+  ESP_LOGCONFIG(TAG, "  Prefix: %s", this->get_prefix().c_str());
+  ESP_LOGCONFIG(TAG, "  Buffer: %zu bytes", this->get_buffer_size());
+  ESP_LOGCONFIG(TAG, "  Write back: %s", TRUEFALSE(this->write_back_));
+}
+
+SdMmcStorage::Handle *SdMmcStorage::find_(std::string const &path) {
+  return const_cast<Handle *>(static_cast<SdMmcStorage const *>(this)->find_(path));
+}
+
+const SdMmcStorage::Handle *SdMmcStorage::find_(std::string const &path) const {
+  for (auto const &handle : this->handles_) {
+    if (handle->path == path)
+      return handle.get();
+  }
+  return nullptr;
+}
+
+void SdMmcStorage::direct_set_file(const std::string &path) {
+  std::string key = this->parent_->card_path(path);
+  Handle *handle = this->find_(key);
+  if (handle == nullptr) {
+    if (this->handles_.size() >= MAX_HANDLES) {
+      // The least recently used file gives its handle up
+      auto oldest = std::min_element(
+          this->handles_.begin(), this->handles_.end(),
+          [](std::unique_ptr<Handle> const &a, std::unique_ptr<Handle> const &b) { return a->last_used < b->last_used; });
+      if (oldest->get() == this->current_)
+        this->current_ = nullptr;
+      this->close_(**oldest);
+      this->handles_.erase(oldest);
+    }
+    this->handles_.emplace_back(new Handle());
+    handle = this->handles_.back().get();
+    handle->path = key;
+  }
+  handle->last_used = millis();
+  this->current_ = handle;
+}
+
+void SdMmcStorage::close_(Handle &handle) const {
+  handle.reader.close();
+  if (handle.stream != nullptr) {
+    this->parent_->close_stream(handle.stream);
+    handle.stream = nullptr;
+  }
+  handle.lock = PathLock();
+  handle.writing = false;
+}
+
+bool SdMmcStorage::open_stream_(Handle &handle) {
+  if (handle.stream != nullptr)
+    return true;
+  // The shared lock of our own reader would hold off the exclusive one
+  handle.reader.close();
+  handle.lock = this->parent_->lock_path(handle.path, true, LOCK_TIMEOUT_MS);
+  if (!handle.lock.is_locked()) {
+    ESP_LOGE(TAG, "Failed to lock %s for writing", handle.path.c_str());
+    return false;
+  }
+  handle.stream = this->parent_->open_stream(handle.path, "r+b", LOCK_TIMEOUT_MS);
+  if (handle.stream == nullptr && errno == ENOENT)
+    handle.stream = this->parent_->open_stream(handle.path, "w+b", LOCK_TIMEOUT_MS);
+  long size = handle.stream != nullptr && fseek(handle.stream, 0, SEEK_END) == 0 ? ftell(handle.stream) : -1;
+  if (size < 0) {
+    ESP_LOGE(TAG, "Failed to open %s for writing: %s", handle.path.c_str(), strerror(errno));
+    if (handle.stream != nullptr)
+      this->parent_->close_stream(handle.stream);
+    handle.stream = nullptr;
+    handle.lock = PathLock();
+    return false;
+  }
+  handle.size = size;
+  handle.position = size;
+  handle.writing = false;
+  return true;
+}
+
+bool SdMmcStorage::seek_(Handle &handle, size_t offset, bool writing) {
+  // stdio needs a seek between a write and a following read and the other way round
+  if (offset == handle.position && writing == handle.writing)
+    return true;
+  if (fseek(handle.stream, offset, SEEK_SET) != 0) {
+    ESP_LOGE(TAG, "Failed to seek %s to %zu: %s", handle.path.c_str(), offset, strerror(errno));
+    handle.position = SIZE_MAX;
+    return false;
+  }
+  handle.position = offset;
+  handle.writing = writing;
+  return true;
+}
+
+uint8_t SdMmcStorage::direct_read_byte(size_t offset) {
+  uint8_t data = 0;
+  this->direct_read_byte_array(offset, &data, 1);
+  return data;
+}
+
+size_t SdMmcStorage::direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) {
+  Handle *handle = this->current_;
+  if (handle == nullptr) {
+    ESP_LOGE(TAG, "File has not been set");
+    return 0;
+  }
+  handle->last_used = millis();
+  if (handle->stream != nullptr) {
+    if (!this->seek_(*handle, offset, false))
+      return 0;
+    size_t res = fread(data, 1, data_length, handle->stream);
+    handle->position += res;
+    return res;
+  }
+  if (!handle->reader.is_open()) {
+    handle->reader = this->parent_->open_file(handle->path, LOCK_TIMEOUT_MS);
+    if (!handle->reader.is_open())
+      return 0;
+  }
+  // Seeks only when the offset does not follow the previous read
+  return handle->reader.read(offset, data, data_length);
+}
+
+bool SdMmcStorage::direct_write_byte(size_t offset, uint8_t data) {
+  return this->direct_write_byte_array(offset, &data, 1);
+}
+
+bool SdMmcStorage::direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) {
+  Handle *handle = this->current_;
+  if (handle == nullptr) {
+    ESP_LOGE(TAG, "File has not been set");
+    return false;
+  }
+  handle->last_used = millis();
+  if (!this->open_stream_(*handle) || !this->seek_(*handle, offset, true))
+    return false;
+  size_t res = fwrite(data, 1, data_length, handle->stream);
+  handle->position += res;
+  handle->size = std::max(handle->size, handle->position);
+  if (res != data_length) {
+    ESP_LOGE(TAG, "Failed to write %s: %s", handle->path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool SdMmcStorage::direct_append_byte(uint8_t data) { return this->direct_append_byte_array(&data, 1); }
+
+bool SdMmcStorage::direct_append_byte_array(uint8_t *data, size_t data_length) {
+  Handle *handle = this->current_;
+  if (handle == nullptr) {
+    ESP_LOGE(TAG, "File has not been set");
+    return false;
+  }
+  handle->last_used = millis();
+  if (!this->open_stream_(*handle) || !this->seek_(*handle, handle->size, true))
+    return false;
+  size_t res = fwrite(data, 1, data_length, handle->stream);
+  handle->position += res;
+  handle->size = handle->position;
+  if (res != data_length) {
+    ESP_LOGE(TAG, "Failed to append to %s: %s", handle->path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void SdMmcStorage::direct_delete_file(const std::string &path) {
+  // Our own handle would hold off the exclusive lock of the delete
+  Handle *handle = this->find_(this->parent_->card_path(path));
+  if (handle != nullptr)
+    this->close_(*handle);
+  this->parent_->delete_file(path);
+}
+
+storage::FileInfo SdMmcStorage::direct_get_file_info(const std::string &path) const {
+  const Handle *handle = this->find_(this->parent_->card_path(path));
+  // The directory entry only gets the size of a file being written when it is closed
+  if (handle != nullptr && handle->stream != nullptr)
+    return storage::FileInfo(handle->path, handle->size, false);
+  FileInfo info;
+  if (!this->parent_->stat(path, info))
+    return storage::FileInfo(path, 0, false);
+  return storage::FileInfo(info.path, info.size, info.is_directory);
+}
+
+std::vector<storage::FileInfo> SdMmcStorage::direct_list_directory(const std::string &path) const {
+  std::vector<storage::FileInfo> result;
+  this->parent_->for_each_entry(this->parent_->card_path(path), 0, [&result](FileInfo const &info) {
+    result.emplace_back(info.path, info.size, info.is_directory);
+    return true;
+  });
+  return result;
+}
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
+
+#endif  // USE_STORAGE
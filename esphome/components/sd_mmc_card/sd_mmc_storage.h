@@ -0,0 +1,66 @@
+#pragma once
+#include "esphome/core/defines.h"
+
+#ifdef USE_STORAGE
+#include <memory>
+#include <string>
+#include <vector>
+#include "esphome/components/storage/storage.h"
+#include "sd_mmc_card.h"
+
+namespace esphome {
+namespace sd_mmc_card {
+
+/* storage::Storage backend on the card. Every file keeps its handle open between calls and reads are positional:
+ * the handle only seeks when a read does not follow the previous one. Handles left unused are closed from loop()
+ * so their path locks do not hold off the other clients of the card. */
+class SdMmcStorage : public storage::Storage {
+ public:
+  explicit SdMmcStorage(SdMmc *parent) : parent_(parent) {}
+  void loop() override;
+  void dump_config() override;
+  /* Writes back the buffer, then closes the streams so their data reaches the card before it shuts down. */
+  void on_shutdown() override;
+
+  uint8_t direct_read_byte(size_t offset) override;
+  bool direct_write_byte(size_t offset, uint8_t data) override;
+  bool direct_append_byte(uint8_t data) override;
+  size_t direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) override;
+  bool direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) override;
+  bool direct_append_byte_array(uint8_t *data, size_t data_length) override;
+
+ protected:
+  /* Reader sharing the file until the first write, then a read/write stream under the exclusive lock. */
+  struct Handle {
+    std::string path;
+    FileReader reader;
+    FILE *stream{nullptr};
+    PathLock lock;
+    size_t position{0};
+    /* Size of the file while the stream is open, its directory entry is only updated on close */
+    size_t size{0};
+    bool writing{false};
+    uint32_t last_used{0};
+  };
+
+  void direct_set_file(const std::string &path) override;
+  void direct_delete_file(const std::string &path) override;
+  storage::FileInfo direct_get_file_info(const std::string &path) const override;
+  std::vector<storage::FileInfo> direct_list_directory(const std::string &path) const override;
+
+  Handle *find_(std::string const &path);
+  const Handle *find_(std::string const &path) const;
+  bool open_stream_(Handle &handle);
+  bool seek_(Handle &handle, size_t offset, bool writing);
+  void close_(Handle &handle) const;
+
+  SdMmc *parent_;
+  // Owned handles, the current one stays valid when others are evicted
+  std::vector<std::unique_ptr<Handle>> handles_;
+  Handle *current_{nullptr};
+};
+
+}  // namespace sd_mmc_card
+}  // namespace esphome
+
+#endif  // USE_STORAGE
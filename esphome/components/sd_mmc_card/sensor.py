@@ -4,8 +4,11 @@ from esphome.components import sensor
 from esphome.const import (
     CONF_TYPE,
     STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
     UNIT_BYTES,
+    UNIT_MILLISECOND,
     ICON_MEMORY,
+    ICON_TIMER,
 )
 from . import (
     SdMmc,
@@ -19,9 +22,38 @@ CONF_USED_SPACE = "used_space"
 CONF_TOTAL_SPACE = "total_space"
 CONF_FREE_SPACE = "free_space"
 CONF_FILE_SIZE = "file_size"
+CONF_IO_QUEUE_DEPTH = "io_queue_depth"
+CONF_IO_INTERACTIVE_LATENCY = "io_interactive_latency"
+CONF_IO_NORMAL_LATENCY = "io_normal_latency"
+CONF_IO_BULK_LATENCY = "io_bulk_latency"
+CONF_BENCHMARK_READ_SPEED = "benchmark_read_speed"
+CONF_BENCHMARK_WRITE_SPEED = "benchmark_write_speed"
+CONF_BENCHMARK_RANDOM_READ_IOPS = "benchmark_random_read_iops"
+CONF_BENCHMARK_RANDOM_WRITE_IOPS = "benchmark_random_write_iops"
+CONF_BENCHMARK_READ_LATENCY_P99 = "benchmark_read_latency_p99"
+CONF_BENCHMARK_METADATA_LATENCY = "benchmark_metadata_latency"
+CONF_ERASED_SPACE = "erased_space"
+
+UNIT_MEGABYTES_PER_SECOND = "MB/s"
+UNIT_IOPS = "IOPS"
 
 TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_USED_SPACE, CONF_FREE_SPACE]
-SIMPLE_TYPES = [CONF_USED_SPACE, CONF_TOTAL_SPACE, CONF_FREE_SPACE]
+SIMPLE_TYPES = [
+    CONF_USED_SPACE,
+    CONF_TOTAL_SPACE,
+    CONF_FREE_SPACE,
+    CONF_IO_QUEUE_DEPTH,
+    CONF_IO_INTERACTIVE_LATENCY,
+    CONF_IO_NORMAL_LATENCY,
+    CONF_IO_BULK_LATENCY,
+    CONF_BENCHMARK_READ_SPEED,
+    CONF_BENCHMARK_WRITE_SPEED,
+    CONF_BENCHMARK_RANDOM_READ_IOPS,
+    CONF_BENCHMARK_RANDOM_WRITE_IOPS,
+    CONF_BENCHMARK_READ_LATENCY_P99,
+    CONF_BENCHMARK_METADATA_LATENCY,
+    CONF_ERASED_SPACE,
+]
 
 BASE_CONFIG_SCHEMA = sensor.sensor_schema(
     unit_of_measurement=UNIT_BYTES,
@@ -34,6 +66,60 @@ BASE_CONFIG_SCHEMA = sensor.sensor_schema(
     }
 )
 
+ERASED_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_BYTES,
+    icon=ICON_MEMORY,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
+QUEUE_CONFIG_SCHEMA = sensor.sensor_schema(
+    icon=ICON_MEMORY,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
+LATENCY_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MILLISECOND,
+    icon=ICON_TIMER,
+    accuracy_decimals=1,
+    state_class=STATE_CLASS_MEASUREMENT,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
+SPEED_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MEGABYTES_PER_SECOND,
+    icon=ICON_TIMER,
+    accuracy_decimals=2,
+    state_class=STATE_CLASS_MEASUREMENT,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
+IOPS_CONFIG_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_IOPS,
+    icon=ICON_TIMER,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
 CONFIG_SCHEMA = cv.typed_schema(
     {
         CONF_TOTAL_SPACE : BASE_CONFIG_SCHEMA,
@@ -43,7 +129,18 @@ CONFIG_SCHEMA = cv.typed_schema(
             {
                 cv.Required(CONF_PATH): cv.templatable(cv.string_strict),
             }
-        )
+        ),
+        CONF_IO_QUEUE_DEPTH: QUEUE_CONFIG_SCHEMA,
+        CONF_IO_INTERACTIVE_LATENCY: LATENCY_CONFIG_SCHEMA,
+        CONF_IO_NORMAL_LATENCY: LATENCY_CONFIG_SCHEMA,
+        CONF_IO_BULK_LATENCY: LATENCY_CONFIG_SCHEMA,
+        CONF_BENCHMARK_READ_SPEED: SPEED_CONFIG_SCHEMA,
+        CONF_BENCHMARK_WRITE_SPEED: SPEED_CONFIG_SCHEMA,
+        CONF_BENCHMARK_RANDOM_READ_IOPS: IOPS_CONFIG_SCHEMA,
+        CONF_BENCHMARK_RANDOM_WRITE_IOPS: IOPS_CONFIG_SCHEMA,
+        CONF_BENCHMARK_READ_LATENCY_P99: LATENCY_CONFIG_SCHEMA,
+        CONF_BENCHMARK_METADATA_LATENCY: LATENCY_CONFIG_SCHEMA,
+        CONF_ERASED_SPACE: ERASED_CONFIG_SCHEMA,
     },
     lower=True,
 )
@@ -0,0 +1,25 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import storage
+from esphome.const import CONF_ID
+from . import (
+    SdMmc,
+    CONF_SD_MMC_CARD_ID,
+    sd_mmc_card_component_ns,
+)
+
+DEPENDENCIES = ["sd_mmc_card"]
+
+SdMmcStorage = sd_mmc_card_component_ns.class_("SdMmcStorage", storage.Storage)
+
+CONFIG_SCHEMA = storage.storage_schema(SdMmcStorage).extend(
+    {
+        cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
+    }
+)
+
+
+async def to_code(config):
+    parent = await cg.get_variable(config[CONF_SD_MMC_CARD_ID])
+    cg.new_Pvariable(config[CONF_ID], parent)
+    await storage.storage_to_code(config)
@@ -9,12 +9,16 @@ from . import SdMmc, CONF_SD_MMC_CARD_ID
 DEPENDENCIES = ["sd_mmc_card"]
 
 CONF_SD_CARD_TYPE = "sd_card_type"
+CONF_BUS_MODE = "bus_mode"
 
 CONFIG_SCHEMA = {
     cv.GenerateID(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
     cv.Optional(CONF_SD_CARD_TYPE): text_sensor.text_sensor_schema(
         entity_category=ENTITY_CATEGORY_DIAGNOSTIC
     ),
+    cv.Optional(CONF_BUS_MODE): text_sensor.text_sensor_schema(
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC
+    ),
 }
 
 async def to_code(config):
@@ -23,3 +27,7 @@ async def to_code(config):
     if CONF_SD_CARD_TYPE in config:
         sens = await text_sensor.new_text_sensor(config[CONF_SD_CARD_TYPE])
         cg.add(sd_mmc_component.set_sd_card_type_text_sensor(sens))
+
+    if CONF_BUS_MODE in config:
+        sens = await text_sensor.new_text_sensor(config[CONF_BUS_MODE])
+        cg.add(sd_mmc_component.set_bus_mode_text_sensor(sens))
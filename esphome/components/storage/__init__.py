@@ -4,18 +4,46 @@ from esphome.const import CONF_ID
 from esphome.cpp_generator import MockObjClass
 
 storage_ns = cg.esphome_ns.namespace("storage")
-Storage = storage_ns.class_("Storage", cg.EntityBase)
+Storage = storage_ns.class_("Storage", cg.EntityBase, cg.Component)
 StorageClient = storage_ns.class_("StorageClient", cg.EntityBase)
 StorageClientStatic = storage_ns.namespace("StorageClient")
 
 IS_PLATFORM_COMPONENT = True
 
 CONF_PREFIX = "path_prefix"
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_BUFFER_PLACEMENT = "buffer_placement"
+CONF_WRITE_BACK = "write_back"
+CONF_FLUSH_SIZE = "flush_size"
+CONF_FLUSH_INTERVAL = "flush_interval"
+CONF_WRITE_ON_SHUTDOWN = "write_on_shutdown"
+
+BufferPlacement = storage_ns.enum("BufferPlacement")
+BUFFER_PLACEMENTS = {
+    "internal": BufferPlacement.BUFFER_INTERNAL,
+    "psram": BufferPlacement.BUFFER_PSRAM,
+}
 
 
 STORAGE_SCHEMA = cv.Schema(
-    {cv.GenerateID(): cv.declare_id(Storage), cv.Required(CONF_PREFIX): cv.string}
-)
+    {
+        cv.GenerateID(): cv.declare_id(Storage),
+        cv.Required(CONF_PREFIX): cv.string,
+        cv.Optional(CONF_BUFFER_SIZE, default=4096): cv.int_range(min=0),
+        cv.Optional(CONF_BUFFER_PLACEMENT, default="internal"): cv.enum(
+            BUFFER_PLACEMENTS, lower=True
+        ),
+        cv.Optional(CONF_WRITE_BACK): cv.Schema(
+            {
+                cv.Optional(CONF_FLUSH_SIZE, default=0): cv.int_range(min=0),
+                cv.Optional(
+                    CONF_FLUSH_INTERVAL, default="1s"
+                ): cv.positive_time_period_milliseconds,
+                cv.Optional(CONF_WRITE_ON_SHUTDOWN, default=True): cv.boolean,
+            }
+        ),
+    }
+).extend(cv.COMPONENT_SCHEMA)
 
 
 def storage_schema(
@@ -32,5 +60,15 @@ def storage_schema(
 
 async def storage_to_code(config):
     storage = await cg.get_variable(config[CONF_ID])
+    await cg.register_component(storage, config)
+    cg.add_define("USE_STORAGE")
     prefix = config[CONF_PREFIX]
+    cg.add(storage.set_buffer_size(config[CONF_BUFFER_SIZE]))
+    cg.add(storage.set_buffer_placement(config[CONF_BUFFER_PLACEMENT]))
+    if CONF_WRITE_BACK in config:
+        write_back = config[CONF_WRITE_BACK]
+        cg.add(storage.set_write_back(True))
+        cg.add(storage.set_flush_size(write_back[CONF_FLUSH_SIZE]))
+        cg.add(storage.set_flush_interval(write_back[CONF_FLUSH_INTERVAL]))
+        cg.add(storage.write_on_shutdown(write_back[CONF_WRITE_ON_SHUTDOWN]))
     cg.add(StorageClientStatic.add_storage(storage, prefix))
@@ -5,10 +5,18 @@
 #include "esphome/core/log.h"
 #include "esphome/core/component.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace esphome {
 namespace storage {
 
 static const char *const TAG = "storage";
+
+// Granularity of the dirty map of the window
+static constexpr size_t DIRTY_BLOCK_SIZE = 64;
+// Clean bytes written along to join two dirty runs in a single write
+static constexpr size_t MERGE_GAP = 512;
 FileInfo::FileInfo(std::string const &path, size_t size, bool is_directory)
     : path(path), size(size), is_directory(is_directory) {
   this->read_offset = 0;
@@ -16,6 +24,16 @@ FileInfo::FileInfo(std::string const &path, size_t size, bool is_directory)
 
 FileInfo::FileInfo() : path(), size(), is_directory() { this->read_offset = 0; }
 
+std::string FileInfo::full_path() const {
+  if (this->prefix.empty()) {
+    return this->path;
+  }
+  std::string result;
+  result.reserve(this->prefix.size() + 3 + this->path.size());
+  result.append(this->prefix.data(), this->prefix.size()).append("://").append(this->path);
+  return result;
+}
+
 std::vector<FileInfo> Storage::list_directory(const std::string &path) const {
   return this->direct_list_directory(path);
 }
@@ -23,126 +41,372 @@ std::vector<FileInfo> Storage::list_directory(const std::string &path) const {
 FileInfo Storage::get_file_info(const std::string &path) const { return this->direct_get_file_info(path); }
 
 void Storage::set_file(FileInfo *file) {
-  if (this->current_file_ != file) {
+  // A client reuses its FileInfo for the next file, the path tells the switch apart
+  if (this->current_file_ != file || this->file_path_ != file->path) {
+    // Modified bytes belong to the file still open in the backend
+    this->flush();
+    this->drop_buffer();
     this->current_file_ = file;
+    this->file_path_ = file->path;
     this->direct_set_file(this->current_file_->path);
   }
 }
 
-void Storage::delete_file(const std::string &path) { this->direct_delete_file(path); }
+void Storage::delete_file(const std::string &path) {
+  if (this->current_file_ != nullptr && path == this->file_path_) {
+    this->drop_buffer();
+  }
+  this->direct_delete_file(path);
+}
 
 uint8_t Storage::read() {
+  size_t offset = this->current_file_->read_offset;
   uint8_t data;
-  data = this->direct_read_byte(this->current_file_->read_offset);
+  if (this->buffered_bytes(offset) > 0 || (this->refresh_buffer(offset) && this->buffered_bytes(offset) > 0)) {
+    data = this->buffer_[offset - this->buffer_offset_];
+  } else {
+    data = this->direct_read_byte(offset);
+  }
   this->update_offset(1);
   return data;
 }
 
 bool Storage::write(uint8_t data) {
-  //    if(this->buffer_ != nullptr) {
-  //       this->buffer_[this->current_offset_] = data;
-  //    } else {
-  ESP_LOGW(TAG, "Buffer not available using direct access instead");
-  return this->direct_write_byte(data);
-  //    }
+  if (this->allocate_buffer()) {
+    return this->write_array(&data, 1);
+  }
+  size_t offset = this->current_file_->read_offset;
+  if (!this->direct_write_byte(offset, data)) {
+    return false;
+  }
+  this->current_file_->size = std::max(this->current_file_->size, offset + 1);
+  this->update_offset(1);
+  return true;
 }
 
-bool Storage::append(uint8_t data) { return this->direct_append_byte(data); }
+bool Storage::append(uint8_t data) {
+  if (this->allocate_buffer()) {
+    return this->append_array(&data, 1);
+  }
+  if (!this->direct_append_byte(data)) {
+    return false;
+  }
+  this->current_file_->size++;
+  return true;
+}
 
 size_t Storage::read_array(uint8_t *data, size_t data_length) {
-  size_t num_bytes_read = this->direct_read_byte_array(this->current_file_->read_offset, data, data_length);
-  this->update_offset(num_bytes_read);
-  return num_bytes_read;
+  size_t total = 0;
+  while (total < data_length) {
+    size_t offset = this->current_file_->read_offset;
+    size_t remaining = data_length - total;
+    size_t available = this->buffered_bytes(offset);
+    if (available == 0) {
+      // Reads of a whole window or more skip the copy through it
+      if (remaining >= this->buffer_size_ || !this->refresh_buffer(offset)) {
+        if (!this->flush()) {
+          break;
+        }
+        size_t num_bytes_read = this->direct_read_byte_array(offset, data + total, remaining);
+        this->update_offset(num_bytes_read);
+        total += num_bytes_read;
+        break;
+      }
+      available = this->buffered_bytes(offset);
+      if (available == 0) {
+        // End of file
+        break;
+      }
+    }
+    size_t n = std::min(available, remaining);
+    memcpy(data + total, this->buffer_ + (offset - this->buffer_offset_), n);
+    this->update_offset(n);
+    total += n;
+  }
+  return total;
 }
 
 bool Storage::write_array(uint8_t *data, size_t data_length) {
-  return this->direct_write_byte_array(data, data_length);
+  size_t offset = this->current_file_->read_offset;
+  if (data_length >= this->buffer_size_ || !this->allocate_buffer()) {
+    if (!this->flush()) {
+      return false;
+    }
+    // The window must not keep an old copy of the written bytes
+    if (offset < this->buffer_offset_ + this->buffer_length_ && offset + data_length > this->buffer_offset_) {
+      this->drop_buffer();
+    }
+    if (!this->direct_write_byte_array(offset, data, data_length)) {
+      return false;
+    }
+    this->current_file_->size = std::max(this->current_file_->size, offset + data_length);
+    this->update_offset(data_length);
+    return true;
+  }
+  if (!this->buffer_write(offset, data, data_length)) {
+    return false;
+  }
+  this->update_offset(data_length);
+  return this->check_flush();
 }
 
 bool Storage::append_array(uint8_t *data, size_t data_length) {
-  return this->direct_write_byte_array(data, data_length);
-}
-// void Storage::allocate_buffer(uint32_t buffer_size) {
-//    if(buffer_size) {
-//       if(this->buffer_ == nullptr) {
-//          RAMAllocator<uint8_t> allocator(RAMAllocator<uint8_t>::NONE);
-//          this->buffer_ = allocator.allocate(buffer_size);
-//       }
-//       if(this->buffer_ == nullptr) {
-//          ESP_LOGE(TAG, "Unable to Allocate memory for storage buffer");
-//       }
-//    }
-// }
+  if (data_length >= this->buffer_size_ || !this->allocate_buffer()) {
+    // Modified bytes of the window may extend the file
+    if (!this->flush() || !this->direct_append_byte_array(data, data_length)) {
+      return false;
+    }
+    this->current_file_->size += data_length;
+    return true;
+  }
+  // A window ending at the end of the file holds the latest appends. Otherwise the size may be stale: the
+  // FileInfo can come from an old listing or another client may have appended, the backend knows the real one
+  if (this->buffer_length_ == 0 || this->current_file_->size != this->buffer_offset_ + this->buffer_length_) {
+    if (!this->flush()) {
+      return false;
+    }
+    this->current_file_->size = this->direct_get_file_info(this->file_path_).size;
+  }
+  // Appends land in the window like writes at the end of the file, the read position stays
+  if (!this->buffer_write(this->current_file_->size, data, data_length)) {
+    return false;
+  }
+  return this->check_flush();
+}
+
+const uint8_t *Storage::get_mapped_view(size_t offset, size_t length) {
+  // The backend copy must hold the modified bytes
+  if (!this->flush()) {
+    return nullptr;
+  }
+  return this->direct_get_mapped_view(offset, length);
+}
+
+bool Storage::buffer_write(size_t offset, const uint8_t *data, size_t data_length) {
+  size_t written = 0;
+  while (written < data_length) {
+    // The window only grows from its valid bytes, a write past them starts a new one without loading it
+    if (offset < this->buffer_offset_ || offset > this->buffer_offset_ + this->buffer_length_ ||
+        offset >= this->buffer_offset_ + this->buffer_size_) {
+      if (!this->flush()) {
+        return false;
+      }
+      this->drop_buffer();
+      this->buffer_offset_ = offset;
+    }
+    size_t start = offset - this->buffer_offset_;
+    size_t n = std::min(data_length - written, this->buffer_size_ - start);
+    memcpy(this->buffer_ + start, data + written, n);
+    this->mark_dirty(start, start + n);
+    this->buffer_length_ = std::max(this->buffer_length_, start + n);
+    this->current_file_->size = std::max(this->current_file_->size, offset + n);
+    offset += n;
+    written += n;
+  }
+  return true;
+}
+
+bool Storage::check_flush() {
+  if (this->dirty_blocks_ == 0) {
+    return true;
+  }
+  // With a flush_size of 0, a full window is written back when the next write moves it
+  if (!this->write_back_ || (this->flush_size_ > 0 && this->dirty_blocks_ * DIRTY_BLOCK_SIZE >= this->flush_size_) ||
+      millis() - this->dirty_since_ >= this->flush_interval_) {
+    return this->flush();
+  }
+  return true;
+}
+
+void Storage::mark_dirty(size_t start, size_t end) {
+  if (this->dirty_blocks_ == 0) {
+    this->dirty_since_ = millis();
+  }
+  for (size_t block = start / DIRTY_BLOCK_SIZE; block <= (end - 1) / DIRTY_BLOCK_SIZE; block++) {
+    uint32_t bit = 1u << (block % 32);
+    if ((this->dirty_map_[block / 32] & bit) == 0) {
+      this->dirty_map_[block / 32] |= bit;
+      this->dirty_blocks_++;
+    }
+  }
+}
+
+bool Storage::is_dirty(size_t block) const { return (this->dirty_map_[block / 32] >> (block % 32)) & 1; }
+
+bool Storage::allocate_buffer() {
+  if (this->buffer_ != nullptr) {
+    return true;
+  }
+  if (this->buffer_size_ == 0) {
+    return false;
+  }
+  // PSRAM is tried first and internal RAM used when it is missing or full
+  RAMAllocator<uint8_t> allocator(this->buffer_placement_ == BUFFER_PSRAM ? RAMAllocator<uint8_t>::NONE
+                                                                          : RAMAllocator<uint8_t>::ALLOC_INTERNAL);
+  this->buffer_ = allocator.allocate(this->buffer_size_);
+  if (this->buffer_ == nullptr) {
+    ESP_LOGE(TAG, "Unable to allocate %zu bytes of storage buffer, using direct access", this->buffer_size_);
+    this->buffer_size_ = 0;
+    return false;
+  }
+  size_t blocks = (this->buffer_size_ + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+  this->dirty_map_.assign((blocks + 31) / 32, 0);
+  return true;
+}
+
+size_t Storage::buffered_bytes(size_t offset) const {
+  if (offset < this->buffer_offset_ || offset >= this->buffer_offset_ + this->buffer_length_) {
+    return 0;
+  }
+  return this->buffer_offset_ + this->buffer_length_ - offset;
+}
+
+void Storage::drop_buffer() {
+  this->buffer_offset_ = 0;
+  this->buffer_length_ = 0;
+  if (this->dirty_blocks_ > 0) {
+    std::fill(this->dirty_map_.begin(), this->dirty_map_.end(), 0);
+    this->dirty_blocks_ = 0;
+  }
+}
+
+bool Storage::flush() {
+  if (this->dirty_blocks_ == 0) {
+    return true;
+  }
+  size_t blocks = (this->buffer_length_ + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+  size_t block = 0;
+  while (block < blocks) {
+    if (!this->is_dirty(block)) {
+      block++;
+      continue;
+    }
+    // Adjacent dirty blocks go out as one write, short clean gaps between them too: the bytes are valid and
+    // one larger write costs less than another command
+    size_t first = block;
+    size_t end = block + 1;
+    for (size_t next = end; next < blocks && (next - end) * DIRTY_BLOCK_SIZE < MERGE_GAP; next++) {
+      if (this->is_dirty(next)) {
+        end = next + 1;
+      }
+    }
+    size_t start = first * DIRTY_BLOCK_SIZE;
+    size_t length = std::min(end * DIRTY_BLOCK_SIZE, this->buffer_length_) - start;
+    if (!this->direct_write_byte_array(this->buffer_offset_ + start, this->buffer_ + start, length)) {
+      ESP_LOGE(TAG, "Failed to write back %zu bytes of %s", length, this->file_path_.c_str());
+      return false;
+    }
+    for (size_t i = first; i < end; i++) {
+      uint32_t bit = 1u << (i % 32);
+      if (this->dirty_map_[i / 32] & bit) {
+        this->dirty_map_[i / 32] &= ~bit;
+        this->dirty_blocks_--;
+      }
+    }
+    block = end;
+  }
+  return true;
+}
+
+bool Storage::refresh_buffer(size_t offset) {
+  if (this->current_file_ == nullptr || !this->allocate_buffer() || !this->flush()) {
+    return false;
+  }
+  this->buffer_offset_ = offset;
+  this->buffer_length_ = this->direct_read_byte_array(offset, this->buffer_, this->buffer_size_);
+  return true;
+}
 
 void Storage::update_offset(size_t value) {
   this->current_file_->read_offset += value;
-  //    if (this->current_offset_ > this->buffer_size_){
-  //       if(this->max_offset_ && (this->base_offset_ + this->current_offset_ > this->max_offset_)) {
-  //          if(this->buffer_offset_ != this->base_offset_){
-  //             this->load_buffer(base_offset_,0,this->buffer_size_);
-  //          }
-  //       } else {
-  //          uint32_t new_buffer_offset = this->buffer_offset_+this->current_offset_;
-  //          if(this->max_offset_ && (new_buffer_offset+this->buffer_size_-1 > this->max_offset_)) {
-  //             this->load_buffer(this->buffer_offset_+this->current_offset_,0,this->max_offset_-new_buffer_offset+1);
-  //          } else {
-  //             this->load_buffer(this->buffer_offset_+this->current_offset_,0,this->buffer_size_);
-  //          }
-  //       }
-  //       this->current_offset_ = 0;
-  //    }
+  size_t offset = this->current_file_->read_offset;
+  if (this->buffer_ == nullptr ||
+      (offset >= this->buffer_offset_ && offset < this->buffer_offset_ + this->buffer_size_)) {
+    return;
+  }
+  // A reader reaching the end of a full window gets the next one, a writer leaving it writes it back
+  size_t window_end = this->buffer_offset_ + this->buffer_size_;
+  if (this->dirty_blocks_ == 0 && offset == window_end && this->buffer_length_ == this->buffer_size_ &&
+      offset < this->current_file_->size) {
+    this->refresh_buffer(offset);
+  } else if (this->flush()) {
+    this->drop_buffer();
+  }
 }
 
-std::vector<FileInfo> StorageClient::list_directory(const std::string &path) const {
-  int prefix_end = path.find("://");
-  if (prefix_end < 0) {
+void Storage::loop() {
+  if (this->dirty_blocks_ > 0 && millis() - this->dirty_since_ >= this->flush_interval_) {
+    this->flush();
+  }
+}
+
+void Storage::on_shutdown() {
+  if (this->write_on_shutdown_) {
+    this->flush();
+  }
+}
+
+Storage *StorageClient::find_storage(std::string_view prefix) {
+  for (auto const &registration : storages) {
+    if (registration.prefix == prefix) {
+      return registration.storage;
+    }
+  }
+  ESP_LOGE(TAG, "storage %.*s prefix does not exist", (int) prefix.size(), prefix.data());
+  return nullptr;
+}
+
+Storage *StorageClient::resolve(std::string_view path, std::string_view &prefix, std::string_view &rest) {
+  size_t prefix_end = path.find("://");
+  if (prefix_end == std::string_view::npos) {
     ESP_LOGE(TAG, "Invalid path. Must start with a valid prefix");
-    return std::vector<FileInfo>();
+    return nullptr;
+  }
+  Storage *storage = find_storage(path.substr(0, prefix_end));
+  if (storage != nullptr) {
+    // The view of the registry outlives the path
+    prefix = storage->get_prefix();
+    rest = path.substr(prefix_end + 3);
   }
-  std::string prefix = path.substr(0, prefix_end);
-  auto nstorage = storages.find(prefix);
-  if (nstorage == storages.end()) {
-    ESP_LOGE(TAG, "storage %s prefix does not exist", prefix);
+  return storage;
+}
+
+std::vector<FileInfo> StorageClient::list_directory(const std::string &path) const {
+  std::string_view prefix;
+  std::string_view rest;
+  Storage *storage = resolve(path, prefix, rest);
+  if (storage == nullptr) {
     return std::vector<FileInfo>();
   }
-  std::vector<FileInfo> result = nstorage->second->list_directory(path.substr(prefix_end + 3));
-  for (auto i = result.begin(); i != result.end(); i++) {
-    i->path = prefix + "://" + i->path;
+  std::vector<FileInfo> result = storage->list_directory(std::string(rest));
+  for (auto &info : result) {
+    info.prefix = prefix;
   }
   return result;
 }
 
 FileInfo StorageClient::get_file_info(const std::string &path) const {
-  int prefix_end = path.find("://");
-  if (prefix_end < 0) {
-    ESP_LOGE(TAG, "Invalid path. Must start with a valid prefix");
-    return FileInfo();
-  }
-  std::string prefix = path.substr(0, prefix_end);
-  auto nstorage = storages.find(prefix);
-  if (nstorage == storages.end()) {
-    ESP_LOGE(TAG, "storage %s prefix does not exist", prefix);
+  std::string_view prefix;
+  std::string_view rest;
+  Storage *storage = resolve(path, prefix, rest);
+  if (storage == nullptr) {
     return FileInfo();
   }
-  FileInfo result = nstorage->second->get_file_info(path.substr(prefix_end + 3));
-  result.path = prefix + "://" + result.path;
+  FileInfo result = storage->get_file_info(std::string(rest));
+  result.prefix = prefix;
   return result;
 }
 
 void StorageClient::set_file(const std::string &path) {
-  int prefix_end = path.find("://");
-  if (prefix_end < 0) {
-    ESP_LOGE(TAG, "Invalid path. Must start with a valid prefix");
-    return;
-  }
-  std::string prefix = path.substr(0, prefix_end);
-  auto nstorage = storages.find(prefix);
-  if (nstorage == storages.end()) {
-    ESP_LOGE(TAG, "storage %s prefix does not exist", prefix);
+  std::string_view prefix;
+  std::string_view rest;
+  Storage *storage = resolve(path, prefix, rest);
+  if (storage == nullptr) {
     return;
   }
-  this->current_storage_ = nstorage->second;
-  this->current_file_ = this->current_storage_->get_file_info(path.substr(prefix_end + 3));
+  this->current_storage_ = storage;
+  this->current_file_ = this->current_storage_->get_file_info(std::string(rest));
+  this->current_file_.prefix = prefix;
   this->current_storage_->set_file(&(this->current_file_));
   ESP_LOGVV(TAG, "Current File Set to %s", this->current_file_.path.c_str());
 }
@@ -155,20 +419,22 @@ void StorageClient::delete_current_file() {
 }
 
 void StorageClient::set_file(FileInfo file) {
-  this->current_file_ = file;
-  int prefix_end = this->current_file_.path.find("://");
-  if (prefix_end < 0) {
-    ESP_LOGE(TAG, "Invalid path. Must start with a valid prefix");
-    return;
+  Storage *storage;
+  if (!file.prefix.empty()) {
+    // From a listing or get_file_info, already resolved
+    storage = find_storage(file.prefix);
+  } else {
+    std::string_view rest;
+    storage = resolve(file.path, file.prefix, rest);
+    if (storage != nullptr) {
+      file.path.erase(0, file.path.size() - rest.size());
+    }
   }
-  std::string prefix = this->current_file_.path.substr(0, prefix_end);
-  auto nstorage = storages.find(prefix);
-  if (nstorage == storages.end()) {
-    ESP_LOGE(TAG, "storage %s prefix does not exist", prefix);
+  if (storage == nullptr) {
     return;
   }
-  this->current_storage_ = nstorage->second;
-  this->current_file_.path = this->current_file_.path.substr(prefix_end + 3);
+  this->current_storage_ = storage;
+  this->current_file_ = std::move(file);
   this->current_storage_->set_file(&(this->current_file_));
   ESP_LOGVV(TAG, "Current File Set to %s", this->current_file_.path.c_str());
 }
@@ -243,10 +509,28 @@ bool StorageClient::append_array(uint8_t *data, size_t data_length) {
   }
 }
 
-std::map<std::string, Storage *> StorageClient::storages = {};
+const uint8_t *StorageClient::get_mapped_view(size_t offset, size_t length) {
+  if (current_storage_) {
+    this->current_storage_->set_file(&(this->current_file_));
+    return current_storage_->get_mapped_view(offset, length);
+  } else {
+    ESP_LOGE(TAG, "File has not been set");
+    return nullptr;
+  }
+}
+
+std::vector<StorageClient::Registration> StorageClient::storages = {};
 
 void StorageClient::add_storage(Storage *storage_inst, std::string prefix) {
-  StorageClient::storages[prefix] = storage_inst;
+  storage_inst->set_prefix(std::move(prefix));
+  std::string_view view = storage_inst->get_prefix();
+  for (auto &registration : StorageClient::storages) {
+    if (registration.prefix == view) {
+      registration = Registration{view, storage_inst};
+      return;
+    }
+  }
+  StorageClient::storages.push_back(Registration{view, storage_inst});
 }
 
 }  // namespace storage
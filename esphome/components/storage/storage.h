@@ -2,29 +2,45 @@
 
 #include "esphome/core/component.h"
 #include "esphome/core/entity_base.h"
+#include <string>
+#include <string_view>
 #include <vector>
-#include <map>
 
 namespace esphome {
 namespace storage {
 
+enum BufferPlacement : uint8_t {
+  BUFFER_INTERNAL,
+  BUFFER_PSRAM,
+};
+
 struct FileInfo {
   std::string path;
   size_t size;
   bool is_directory;
+  // Position of the next read or write
   size_t read_offset;
+  // Prefix of the storage holding path, owned by the storage. Empty when path still starts with "prefix://"
+  std::string_view prefix;
   FileInfo(std::string const &path, size_t size, bool is_directory);
   FileInfo();
+  // "prefix://path"
+  std::string full_path() const;
 };
 
-class Storage : public EntityBase {
+class Storage : public EntityBase, public Component {
  public:
+  void loop() override;
+  // Modified bytes are written back before the backend, set up earlier, shuts down
+  void on_shutdown() override;
+  float get_setup_priority() const override { return setup_priority::DATA - 1.0f; }
+
   // direct functions
   virtual uint8_t direct_read_byte(size_t offset) = 0;
-  virtual bool direct_write_byte(uint8_t data) = 0;
+  virtual bool direct_write_byte(size_t offset, uint8_t data) = 0;
   virtual bool direct_append_byte(uint8_t data) = 0;
   virtual size_t direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) = 0;
-  virtual bool direct_write_byte_array(uint8_t *data, size_t data_length) = 0;
+  virtual bool direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) = 0;
   virtual bool direct_append_byte_array(uint8_t *data, size_t data_length) = 0;
   std::vector<FileInfo> list_directory(const std::string &path) const;
   FileInfo get_file_info(const std::string &path) const;
@@ -36,29 +52,62 @@ class Storage : public EntityBase {
   size_t read_array(uint8_t *data, size_t data_length);
   bool write_array(uint8_t *data, size_t data_length);
   bool append_array(uint8_t *data, size_t data_length);
+  // Bytes of the current file readable in place, nullptr when the backend cannot map them
+  const uint8_t *get_mapped_view(size_t offset, size_t length);
 
-  // void write_buffer();
-  // void refresh_buffer(uint32_t offset = 0);
-  // uint8_t & operator[] (size_t index);
-  // uint32_t get_buffer_size();
-  // void write_on_shutdown(bool value);
+  // Reads and writes go through a window of buffer_size bytes of the current file, 0 disables it
+  void set_buffer_size(size_t buffer_size) { this->buffer_size_ = buffer_size; }
+  size_t get_buffer_size() const { return this->buffer_size_; }
+  void set_buffer_placement(BufferPlacement placement) { this->buffer_placement_ = placement; }
+  // Writes the modified bytes of the window back to the backend
+  bool flush();
+  // Moves the window to offset and loads it
+  bool refresh_buffer(size_t offset);
+  void set_prefix(std::string prefix) { this->prefix_ = std::move(prefix); }
+  std::string const &get_prefix() const { return this->prefix_; }
+  // Keep written bytes in the window until flush_size bytes are dirty, flush_interval ms have passed, the window
+  // moves or the file changes. Without write back every write call ends with a flush.
+  void set_write_back(bool write_back) { this->write_back_ = write_back; }
+  void set_flush_size(size_t flush_size) { this->flush_size_ = flush_size; }
+  void set_flush_interval(uint32_t flush_interval) { this->flush_interval_ = flush_interval; }
+  void write_on_shutdown(bool value) { this->write_on_shutdown_ = value; }
 
  protected:
   virtual void direct_set_file(const std::string &path) = 0;
   virtual void direct_delete_file(const std::string &path) = 0;
   virtual FileInfo direct_get_file_info(const std::string &path) const = 0;
   virtual std::vector<FileInfo> direct_list_directory(const std::string &path) const = 0;
-  // void load_buffer (uint32_t offset, uint32_t buffer_offset, uint32_t length);
-  // void write_buffer (uint32_t offset, uint32_t buffer_offset, uint32_t length);
-  // void allocate_buffer(uint32_t buffer_size);
+  virtual const uint8_t *direct_get_mapped_view(size_t, size_t) { return nullptr; }
+  bool allocate_buffer();
+  // Bytes of the window readable from offset, 0 when offset is outside of it
+  size_t buffered_bytes(size_t offset) const;
+  // Empties the window without writing it back
+  void drop_buffer();
+  bool buffer_write(size_t offset, const uint8_t *data, size_t data_length);
+  // Flushes when the write back thresholds are reached
+  bool check_flush();
+  void mark_dirty(size_t start, size_t end);
+  bool is_dirty(size_t block) const;
   void update_offset(size_t value);
-  // uint8_t * buffer_;
-  // uint32_t buffer_size_;
-  // uint32_t buffer_offset_;
-  FileInfo *current_file_;
-  // uint32_t base_offset_;
-  // uint32_t max_offset_;
-  // bool write_on_shutdown_;
+  uint8_t *buffer_{nullptr};
+  size_t buffer_size_{0};
+  BufferPlacement buffer_placement_{BUFFER_INTERNAL};
+  // File offset of the window and number of valid bytes in it
+  size_t buffer_offset_{0};
+  size_t buffer_length_{0};
+  // One bit per block of the window holding modified bytes
+  std::vector<uint32_t> dirty_map_;
+  size_t dirty_blocks_{0};
+  // When the first modified byte of the window was written
+  uint32_t dirty_since_{0};
+  bool write_back_{false};
+  size_t flush_size_{0};
+  uint32_t flush_interval_{1000};
+  bool write_on_shutdown_{true};
+  FileInfo *current_file_{nullptr};
+  // File open in the backend
+  std::string file_path_;
+  std::string prefix_;
 };
 
 class StorageClient : public EntityBase {
@@ -75,12 +124,21 @@ class StorageClient : public EntityBase {
   size_t read_array(uint8_t *data, size_t data_length);
   bool write_array(uint8_t *data, size_t data_length);
   bool append_array(uint8_t *data, size_t data_length);
+  const uint8_t *get_mapped_view(size_t offset, size_t length);
 
   static void add_storage(Storage *storage_inst, std::string prefix);
 
  protected:
-  static std::map<std::string, Storage *> storages;
-  Storage *current_storage_;
+  struct Registration {
+    std::string_view prefix;
+    Storage *storage;
+  };
+  // Storage of "prefix://path", with the registered prefix and the rest of the path. Never allocates.
+  static Storage *resolve(std::string_view path, std::string_view &prefix, std::string_view &rest);
+  static Storage *find_storage(std::string_view prefix);
+  // A handful of storages, a linear scan beats a map
+  static std::vector<Registration> storages;
+  Storage *current_storage_{nullptr};
   FileInfo current_file_;
 };
 
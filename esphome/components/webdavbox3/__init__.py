@@ -1,6 +1,7 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.const import CONF_ID, CONF_USERNAME, CONF_PASSWORD, CONF_PORT
+from ..sd_mmc_card import CONF_SD_MMC_CARD_ID, SdMmc
 
 CODEOWNERS = ["@youkorr"]
 DEPENDENCIES = ["sd_mmc_card"]
@@ -16,8 +17,12 @@ CONFIG_SCHEMA = cv.Schema({
     cv.Optional(CONF_PORT, default=81): cv.port,
     cv.Optional(CONF_USERNAME, default=""): cv.string,
     cv.Optional(CONF_PASSWORD, default=""): cv.string,
+    cv.Optional(CONF_SD_MMC_CARD_ID): cv.use_id(SdMmc),
 }).extend(cv.COMPONENT_SCHEMA)
 
+# Serveur HTTP d'ESP-IDF (esp_http_server), pas de version host
+CONFIG_SCHEMA = cv.All(CONFIG_SCHEMA, cv.only_on_esp32)
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
@@ -30,6 +35,11 @@ async def to_code(config):
         cg.add(var.set_username(config[CONF_USERNAME]))
     if CONF_PASSWORD in config:
         cg.add(var.set_password(config[CONF_PASSWORD]))
+
+    # Verrous partagés avec les autres composants qui utilisent la carte
+    if CONF_SD_MMC_CARD_ID in config:
+        sd_mmc_card = await cg.get_variable(config[CONF_SD_MMC_CARD_ID])
+        cg.add(var.set_sd_mmc_card(sd_mmc_card))
     
     return var
 
@@ -10,6 +10,9 @@
 #include "esp_netif.h"
 #include <ctime>
 #include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <functional>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -624,29 +627,18 @@ esp_err_t WebDAVBox3::handle_webdav_propfind(httpd_req_t *req) {
 
   // Ajouter plus de logs détaillés
   ESP_LOGI(TAG, "PROPFIND sur %s (URI: %s)", path.c_str(), req->uri);
+
+  sd_mmc_card::PathLock lock;
+  if (!inst->lock_path(path, false, lock))
+    return send_locked_response(req);
   
   // Vérifier si le chemin existe
   struct stat st;
-  if (stat(path.c_str(), &st) != 0) {
+  if (!inst->stat_path(path, st)) {
     ESP_LOGE(TAG, "Chemin non trouvé: %s (errno: %d)", path.c_str(), errno);
     return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not Found");
   }
   
-  // Lister le contenu du répertoire pour diagnostic
-  if (S_ISDIR(st.st_mode)) {
-    DIR *dir = opendir(path.c_str());
-    if (dir) {
-      ESP_LOGI(TAG, "Contenu du répertoire %s:", path.c_str());
-      struct dirent *entry;
-      while ((entry = readdir(dir)) != nullptr) {
-        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
-          ESP_LOGI(TAG, "  - %s", entry->d_name);
-        }
-      }
-      closedir(dir);
-    }
-  }
-  
   bool is_directory = S_ISDIR(st.st_mode);
   std::string depth_header = "0";  // Par défaut, profondeur 0
   
@@ -674,28 +666,41 @@ esp_err_t WebDAVBox3::handle_webdav_propfind(httpd_req_t *req) {
   
   // Si c'est un répertoire et que la profondeur > 0, lister son contenu
   if (is_directory && (depth_header == "1" || depth_header == "infinity")) {
-    auto files = list_dir(path);
-    ESP_LOGI(TAG, "Trouvé %d fichiers/dossiers dans %s", files.size(), path.c_str());
-    
-    for (const auto &file_name : files) {
-      std::string file_path = path;
-      if (file_path.back() != '/') file_path += '/';
-      file_path += file_name;
+    // Un seul parcours du répertoire, les métadonnées viennent avec chaque entrée
+    size_t count = 0;
+    auto add_entry = [&](const std::string &file_name, bool is_file_dir, time_t mtime, size_t size) {
+      std::string href = uri_path;
+      if (href.back() != '/') href += '/';
+      href += file_name;
+      if (is_file_dir) href += '/';
       
-      struct stat file_stat;
-      if (stat(file_path.c_str(), &file_stat) == 0) {
-        bool is_file_dir = S_ISDIR(file_stat.st_mode);
-        std::string href = uri_path;
-        if (href.back() != '/') href += '/';
-        href += file_name;
-        if (is_file_dir) href += '/';
+      ESP_LOGV(TAG, "Ajout de %s à la réponse PROPFIND (est_dir: %d)", href.c_str(), is_file_dir);
+      response += generate_prop_xml(href, is_file_dir, mtime, size);
+      count++;
+    };
+    
+    if (inst->sd_mmc_card_ != nullptr) {
+      // Servi depuis le cache des dossiers du composant SD quand il est configuré
+      auto on_entry = [&](const sd_mmc_card::FileInfo &info) {
+        add_entry(info.path.substr(info.path.rfind('/') + 1), info.is_directory, info.mtime, info.size);
+        return true;
+      };
+      inst->sd_mmc_card_->for_each_entry(inst->sd_mmc_card_->card_path(path), 0, on_entry);
+    } else {
+      for (const auto &file_name : list_dir(path)) {
+        std::string file_path = path;
+        if (file_path.back() != '/') file_path += '/';
+        file_path += file_name;
         
-        ESP_LOGI(TAG, "Ajout de %s à la réponse PROPFIND (est_dir: %d)", href.c_str(), is_file_dir);
-        response += generate_prop_xml(href, is_file_dir, file_stat.st_mtime, file_stat.st_size);
-      } else {
-        ESP_LOGE(TAG, "Impossible d'obtenir le stat pour %s (errno: %d)", file_path.c_str(), errno);
+        struct stat file_stat;
+        if (stat(file_path.c_str(), &file_stat) == 0) {
+          add_entry(file_name, S_ISDIR(file_stat.st_mode), file_stat.st_mtime, file_stat.st_size);
+        } else {
+          ESP_LOGE(TAG, "Impossible d'obtenir le stat pour %s (errno: %d)", file_path.c_str(), errno);
+        }
       }
     }
+    ESP_LOGI(TAG, "Trouvé %d fichiers/dossiers dans %s", count, path.c_str());
   }
   
   response += "</D:multistatus>";
@@ -715,15 +720,81 @@ esp_err_t WebDAVBox3::handle_webdav_propfind(httpd_req_t *req) {
 }
 
 
+bool WebDAVBox3::stat_path(const std::string &path, struct stat &st) {
+  if (sd_mmc_card_ == nullptr)
+    return stat(path.c_str(), &st) == 0;
+  // Métadonnées partagées avec les autres serveurs via le cache du composant SD
+  sd_mmc_card::FileInfo info;
+  if (!sd_mmc_card_->stat(path, info)) {
+    errno = ENOENT;
+    return false;
+  }
+  sd_mmc_card::file_info_to_stat(info, st);
+  return true;
+}
+
+bool WebDAVBox3::lock_path(const std::string &path, bool exclusive, sd_mmc_card::PathLock &lock) {
+  if (sd_mmc_card_ == nullptr)
+    return true;
+  lock = sd_mmc_card_->lock_path(path, exclusive);
+  return lock.is_locked();
+}
+
+bool WebDAVBox3::create_directories(const std::string &path) {
+  // L'appelant tient le verrou d'un chemin sous path, un verrou exclusif sur les dossiers créés
+  // entrerait en conflit avec lui
+  if (sd_mmc_card_ == nullptr)
+    return create_directories_util(path);
+  return sd_mmc_card_->create_directories(path);
+}
+
+FILE *WebDAVBox3::open_stream(const std::string &path, const char *mode) {
+  if (sd_mmc_card_ == nullptr)
+    return fopen(path.c_str(), mode);
+  // Les requêtes tournent dans la tâche du serveur HTTP, elles peuvent attendre un handle libre
+  return sd_mmc_card_->open_stream(path, mode, sd_mmc_card::DEFAULT_LOCK_TIMEOUT_MS);
+}
+
+bool WebDAVBox3::close_stream(FILE *file) {
+  if (sd_mmc_card_ == nullptr)
+    return fclose(file) == 0;
+  return sd_mmc_card_->close_stream(file);
+}
+
+bool WebDAVBox3::remove_file(const std::string &path) {
+  if (sd_mmc_card_ == nullptr)
+    return remove(path.c_str()) == 0;
+  return sd_mmc_card_->remove_file(path);
+}
+
+// 507 quand la carte est pleine, 500 pour les autres erreurs d'écriture
+esp_err_t WebDAVBox3::send_write_error(httpd_req_t *req, int err) {
+  if (err == ENOSPC) {
+    httpd_resp_set_status(req, "507 Insufficient Storage");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write error");
+}
+
+esp_err_t WebDAVBox3::send_locked_response(httpd_req_t *req) {
+  httpd_resp_set_status(req, "423 Locked");
+  httpd_resp_send(req, NULL, 0);
+  return ESP_OK;
+}
+
 esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     auto *inst = static_cast<WebDAVBox3 *>(req->user_ctx);
     std::string path = get_file_path(req, inst->root_path_);
     
     ESP_LOGI(TAG, "GET %s (URI: %s)", path.c_str(), req->uri);
+
+    sd_mmc_card::PathLock lock;
+    if (!inst->lock_path(path, false, lock))
+        return send_locked_response(req);
     
     // Vérifier si le fichier existe
     struct stat st;
-    if (stat(path.c_str(), &st) != 0) {
+    if (!inst->stat_path(path, st)) {
         ESP_LOGE(TAG, "Fichier non trouvé: %s (errno: %d)", path.c_str(), errno);
         return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
     }
@@ -734,7 +805,7 @@ esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     }
     
     // Ouvrir le fichier
-    FILE *file = fopen(path.c_str(), "rb");
+    FILE *file = inst->open_stream(path, "rb");
     if (!file) {
         ESP_LOGE(TAG, "Impossible d'ouvrir le fichier: %s (errno: %d)", path.c_str(), errno);
         return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
@@ -786,6 +857,12 @@ esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     httpd_resp_set_type(req, content_type);
     //httpd_resp_set_hdr(req, "Content-Length", std::to_string(st.st_size).c_str());
     httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+
+    // Requête partielle (lecture vidéo, avance rapide) : lecture positionnée via le composant SD
+    char range_value[64];
+    if (httpd_req_get_hdr_value_str(req, "Range", range_value, sizeof(range_value)) == ESP_OK) {
+        return inst->send_range(req, path, file, (size_t)st.st_size, range_value);
+    }
     
     ESP_LOGI(TAG, "Envoi du fichier %s (%zu octets, type: %s)", path.c_str(), (size_t)st.st_size, content_type);
     
@@ -803,7 +880,7 @@ esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     
     if (!buffer) {
         ESP_LOGE(TAG, "Impossible d'allouer le buffer pour l'envoi");
-        fclose(file);
+        inst->close_stream(file);
         return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server Error");
     }
     
@@ -858,7 +935,7 @@ esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     
     // Libérer le buffer
     free(buffer);
-    fclose(file);
+    inst->close_stream(file);
     
     unsigned long end_time = esp_timer_get_time() / 1000;
     float total_time = (end_time - start_time) / 1000.0f;
@@ -876,7 +953,107 @@ esp_err_t WebDAVBox3::handle_webdav_get(httpd_req_t *req) {
     
     return err;
 }
+// Formats acceptés : "bytes=debut-fin", "bytes=debut-" et "bytes=-suffixe", une seule plage
+static bool parse_range(const char *range, size_t file_size, size_t &start, size_t &end) {
+    if (file_size == 0 || strncmp(range, "bytes=", 6) != 0)
+        return false;
+    const char *spec = range + 6;
+    char *parsed;
+    end = file_size - 1;
+    if (*spec == '-') {
+        if (!isdigit((unsigned char) spec[1]))
+            return false;
+        size_t suffix = strtoull(spec + 1, &parsed, 10);
+        if (*parsed != '\0' || suffix == 0)
+            return false;
+        start = suffix >= file_size ? 0 : file_size - suffix;
+        return true;
+    }
+    if (!isdigit((unsigned char) *spec))
+        return false;
+    start = strtoull(spec, &parsed, 10);
+    if (*parsed != '-')
+        return false;
+    const char *end_spec = parsed + 1;
+    if (*end_spec != '\0') {
+        if (!isdigit((unsigned char) *end_spec))
+            return false;
+        size_t last = strtoull(end_spec, &parsed, 10);
+        if (*parsed != '\0')
+            return false;
+        end = std::min(last, end);
+    }
+    return start < file_size && start <= end;
+}
+
+esp_err_t WebDAVBox3::send_range(httpd_req_t *req, const std::string &path, FILE *file, size_t file_size,
+                                 const char *range) {
+    // Le flux est fermé ici dans tous les cas
+    std::unique_ptr<FILE, std::function<void(FILE *)>> stream(file, [this](FILE *f) { this->close_stream(f); });
+    size_t start = 0;
+    size_t end = 0;
+    if (!parse_range(range, file_size, start, end)) {
+        ESP_LOGW(TAG, "Range invalide pour %s: %s", path.c_str(), range);
+        std::string content_range = "bytes */" + std::to_string(file_size);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", content_range.c_str());
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // Avec le composant SD et fast seek, le lecteur se positionne sans parcourir la chaîne de clusters
+    sd_mmc_card::FileReader reader;
+    if (sd_mmc_card_ != nullptr) {
+        // Rend le descripteur au pool avant que le lecteur en prenne un
+        stream.reset();
+        reader = sd_mmc_card_->open_file(sd_mmc_card_->card_path(path));
+        if (!reader.is_open())
+            return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+    } else if (fseek(file, (long) start, SEEK_SET) != 0) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Seek failed");
+    }
+
+    std::string content_range =
+        "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(file_size);
+    httpd_resp_set_status(req, "206 Partial Content");
+    httpd_resp_set_hdr(req, "Content-Range", content_range.c_str());
+
+    const size_t CHUNK_SIZE = 16384;
+    std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[CHUNK_SIZE]);
+    if (!buffer)
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server Error");
+    size_t offset = start;
+    while (offset <= end) {
+        size_t len = 0;
+        size_t wanted = std::min(CHUNK_SIZE, end - offset + 1);
+        if (sd_mmc_card_ != nullptr) {
+            sd_mmc_card_->run_io(sd_mmc_card::IO_PRIORITY_BULK,
+                                 [&]() { len = reader.read(offset, buffer.get(), wanted); });
+        } else {
+            len = fread(buffer.get(), 1, wanted, file);
+        }
+        if (len == 0) {
+            // L'en-tête 206 est parti : fermer la connexion plutôt que terminer une réponse tronquée
+            ESP_LOGE(TAG, "Erreur de lecture à l'offset %zu de %s", offset, path.c_str());
+            return ESP_FAIL;
+        }
+        if (httpd_resp_send_chunk(req, reinterpret_cast<const char *>(buffer.get()), len) != ESP_OK)
+            return ESP_FAIL;
+        offset += len;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
 float WebDAVBox3::benchmark_sd_read(const std::string &filepath) {
+    // Le moteur de benchmark de la carte mesure sans buffer stdio et respecte les verrous
+    if (sd_mmc_card_ != nullptr) {
+        std::string card_path = filepath;
+        if (card_path.rfind("/sdcard", 0) == 0)
+            card_path = card_path.substr(strlen("/sdcard"));
+        float mbps = sd_mmc_card_->benchmark_sequential_read(card_path, 8192);
+        ESP_LOGI(TAG, "Benchmark SD: %.2f MB/s", mbps);
+        return mbps;
+    }
+
     FILE *file = fopen(filepath.c_str(), "rb");
     if (!file) {
         ESP_LOGE(TAG, "Erreur ouverture %s", filepath.c_str());
@@ -926,14 +1103,14 @@ esp_err_t WebDAVBox3::handle_webdav_get_small_file(httpd_req_t *req, const std::
     }
     
     // Ouvrir et lire le fichier
-    FILE *file = fopen(path.c_str(), "rb");
+    FILE *file = open_stream(path, "rb");
     if (!file) {
         heap_caps_free(buffer);
         return ESP_FAIL;
     }
     
     size_t bytes_read = fread(buffer, 1, file_size, file);
-    fclose(file);
+    close_stream(file);
     
     if (bytes_read != file_size) {
         ESP_LOGE(TAG, "Échec de lecture du fichier complet: %zu/%zu", bytes_read, file_size);
@@ -990,6 +1167,10 @@ esp_err_t WebDAVBox3::handle_webdav_put(httpd_req_t *req) {
     }
 
     ESP_LOGI(TAG, "PUT %s (URI: %s)", path.c_str(), req->uri);
+
+    sd_mmc_card::PathLock lock;
+    if (!inst->lock_path(path, true, lock))
+        return send_locked_response(req);
     ESP_LOGI(TAG, "Content length: %d bytes", req->content_len);
 
     // Ne pas écraser un dossier
@@ -1004,14 +1185,24 @@ esp_err_t WebDAVBox3::handle_webdav_put(httpd_req_t *req) {
         std::string dir_path = path.substr(0, last_slash);
         struct stat dir_stat;
         if (stat(dir_path.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
-            if (!create_directories_util(dir_path)) {
+            if (!inst->create_directories(dir_path)) {
                 return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create parent directory");
             }
         }
     }
 
-    // Ouverture du fichier en écriture
-    FILE *file = fopen(path.c_str(), "wb");
+    // Taille annoncée : les clusters sont réservés d'un seul bloc contigu plutôt qu'au fil de l'eau,
+    // le fichier est ramené à la taille reçue avant fermeture
+    bool preallocated = !is_chunked && req->content_len > 0 && inst->sd_mmc_card_ != nullptr &&
+                        inst->sd_mmc_card_->preallocate(path, req->content_len);
+
+    // Un fichier existant est supprimé plutôt que tronqué par "wb", ses clusters partent ainsi au trim
+    if (!preallocated && inst->stat_path(path, st) && S_ISREG(st.st_mode)) {
+        inst->remove_file(path);
+    }
+
+    // Ouverture du fichier en écriture ("r+b" conserve la réservation)
+    FILE *file = inst->open_stream(path, preallocated ? "r+b" : "wb");
     if (!file) {
         ESP_LOGE(TAG, "Cannot open file: %s (errno=%d)", path.c_str(), errno);
         return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to open file");
@@ -1021,6 +1212,22 @@ esp_err_t WebDAVBox3::handle_webdav_put(httpd_req_t *req) {
     char buffer[4096];
     int total_received = 0;
     int timeout_count = 0;
+    // Faux si les données tamponnées n'ont pas pu être écrites, errno indique pourquoi
+    auto close_file = [&]() {
+        errno = 0;
+        bool ok = !preallocated || (fflush(file) == 0 && ftruncate(fileno(file), total_received) == 0);
+        if (!ok) {
+            ESP_LOGE(TAG, "Cannot trim preallocated file: %s (errno=%d)", path.c_str(), errno);
+        }
+        int err = errno;
+        if (!inst->close_stream(file)) {
+            ok = false;
+            if (err == 0)
+                err = errno;
+        }
+        errno = err;
+        return ok;
+    };
 
     while (true) {
         int received = httpd_req_recv(req, buffer, sizeof(buffer));
@@ -1029,14 +1236,14 @@ esp_err_t WebDAVBox3::handle_webdav_put(httpd_req_t *req) {
             if (received == HTTPD_SOCK_ERR_TIMEOUT) {
                 if (++timeout_count >= 5) {
                     ESP_LOGE(TAG, "Too many timeouts, aborting");
-                    fclose(file);
+                    close_file();
                     return httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Timeout");
                 }
                 continue;
             } else {
                 ESP_LOGE(TAG, "Socket error: %d", received);
-                fclose(file);
-                unlink(path.c_str());
+                close_file();
+                inst->remove_file(path);
                 return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Socket error");
             }
         }
@@ -1046,18 +1253,25 @@ esp_err_t WebDAVBox3::handle_webdav_put(httpd_req_t *req) {
             break;
         }
 
+        errno = 0;
         size_t written = fwrite(buffer, 1, received, file);
         if (written != received) {
-            ESP_LOGE(TAG, "Write error: wrote %zu / %d", written, received);
-            fclose(file);
-            unlink(path.c_str());
-            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write error");
+            int err = errno;
+            ESP_LOGE(TAG, "Write error: wrote %zu / %d (errno=%d)", written, received, err);
+            close_file();
+            inst->remove_file(path);
+            return send_write_error(req, err);
         }
 
         total_received += received;
     }
 
-    fclose(file);
+    if (!close_file()) {
+        int err = errno;
+        ESP_LOGE(TAG, "Cannot close file: %s (errno=%d)", path.c_str(), err);
+        inst->remove_file(path);
+        return send_write_error(req, err);
+    }
     ESP_LOGI(TAG, "✅ Upload complete: %s (%d bytes)", path.c_str(), total_received);
 
     // Réponse HTTP
@@ -1073,6 +1287,10 @@ esp_err_t WebDAVBox3::handle_webdav_delete(httpd_req_t *req) {
   std::string path = get_file_path(req, inst->root_path_);
 
   ESP_LOGD(TAG, "DELETE %s", path.c_str());
+
+  sd_mmc_card::PathLock lock;
+  if (!inst->lock_path(path, true, lock))
+    return send_locked_response(req);
   
   // Vérifier si c'est un répertoire ou un fichier
   if (is_dir(path)) {
@@ -1087,7 +1305,7 @@ esp_err_t WebDAVBox3::handle_webdav_delete(httpd_req_t *req) {
     }
   } else {
     // Supprimer le fichier
-    if (remove(path.c_str()) == 0) {
+    if (inst->remove_file(path)) {
       ESP_LOGI(TAG, "Fichier supprimé: %s", path.c_str());
       httpd_resp_set_status(req, "204 No Content");
       httpd_resp_send(req, NULL, 0);
@@ -1105,6 +1323,10 @@ esp_err_t WebDAVBox3::handle_webdav_mkcol(httpd_req_t *req) {
     std::string path = get_file_path(req, inst->root_path_);
     
     ESP_LOGI(TAG, "MKCOL %s (URI: %s)", path.c_str(), req->uri);
+
+    sd_mmc_card::PathLock lock;
+    if (!inst->lock_path(path, true, lock))
+        return send_locked_response(req);
     
     // Vérifier si le chemin existe déjà
     struct stat st;
@@ -1170,12 +1392,16 @@ esp_err_t WebDAVBox3::handle_webdav_move(httpd_req_t *req) {
     dst += url_decode(uri_str);
     
     ESP_LOGD(TAG, "MOVE de %s vers %s", src.c_str(), dst.c_str());
+
+    sd_mmc_card::PathLock src_lock, dst_lock;
+    if (!inst->lock_path(src, true, src_lock) || !inst->lock_path(dst, true, dst_lock))
+      return send_locked_response(req);
     
     // Créer le répertoire parent si nécessaire
     std::string parent_dir = dst.substr(0, dst.find_last_of('/'));
     if (!parent_dir.empty() && !is_dir(parent_dir)) {
       ESP_LOGI(TAG, "Création du répertoire parent: %s", parent_dir.c_str());
-      if (mkdir(parent_dir.c_str(), 0755) != 0) {
+      if (!inst->create_directories(parent_dir)) {
         ESP_LOGE(TAG, "Impossible de créer le répertoire parent: %s (errno: %d)", parent_dir.c_str(), errno);
       }
     }
@@ -1215,11 +1441,15 @@ esp_err_t WebDAVBox3::handle_webdav_copy(httpd_req_t *req) {
     }
     
     ESP_LOGD(TAG, "COPY de %s vers %s", src.c_str(), dst.c_str());
+
+    sd_mmc_card::PathLock src_lock, dst_lock;
+    if (!inst->lock_path(src, false, src_lock) || !inst->lock_path(dst, true, dst_lock))
+      return send_locked_response(req);
     
     // Créer le répertoire parent si nécessaire
     std::string parent_dir = dst.substr(0, dst.find_last_of('/'));
     if (!parent_dir.empty() && !is_dir(parent_dir)) {
-      mkdir(parent_dir.c_str(), 0777);
+      inst->create_directories(parent_dir);
     }
     
     // Pour les répertoires, il faudrait une copie récursive (non implémentée ici)
@@ -4,6 +4,7 @@
 #include "esphome/core/helpers.h"
 #include <string>
 #include <vector>
+#include <sys/stat.h>
 #include "driver/sdmmc_host.h"
 #include "driver/sdmmc_defs.h"
 #include "../sd_mmc_card/sd_mmc_card.h"
@@ -23,6 +24,7 @@ class WebDAVBox3 : public Component {
   void set_port(uint16_t port) { port_ = port; }
   void set_username(const std::string &username) { username_ = username; }
   void set_password(const std::string &password) { password_ = password; }
+  void set_sd_mmc_card(sd_mmc_card::SdMmc *card) { sd_mmc_card_ = card; }
   void enable_authentication(bool enabled) { auth_enabled_ = enabled; }
   void add_cors_headers(httpd_req_t *req);
   void register_handlers();
@@ -39,6 +41,7 @@ class WebDAVBox3 : public Component {
   std::string username_;
   std::string password_;
   bool auth_enabled_{false};
+  sd_mmc_card::SdMmc *sd_mmc_card_{nullptr};
 
   bool sdcard_mounted_ = false;  // Ajout de ta variable privée
 
@@ -51,10 +54,25 @@ class WebDAVBox3 : public Component {
   bool authenticate(httpd_req_t *req);
   esp_err_t send_auth_required_response(httpd_req_t *req);
   
+  // Verrous partagés avec les autres clients de la carte (FTP, Box3Web, ...)
+  bool lock_path(const std::string &path, bool exclusive, sd_mmc_card::PathLock &lock);
+  // stat() servi par le cache du composant SD quand il est configuré
+  bool stat_path(const std::string &path, struct stat &st);
+  // Flux tamponnés par le pool du composant SD quand il est configuré
+  FILE *open_stream(const std::string &path, const char *mode);
+  bool close_stream(FILE *file);
+  // Suppression par le composant SD pour que les clusters libérés partent au trim
+  bool remove_file(const std::string &path);
+  static esp_err_t send_locked_response(httpd_req_t *req);
+  static esp_err_t send_write_error(httpd_req_t *req, int err);
+
   // WebDAV path conversion
   std::string uri_to_filepath(const char* uri);
 
   esp_err_t handle_webdav_get_small_file(httpd_req_t *req, const std::string &path, size_t file_size);
+  // Réponse 206 à une requête Range, lue via le composant SD (fast seek) s'il est configuré, sinon dans file.
+  // Ferme file.
+  esp_err_t send_range(httpd_req_t *req, const std::string &path, FILE *file, size_t file_size, const char *range);
   
   // WebDAV handler methods
   static esp_err_t handle_root(httpd_req_t *req);
@@ -71,7 +89,8 @@ class WebDAVBox3 : public Component {
   static esp_err_t handle_webdav_unlock(httpd_req_t *req);
   static esp_err_t handle_webdav_proppatch(httpd_req_t *req);
   static esp_err_t handle_post(httpd_req_t *req);
-  static bool create_directories(const std::string& path);
+  // Crée path et ses parents ; avec le composant SD, ses caches sont invalidés
+  bool create_directories(const std::string &path);
   
   // Helper methods
   static std::string get_file_path(httpd_req_t *req, const std::string &root_path);
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace esphome {
+
+namespace setup_priority {
+const float BUS = 1000.0f;
+const float HARDWARE = 800.0f;
+const float DATA = 600.0f;
+const float LATE = -100.0f;
+}  // namespace setup_priority
+
+class Component {
+ public:
+  virtual ~Component() = default;
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return 0.0f; }
+  virtual void on_shutdown() {}
+  void mark_failed() { this->failed_ = true; }
+  bool is_failed() const { return this->failed_; }
+  void status_set_warning() {}
+  void status_clear_warning() {}
+
+ protected:
+  bool failed_{false};
+};
+
+class PollingComponent : public Component {
+ public:
+  virtual void update() = 0;
+  void set_update_interval(uint32_t) {}
+};
+
+}  // namespace esphome
@@ -0,0 +1,4 @@
+#pragma once
+// Host test build of the card and storage components
+#define USE_HOST
+#define USE_STORAGE
@@ -0,0 +1,5 @@
+#pragma once
+
+namespace esphome {
+class EntityBase {};
+}  // namespace esphome
@@ -0,0 +1,9 @@
+#pragma once
+
+namespace esphome {
+class GPIOPin {
+ public:
+  virtual void setup() {}
+  virtual void digital_write(bool) {}
+};
+}  // namespace esphome
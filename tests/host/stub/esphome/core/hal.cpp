@@ -0,0 +1,45 @@
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+#include <chrono>
+#include <random>
+#include <thread>
+
+namespace esphome {
+
+static const auto START = std::chrono::steady_clock::now();
+
+uint32_t millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - START).count();
+}
+
+uint32_t micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - START).count();
+}
+
+void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+uint32_t random_uint32() {
+  static std::mt19937 generator(42);
+  return generator();
+}
+
+uint16_t crc16(const uint8_t *data, uint16_t len, uint16_t crc, uint16_t reverse_poly, bool refin, bool refout) {
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ reverse_poly : crc >> 1;
+  }
+  return crc;
+}
+
+uint32_t fnv1_hash(const std::string &str) {
+  uint32_t hash = 2166136261UL;
+  for (char c : str) {
+    hash *= 16777619UL;
+    hash ^= c;
+  }
+  return hash;
+}
+
+}  // namespace esphome
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+namespace esphome {
+
+template<class T> class RAMAllocator {
+ public:
+  enum : uint8_t { NONE = 0, ALLOC_EXTERNAL = 1, ALLOC_INTERNAL = 2 };
+  RAMAllocator(uint8_t flags = 0) {}
+  T *allocate(size_t n) { return static_cast<T *>(malloc(n * sizeof(T))); }
+  void deallocate(T *p, size_t) { free(p); }
+};
+
+uint32_t random_uint32();
+uint16_t crc16(const uint8_t *data, uint16_t len, uint16_t crc = 0xffff, uint16_t reverse_poly = 0xa001,
+               bool refin = false, bool refout = false);
+uint32_t fnv1_hash(const std::string &str);
+
+template<typename T> T clamp(T value, T min, T max) { return value < min ? min : value > max ? max : value; }
+
+inline bool str_startswith(const std::string &str, const std::string &start) { return str.rfind(start, 0) == 0; }
+inline bool str_endswith(const std::string &str, const std::string &end) {
+  return str.size() >= end.size() && str.compare(str.size() - end.size(), end.size(), end) == 0;
+}
+
+}  // namespace esphome
@@ -0,0 +1,16 @@
+#pragma once
+#include <cinttypes>
+#include <cstdio>
+
+#define TRUEFALSE(x) ((x) ? "TRUE" : "FALSE")
+#define YESNO(x) ((x) ? "YES" : "NO")
+#define LOG_PIN(prefix, pin)
+
+// Errors and warnings stay visible in the test output
+#define ESP_LOGE(tag, ...) (fprintf(stderr, "[E][%s] ", tag), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define ESP_LOGW(tag, ...) (fprintf(stderr, "[W][%s] ", tag), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define ESP_LOGI(tag, ...) ((void) (tag))
+#define ESP_LOGD(tag, ...) ((void) (tag))
+#define ESP_LOGV(tag, ...) ((void) (tag))
+#define ESP_LOGVV(tag, ...) ((void) (tag))
+#define ESP_LOGCONFIG(tag, ...) ((void) (tag))
@@ -0,0 +1,55 @@
+#pragma once
+// Minimal test registry for the host tests, each test file is its own executable
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+namespace esphome {
+namespace testing {
+
+struct TestCase {
+  const char *name;
+  std::function<void()> body;
+};
+
+inline std::vector<TestCase> &registry() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+inline int &failures() {
+  static int count = 0;
+  return count;
+}
+
+struct Registrar {
+  Registrar(const char *name, std::function<void()> body) { registry().push_back(TestCase{name, std::move(body)}); }
+};
+
+}  // namespace testing
+}  // namespace esphome
+
+#define TEST(name) \
+  static void name(); \
+  static esphome::testing::Registrar name##_registrar(#name, name); \
+  static void name()
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      esphome::testing::failures()++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+#define TEST_MAIN() \
+  int main() { \
+    for (auto const &test : esphome::testing::registry()) { \
+      int before = esphome::testing::failures(); \
+      test.body(); \
+      printf("%s %s\n", esphome::testing::failures() == before ? "PASS" : "FAIL", test.name); \
+    } \
+    return esphome::testing::failures() == 0 ? 0 : 1; \
+  }
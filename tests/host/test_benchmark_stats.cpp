@@ -0,0 +1,41 @@
+#include "test.h"
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+TEST(percentiles_of_sorted_samples) {
+  LatencyStats stats;
+  for (uint32_t i = 100; i > 0; i--)
+    stats.add(i);
+  stats.finalize();
+  CHECK_EQ(stats.percentile(0), 1u);
+  CHECK_EQ(stats.percentile(50), 51u);
+  CHECK_EQ(stats.percentile(100), 100u);
+  CHECK(stats.mean() == 50.5f);
+}
+
+TEST(histogram_buckets_are_powers_of_two) {
+  LatencyStats stats;
+  for (uint32_t sample : {0u, 1u, 2u, 3u, 4u, 1000u})
+    stats.add(sample);
+  std::vector<uint32_t> buckets = stats.histogram();
+  CHECK_EQ(buckets.size(), 10u);
+  CHECK_EQ(buckets[0], 2u);
+  CHECK_EQ(buckets[1], 2u);
+  CHECK_EQ(buckets[2], 1u);
+  CHECK_EQ(buckets[9], 1u);
+  CHECK(LatencyStats().histogram().empty());
+}
+
+TEST(json_carries_the_histogram) {
+  BenchmarkResult result;
+  result.stat_latency.add(5);
+  result.stat_latency.finalize();
+  std::string json = result.to_json();
+  CHECK(json.find("\"stat\":{\"count\":1,") != std::string::npos);
+  CHECK(json.find("\"histogram\":[0,0,1]}") != std::string::npos);
+  CHECK(json.find("\"fopen\":{\"count\":0,") != std::string::npos);
+}
+
+TEST_MAIN()
@@ -0,0 +1,75 @@
+#include "test.h"
+
+#include <cstdlib>
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+static DirectoryCache::Dentry entry(const char *name, bool is_directory) {
+  return DirectoryCache::Dentry{name, is_directory, 0, 0, 0};
+}
+
+TEST(lookup_from_the_parent_listing) {
+  DirectoryCache cache;
+  cache.set_limits(4, 16);
+  CHECK_EQ(cache.lookup("/a/f.txt"), DirectoryCache::LOOKUP_UNKNOWN);
+  cache.store("/a", {entry("f.txt", false), entry("Sub", true)}, cache.get_generation());
+  CHECK_EQ(cache.lookup("/a/f.txt"), DirectoryCache::LOOKUP_FILE);
+  CHECK_EQ(cache.lookup("/a/sub"), DirectoryCache::LOOKUP_DIRECTORY);
+  CHECK_EQ(cache.lookup("/a/g.txt"), DirectoryCache::LOOKUP_MISSING);
+}
+
+TEST(listing_read_across_an_invalidation_is_not_stored) {
+  DirectoryCache cache;
+  cache.set_limits(4, 16);
+  uint32_t generation = cache.get_generation();
+  cache.invalidate("/a/f.txt");
+  cache.store("/a", {entry("f.txt", false)}, generation);
+  CHECK_EQ(cache.lookup("/a/f.txt"), DirectoryCache::LOOKUP_UNKNOWN);
+}
+
+TEST(invalidate_drops_the_parent_and_everything_below) {
+  DirectoryCache cache;
+  cache.set_limits(8, 16);
+  cache.store("/", {entry("a", true), entry("b", true)}, cache.get_generation());
+  cache.store("/a", {entry("x", true)}, cache.get_generation());
+  cache.store("/a/x", {entry("f", false)}, cache.get_generation());
+  cache.store("/b", {entry("g", false)}, cache.get_generation());
+  cache.invalidate("/a");
+  CHECK_EQ(cache.lookup("/a"), DirectoryCache::LOOKUP_UNKNOWN);
+  CHECK_EQ(cache.lookup("/a/x"), DirectoryCache::LOOKUP_UNKNOWN);
+  CHECK_EQ(cache.lookup("/a/x/f"), DirectoryCache::LOOKUP_UNKNOWN);
+  CHECK_EQ(cache.lookup("/b/g"), DirectoryCache::LOOKUP_FILE);
+}
+
+static SdMmc *make_card() {
+  char root[] = "/tmp/sd_cache_XXXXXX";
+  SdMmc *card = new SdMmc();
+  card->set_host_root(mkdtemp(root));
+  card->set_directory_cache(8, 64);
+  card->set_stat_cache(16);
+  card->setup();
+  return card;
+}
+
+TEST(created_parents_show_up_in_cached_listings) {
+  SdMmc *card = make_card();
+  const uint8_t data[] = {1};
+  card->write_file("/a.txt", data, sizeof(data));
+  FileInfo info;
+  // Caches the root listing, where "x" is missing
+  CHECK(!card->stat("/x", info));
+
+  // Like a WebDAV PUT: the file lock is held while its parents are created
+  PathLock lock = card->lock_path("/x/y/z.txt", true);
+  CHECK(lock.is_locked());
+  CHECK(card->create_directories(card->get_mount_point() + "/x/y"));
+  CHECK(card->stat("/x", info));
+  CHECK(info.is_directory);
+  CHECK(card->stat("/x/y", info));
+  CHECK(card->create_directories("/x/y"));
+  CHECK(!card->create_directories("/a.txt/y"));
+}
+
+TEST_MAIN()
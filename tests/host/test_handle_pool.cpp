@@ -0,0 +1,99 @@
+#include "test.h"
+
+#include <cstdio>
+#include <thread>
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+static HandlePool::Handle open_handle() {
+  HandlePool::Handle handle;
+  handle.file = tmpfile();
+  fputs("data", handle.file);
+  return handle;
+}
+
+TEST(slots_run_out_and_come_back) {
+  HandlePool pool;
+  pool.set_slots(2);
+  CHECK(pool.try_acquire());
+  CHECK(pool.acquire(0));
+  CHECK(!pool.try_acquire());
+  CHECK(!pool.acquire(10));
+  CHECK_EQ(pool.get_stats().timeouts, 1u);
+  pool.release();
+  CHECK(pool.try_acquire());
+}
+
+TEST(parked_handle_is_taken_rewound_by_the_next_reader) {
+  HandlePool pool;
+  pool.set_slots(2);
+  CHECK(pool.try_acquire());
+  pool.park("/a", open_handle());
+  CHECK_EQ(pool.get_idle_count(), 1u);
+  HandlePool::Handle handle;
+  CHECK(!pool.take("/b", handle));
+  CHECK(pool.take("/a", handle));
+  CHECK_EQ(ftell(handle.file), 0);
+  CHECK_EQ(pool.get_stats().reused, 1u);
+  fclose(handle.file);
+  pool.release();
+}
+
+TEST(idle_handle_gives_its_slot_to_a_new_file) {
+  HandlePool pool;
+  pool.set_slots(1);
+  CHECK(pool.try_acquire());
+  pool.park("/a", open_handle());
+  // The only slot is held by the idle handle, it is closed for the newcomer
+  CHECK(pool.try_acquire());
+  CHECK_EQ(pool.get_idle_count(), 0u);
+  pool.release();
+}
+
+TEST(drop_closes_the_handles_below_a_directory) {
+  HandlePool pool;
+  pool.set_slots(6);
+  for (const char *path : {"/dir/a", "/dir/sub/b", "/directory/c"}) {
+    CHECK(pool.try_acquire());
+    pool.park(path, open_handle());
+  }
+  pool.drop("/dir");
+  CHECK_EQ(pool.get_idle_count(), 1u);
+  HandlePool::Handle handle;
+  CHECK(pool.take("/directory/c", handle));
+  fclose(handle.file);
+}
+
+TEST(drop_and_take_ignore_case) {
+  HandlePool pool;
+  pool.set_slots(6);
+  for (const char *path : {"/video.mp4", "/Dir/a"}) {
+    CHECK(pool.try_acquire());
+    pool.park(path, open_handle());
+  }
+  pool.drop("/VIDEO.MP4");
+  CHECK_EQ(pool.get_idle_count(), 1u);
+  HandlePool::Handle handle;
+  CHECK(pool.take("/dir/A", handle));
+  fclose(handle.file);
+  pool.release();
+}
+
+TEST(released_slot_goes_to_the_waiter) {
+  HandlePool pool;
+  pool.set_slots(1);
+  CHECK(pool.try_acquire());
+  bool served = false;
+  std::thread waiter([&]() { served = pool.acquire(2000); });
+  while (pool.get_stats().waits == 0)
+    std::this_thread::yield();
+  pool.release();
+  waiter.join();
+  CHECK(served);
+  // The waiter holds the only slot now
+  CHECK(!pool.try_acquire());
+}
+
+TEST_MAIN()
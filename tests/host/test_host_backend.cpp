@@ -0,0 +1,109 @@
+#include "test.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+static SdMmc *make_card() {
+  char root[] = "/tmp/sd_host_XXXXXX";
+  SdMmc *card = new SdMmc();
+  card->set_host_root(mkdtemp(root));
+  card->setup();
+  return card;
+}
+
+TEST(read_fault_is_an_error_not_eof) {
+  SdMmc *card = make_card();
+  const uint8_t data[] = {1, 2, 3, 4};
+  card->write_file("/f.bin", data, sizeof(data));
+
+  FILE *file = card->open_stream("/f.bin", "rb");
+  CHECK(file != nullptr);
+  card->inject_host_fault(HOST_FAULT_EIO);
+  uint8_t buffer[4];
+  errno = 0;
+  CHECK_EQ(fread(buffer, 1, sizeof(buffer), file), 0u);
+  CHECK(ferror(file));
+  CHECK_EQ(errno, EIO);
+  CHECK(!feof(file));
+
+  card->inject_host_fault(HOST_FAULT_NONE);
+  clearerr(file);
+  CHECK_EQ(fread(buffer, 1, sizeof(buffer), file), sizeof(buffer));
+  CHECK_EQ(buffer[3], 4);
+  card->close_stream(file);
+}
+
+TEST(remove_file_takes_paths_with_the_mount_point) {
+  SdMmc *card = make_card();
+  const uint8_t data[] = {1, 2, 3, 4};
+  card->write_file("/g.bin", data, sizeof(data));
+  std::string full_path = card->get_mount_point() + "/g.bin";
+  {
+    PathLock lock = card->lock_path(full_path, true);
+    CHECK(lock.is_locked());
+    CHECK(card->remove_file(full_path));
+  }
+  CHECK(access(full_path.c_str(), F_OK) != 0);
+  CHECK(!card->remove_file("/g.bin"));
+}
+
+TEST(create_directories_fails_on_a_file_leaf) {
+  SdMmc *card = make_card();
+  const uint8_t data[] = {1};
+  card->write_file("/leaf", data, sizeof(data));
+  CHECK(!card->create_directories("/leaf"));
+  CHECK(!card->create_directories("/leaf/below"));
+  CHECK(card->create_directories("/x/y/z"));
+  CHECK(card->create_directories("/x/y"));
+}
+
+TEST(ring_log_export_is_refused_while_formatting) {
+  SdMmc *card = make_card();
+  // The result is only published from loop(), the format counts as running until then
+  CHECK(card->start_format());
+  CHECK(!card->start_ring_log_export("/log.bin"));
+  CHECK(card->is_format_running());
+}
+
+// Exposes the free space counter, the scan that seeds it is only published from loop()
+struct CountedCard : SdMmc {
+  using SdMmc::cluster_size_;
+  using SdMmc::free_clusters_;
+  using SdMmc::free_space_valid_;
+};
+
+TEST(write_streams_charge_the_free_space) {
+  char root[] = "/tmp/sd_host_XXXXXX";
+  CountedCard *card = new CountedCard();
+  card->set_host_root(mkdtemp(root));
+  card->setup();
+  card->cluster_size_ = 512;
+  card->free_clusters_ = 100;
+  card->free_space_valid_ = true;
+
+  std::vector<uint8_t> data(4096, 7);
+  FILE *file = card->open_stream("/s.bin", "wb");
+  CHECK(file != nullptr);
+  CHECK_EQ(fwrite(data.data(), 1, data.size(), file), data.size());
+  CHECK(card->close_stream(file));
+  CHECK_EQ(card->free_clusters_.load(), 92);
+
+  // Truncated by "wb", the old clusters come back before the new ones are taken
+  file = card->open_stream("/s.bin", "wb");
+  CHECK_EQ(fwrite(data.data(), 1, 1024, file), 1024u);
+  CHECK(card->close_stream(file));
+  CHECK_EQ(card->free_clusters_.load(), 98);
+
+  file = card->open_stream("/s.bin", "rb");
+  CHECK(card->close_stream(file));
+  CHECK_EQ(card->free_clusters_.load(), 98);
+}
+
+TEST_MAIN()
@@ -0,0 +1,33 @@
+#include "test.h"
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+static LinkMapCache::Table make_table(size_t words) {
+  return LinkMapCache::Table(new uint32_t[words](), std::default_delete<uint32_t[]>());
+}
+
+TEST(invalidate_drops_the_path_and_below_in_any_case) {
+  LinkMapCache cache;
+  cache.set_budget(1024);
+  for (const char *path : {"/video.mp4", "/Dir/a.bin", "/dir2/b.bin"})
+    CHECK(cache.put(path, 2, 100, make_table(4), 4));
+  cache.invalidate("/VIDEO.MP4");
+  cache.invalidate("/dir");
+  CHECK(cache.get("/video.mp4", 2, 100) == nullptr);
+  CHECK(cache.get("/Dir/a.bin", 2, 100) == nullptr);
+  CHECK(cache.get("/dir2/b.bin", 2, 100) != nullptr);
+  CHECK_EQ(cache.get_used(), 4 * sizeof(uint32_t));
+}
+
+TEST(put_replaces_the_entry_of_the_same_file) {
+  LinkMapCache cache;
+  cache.set_budget(1024);
+  CHECK(cache.put("/a.bin", 2, 100, make_table(4), 4));
+  CHECK(cache.put("/A.BIN", 3, 200, make_table(8), 8));
+  CHECK_EQ(cache.get_used(), 8 * sizeof(uint32_t));
+  CHECK(cache.get("/a.bin", 3, 200) != nullptr);
+}
+
+TEST_MAIN()
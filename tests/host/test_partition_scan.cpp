@@ -0,0 +1,119 @@
+#include "test.h"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+#include "esphome/components/partition_storage/partition_storage.h"
+
+using namespace esphome::partition_storage;
+using esphome::storage::FileInfo;
+
+static constexpr size_t PARTITION_SIZE = 64 * 1024;
+
+static std::string make_label() {
+  char dir[] = "/tmp/partition_XXXXXX";
+  return std::string(mkdtemp(dir)) + "/assets";
+}
+
+static PartitionStorage *mount(std::string const &label) {
+  PartitionStorage *storage = new PartitionStorage();
+  storage->set_partition_label(label);
+  storage->set_host_size(PARTITION_SIZE);
+  storage->setup();
+  return storage;
+}
+
+static bool put(PartitionStorage *storage, FileInfo &file, std::string const &content) {
+  storage->set_file(&file);
+  file.read_offset = 0;
+  return storage->write_array(reinterpret_cast<uint8_t *>(const_cast<char *>(content.data())), content.size());
+}
+
+static std::string get(PartitionStorage *storage, std::string const &path) {
+  FileInfo file = storage->get_file_info(path);
+  storage->set_file(&file);
+  std::string content(file.size, '\0');
+  content.resize(storage->read_array(reinterpret_cast<uint8_t *>(&content[0]), content.size()));
+  return content;
+}
+
+TEST(sealed_files_survive_a_rescan) {
+  std::string label = make_label();
+  PartitionStorage *storage = mount(label);
+  FileInfo a("/a.txt", 0, false);
+  FileInfo b("/dir/b.txt", 0, false);
+  CHECK(put(storage, a, "first"));
+  CHECK(put(storage, b, "bee"));
+  CHECK(put(storage, a, "second"));
+  storage->on_shutdown();
+
+  PartitionStorage *again = mount(label);
+  CHECK_EQ(get(again, "/a.txt"), std::string("second"));
+  CHECK_EQ(get(again, "dir/b.txt"), std::string("bee"));
+  CHECK(again->get_free_space() == storage->get_free_space());
+}
+
+TEST(record_cut_before_sealing_is_dropped) {
+  std::string label = make_label();
+  PartitionStorage *storage = mount(label);
+  FileInfo a("/a.txt", 0, false);
+  FileInfo b("/b.txt", 0, false);
+  CHECK(put(storage, a, "kept"));
+  CHECK(put(storage, b, "cut short"));
+  // No seal: power lost while b was written
+
+  PartitionStorage *again = mount(label);
+  CHECK_EQ(get(again, "/a.txt"), std::string("kept"));
+  CHECK(again->get_file_info("/b.txt").size == 0);
+  // The log continues after the dropped record
+  FileInfo c("/c.txt", 0, false);
+  CHECK(put(again, c, "after"));
+  again->on_shutdown();
+  CHECK_EQ(get(mount(label), "/c.txt"), std::string("after"));
+}
+
+TEST(superseded_version_left_live_loses_to_the_newer_one) {
+  std::string label = make_label();
+  PartitionStorage *storage = mount(label);
+  FileInfo a("/a.txt", 0, false);
+  FileInfo rewrite("/a.txt", 0, false);
+  CHECK(put(storage, a, "old"));
+  // Selecting the file again seals the first version
+  CHECK(put(storage, rewrite, "new"));
+  storage->on_shutdown();
+  // Power lost between sealing the new version and clearing the live flag of the first record
+  int fd = open((label + ".bin").c_str(), O_RDWR);
+  uint8_t live = 0xFF;
+  CHECK(pwrite(fd, &live, 1, 10) == 1);
+  close(fd);
+
+  PartitionStorage *again = mount(label);
+  CHECK_EQ(get(again, "/a.txt"), std::string("new"));
+  CHECK_EQ(again->list_directory("/").size(), 1u);
+  // The scan finishes dropping the old version
+  fd = open((label + ".bin").c_str(), O_RDONLY);
+  CHECK(pread(fd, &live, 1, 10) == 1);
+  close(fd);
+  CHECK_EQ(live & 0x01, 0);
+}
+
+TEST(corrupted_record_makes_the_partition_read_only) {
+  std::string label = make_label();
+  PartitionStorage *storage = mount(label);
+  FileInfo a("/a.txt", 0, false);
+  CHECK(put(storage, a, "data"));
+  storage->on_shutdown();
+  uint32_t end = PARTITION_SIZE - storage->get_free_space();
+  int fd = open((label + ".bin").c_str(), O_RDWR);
+  uint32_t garbage = 0x12345678;
+  CHECK(pwrite(fd, &garbage, sizeof(garbage), end) == (ssize_t) sizeof(garbage));
+  close(fd);
+
+  PartitionStorage *again = mount(label);
+  CHECK_EQ(get(again, "/a.txt"), std::string("data"));
+  CHECK_EQ(again->get_free_space(), 0u);
+}
+
+TEST_MAIN()
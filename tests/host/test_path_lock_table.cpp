@@ -0,0 +1,90 @@
+#include "test.h"
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+TEST(shared_locks_share) {
+  PathLockTable table;
+  CHECK(table.lock("/a", false, 0));
+  CHECK(table.lock("/a", false, 0));
+  CHECK(!table.lock("/a", true, 0));
+  table.unlock("/a", false);
+  table.unlock("/a", false);
+  CHECK(table.lock("/a", true, 0));
+}
+
+TEST(exclusive_conflicts_with_ancestors_and_descendants) {
+  PathLockTable table;
+  CHECK(table.lock("/a/b.txt", false, 0));
+  CHECK(!table.lock("/a", true, 0));
+  CHECK(!table.lock("/", true, 0));
+  CHECK(table.lock("/a", false, 0));
+  table.unlock("/a", false);
+  table.unlock("/a/b.txt", false);
+
+  CHECK(table.lock("/a", true, 0));
+  CHECK(!table.lock("/a/b.txt", false, 0));
+  CHECK(!table.lock("/a/c/d", true, 0));
+  table.unlock("/a", true);
+}
+
+TEST(siblings_do_not_conflict) {
+  PathLockTable table;
+  CHECK(table.lock("/a", true, 0));
+  CHECK(table.lock("/ab", true, 0));
+  CHECK(table.lock("/b/a", true, 0));
+  table.unlock("/a", true);
+  table.unlock("/ab", true);
+  table.unlock("/b/a", true);
+}
+
+TEST(paths_differing_in_case_conflict) {
+  PathLockTable table;
+  CHECK(table.lock("/Foo.txt", true, 0));
+  CHECK(!table.lock("/foo.txt", true, 0));
+  CHECK(!table.lock("/FOO.TXT", false, 0));
+  table.unlock("/Foo.txt", true);
+
+  CHECK(table.lock("/Dir/a", false, 0));
+  CHECK(!table.lock("/dir", true, 0));
+  CHECK(table.lock("/DIR/A", false, 0));
+  table.unlock("/dir/a", false);
+  table.unlock("/Dir/A", false);
+  CHECK(table.lock("/dir", true, 0));
+  table.unlock("/dir", true);
+}
+
+TEST(volume_lock_conflicts_with_everything) {
+  PathLockTable table;
+  CHECK(table.lock("", true, 0));
+  CHECK(!table.lock("/a", false, 0));
+  table.unlock("", true);
+  CHECK(table.lock("/a", false, 0));
+  CHECK(!table.lock("", true, 0));
+  table.unlock("/a", false);
+}
+
+TEST(release_callback_gets_exclusive_paths) {
+  PathLockTable table;
+  std::vector<std::string> released;
+  table.set_release_callback([&](std::string const &path) { released.push_back(path); });
+  table.lock("/a", false, 0);
+  table.unlock("/a", false);
+  table.lock("/b", true, 0);
+  table.unlock("/b", true);
+  CHECK_EQ(released.size(), 1u);
+  CHECK(released[0] == "/b");
+}
+
+TEST(card_path_strips_the_mount_point) {
+  SdMmc card;
+  card.set_host_root("/sdcard");
+  CHECK(card.card_path("/sdcard/f") == "/f");
+  CHECK(card.card_path("/sdcard") == "/");
+  CHECK(card.card_path("/sdcard/dir/") == "/dir");
+  CHECK(card.card_path("dir/f") == "/dir/f");
+  CHECK(card.card_path("/sdcardx/f") == "/sdcardx/f");
+}
+
+TEST_MAIN()
@@ -0,0 +1,82 @@
+#include "test.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+#include "esphome/core/helpers.h"
+
+using namespace esphome::sd_mmc_card;
+
+static std::string make_root() {
+  char root[] = "/tmp/sd_replace_XXXXXX";
+  return mkdtemp(root);
+}
+
+static SdMmc *mount(std::string const &root) {
+  SdMmc *card = new SdMmc();
+  card->set_host_root(root);
+  card->setup();
+  return card;
+}
+
+static void put_raw(std::string const &path, std::vector<uint8_t> const &data) {
+  FILE *file = fopen(path.c_str(), "wb");
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+}
+
+static void put_le(std::vector<uint8_t> &out, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++)
+    out.push_back((value >> (8 * i)) & 0xFF);
+}
+
+// Same layout as replace_file: magic, size, path length, path, CRC16, then the commit mark
+static std::vector<uint8_t> journal(std::string const &path, uint32_t size, bool committed) {
+  std::vector<uint8_t> record;
+  put_le(record, 0x4A524453, 4);
+  put_le(record, size, 4);
+  put_le(record, path.size(), 2);
+  record.insert(record.end(), path.begin(), path.end());
+  put_le(record, esphome::crc16(record.data(), record.size()), 2);
+  if (committed)
+    put_le(record, 0x43524453, 4);
+  return record;
+}
+
+static std::string text(std::vector<uint8_t> const &data) { return std::string(data.begin(), data.end()); }
+
+TEST(replace_leaves_no_journal_or_temporary_file) {
+  std::string root = make_root();
+  SdMmc *card = mount(root);
+  CHECK(card->replace_file("/cfg.json", {'o', 'l', 'd'}));
+  CHECK(card->replace_file("/cfg.json", {'n', 'e', 'w', '!'}));
+  CHECK_EQ(text(card->read_file("/cfg.json")), std::string("new!"));
+  CHECK(access((root + "/cfg.json.replace~").c_str(), F_OK) != 0);
+  CHECK(access((root + "/.replace.journal").c_str(), F_OK) != 0);
+}
+
+TEST(uncommitted_temporary_file_is_dropped_on_setup) {
+  std::string root = make_root();
+  put_raw(root + "/cfg.json", {'o', 'l', 'd'});
+  put_raw(root + "/cfg.json.replace~", {'n', 'e', 'w'});
+  put_raw(root + "/.replace.journal", journal("/cfg.json", 3, false));
+  SdMmc *card = mount(root);
+  CHECK_EQ(text(card->read_file("/cfg.json")), std::string("old"));
+  CHECK(access((root + "/cfg.json.replace~").c_str(), F_OK) != 0);
+  CHECK(access((root + "/.replace.journal").c_str(), F_OK) != 0);
+}
+
+TEST(committed_replacement_is_finished_on_setup) {
+  std::string root = make_root();
+  put_raw(root + "/cfg.json", {'o', 'l', 'd'});
+  put_raw(root + "/cfg.json.replace~", {'n', 'e', 'w'});
+  put_raw(root + "/.replace.journal", journal("/cfg.json", 3, true));
+  SdMmc *card = mount(root);
+  CHECK_EQ(text(card->read_file("/cfg.json")), std::string("new"));
+  CHECK(access((root + "/cfg.json.replace~").c_str(), F_OK) != 0);
+  CHECK(access((root + "/.replace.journal").c_str(), F_OK) != 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,51 @@
+#include "test.h"
+
+#include <cstdlib>
+
+#include "esphome/components/sd_mmc_card/sd_mmc_storage.h"
+#include "esphome/core/hal.h"
+
+using namespace esphome::sd_mmc_card;
+
+static SdMmc *make_card() {
+  char root[] = "/tmp/sd_storage_XXXXXX";
+  SdMmc *card = new SdMmc();
+  card->set_host_root(mkdtemp(root));
+  card->setup();
+  return card;
+}
+
+TEST(file_info_reports_the_size_of_a_file_being_written) {
+  SdMmc *card = make_card();
+  SdMmcStorage storage(card);
+  esphome::storage::FileInfo file("/log.bin", 0, false);
+  storage.set_file(&file);
+  uint8_t data[] = {1, 2, 3, 4, 5, 6};
+  CHECK(storage.write_array(data, 4));
+  CHECK(storage.append_array(data, 6));
+  CHECK_EQ(storage.get_file_info("/log.bin").size, 10u);
+  // Reads keep their position across the size query
+  file.read_offset = 2;
+  uint8_t back[4] = {};
+  CHECK_EQ(storage.read_array(back, 4), 4u);
+  CHECK_EQ(back[0], 3);
+  CHECK_EQ(back[2], 1);
+  CHECK_EQ(storage.get_file_info("/log.bin").size, 10u);
+  storage.on_shutdown();
+  CHECK_EQ(card->file_size("/log.bin"), 10u);
+}
+
+TEST(busy_file_fails_without_blocking) {
+  SdMmc *card = make_card();
+  SdMmcStorage storage(card);
+  esphome::storage::FileInfo file("/busy.bin", 0, false);
+  storage.set_file(&file);
+  PathLock other = card->lock_path("/busy.bin", true);
+  CHECK(other.is_locked());
+  uint8_t data[] = {1};
+  uint32_t start = esphome::millis();
+  CHECK(!storage.write_array(data, 1));
+  CHECK(esphome::millis() - start < 1000);
+}
+
+TEST_MAIN()
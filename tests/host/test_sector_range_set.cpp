@@ -0,0 +1,73 @@
+#include "test.h"
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+static bool ranges_are(SectorRangeSet const &set, std::vector<SectorRange> const &expected) {
+  auto const &ranges = set.get_ranges();
+  if (ranges.size() != expected.size())
+    return false;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (ranges[i].sector != expected[i].sector || ranges[i].count != expected[i].count)
+      return false;
+  }
+  return true;
+}
+
+TEST(add_merges_overlapping_and_adjacent_ranges) {
+  SectorRangeSet set;
+  set.add(100, 10);
+  set.add(120, 10);
+  set.add(0, 0);
+  CHECK(ranges_are(set, {{100, 10}, {120, 10}}));
+  set.add(110, 10);
+  CHECK(ranges_are(set, {{100, 30}}));
+  set.add(90, 50);
+  CHECK(ranges_are(set, {{90, 50}}));
+  set.add(10, 5);
+  CHECK(ranges_are(set, {{10, 5}, {90, 50}}));
+  CHECK_EQ(set.get_sector_count(), 55u);
+}
+
+TEST(remove_trims_and_splits_ranges) {
+  SectorRangeSet set;
+  set.add(100, 100);
+  set.remove(120, 10);
+  CHECK(ranges_are(set, {{100, 20}, {130, 70}}));
+  set.remove(90, 15);
+  CHECK(ranges_are(set, {{105, 15}, {130, 70}}));
+  set.remove(190, 20);
+  CHECK(ranges_are(set, {{105, 15}, {130, 60}}));
+  set.remove(110, 30);
+  CHECK(ranges_are(set, {{105, 5}, {140, 50}}));
+  set.remove(0, 1000);
+  CHECK(set.empty());
+}
+
+TEST(remove_outside_the_ranges_changes_nothing) {
+  SectorRangeSet set;
+  set.remove(10, 10);
+  set.add(100, 10);
+  set.remove(110, 10);
+  set.remove(90, 10);
+  CHECK(ranges_are(set, {{100, 10}}));
+}
+
+TEST(pop_takes_bounded_runs_from_the_lowest_range) {
+  SectorRangeSet set;
+  set.add(200, 5);
+  set.add(0, 20);
+  SectorRange range;
+  CHECK(set.pop(8, range));
+  CHECK_EQ(range.sector, 0u);
+  CHECK_EQ(range.count, 8u);
+  CHECK(set.pop(100, range));
+  CHECK_EQ(range.sector, 8u);
+  CHECK_EQ(range.count, 12u);
+  CHECK(set.pop(100, range));
+  CHECK_EQ(range.sector, 200u);
+  CHECK(!set.pop(100, range));
+}
+
+TEST_MAIN()
@@ -0,0 +1,44 @@
+#include "test.h"
+
+#include "esphome/components/sd_mmc_card/sd_mmc_card.h"
+
+using namespace esphome::sd_mmc_card;
+
+TEST(invalidate_drops_the_path_below_and_parent) {
+  StatCache cache;
+  cache.set_max_entries(8);
+  for (const char *path : {"/a", "/a/b", "/a/b/c", "/a/bc", "/d"})
+    cache.put(FileInfo(path, 0, true), cache.get_generation());
+  cache.invalidate("/a/b");
+  FileInfo info;
+  CHECK(!cache.get("/a", info));
+  CHECK(!cache.get("/a/b", info));
+  CHECK(!cache.get("/a/b/c", info));
+  CHECK(cache.get("/a/bc", info));
+  CHECK(cache.get("/d", info));
+}
+
+TEST(stale_generation_is_not_stored) {
+  StatCache cache;
+  cache.set_max_entries(8);
+  uint32_t generation = cache.get_generation();
+  cache.invalidate("/x");
+  cache.put(FileInfo("/x", 1, false), generation);
+  FileInfo info;
+  CHECK(!cache.get("/x", info));
+}
+
+TEST(file_info_to_stat_honors_read_only) {
+  struct stat st;
+  file_info_to_stat(FileInfo("/f", 42, false, 1000, 0x01), st);
+  CHECK(S_ISREG(st.st_mode));
+  CHECK((st.st_mode & S_IWUSR) == 0);
+  CHECK((st.st_mode & S_IRUSR) != 0);
+  CHECK_EQ(st.st_size, 42);
+  CHECK_EQ(st.st_mtime, 1000);
+  file_info_to_stat(FileInfo("/d", 0, true, 0, 0), st);
+  CHECK(S_ISDIR(st.st_mode));
+  CHECK((st.st_mode & S_IWUSR) != 0);
+}
+
+TEST_MAIN()
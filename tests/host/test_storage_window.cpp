@@ -0,0 +1,176 @@
+#include "test.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "esphome/components/storage/storage.h"
+
+using namespace esphome::storage;
+
+// In-memory backend recording the accesses that reach it
+class MemoryStorage : public Storage {
+ public:
+  struct Write {
+    size_t offset;
+    size_t length;
+  };
+
+  uint8_t direct_read_byte(size_t offset) override {
+    uint8_t data = 0;
+    this->direct_read_byte_array(offset, &data, 1);
+    return data;
+  }
+  bool direct_write_byte(size_t offset, uint8_t data) override { return this->direct_write_byte_array(offset, &data, 1); }
+  bool direct_append_byte(uint8_t data) override { return this->direct_append_byte_array(&data, 1); }
+  size_t direct_read_byte_array(size_t offset, uint8_t *data, size_t data_length) override {
+    this->reads++;
+    std::string const &file = this->files[this->path];
+    if (offset >= file.size())
+      return 0;
+    size_t n = std::min(data_length, file.size() - offset);
+    memcpy(data, file.data() + offset, n);
+    return n;
+  }
+  bool direct_write_byte_array(size_t offset, uint8_t *data, size_t data_length) override {
+    this->writes.push_back(Write{offset, data_length});
+    std::string &file = this->files[this->path];
+    if (file.size() < offset + data_length)
+      file.resize(offset + data_length);
+    memcpy(&file[offset], data, data_length);
+    return true;
+  }
+  bool direct_append_byte_array(uint8_t *data, size_t data_length) override {
+    this->files[this->path].append(reinterpret_cast<char *>(data), data_length);
+    return true;
+  }
+
+  std::map<std::string, std::string> files;
+  std::string path;
+  std::vector<Write> writes;
+  int reads{0};
+
+ protected:
+  void direct_set_file(const std::string &path) override { this->path = path; }
+  void direct_delete_file(const std::string &path) override { this->files.erase(path); }
+  FileInfo direct_get_file_info(const std::string &path) const override {
+    auto it = this->files.find(path);
+    return FileInfo(path, it == this->files.end() ? 0 : it->second.size(), false);
+  }
+  std::vector<FileInfo> direct_list_directory(const std::string &path) const override { return {}; }
+};
+
+static uint8_t bytes[4096];
+
+TEST(small_reads_are_served_from_one_window) {
+  MemoryStorage storage;
+  storage.set_buffer_size(256);
+  storage.files["/f"] = std::string(1000, 'x');
+  FileInfo file("/f", 1000, false);
+  storage.set_file(&file);
+  uint8_t data[16];
+  for (int i = 0; i < 15; i++)
+    CHECK_EQ(storage.read_array(data, sizeof(data)), sizeof(data));
+  CHECK_EQ(storage.reads, 1);
+  // Reaching the end of the window loads the next one
+  CHECK_EQ(storage.read_array(data, sizeof(data)), sizeof(data));
+  CHECK_EQ(storage.reads, 2);
+  CHECK_EQ(file.read_offset, 256u);
+}
+
+TEST(write_back_merges_dirty_blocks_close_together) {
+  MemoryStorage storage;
+  storage.set_buffer_size(4096);
+  storage.set_write_back(true);
+  storage.set_flush_interval(60000);
+  FileInfo file("/f", 0, false);
+  storage.set_file(&file);
+  CHECK(storage.write_array(bytes, 4096 - 1));
+  CHECK_EQ(storage.writes.size(), 0u);
+  CHECK(storage.flush());
+  CHECK_EQ(storage.writes.size(), 1u);
+  storage.writes.clear();
+
+  // Blocks 0 and 2 are one short gap apart, block 40 is too far and goes out on its own
+  file.read_offset = 0;
+  CHECK(storage.write_array(bytes, 10));
+  file.read_offset = 130;
+  CHECK(storage.write_array(bytes, 10));
+  file.read_offset = 2560;
+  CHECK(storage.write_array(bytes, 10));
+  CHECK(storage.flush());
+  CHECK_EQ(storage.writes.size(), 2u);
+  CHECK_EQ(storage.writes[0].offset, 0u);
+  CHECK_EQ(storage.writes[0].length, 192u);
+  CHECK_EQ(storage.writes[1].offset, 2560u);
+  CHECK_EQ(storage.writes[1].length, 64u);
+}
+
+TEST(reads_of_a_whole_window_skip_it) {
+  MemoryStorage storage;
+  storage.set_buffer_size(256);
+  storage.files["/f"] = std::string(1000, 'x');
+  FileInfo file("/f", 1000, false);
+  storage.set_file(&file);
+  uint8_t data[512];
+  CHECK_EQ(storage.read_array(data, sizeof(data)), sizeof(data));
+  CHECK_EQ(storage.reads, 1);
+  CHECK_EQ(file.read_offset, 512u);
+  // Reading past the end stops at it
+  CHECK_EQ(storage.read_array(data, sizeof(data)), 1000u - 512u);
+}
+
+TEST(without_write_back_every_write_reaches_the_backend) {
+  MemoryStorage storage;
+  storage.set_buffer_size(256);
+  FileInfo file("/f", 0, false);
+  storage.set_file(&file);
+  CHECK(storage.write(1));
+  CHECK(storage.write(2));
+  CHECK_EQ(storage.writes.size(), 2u);
+  CHECK_EQ(storage.files["/f"].size(), 2u);
+}
+
+TEST(unflushed_writes_are_read_back_from_the_window) {
+  MemoryStorage storage;
+  storage.set_buffer_size(256);
+  storage.set_write_back(true);
+  storage.set_flush_interval(60000);
+  storage.files["/f"] = std::string(100, 'x');
+  FileInfo file("/f", 100, false);
+  storage.set_file(&file);
+  uint8_t data[] = {'a', 'b'};
+  file.read_offset = 10;
+  uint8_t loaded;
+  CHECK_EQ(storage.read_array(&loaded, 1), 1u);
+  CHECK(storage.write_array(data, 2));
+  CHECK_EQ(storage.writes.size(), 0u);
+  file.read_offset = 11;
+  uint8_t back[2];
+  CHECK_EQ(storage.read_array(back, 2), 2u);
+  CHECK_EQ(back[0], 'a');
+  CHECK_EQ(back[1], 'b');
+  // Selecting another file writes the window back first
+  FileInfo other("/g", 0, false);
+  storage.set_file(&other);
+  CHECK_EQ(storage.files["/f"].substr(10, 3), std::string("xab"));
+}
+
+TEST(buffered_append_starts_at_the_real_end_of_the_file) {
+  MemoryStorage storage;
+  storage.set_buffer_size(256);
+  storage.set_write_back(true);
+  storage.set_flush_interval(60000);
+  storage.files["/log"] = "0123456789";
+  // Size from an old listing
+  FileInfo file("/log", 4, false);
+  storage.set_file(&file);
+  uint8_t data[] = {'a', 'b'};
+  CHECK(storage.append_array(data, 2));
+  CHECK(storage.append_array(data, 2));
+  CHECK(storage.flush());
+  CHECK_EQ(storage.files["/log"], std::string("0123456789abab"));
+  CHECK_EQ(file.size, 14u);
+}
+
+TEST_MAIN()